@@ -23,13 +23,33 @@
  * __atomic_load_1/2/4, do not provide __atomic_load_8, so we need
  * to implement the software version __atomic_load_8
  * the implementation is referred to nuttx/libs/libc/machine/arch_atomic.c
+ *
+ * ARMv7-A/R read the doubleword with LDREXD, which is single-copy atomic,
+ * and AArch64 with a plain 64-bit load, so only cores without 64-bit
+ * exclusives (ARMv7-M, the sim) fall back to the global lock.
  */
 uint64_t __atomic_load_8(FAR const volatile void* ptr, int memorder)
 {
+#if defined(__aarch64__)
+    return __atomic_load_n((FAR const volatile uint64_t*)ptr, memorder);
+#elif defined(__arm__) && __ARM_ARCH >= 7 && __ARM_ARCH_PROFILE != 'M'
+    uint64_t ret;
+
+    __asm__ volatile("ldrexd %0, %H0, [%1]\n\t"
+                     "clrex"
+                     : "=&r"(ret)
+                     : "r"(ptr)
+                     : "memory");
+    if (memorder != __ATOMIC_RELAXED)
+        __asm__ volatile("dmb ish" ::: "memory");
+
+    return ret;
+#else
     irqstate_t irqstate = spin_lock_irqsave(NULL);
 
     uint64_t ret = *(FAR uint64_t*)ptr;
 
     spin_unlock_irqrestore(NULL, irqstate);
     return ret;
+#endif
 }
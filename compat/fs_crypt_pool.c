@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fs_crypt_pool.h>
+#include <pthread.h>
+#include <trace.h>
+
+#ifdef CONFIG_OPTEE_FS_CRYPT_WORKERS
+#define FS_CRYPT_WORKERS CONFIG_OPTEE_FS_CRYPT_WORKERS
+#else
+#define FS_CRYPT_WORKERS 1
+#endif
+
+struct fs_crypt_job {
+    TEE_Result (*fn)(void* arg, size_t index);
+    void* arg;
+    size_t count;
+    size_t next; /* next index to run */
+    size_t running; /* indexes being run by the workers or the caller */
+    TEE_Result res;
+};
+
+/* One job at a time, a caller finding the pool busy runs its job alone */
+static struct fs_crypt_job* fs_crypt_job;
+static pthread_mutex_t fs_crypt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fs_crypt_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t fs_crypt_done = PTHREAD_COND_INITIALIZER;
+static size_t fs_crypt_started;
+static bool fs_crypt_failed;
+
+/* Run the indexes left in the job, must be called with the lock held */
+static void fs_crypt_job_work(struct fs_crypt_job* job)
+{
+    TEE_Result res = TEE_SUCCESS;
+    size_t index = 0;
+
+    while (job->next < job->count) {
+        index = job->next++;
+        job->running++;
+        pthread_mutex_unlock(&fs_crypt_lock);
+
+        res = job->fn(job->arg, index);
+
+        pthread_mutex_lock(&fs_crypt_lock);
+        job->running--;
+        if (res != TEE_SUCCESS && job->res == TEE_SUCCESS) {
+            job->res = res;
+        }
+    }
+}
+
+static void* fs_crypt_main(void* arg)
+{
+    struct fs_crypt_job* job = NULL;
+
+    (void)arg;
+    pthread_mutex_lock(&fs_crypt_lock);
+    while (true) {
+        while (!fs_crypt_job || fs_crypt_job->next >= fs_crypt_job->count) {
+            pthread_cond_wait(&fs_crypt_work, &fs_crypt_lock);
+        }
+
+        job = fs_crypt_job;
+        fs_crypt_job_work(job);
+        if (!job->running) {
+            pthread_cond_signal(&fs_crypt_done);
+        }
+    }
+
+    return NULL;
+}
+
+/* Must be called with the lock held */
+static bool fs_crypt_start(void)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    int ret = 0;
+
+    if (fs_crypt_started || fs_crypt_failed) {
+        return fs_crypt_started > 0;
+    }
+
+    pthread_attr_init(&attr);
+#ifdef CONFIG_OPTEE_FS_CRYPT_WORKER_STACKSIZE
+    pthread_attr_setstacksize(&attr, CONFIG_OPTEE_FS_CRYPT_WORKER_STACKSIZE);
+#endif
+    while (fs_crypt_started < FS_CRYPT_WORKERS) {
+        ret = pthread_create(&thread, &attr, fs_crypt_main, NULL);
+        if (ret) {
+            EMSG("%08x : crypt worker %zu, %d\n", TEE_ERROR_OUT_OF_MEMORY,
+                fs_crypt_started, ret);
+            break;
+        }
+        pthread_detach(thread);
+        fs_crypt_started++;
+    }
+    pthread_attr_destroy(&attr);
+
+    /* Go on with the workers started, never retry the others */
+    fs_crypt_failed = fs_crypt_started < FS_CRYPT_WORKERS;
+    return fs_crypt_started > 0;
+}
+
+TEE_Result fs_crypt_pool_run(TEE_Result (*fn)(void* arg, size_t index),
+    void* arg, size_t count)
+{
+    struct fs_crypt_job job = {
+        .fn = fn,
+        .arg = arg,
+        .count = count,
+        .res = TEE_SUCCESS,
+    };
+    TEE_Result res = TEE_SUCCESS;
+    size_t n = 0;
+
+    pthread_mutex_lock(&fs_crypt_lock);
+    if (count < 2 || fs_crypt_job || !fs_crypt_start()) {
+        pthread_mutex_unlock(&fs_crypt_lock);
+        for (n = 0; n < count; n++) {
+            res = fn(arg, n);
+            if (res != TEE_SUCCESS) {
+                return res;
+            }
+        }
+        return TEE_SUCCESS;
+    }
+
+    fs_crypt_job = &job;
+    pthread_cond_broadcast(&fs_crypt_work);
+    fs_crypt_job_work(&job);
+    while (job.running) {
+        pthread_cond_wait(&fs_crypt_done, &fs_crypt_lock);
+    }
+    fs_crypt_job = NULL;
+    pthread_mutex_unlock(&fs_crypt_lock);
+
+    return job.res;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fs_worker.h>
+#include <pthread.h>
+#include <trace.h>
+
+#ifdef CONFIG_OPTEE_FS_WORKER_QUEUE_DEPTH
+#define FS_WORKER_QUEUE_DEPTH CONFIG_OPTEE_FS_WORKER_QUEUE_DEPTH
+#else
+#define FS_WORKER_QUEUE_DEPTH 4
+#endif
+
+/* A single worker, so calls complete in the order they were submitted */
+static STAILQ_HEAD(fs_worker_queue_head, fs_worker_req) fs_worker_queue = STAILQ_HEAD_INITIALIZER(fs_worker_queue);
+static size_t fs_worker_queue_len;
+static pthread_mutex_t fs_worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fs_worker_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t fs_worker_done = PTHREAD_COND_INITIALIZER;
+static bool fs_worker_started;
+static bool fs_worker_failed;
+
+static void* fs_worker_main(void* arg)
+{
+    struct fs_worker_req* req = NULL;
+
+    (void)arg;
+    pthread_mutex_lock(&fs_worker_lock);
+    while (true) {
+        while (STAILQ_EMPTY(&fs_worker_queue)) {
+            pthread_cond_wait(&fs_worker_work, &fs_worker_lock);
+        }
+
+        /* Stays queued while running, so the depth covers it too */
+        req = STAILQ_FIRST(&fs_worker_queue);
+        pthread_mutex_unlock(&fs_worker_lock);
+
+        req->res = req->fn(req->arg);
+
+        pthread_mutex_lock(&fs_worker_lock);
+        STAILQ_REMOVE_HEAD(&fs_worker_queue, link);
+        fs_worker_queue_len--;
+        req->done = true;
+        pthread_cond_broadcast(&fs_worker_done);
+    }
+
+    return NULL;
+}
+
+/* Must be called with the lock held */
+static bool fs_worker_start(void)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    int ret = 0;
+
+    if (fs_worker_started || fs_worker_failed) {
+        return fs_worker_started;
+    }
+
+    pthread_attr_init(&attr);
+#ifdef CONFIG_OPTEE_FS_WORKER_STACKSIZE
+    pthread_attr_setstacksize(&attr, CONFIG_OPTEE_FS_WORKER_STACKSIZE);
+#endif
+    ret = pthread_create(&thread, &attr, fs_worker_main, NULL);
+    pthread_attr_destroy(&attr);
+    if (ret) {
+        EMSG("%08x : fs worker, %d\n", TEE_ERROR_OUT_OF_MEMORY, ret);
+        fs_worker_failed = true;
+        return false;
+    }
+
+    pthread_detach(thread);
+    fs_worker_started = true;
+    return true;
+}
+
+void fs_worker_submit(struct fs_worker_req* req, TEE_Result (*fn)(void* arg),
+    void* arg)
+{
+    req->fn = fn;
+    req->arg = arg;
+    req->done = false;
+
+    pthread_mutex_lock(&fs_worker_lock);
+    if (!fs_worker_start()) {
+        pthread_mutex_unlock(&fs_worker_lock);
+        req->res = fn(arg);
+        req->done = true;
+        return;
+    }
+
+    while (fs_worker_queue_len >= FS_WORKER_QUEUE_DEPTH) {
+        pthread_cond_wait(&fs_worker_done, &fs_worker_lock);
+    }
+
+    STAILQ_INSERT_TAIL(&fs_worker_queue, req, link);
+    fs_worker_queue_len++;
+    pthread_cond_signal(&fs_worker_work);
+    pthread_mutex_unlock(&fs_worker_lock);
+}
+
+TEE_Result fs_worker_wait(struct fs_worker_req* req)
+{
+    pthread_mutex_lock(&fs_worker_lock);
+    while (!req->done) {
+        pthread_cond_wait(&fs_worker_done, &fs_worker_lock);
+    }
+    pthread_mutex_unlock(&fs_worker_lock);
+
+    return req->res;
+}
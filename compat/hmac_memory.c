@@ -14,28 +14,70 @@
  * limitations under the License.
  */
 
-#include <ctype.h>
 #include <hmac_memory.h>
+#include <limits.h>
 #include <mbedtls/md.h>
 #include <md_wrap.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/queue.h>
 
-#define MAX_HASH_NAME_LEN 32
+/* Enough for every digest mbedTLS can be built with */
+#define HASH_TABLE_SIZE 16
+
+/* Streaming HMACs one TA may have open at once, so a TA can't take
+ * them all from the others
+ */
+#define HMAC_STREAM_MAX 8
+
+struct hash_entry {
+    const char* name;
+    int type;
+};
+
+struct hmac_stream {
+    LIST_ENTRY(hmac_stream) link;
+    const void* owner;
+    int handle;
+    mbedtls_md_context_t ctx;
+};
+
+static struct hash_entry hash_table[HASH_TABLE_SIZE];
+static size_t hash_table_len;
+static pthread_once_t hash_table_once = PTHREAD_ONCE_INIT;
+
+static LIST_HEAD(hmac_stream_head, hmac_stream) hmac_streams = LIST_HEAD_INITIALIZER(hmac_streams);
+static int hmac_stream_next;
+static pthread_mutex_t hmac_streams_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Names and ids of the digests mbedTLS provides, looked up once */
+static void hash_table_init(void)
+{
+    const int* types = mbedtls_md_list();
+
+    for (; *types != MBEDTLS_MD_NONE && hash_table_len < HASH_TABLE_SIZE; types++) {
+        const mbedtls_md_info_t* info = mbedtls_md_info_from_type(*types);
+        if (info) {
+            hash_table[hash_table_len].name = mbedtls_md_get_name(info);
+            hash_table[hash_table_len++].type = *types;
+        }
+    }
+}
 
 int find_hash(const char* name)
 {
     if (!name) {
         return -1;
     }
-    char uc_name[MAX_HASH_NAME_LEN];
-    int i = 0;
-    do {
-        uc_name[i++] = toupper(*name);
-    } while (*name++);
-    const mbedtls_md_info_t* info = mbedtls_md_info_from_string(uc_name);
-    if (!info) {
-        return -1;
+
+    pthread_once(&hash_table_once, hash_table_init);
+    for (size_t i = 0; i < hash_table_len; i++) {
+        if (!strcasecmp(hash_table[i].name, name)) {
+            return hash_table[i].type;
+        }
     }
-    return info->type;
+    return -1;
 }
 
 /*
@@ -54,3 +96,155 @@ int hmac_memory(int md_type,
     return mbedtls_md_hmac(md_info, key,
         keylen, in, inlen, out);
 }
+
+static void hmac_stream_free(struct hmac_stream* stream)
+{
+    mbedtls_md_free(&stream->ctx);
+    free(stream);
+}
+
+/* Find the stream of handle, must be called with the lock held */
+static struct hmac_stream* hmac_stream_get(const void* owner, int handle)
+{
+    struct hmac_stream* stream = NULL;
+
+    LIST_FOREACH(stream, &hmac_streams, link)
+    {
+        if (stream->handle == handle && stream->owner == owner) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+/* Count the streams of owner and pick a free handle for a new one, must
+ * be called with the lock held
+ */
+static int hmac_stream_handle(const void* owner)
+{
+    struct hmac_stream* stream = NULL;
+    int count = 0;
+    int handle;
+
+    LIST_FOREACH(stream, &hmac_streams, link)
+    {
+        if (stream->owner == owner && ++count >= HMAC_STREAM_MAX) {
+            return -1;
+        }
+    }
+
+    /* handles wrap around, skip the ones still open */
+    do {
+        handle = hmac_stream_next;
+        hmac_stream_next = hmac_stream_next < INT_MAX ? hmac_stream_next + 1 : 0;
+        LIST_FOREACH(stream, &hmac_streams, link)
+        {
+            if (stream->handle == handle) {
+                break;
+            }
+        }
+    } while (stream);
+
+    return handle;
+}
+
+int hmac_stream_init(const void* owner, int md_type,
+    const unsigned char* key, unsigned long keylen)
+{
+    const mbedtls_md_info_t* md_info = mbedtls_md_info_from_type(md_type);
+    struct hmac_stream* stream = NULL;
+    int handle = -1;
+
+    if (!md_info) {
+        return -1;
+    }
+
+    stream = malloc(sizeof(*stream));
+    if (!stream) {
+        return -1;
+    }
+
+    stream->owner = owner;
+    mbedtls_md_init(&stream->ctx);
+    if (mbedtls_md_setup(&stream->ctx, md_info, 1)
+        || mbedtls_md_hmac_starts(&stream->ctx, key, keylen)) {
+        hmac_stream_free(stream);
+        return -1;
+    }
+
+    pthread_mutex_lock(&hmac_streams_lock);
+    handle = hmac_stream_handle(owner);
+    if (handle >= 0) {
+        stream->handle = handle;
+        LIST_INSERT_HEAD(&hmac_streams, stream, link);
+    }
+    pthread_mutex_unlock(&hmac_streams_lock);
+
+    if (handle < 0) {
+        hmac_stream_free(stream);
+    }
+    return handle;
+}
+
+int hmac_stream_update(const void* owner, int handle,
+    const unsigned char* in, unsigned long inlen)
+{
+    struct hmac_stream* stream = NULL;
+
+    /* A handle is only used by the TA owning it, which runs one request
+     * at a time on it, so the update itself needs no lock
+     */
+    pthread_mutex_lock(&hmac_streams_lock);
+    stream = hmac_stream_get(owner, handle);
+    pthread_mutex_unlock(&hmac_streams_lock);
+    if (!stream) {
+        return MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+    }
+
+    return mbedtls_md_hmac_update(&stream->ctx, in, inlen);
+}
+
+int hmac_stream_final(const void* owner, int handle,
+    unsigned char* out, unsigned long* outlen)
+{
+    struct hmac_stream* stream = NULL;
+    unsigned long size;
+    int ret;
+
+    pthread_mutex_lock(&hmac_streams_lock);
+    stream = hmac_stream_get(owner, handle);
+    if (stream) {
+        size = mbedtls_md_get_size(mbedtls_md_info_from_ctx(&stream->ctx));
+        if (*outlen < size) {
+            *outlen = size;
+            stream = NULL;
+        } else {
+            LIST_REMOVE(stream, link);
+        }
+    }
+    pthread_mutex_unlock(&hmac_streams_lock);
+    if (!stream) {
+        return MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+    }
+
+    *outlen = size;
+    ret = mbedtls_md_hmac_finish(&stream->ctx, out);
+    hmac_stream_free(stream);
+    return ret;
+}
+
+void hmac_stream_release(const void* owner)
+{
+    struct hmac_stream* stream = NULL;
+    struct hmac_stream* next = NULL;
+
+    pthread_mutex_lock(&hmac_streams_lock);
+    for (stream = LIST_FIRST(&hmac_streams); stream; stream = next) {
+        next = LIST_NEXT(stream, link);
+        if (stream->owner == owner) {
+            LIST_REMOVE(stream, link);
+            hmac_stream_free(stream);
+        }
+    }
+    pthread_mutex_unlock(&hmac_streams_lock);
+}
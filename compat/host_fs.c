@@ -23,6 +23,7 @@
 #include <initcall.h>
 #include <libgen.h>
 #include <mm/mobj.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -35,17 +36,34 @@
 #define PATH_MAX 255
 #endif
 
+#ifdef CONFIG_OPTEE_HOST_FS_DIR_CACHE_SLOTS
+#define HOST_FS_DIR_CACHE_SLOTS CONFIG_OPTEE_HOST_FS_DIR_CACHE_SLOTS
+#else
+#define HOST_FS_DIR_CACHE_SLOTS 4
+#endif
+
+/*
+ * Directory of the secure storage known to exist, kept open so the files
+ * in it are opened relative to it, without walking or creating the path.
+ */
+struct host_fs_dir {
+    char path[PATH_MAX]; /* relative to tee_fs_root, empty if free */
+    int fd;
+    uint32_t last_used;
+};
+
 /* Path to all secure storage files. */
 static char tee_fs_root[PATH_MAX];
+static int tee_fs_root_fd = -1;
+
+static struct host_fs_dir host_fs_dirs[HOST_FS_DIR_CACHE_SLOTS];
+static uint32_t host_fs_dir_tick;
+static pthread_mutex_t host_fs_dir_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void fs_fsync(void)
 {
-    int fd = 0;
-
-    fd = open(tee_fs_root, O_RDONLY | O_DIRECTORY);
-    if (fd >= 0) {
-        fsync(fd);
-        close(fd);
+    if (tee_fs_root_fd >= 0) {
+        fsync(tee_fs_root_fd);
     }
 }
 
@@ -61,7 +79,6 @@ static int do_mkdir(const char* path, mode_t mode)
     if (stat(path, &st) != 0 && !S_ISDIR(st.st_mode))
         return -1;
 
-    fs_fsync();
     return 0;
 }
 
@@ -119,6 +136,11 @@ static TEE_Result host_fs_init(void)
     if (mkpath(tee_fs_root, mode) != 0)
         return TEE_ERROR_NOT_SUPPORTED;
 
+    tee_fs_root_fd = open(tee_fs_root, O_RDONLY | O_DIRECTORY);
+    if (tee_fs_root_fd < 0)
+        return TEE_ERROR_NOT_SUPPORTED;
+
+    fs_fsync();
     return TEE_SUCCESS;
 }
 
@@ -138,16 +160,110 @@ static size_t tee_fs_get_absolute_filename(char* file, char* out,
     return (size_t)s;
 }
 
-static int open_wrapper(const char* fname, int flags)
+static int open_wrapper(int dirfd, const char* fname, int flags)
 {
     int fd = 0;
     while (true) {
-        fd = open(fname, flags | O_SYNC, 0600);
+        fd = openat(dirfd, fname, flags | O_SYNC, 0600);
         if (fd >= 0 || errno != EINTR)
             return fd;
     }
 }
 
+/*
+ * Splits fname, relative to tee_fs_root, into its directory copied to
+ * dir and its base name, which is returned.
+ */
+static const char* host_fs_split(const char* fname, char* dir,
+    size_t dir_size)
+{
+    const char* base = NULL;
+
+    while (*fname == '/')
+        fname++;
+
+    base = strrchr(fname, '/');
+    if (!base) {
+        dir[0] = '\0';
+        return *fname ? fname : NULL;
+    }
+
+    if ((size_t)(base - fname) >= dir_size || !base[1])
+        return NULL;
+
+    memcpy(dir, fname, base - fname);
+    dir[base - fname] = '\0';
+    return base + 1;
+}
+
+/*
+ * Returns a handle of the directory, creating it if needed and asked to,
+ * must be called with host_fs_dir_lock held. The handle stays owned by
+ * the cache.
+ */
+static int host_fs_dir_get(const char* dir, bool create)
+{
+    char abs_dir[PATH_MAX] = { 0 };
+    struct host_fs_dir* victim = &host_fs_dirs[0];
+    int fd = 0;
+    int i = 0;
+
+    if (!dir[0])
+        return tee_fs_root_fd;
+
+    for (i = 0; i < HOST_FS_DIR_CACHE_SLOTS; i++) {
+        struct host_fs_dir* e = &host_fs_dirs[i];
+
+        if (!strcmp(e->path, dir)) {
+            e->last_used = ++host_fs_dir_tick;
+            return e->fd;
+        }
+        if (e->last_used < victim->last_used)
+            victim = e;
+    }
+
+    fd = openat(tee_fs_root_fd, dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 && errno == ENOENT && create) {
+        if (!tee_fs_get_absolute_filename((char*)dir, abs_dir,
+                sizeof(abs_dir))) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (mkpath(abs_dir, 0700))
+            return -1;
+
+        /* one sync for all the directories made */
+        fs_fsync();
+        fd = openat(tee_fs_root_fd, dir, O_RDONLY | O_DIRECTORY);
+    }
+    if (fd < 0)
+        return -1;
+
+    if (victim->path[0])
+        close(victim->fd);
+    strcpy(victim->path, dir);
+    victim->fd = fd;
+    victim->last_used = ++host_fs_dir_tick;
+    return fd;
+}
+
+/* Drops dir and the directories below it, before they are removed */
+static void host_fs_dir_forget(const char* dir)
+{
+    size_t len = strlen(dir);
+    int i = 0;
+
+    for (i = 0; i < HOST_FS_DIR_CACHE_SLOTS; i++) {
+        struct host_fs_dir* e = &host_fs_dirs[i];
+
+        if (e->path[0] && !strncmp(e->path, dir, len)
+            && (e->path[len] == '\0' || e->path[len] == '/')) {
+            close(e->fd);
+            memset(e, 0, sizeof(*e));
+        }
+    }
+}
+
 static bool param_is_memref(struct thread_param* param)
 {
     switch (param->attr) {
@@ -189,8 +305,10 @@ static void set_memsize(struct thread_param* param, size_t new_size)
 
 TEE_Result host_fs_open(size_t num_params, struct thread_param* params)
 {
-    char abs_filename[PATH_MAX] = { 0 };
+    char dir[PATH_MAX] = { 0 };
+    const char* base = NULL;
     char* fname = NULL;
+    int dirfd = 0;
     int fd = 0;
 
     if (num_params != 3 || params[0].attr != THREAD_PARAM_ATTR_VALUE_IN || params[1].attr != THREAD_PARAM_ATTR_MEMREF_IN || params[2].attr != THREAD_PARAM_ATTR_VALUE_OUT) {
@@ -202,20 +320,23 @@ TEE_Result host_fs_open(size_t num_params, struct thread_param* params)
         return TEE_ERROR_BAD_PARAMETERS;
     }
 
-    if (!tee_fs_get_absolute_filename(fname, abs_filename,
-            sizeof(abs_filename)))
+    base = host_fs_split(fname, dir, sizeof(dir));
+    if (!base)
         return TEE_ERROR_BAD_PARAMETERS;
 
-    fd = open_wrapper(abs_filename, O_RDWR);
-    if (fd < 0) {
+    pthread_mutex_lock(&host_fs_dir_lock);
+    dirfd = host_fs_dir_get(dir, false);
+    fd = dirfd < 0 ? -1 : open_wrapper(dirfd, base, O_RDWR);
+    if (dirfd >= 0 && fd < 0) {
         /*
          * In case the problem is the filesystem is RO, retry with the
          * open flags restricted to RO.
          */
-        fd = open_wrapper(abs_filename, O_RDONLY);
-        if (fd < 0) {
-            return TEE_ERROR_ITEM_NOT_FOUND;
-        }
+        fd = open_wrapper(dirfd, base, O_RDONLY);
+    }
+    pthread_mutex_unlock(&host_fs_dir_lock);
+    if (fd < 0) {
+        return TEE_ERROR_ITEM_NOT_FOUND;
     }
 
     params[2].u.value.a = fd;
@@ -224,11 +345,12 @@ TEE_Result host_fs_open(size_t num_params, struct thread_param* params)
 
 TEE_Result host_fs_create(size_t num_params, struct thread_param* params)
 {
-    char abs_filename[PATH_MAX] = { 0 };
-    char abs_dir[PATH_MAX] = { 0 };
+    char dir[PATH_MAX] = { 0 };
+    const char* base = NULL;
     char* fname = NULL;
-    char* d = NULL;
+    int dirfd = 0;
     int fd = 0;
+    int err = 0;
     const int flags = O_RDWR | O_CREAT | O_TRUNC;
 
     if (num_params != 3 || params[0].attr != THREAD_PARAM_ATTR_VALUE_IN || params[1].attr != THREAD_PARAM_ATTR_MEMREF_IN || params[2].attr != THREAD_PARAM_ATTR_VALUE_OUT) {
@@ -239,67 +361,30 @@ TEE_Result host_fs_create(size_t num_params, struct thread_param* params)
     if (!fname)
         return TEE_ERROR_BAD_PARAMETERS;
 
-    if (!tee_fs_get_absolute_filename(fname, abs_filename,
-            sizeof(abs_filename)))
+    base = host_fs_split(fname, dir, sizeof(dir));
+    if (!base)
         return TEE_ERROR_BAD_PARAMETERS;
 
-    fd = open_wrapper(abs_filename, flags);
-    if (fd >= 0)
-        goto out;
-    if (errno != ENOENT)
-        return errno_to_tee(errno);
-
-    /* Directory for file missing, try make to it */
-    strncpy(abs_dir, abs_filename, sizeof(abs_dir));
-    abs_dir[sizeof(abs_dir) - 1] = '\0';
-    d = dirname(abs_dir);
-    if (!mkdir(d, 0700)) {
-        int err = 0;
-
-        fd = open_wrapper(abs_filename, flags);
-        if (fd >= 0)
-            goto out;
-
-        /*
-         * The directory was made but the file could still not be
-         * created.
-         */
-        err = errno;
-        rmdir(d);
-        return errno_to_tee(err);
-    }
-    if (errno != ENOENT)
-        return errno_to_tee(errno);
-
-    /* Parent directory for file missing, try to make it */
-    d = dirname(d);
-    if (mkdir(d, 0700))
-        return errno_to_tee(errno);
-
-    /* Try to make directory for file again */
-    strncpy(abs_dir, abs_filename, sizeof(abs_dir));
-    abs_dir[sizeof(abs_dir) - 1] = '\0';
-    d = dirname(abs_dir);
-    if (mkdir(d, 0700)) {
-        int err = errno;
-
-        d = dirname(d);
-        rmdir(d);
-        return errno_to_tee(err);
+    pthread_mutex_lock(&host_fs_dir_lock);
+    dirfd = host_fs_dir_get(dir, true);
+    if (dirfd >= 0) {
+        fd = open_wrapper(dirfd, base, flags);
+        if (fd < 0 && errno == ENOENT && dir[0]) {
+            /* The cached directory was removed behind our back */
+            host_fs_dir_forget(dir);
+            dirfd = host_fs_dir_get(dir, true);
+            if (dirfd >= 0)
+                fd = open_wrapper(dirfd, base, flags);
+        }
     }
-
-    fd = open_wrapper(abs_filename, flags);
-    if (fd < 0) {
-        int err = errno;
-
-        rmdir(d);
-        d = dirname(d);
-        rmdir(d);
+    if (dirfd < 0 || fd < 0) {
+        err = errno;
+        pthread_mutex_unlock(&host_fs_dir_lock);
         return errno_to_tee(err);
     }
 
-out:
-    fs_fsync();
+    fsync(dirfd);
+    pthread_mutex_unlock(&host_fs_dir_lock);
     params[2].u.value.a = fd;
     return TEE_SUCCESS;
 }
@@ -422,6 +507,8 @@ TEE_Result host_fs_truncate(size_t num_params, struct thread_param* params)
 TEE_Result host_fs_remove(size_t num_params, struct thread_param* params)
 {
     char abs_filename[PATH_MAX] = { 0 };
+    char dir[PATH_MAX] = { 0 };
+    const char* base = NULL;
     char* fname = NULL;
     char* d = NULL;
 
@@ -441,14 +528,20 @@ TEE_Result host_fs_remove(size_t num_params, struct thread_param* params)
         return errno_to_tee(errno);
 
     /* If a file is removed, maybe the directory can be removed to? */
+    base = host_fs_split(fname, dir, sizeof(dir));
     d = dirname(abs_filename);
-    if (!rmdir(d)) {
+    if (base && dir[0] && !rmdir(d)) {
         /*
          * If the directory was removed, maybe the parent directory
          * can be removed too?
          */
         d = dirname(d);
-        rmdir(d);
+        if (!rmdir(d) && (d = strrchr(dir, '/')))
+            *d = '\0';
+
+        pthread_mutex_lock(&host_fs_dir_lock);
+        host_fs_dir_forget(dir);
+        pthread_mutex_unlock(&host_fs_dir_lock);
     }
 
     return TEE_SUCCESS;
@@ -17,35 +17,170 @@
  */
 
 #include <malloc.h>
-#include <stdlib.h>
+#include <mem_budget.h>
 #include <nuttx/mm/mm.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string_ext.h>
+#include <util.h>
+
+#ifdef CONFIG_OPTEE_TEE_HEAP_SIZE
+#define TEE_HEAP_SIZE CONFIG_OPTEE_TEE_HEAP_SIZE
+#else
+#define TEE_HEAP_SIZE 0
+#endif
+
+#if TEE_HEAP_SIZE > 0
+/*
+ * raw_* allocations live in their own arena, so TEE buffers neither
+ * fragment nor get fragmented by the rest of the system. The arena is
+ * set up on first use, if that fails everything stays on the system
+ * heap.
+ */
+static max_align_t tee_heap_pool[TEE_HEAP_SIZE / sizeof(max_align_t)];
+static struct mm_heap_s *tee_heap;
+static pthread_once_t tee_heap_once = PTHREAD_ONCE_INIT;
+
+static void tee_heap_init(void)
+{
+	tee_heap = mm_initialize("tee", tee_heap_pool, sizeof(tee_heap_pool));
+}
+
+static struct mm_heap_s *tee_heap_get(void)
+{
+	pthread_once(&tee_heap_once, tee_heap_init);
+	return tee_heap;
+}
+
+static void *heap_malloc(size_t size)
+{
+	if (tee_heap_get())
+		return mm_malloc(tee_heap, size);
+	return malloc(size);
+}
+
+static void *heap_zalloc(size_t size)
+{
+	if (tee_heap_get())
+		return mm_zalloc(tee_heap, size);
+	return calloc(1, size);
+}
+
+/*
+ * free_wipe() also gets buffers OP-TEE took from the system heap, so
+ * pick the heap the pointer came from rather than trusting the arena.
+ */
+static void heap_free(void *ptr, bool wipe)
+{
+	if (tee_heap_get() && mm_heapmember(tee_heap, ptr)) {
+		if (wipe)
+			memzero_explicit(ptr, mm_malloc_size(tee_heap, ptr));
+		mm_free(tee_heap, ptr);
+		return;
+	}
+	if (wipe)
+		memzero_explicit(ptr, malloc_size(ptr));
+	free(ptr);
+}
+
+static bool heap_overlaps(void *buf, size_t len)
+{
+	uintptr_t start = (uintptr_t)buf;
+	uintptr_t pool = (uintptr_t)tee_heap_pool;
+
+	if (!tee_heap_get())
+		return umm_heapmember(buf);
+
+	return start < pool + sizeof(tee_heap_pool) && start + len > pool;
+}
+
+static bool heap_member(void *buf)
+{
+	if (tee_heap_get() && mm_heapmember(tee_heap, buf))
+		return true;
+	return umm_heapmember(buf);
+}
+#else
+static void *heap_malloc(size_t size)
+{
+	return malloc(size);
+}
+
+static void *heap_zalloc(size_t size)
+{
+	return calloc(1, size);
+}
+
+static void heap_free(void *ptr, bool wipe)
+{
+	if (wipe)
+		memzero_explicit(ptr, malloc_size(ptr));
+	free(ptr);
+}
+
+static bool heap_overlaps(void *buf, size_t len)
+{
+	return umm_heapmember(buf);
+}
+
+static bool heap_member(void *buf)
+{
+	return umm_heapmember(buf);
+}
+#endif
 
 void *raw_malloc(size_t hdr_size, size_t ftr_size, size_t pl_size,
 		 struct malloc_ctx *ctx)
 {
-	return malloc(pl_size);
+	size_t s = 0;
+	void *ptr = NULL;
+
+	if (ADD_OVERFLOW(hdr_size, ftr_size, &s) ||
+	    ADD_OVERFLOW(s, pl_size, &s))
+		return NULL;
+
+	/* Let the caches make room and try once more */
+	ptr = heap_malloc(s);
+	if (!ptr && mem_budget_reclaim(s))
+		ptr = heap_malloc(s);
+	return ptr;
 }
 
 void raw_free(void *ptr, struct malloc_ctx *ctx, bool wipe)
 {
-	free(ptr);
+	if (ptr)
+		heap_free(ptr, wipe);
 }
 
 void *raw_calloc(size_t hdr_size, size_t ftr_size, size_t pl_nmemb,
 		 size_t pl_size, struct malloc_ctx *ctx)
 {
-	return calloc(pl_nmemb, ftr_size);
+	size_t s = 0;
+	void *ptr = NULL;
+
+	if (MUL_OVERFLOW(pl_nmemb, pl_size, &s) ||
+	    ADD_OVERFLOW(s, hdr_size, &s) ||
+	    ADD_OVERFLOW(s, ftr_size, &s))
+		return NULL;
+
+	ptr = heap_zalloc(s);
+	if (!ptr && mem_budget_reclaim(s))
+		ptr = heap_zalloc(s);
+	return ptr;
 }
 
 bool raw_malloc_buffer_overlaps_heap(struct malloc_ctx *ctx,
 				     void *buf, size_t len)
 {
-	return umm_heapmember(buf);
+	return heap_overlaps(buf, len);
 }
 
 bool malloc_buffer_is_within_alloced(void *buf, size_t len)
 {
-	return umm_heapmember(buf);
+	return heap_member(buf);
 }
 
 void free_wipe(void *ptr)
@@ -55,5 +190,5 @@ void free_wipe(void *ptr)
 
 bool malloc_buffer_overlaps_heap(void *buf, size_t len)
 {
-	return umm_heapmember(buf);
+	return heap_overlaps(buf, len);
 }
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <mem_budget.h>
+#include <pthread.h>
+#include <trace.h>
+
+#ifdef CONFIG_OPTEE_MEM_BUDGET_CEILING
+#define MEM_BUDGET_CEILING CONFIG_OPTEE_MEM_BUDGET_CEILING
+#else
+#define MEM_BUDGET_CEILING 0
+#endif
+
+static SLIST_HEAD(mem_budget_head, mem_budget_cache) mem_budget_caches = SLIST_HEAD_INITIALIZER(mem_budget_caches);
+static pthread_mutex_t mem_budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t mem_budget_total;
+static uint32_t mem_budget_gen;
+
+/* One reclaim at a time, the caches it shrinks report their new size
+ * without starting another one, and allocations failing meanwhile on
+ * other threads don't wait for it.
+ */
+static bool mem_budget_reclaiming;
+
+void mem_budget_update(struct mem_budget_cache* cache, size_t size)
+{
+    size_t over = 0;
+
+    pthread_mutex_lock(&mem_budget_lock);
+    if (!cache->registered) {
+        SLIST_INSERT_HEAD(&mem_budget_caches, cache, link);
+        cache->registered = true;
+    }
+
+    mem_budget_total += size;
+    mem_budget_total -= cache->size;
+    cache->size = size;
+    if (MEM_BUDGET_CEILING > 0 && mem_budget_total > MEM_BUDGET_CEILING) {
+        over = mem_budget_total - MEM_BUDGET_CEILING;
+    }
+    pthread_mutex_unlock(&mem_budget_lock);
+
+    if (over) {
+        mem_budget_reclaim(over);
+    }
+}
+
+/* Largest cache not shrunk yet in pass gen, must be called with the lock
+ * held
+ */
+static struct mem_budget_cache* mem_budget_next(uint32_t gen)
+{
+    struct mem_budget_cache* cache = NULL;
+    struct mem_budget_cache* largest = NULL;
+
+    SLIST_FOREACH(cache, &mem_budget_caches, link)
+    {
+        if (cache->gen != gen && cache->size
+            && (!largest || cache->size > largest->size)) {
+            largest = cache;
+        }
+    }
+
+    if (largest) {
+        largest->gen = gen;
+    }
+    return largest;
+}
+
+bool mem_budget_reclaim(size_t bytes)
+{
+    struct mem_budget_cache* cache = NULL;
+    size_t freed = 0;
+    size_t n = 0;
+    uint32_t gen = 0;
+
+    pthread_mutex_lock(&mem_budget_lock);
+    if (mem_budget_reclaiming) {
+        pthread_mutex_unlock(&mem_budget_lock);
+        return false;
+    }
+
+    mem_budget_reclaiming = true;
+    gen = ++mem_budget_gen;
+    while (freed < bytes && (cache = mem_budget_next(gen))) {
+        pthread_mutex_unlock(&mem_budget_lock);
+        n = cache->shrink(bytes - freed);
+        DMSG("shrink %s: %zu of %zu\n", cache->name, n, bytes - freed);
+        freed += n;
+        pthread_mutex_lock(&mem_budget_lock);
+    }
+
+    mem_budget_reclaiming = false;
+    pthread_mutex_unlock(&mem_budget_lock);
+    return freed > 0;
+}
@@ -16,17 +16,196 @@
  * limitations under the License.
  */
 
+#include <assert.h>
+#include <initcall.h>
 #include <mempool.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <tee_api_types.h>
+#include <trace.h>
+#include <util.h>
+
+#ifdef CONFIG_OPTEE_MEMPOOL_SIZE
+#define MEMPOOL_DEFAULT_SIZE CONFIG_OPTEE_MEMPOOL_SIZE
+#else
+#define MEMPOOL_DEFAULT_SIZE 16384
+#endif
+
+#ifndef MEMPOOL_ALIGN
+#define MEMPOOL_ALIGN __alignof__(long)
+#endif
+
+/*
+ * Allocations are stacked in the pool data, each preceded by an item
+ * linking it to its neighbours. Space is reclaimed as the most recent
+ * items are freed, and the pool starts over once all items are freed.
+ */
+struct mempool_item {
+    size_t size;
+    ssize_t prev_item_offset;
+    ssize_t next_item_offset;
+};
+
+/*
+ * The pool is owned by one thread from its first allocation until its
+ * last free, other threads wait on the recursive lock. Allocations that
+ * don't fit fall back to the heap.
+ */
+struct mempool {
+    uint8_t* data;
+    size_t size;
+    ssize_t last_offset;
+    pthread_mutex_t mu;
+    unsigned int depth;
+    void (*release_mem)(void* ptr, size_t size);
+};
 
 struct mempool* mempool_default;
 
+#if MEMPOOL_DEFAULT_SIZE > 0
+static long mempool_default_data[MEMPOOL_DEFAULT_SIZE / sizeof(long)];
+#endif
+
+static void get_pool(struct mempool* pool)
+{
+    pthread_mutex_lock(&pool->mu);
+    pool->depth++;
+}
+
+static void put_pool(struct mempool* pool)
+{
+    if (pool->depth == 1) {
+        /* The last item is gone, the pool starts over */
+        assert(pool->last_offset < 0);
+        if (pool->release_mem)
+            pool->release_mem(pool->data, pool->size);
+    }
+    pool->depth--;
+    pthread_mutex_unlock(&pool->mu);
+}
+
+static bool pool_owns(struct mempool* pool, void* ptr)
+{
+    uint8_t* p = ptr;
+
+    return p >= pool->data && p < pool->data + pool->size;
+}
+
+struct mempool* mempool_alloc_pool(void* data, size_t size,
+    void (*release_mem)(void* ptr, size_t size))
+{
+    pthread_mutexattr_t attr;
+    struct mempool* pool = calloc(1, sizeof(*pool));
+
+    if (!pool)
+        return NULL;
+
+    pool->data = data;
+    pool->size = size;
+    pool->last_offset = -1;
+    pool->release_mem = release_mem;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&pool->mu, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    return pool;
+}
+
 void* mempool_alloc(struct mempool* pool, size_t size)
 {
-    return malloc(size);
+    struct mempool_item* last_item = NULL;
+    struct mempool_item* new_item = NULL;
+    size_t item_size = 0;
+    size_t offset = 0;
+
+    if (!pool)
+        return malloc(size);
+
+    get_pool(pool);
+
+    if (pool->last_offset >= 0) {
+        last_item = (struct mempool_item*)(pool->data + pool->last_offset);
+        offset = ROUNDUP(pool->last_offset + last_item->size, MEMPOOL_ALIGN);
+    }
+
+    if (size < pool->size)
+        item_size = ROUNDUP(sizeof(*new_item) + size, MEMPOOL_ALIGN);
+    if (!item_size || offset > pool->size || item_size > pool->size - offset) {
+        put_pool(pool);
+        DMSG("mempool full, %zu bytes from the heap\n", size);
+        return malloc(size);
+    }
+
+    new_item = (struct mempool_item*)(pool->data + offset);
+    new_item->size = item_size;
+    new_item->prev_item_offset = pool->last_offset;
+    new_item->next_item_offset = -1;
+    if (last_item)
+        last_item->next_item_offset = offset;
+    pool->last_offset = offset;
+
+    return new_item + 1;
+}
+
+void* mempool_calloc(struct mempool* pool, size_t nmemb, size_t size)
+{
+    size_t sz = 0;
+    void* p = NULL;
+
+    if (MUL_OVERFLOW(nmemb, size, &sz))
+        return NULL;
+
+    p = mempool_alloc(pool, sz);
+    if (p)
+        memset(p, 0, sz);
+
+    return p;
 }
 
 void mempool_free(struct mempool* pool, void* ptr)
 {
-    free(ptr);
+    struct mempool_item* item = NULL;
+    struct mempool_item* prev_item = NULL;
+    struct mempool_item* next_item = NULL;
+
+    if (!ptr)
+        return;
+
+    if (!pool || !pool_owns(pool, ptr)) {
+        free(ptr);
+        return;
+    }
+
+    item = (struct mempool_item*)ptr - 1;
+    if (item->prev_item_offset >= 0) {
+        prev_item = (struct mempool_item*)(pool->data + item->prev_item_offset);
+        prev_item->next_item_offset = item->next_item_offset;
+    }
+    if (item->next_item_offset >= 0) {
+        next_item = (struct mempool_item*)(pool->data + item->next_item_offset);
+        next_item->prev_item_offset = item->prev_item_offset;
+    } else {
+        pool->last_offset = item->prev_item_offset;
+    }
+
+    put_pool(pool);
 }
+
+#if MEMPOOL_DEFAULT_SIZE > 0
+static TEE_Result mempool_default_init(void)
+{
+    mempool_default = mempool_alloc_pool(mempool_default_data,
+        sizeof(mempool_default_data), NULL);
+    if (!mempool_default)
+        return TEE_ERROR_OUT_OF_MEMORY;
+
+    return TEE_SUCCESS;
+}
+
+early_init(mempool_default_init);
+#endif
@@ -18,12 +18,22 @@
 #include <config.h>
 #include <crypto/crypto.h>
 #include <kernel/huk_subkey.h>
+#include <pthread.h>
+#include <string.h>
 #include <string_ext.h>
 #include <tee_otp_compat.h>
 #include <tee/tee_fs_key_manager.h>
 
 static uint8_t string_for_ssk_gen[] = "ONLY_FOR_tee_fs_ssk";
 
+/*
+ * The SSK only depends on device constants, so it is derived on first
+ * use and handed out from here until huk_subkey_invalidate().
+ */
+static uint8_t ssk_cache[TEE_FS_KM_SSK_SIZE];
+static bool ssk_cache_valid;
+static pthread_mutex_t ssk_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static TEE_Result do_hmac(void *out_key, size_t out_key_size,
 			  const void *in_key, size_t in_key_size,
 			  const void *message, size_t message_size)
@@ -57,9 +67,7 @@ exit:
 	return res;
 }
 
-TEE_Result huk_subkey_derive(enum huk_subkey_usage usage __unused,
-			     const void *const_data, size_t const_data_len,
-			     uint8_t *subkey, size_t subkey_len)
+static TEE_Result derive_ssk(uint8_t *ssk, size_t ssk_len)
 {
 	TEE_Result res = TEE_SUCCESS;
 
@@ -89,9 +97,44 @@ TEE_Result huk_subkey_derive(enum huk_subkey_usage usage __unused,
 	memcpy(message + sizeof(chip_id), string_for_ssk_gen,
 			sizeof(string_for_ssk_gen));
 
-	res = do_hmac(subkey, subkey_len,
+	res = do_hmac(ssk, ssk_len,
 			huk.data, sizeof(huk.data),
 			message, sizeof(message));
 
+	memzero_explicit(&huk, sizeof(huk));
 	return res;
 }
+
+TEE_Result huk_subkey_derive(enum huk_subkey_usage usage __unused,
+			     const void *const_data __unused,
+			     size_t const_data_len __unused,
+			     uint8_t *subkey, size_t subkey_len)
+{
+	TEE_Result res = TEE_SUCCESS;
+
+	/* Longer subkeys than one HMAC output are not cached */
+	if (subkey_len > sizeof(ssk_cache))
+		return derive_ssk(subkey, subkey_len);
+
+	pthread_mutex_lock(&ssk_cache_lock);
+	if (!ssk_cache_valid) {
+		res = derive_ssk(ssk_cache, sizeof(ssk_cache));
+		if (res == TEE_SUCCESS)
+			ssk_cache_valid = true;
+		else
+			memzero_explicit(ssk_cache, sizeof(ssk_cache));
+	}
+	if (res == TEE_SUCCESS)
+		memcpy(subkey, ssk_cache, subkey_len);
+	pthread_mutex_unlock(&ssk_cache_lock);
+
+	return res;
+}
+
+void huk_subkey_invalidate(void)
+{
+	pthread_mutex_lock(&ssk_cache_lock);
+	memzero_explicit(ssk_cache, sizeof(ssk_cache));
+	ssk_cache_valid = false;
+	pthread_mutex_unlock(&ssk_cache_lock);
+}
@@ -32,10 +32,154 @@
 #include <kernel/thread.h>
 #endif
 
+#ifdef CONFIG_OPTEE_CRYPTO_MBEDTLS
+#include <mbedtls/sha256.h>
+#endif
+
 #include <string_ext.h>
 
 #define CRYPT_OK		0
 
+#ifdef CONFIG_OPTEE_CRYPTO_MBEDTLS
+/*
+ * AES-GCM and SHA-256 on mbedTLS, which brings in whatever acceleration
+ * it is configured with: ARMv8 Crypto Extensions (MBEDTLS_AESCE_C,
+ * MBEDTLS_SHA256_USE_A64_CRYPTO_IF_PRESENT) or the /dev/crypto engine
+ * through the NuttX AES and SHA-256 ALT implementations.
+ */
+struct mitee_gcm_ctx {
+	mbedtls_gcm_context gcm;
+};
+
+static TEE_Result mitee_gcm_res(int ret)
+{
+	switch (ret) {
+	case 0:
+		return TEE_SUCCESS;
+	case MBEDTLS_ERR_GCM_AUTH_FAILED:
+		return TEE_ERROR_MAC_INVALID;
+	case MBEDTLS_ERR_GCM_BAD_INPUT:
+		return TEE_ERROR_BAD_PARAMETERS;
+	default:
+		return TEE_ERROR_GENERIC;
+	}
+}
+
+static TEE_Result crypto_aes_gcm_alloc(void **ctx)
+{
+	struct mitee_gcm_ctx *c = calloc(1, sizeof(*c));
+
+	if (!c)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	mbedtls_gcm_init(&c->gcm);
+	*ctx = c;
+	return TEE_SUCCESS;
+}
+
+static TEE_Result crypto_aes_gcm_init(void *ctx, TEE_OperationMode mode,
+		const uint8_t *key, size_t key_len,
+		const uint8_t *nonce, size_t nonce_len,
+		size_t tag_len __unused, size_t aad_len __unused,
+		size_t payload_len __unused)
+{
+	struct mitee_gcm_ctx *c = ctx;
+	int ret = 0;
+
+	ret = mbedtls_gcm_setkey(&c->gcm, MBEDTLS_CIPHER_ID_AES, key,
+		key_len * 8);
+	if (!ret)
+		ret = mbedtls_gcm_starts(&c->gcm, mode == TEE_MODE_ENCRYPT ?
+			MBEDTLS_GCM_ENCRYPT : MBEDTLS_GCM_DECRYPT,
+			nonce, nonce_len);
+
+	return mitee_gcm_res(ret);
+}
+
+static TEE_Result crypto_aes_gcm_update_aad(void *ctx,
+		TEE_OperationMode mode __unused,
+		const uint8_t *data, size_t len)
+{
+	struct mitee_gcm_ctx *c = ctx;
+
+	return mitee_gcm_res(mbedtls_gcm_update_ad(&c->gcm, data, len));
+}
+
+static TEE_Result crypto_aes_gcm_update_payload(void *ctx,
+		TEE_OperationMode mode __unused,
+		const uint8_t *src_data,
+		size_t src_len, uint8_t *dst_data, size_t *dst_len)
+{
+	struct mitee_gcm_ctx *c = ctx;
+
+	/* GCM is a stream mode, mbedTLS outputs every byte it is given */
+	return mitee_gcm_res(mbedtls_gcm_update(&c->gcm, src_data, src_len,
+		dst_data, *dst_len, dst_len));
+}
+
+static TEE_Result crypto_aes_gcm_enc_final(void *ctx, const uint8_t *src_data,
+		size_t src_len, uint8_t *dst_data, size_t *dst_len,
+		uint8_t *dst_tag, size_t *dst_tag_len)
+{
+	struct mitee_gcm_ctx *c = ctx;
+	size_t olen = 0;
+	TEE_Result res = TEE_SUCCESS;
+
+	if (*dst_tag_len > TEE_AES_BLOCK_SIZE)
+		*dst_tag_len = TEE_AES_BLOCK_SIZE;
+
+	res = crypto_aes_gcm_update_payload(ctx, TEE_MODE_ENCRYPT, src_data,
+		src_len, dst_data, dst_len);
+	if (res)
+		return res;
+
+	return mitee_gcm_res(mbedtls_gcm_finish(&c->gcm, NULL, 0, &olen,
+		dst_tag, *dst_tag_len));
+}
+
+static TEE_Result crypto_aes_gcm_dec_final(void *ctx, const uint8_t *src_data,
+		size_t src_len, uint8_t *dst_data, size_t *dst_len,
+		const uint8_t *tag, size_t tag_len)
+{
+	struct mitee_gcm_ctx *c = ctx;
+	uint8_t digest[TEE_AES_BLOCK_SIZE];
+	size_t olen = 0;
+	TEE_Result res = TEE_SUCCESS;
+
+	if (tag_len > sizeof(digest))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = crypto_aes_gcm_update_payload(ctx, TEE_MODE_DECRYPT, src_data,
+		src_len, dst_data, dst_len);
+	if (res)
+		return res;
+
+	res = mitee_gcm_res(mbedtls_gcm_finish(&c->gcm, NULL, 0, &olen,
+		digest, tag_len));
+	if (!res && consttime_memcmp(digest, tag, tag_len))
+		res = TEE_ERROR_MAC_INVALID;
+
+	memzero_explicit(digest, sizeof(digest));
+	return res;
+}
+
+static void crypto_aes_gcm_final(void *ctx __unused)
+{
+}
+
+static void crypto_aes_gcm_free_ctx(void *ctx)
+{
+	struct mitee_gcm_ctx *c = ctx;
+
+	mbedtls_gcm_free(&c->gcm);
+	free(c);
+}
+#else
+static TEE_Result crypto_aes_gcm_alloc(void **ctx)
+{
+	return crypto_aes_gcm_alloc_ctx((struct crypto_authenc_ctx **)ctx);
+}
+
 static TEE_Result crypto_aes_gcm_init(void *ctx, TEE_OperationMode mode,
 		const uint8_t *key, size_t key_len,
 		const uint8_t *nonce, size_t nonce_len,
@@ -85,6 +229,7 @@ static void crypto_aes_gcm_free_ctx(void *ctx)
 {
 	crypto_authenc_free_ctx(ctx);
 }
+#endif
 
 TEE_Result mitee_crypto_authenc_alloc_ctx(void **ctx, uint32_t algo)
 {
@@ -93,7 +238,7 @@ TEE_Result mitee_crypto_authenc_alloc_ctx(void **ctx, uint32_t algo)
 
 	switch (algo) {
 		case TEE_ALG_AES_GCM:
-			res = crypto_aes_gcm_alloc_ctx((struct crypto_authenc_ctx **) &c);
+			res = crypto_aes_gcm_alloc(&c);
 			break;
 		default:
 			return TEE_ERROR_NOT_IMPLEMENTED;
@@ -171,12 +316,99 @@ void mitee_crypto_authenc_free_ctx(void *ctx, uint32_t algo __unused)
 		crypto_aes_gcm_free_ctx(ctx);
 }
 
+#ifdef CONFIG_OPTEE_CRYPTO_MBEDTLS
+TEE_Result mitee_crypto_aes_gcm_expand_key(const uint8_t *key, size_t key_len,
+		struct mitee_aes_gcm_key *enc_key)
+{
+	if (key_len != 16 && key_len != 24 && key_len != 32)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	memcpy(enc_key->key, key, key_len);
+	enc_key->key_len = key_len;
+	return TEE_SUCCESS;
+}
+
+TEE_Result mitee_crypto_aes_gcm_enc_key(
+		const struct mitee_aes_gcm_key *enc_key,
+		const uint8_t *nonce, size_t nonce_len,
+		const uint8_t *aad, size_t aad_len,
+		const uint8_t *src, size_t len, uint8_t *dst,
+		uint8_t *tag, size_t *tag_len)
+{
+	mbedtls_gcm_context gcm;
+	int ret = 0;
+
+	if (*tag_len > TEE_AES_BLOCK_SIZE)
+		*tag_len = TEE_AES_BLOCK_SIZE;
+
+	mbedtls_gcm_init(&gcm);
+	ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, enc_key->key,
+		enc_key->key_len * 8);
+	if (!ret)
+		ret = mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, len,
+			nonce, nonce_len, aad, aad_len, src, dst,
+			*tag_len, tag);
+	mbedtls_gcm_free(&gcm);
+
+	return mitee_gcm_res(ret);
+}
+
+TEE_Result mitee_crypto_aes_gcm_dec_key(
+		const struct mitee_aes_gcm_key *enc_key,
+		const uint8_t *nonce, size_t nonce_len,
+		const uint8_t *aad, size_t aad_len,
+		const uint8_t *src, size_t len, uint8_t *dst,
+		const uint8_t *tag, size_t tag_len)
+{
+	mbedtls_gcm_context gcm;
+	int ret = 0;
+
+	mbedtls_gcm_init(&gcm);
+	ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, enc_key->key,
+		enc_key->key_len * 8);
+	if (!ret)
+		ret = mbedtls_gcm_auth_decrypt(&gcm, len, nonce, nonce_len,
+			aad, aad_len, tag, tag_len, src, dst);
+	mbedtls_gcm_free(&gcm);
+
+	return mitee_gcm_res(ret);
+}
+#else
 void mitee_crypto_authenc_copy_state(void *dst_ctx, void *src_ctx,
 		uint32_t algo __unused)
 {
 	crypto_aes_gcm_copy_state(dst_ctx, src_ctx);
 }
 
+TEE_Result mitee_crypto_aes_gcm_expand_key(const uint8_t *key, size_t key_len,
+		struct mitee_aes_gcm_key *enc_key)
+{
+	return internal_aes_gcm_expand_enc_key(key, key_len, &enc_key->key);
+}
+
+TEE_Result mitee_crypto_aes_gcm_enc_key(
+		const struct mitee_aes_gcm_key *enc_key,
+		const uint8_t *nonce, size_t nonce_len,
+		const uint8_t *aad, size_t aad_len,
+		const uint8_t *src, size_t len, uint8_t *dst,
+		uint8_t *tag, size_t *tag_len)
+{
+	return internal_aes_gcm_enc_key(&enc_key->key, nonce, nonce_len, aad,
+		aad_len, src, len, dst, tag, tag_len);
+}
+
+TEE_Result mitee_crypto_aes_gcm_dec_key(
+		const struct mitee_aes_gcm_key *enc_key,
+		const uint8_t *nonce, size_t nonce_len,
+		const uint8_t *aad, size_t aad_len,
+		const uint8_t *src, size_t len, uint8_t *dst,
+		const uint8_t *tag, size_t tag_len)
+{
+	return internal_aes_gcm_dec_key(&enc_key->key, nonce, nonce_len, aad,
+		aad_len, src, len, dst, tag, tag_len);
+}
+#endif
+
 #if defined(CFG_WITH_VFP)
 void tomcrypt_arm_neon_enable(struct tomcrypt_arm_neon_state *state)
 {
@@ -189,7 +421,19 @@ void tomcrypt_arm_neon_disable(struct tomcrypt_arm_neon_state *state)
 }
 #endif
 
-#if defined(CFG_CRYPTO_SHA256)
+#if defined(CONFIG_OPTEE_CRYPTO_MBEDTLS)
+TEE_Result hash_sha256_check(const uint8_t *hash, const uint8_t *data,
+		size_t data_size)
+{
+	uint8_t digest[TEE_SHA256_HASH_SIZE];
+
+	if (mbedtls_sha256(data, data_size, digest, 0) != 0)
+		return TEE_ERROR_GENERIC;
+	if (buf_compare_ct(digest, hash, sizeof(digest)) != 0)
+		return TEE_ERROR_SECURITY;
+	return TEE_SUCCESS;
+}
+#elif defined(CFG_CRYPTO_SHA256)
 TEE_Result hash_sha256_check(const uint8_t *hash, const uint8_t *data,
 		size_t data_size)
 {
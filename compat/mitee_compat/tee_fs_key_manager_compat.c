@@ -16,6 +16,7 @@
  */
 
 #include <string.h>
+#include <string_ext.h>
 
 #include <kernel/tee_ta_manager.h>
 #include <tee/tee_fs_key_manager.h>
@@ -32,9 +33,36 @@ struct km_header {
 	uint8_t *tag;
 };
 
+TEE_Result tee_fs_fek_unwrap(const TEE_UUID *uuid,
+		const uint8_t *encrypted_fek, struct tee_fs_fek *fek)
+{
+	TEE_Result res;
+
+	res = tee_fs_fek_crypt(uuid, TEE_MODE_DECRYPT, encrypted_fek,
+			       TEE_FS_KM_FEK_SIZE, fek->fek);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		return res;
+	}
+
+#ifndef FS_PLAINTEXT
+	res = mitee_crypto_aes_gcm_expand_key(fek->fek, TEE_FS_KM_FEK_SIZE,
+					      &fek->key);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		tee_fs_fek_clear(fek);
+	}
+#endif
+	return res;
+}
+
+void tee_fs_fek_clear(struct tee_fs_fek *fek)
+{
+	memzero_explicit(fek, sizeof(*fek));
+}
+
 static TEE_Result do_auth_enc(TEE_OperationMode mode,
-		struct km_header *hdr,
-		uint8_t *fek, int fek_len,
+		struct km_header *hdr, const struct tee_fs_fek *fek,
 		const uint8_t *data_in, size_t in_size,
 		uint8_t *data_out, size_t *out_size)
 {
@@ -45,7 +73,7 @@ static TEE_Result do_auth_enc(TEE_OperationMode mode,
 	return TEE_SUCCESS;
 #else
 	TEE_Result res = TEE_SUCCESS;
-	void *ctx = NULL;
+	uint8_t aad[TEE_FS_KM_FEK_SIZE + TEE_FS_KM_IV_LEN];
 	size_t tag_len = TEE_FS_KM_MAX_TAG_LEN;
 
 	if ((mode != TEE_MODE_ENCRYPT) && (mode != TEE_MODE_DECRYPT)) {
@@ -58,61 +86,30 @@ static TEE_Result do_auth_enc(TEE_OperationMode mode,
 		return TEE_ERROR_SHORT_BUFFER;
 	}
 
-	res = mitee_crypto_authenc_alloc_ctx(&ctx, TEE_FS_KM_AUTH_ENC_ALG);
-	if (res != TEE_SUCCESS) {
-		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
-		return res;
-	}
-
-	res = mitee_crypto_authenc_init(ctx, TEE_FS_KM_AUTH_ENC_ALG,
-			mode, fek, fek_len, hdr->aad.iv,
-			TEE_FS_KM_IV_LEN, TEE_FS_KM_MAX_TAG_LEN,
-			sizeof(struct aad), in_size);
-	if (res != TEE_SUCCESS) {
-		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
-		goto exit;
-	}
-
-	res = mitee_crypto_authenc_update_aad(ctx, TEE_FS_KM_AUTH_ENC_ALG,
-			mode, (uint8_t *)hdr->aad.encrypted_key,
-			TEE_FS_KM_FEK_SIZE);
-	if (res != TEE_SUCCESS) {
-		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
-		goto exit;
-	}
-
-	res = mitee_crypto_authenc_update_aad(ctx, TEE_FS_KM_AUTH_ENC_ALG,
-			mode, (uint8_t *)hdr->aad.iv,
-			TEE_FS_KM_IV_LEN);
-	if (res != TEE_SUCCESS) {
-		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
-		goto exit;
-	}
+	/* AAD: |Encrypted_FEK|IV| */
+	memcpy(aad, hdr->aad.encrypted_key, TEE_FS_KM_FEK_SIZE);
+	memcpy(aad + TEE_FS_KM_FEK_SIZE, hdr->aad.iv, TEE_FS_KM_IV_LEN);
 
 	if (mode == TEE_MODE_ENCRYPT) {
-		res = mitee_crypto_authenc_enc_final(ctx, TEE_FS_KM_AUTH_ENC_ALG,
-				data_in, in_size, data_out, out_size,
+		res = mitee_crypto_aes_gcm_enc_key(&fek->key, hdr->aad.iv,
+				TEE_FS_KM_IV_LEN, aad, sizeof(aad),
+				data_in, in_size, data_out,
 				hdr->tag, &tag_len);
 	} else {
-		res = mitee_crypto_authenc_dec_final(ctx, TEE_FS_KM_AUTH_ENC_ALG,
-				data_in, in_size, data_out, out_size,
+		res = mitee_crypto_aes_gcm_dec_key(&fek->key, hdr->aad.iv,
+				TEE_FS_KM_IV_LEN, aad, sizeof(aad),
+				data_in, in_size, data_out,
 				hdr->tag, tag_len);
 	}
 
 	if (res != TEE_SUCCESS) {
 		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
-		goto exit;
-	}
-
-	mitee_crypto_authenc_final(ctx, TEE_FS_KM_AUTH_ENC_ALG);
-
-exit:
-	mitee_crypto_authenc_free_ctx(ctx, TEE_FS_KM_AUTH_ENC_ALG);
-
-	if (res) {
 		DMSG("res: 0x%08lx", res);
+		return res;
 	}
-	return res;
+
+	*out_size = in_size;
+	return TEE_SUCCESS;
 #endif
 }
 
@@ -147,13 +144,13 @@ size_t tee_fs_get_header_size(enum tee_fs_file_type type)
 TEE_Result tee_fs_encrypt_file(enum tee_fs_file_type file_type,
 		const uint8_t *data_in, size_t data_in_size,
 		uint8_t *data_out, size_t *data_out_size,
-		const uint8_t *encrypted_fek)
+		const uint8_t *encrypted_fek, const struct tee_fs_fek *fek)
 {
 	TEE_Result res = TEE_SUCCESS;
 	struct km_header hdr;
 	uint8_t iv[TEE_FS_KM_IV_LEN];
 	uint8_t tag[TEE_FS_KM_MAX_TAG_LEN];
-	uint8_t fek[TEE_FS_KM_FEK_SIZE];
+	struct tee_fs_fek fek_buf;
 	uint8_t *ciphertext;
 	size_t cipher_size;
 	size_t header_size = tee_fs_get_header_size(file_type);
@@ -184,13 +181,14 @@ TEE_Result tee_fs_encrypt_file(enum tee_fs_file_type file_type,
 #ifdef DEBUG_KEY_MANAGER
 	dump_buf("WARNING: iv", iv, sizeof(iv));
 #endif
-	struct ts_session *ts_sess = ts_get_current_session();
-
-	res = tee_fs_fek_crypt(&ts_sess->ctx->uuid, TEE_MODE_DECRYPT, encrypted_fek,
-			       TEE_FS_KM_FEK_SIZE, fek);
-	if (res != TEE_SUCCESS) {
-		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
-		goto fail;
+	if (!fek) {
+		struct ts_session *ts_sess = ts_get_current_session();
+
+		res = tee_fs_fek_unwrap(&ts_sess->ctx->uuid, encrypted_fek,
+					&fek_buf);
+		if (res != TEE_SUCCESS)
+			goto fail;
+		fek = &fek_buf;
 	}
 
 	ciphertext = data_out + header_size;
@@ -200,8 +198,7 @@ TEE_Result tee_fs_encrypt_file(enum tee_fs_file_type file_type,
 	hdr.aad.encrypted_key = encrypted_fek;
 	hdr.tag = tag;
 
-	res = do_auth_enc(TEE_MODE_ENCRYPT, &hdr,
-			fek, TEE_FS_KM_FEK_SIZE,
+	res = do_auth_enc(TEE_MODE_ENCRYPT, &hdr, fek,
 			data_in, data_in_size,
 			ciphertext, &cipher_size);
 
@@ -220,6 +217,7 @@ TEE_Result tee_fs_encrypt_file(enum tee_fs_file_type file_type,
 	}
 
 fail:
+	tee_fs_fek_clear(&fek_buf);
 	if (res) {
 		DMSG("res: 0x%08lx\n", res);
 	}
@@ -229,14 +227,14 @@ fail:
 TEE_Result tee_fs_decrypt_file(enum tee_fs_file_type file_type,
 		const uint8_t *data_in, size_t data_in_size,
 		uint8_t *plaintext, size_t *plaintext_size,
-		uint8_t *encrypted_fek)
+		uint8_t *encrypted_fek, const struct tee_fs_fek *fek)
 {
 	TEE_Result res = TEE_SUCCESS;
 	struct km_header km_hdr;
 	size_t file_hdr_size = tee_fs_get_header_size(file_type);
 	const uint8_t *cipher = data_in + file_hdr_size;
 	int cipher_size = data_in_size - file_hdr_size;
-	uint8_t fek[TEE_FS_KM_FEK_SIZE];
+	struct tee_fs_fek fek_buf;
 
 	if (file_type == META_FILE) {
 		DMSG("meta file\n");
@@ -256,15 +254,20 @@ TEE_Result tee_fs_decrypt_file(enum tee_fs_file_type file_type,
 		km_hdr.tag = hdr->common.tag;
 	}
 
+	if (fek)
+		return do_auth_enc(TEE_MODE_DECRYPT, &km_hdr, fek,
+				   cipher, cipher_size,
+				   plaintext, plaintext_size);
+
 	struct ts_session *ts_sess = ts_get_current_session();
 
-	res = tee_fs_fek_crypt(&ts_sess->ctx->uuid, TEE_MODE_DECRYPT, km_hdr.aad.encrypted_key,
-			       TEE_FS_KM_FEK_SIZE, fek);
-	if (res != TEE_SUCCESS) {
-		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+	res = tee_fs_fek_unwrap(&ts_sess->ctx->uuid, km_hdr.aad.encrypted_key,
+				&fek_buf);
+	if (res != TEE_SUCCESS)
 		return res;
-	}
 
-	return do_auth_enc(TEE_MODE_DECRYPT, &km_hdr, fek, TEE_FS_KM_FEK_SIZE,
+	res = do_auth_enc(TEE_MODE_DECRYPT, &km_hdr, &fek_buf,
 			cipher, cipher_size, plaintext, plaintext_size);
+	tee_fs_fek_clear(&fek_buf);
+	return res;
 }
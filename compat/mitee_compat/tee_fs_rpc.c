@@ -31,12 +31,22 @@
 #include <sys/stat.h>
 #include <tee/error_messages.h>
 
+/*
+ * Without O_SYNC the data only reaches the flash at the
+ * tee_fs_rpc_fdatasync() calls of the commit points
+ */
+#ifdef CONFIG_OPTEE_REE_FS_FDATASYNC
+#define TEE_FS_RPC_O_SYNC	0
+#else
+#define TEE_FS_RPC_O_SYNC	O_SYNC
+#endif
+
 /* file name: /data/00F2AA8A5024E411ABE20002A5D5C51B/.74657374312E74787400 */
 TEE_Result tee_fs_rpc_open(const char *file, bool create, int *fd)
 {
 	int _fd = -1;
-	int flags_c = 0x87; /* O_RDWR | O_CREAT | O_SYNC */
-	int flags_o = 0x83; /* O_RDWR | O_SYNC */
+	int flags_c = O_RDWR | O_CREAT | TEE_FS_RPC_O_SYNC;
+	int flags_o = O_RDWR | TEE_FS_RPC_O_SYNC;
 	char tmp_file[128] = { 0 };
 	char tmp_dir[128] = { 0 };
 
@@ -110,21 +120,13 @@ TEE_Result tee_fs_rpc_close(int fd)
 
 TEE_Result tee_fs_rpc_read(int fd, void *buf, size_t *size, int offs)
 {
-	long long int _offs = 0;
 	ssize_t r = -1;
 	ssize_t _size = *size;
 
-	_offs = lseek(fd, offs, 0); /* SEEK_SET */
-	DMSG("lseek, offs: %d --> offs: %lld\n", offs, _offs);
-	if(_offs != offs) {
-		EMSG(ERR_MSG_GENERIC ": %lld\n", _offs);
-		*size = 0;
-		return TEE_ERROR_GENERIC;
-	}
-
+	/* positioned reads, no lseek round trip per block */
 	while (r && _size) {
-		DMSG("fd: %d, read size: %d\n", fd, _size);
-		r = read(fd, buf, _size);
+		DMSG("fd: %d, read size: %d, offs: %d\n", fd, _size, offs);
+		r = pread(fd, buf, _size, offs);
 		DMSG("r: %d\n", r);
 		if (r < 0) {
 			EMSG(ERR_MSG_GENERIC ": %d, %d\n", fd, errno);
@@ -134,6 +136,7 @@ TEE_Result tee_fs_rpc_read(int fd, void *buf, size_t *size, int offs)
 			return TEE_ERROR_GENERIC;
 		}
 		buf += r;
+		offs += r;
 		_size -= r;
 	}
 
@@ -143,21 +146,12 @@ TEE_Result tee_fs_rpc_read(int fd, void *buf, size_t *size, int offs)
 
 TEE_Result tee_fs_rpc_write(int fd, void *buf, size_t *size, int offs)
 {
-	long long int _offs = 0;
 	ssize_t r = 0;
 	size_t _size = *size;
 
-	_offs = lseek(fd, offs, 0); /* SEEK_SET */
-	DMSG("lseek, offs: %d --> offs: %lld\n", offs, _offs);
-	if(_offs != offs) {
-		EMSG(ERR_MSG_GENERIC ": %lld\n", _offs);
-		*size = 0;
-		return TEE_ERROR_GENERIC;
-	}
-
 	while (_size) {
-		DMSG("fd: %d, write size: %d\n", fd, _size);
-		r = write(fd, buf, _size);
+		DMSG("fd: %d, write size: %d, offs: %d\n", fd, _size, offs);
+		r = pwrite(fd, buf, _size, offs);
 		DMSG("r: %d\n", r);
 		if (r < 0) {
 			EMSG(ERR_MSG_GENERIC ": %d, %d\n", fd, errno);
@@ -167,6 +161,7 @@ TEE_Result tee_fs_rpc_write(int fd, void *buf, size_t *size, int offs)
 			return TEE_ERROR_GENERIC;
 		}
 		buf += r;
+		offs += r;
 		_size -= r;
 	}
 
@@ -237,3 +232,96 @@ TEE_Result tee_fs_rpc_fsync(int fd)
 
 	return fsync(fd);
 }
+
+TEE_Result tee_fs_rpc_fdatasync(int fd)
+{
+#ifdef CONFIG_OPTEE_REE_FS_FDATASYNC
+	if (fd < 0) {
+		EMSG(ERR_MSG_BAD_PARAMETERS "\n");
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	while (fdatasync(fd)) {
+		if (errno != EINTR) {
+			EMSG(ERR_MSG_GENERIC ": %d, %d\n", fd, errno);
+			return TEE_ERROR_GENERIC;
+		}
+	}
+#endif
+	/* files opened with O_SYNC are already stable */
+	return TEE_SUCCESS;
+}
+
+TEE_Result tee_fs_rpc_truncate(int fd, size_t len)
+{
+	if (fd < 0) {
+		EMSG(ERR_MSG_BAD_PARAMETERS "\n");
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	if (ftruncate(fd, len)) {
+		EMSG(ERR_MSG_GENERIC ": %d, %d\n", fd, errno);
+		return TEE_ERROR_GENERIC;
+	}
+	return TEE_SUCCESS;
+}
+
+static TEE_Result tee_fs_rpc_read_op(void *arg)
+{
+	struct tee_fs_rpc_op *op = arg;
+
+	return tee_fs_rpc_read(op->fd, op->buf, &op->size, op->offs);
+}
+
+void tee_fs_rpc_read_async(struct tee_fs_rpc_op *op, int fd, void *buf,
+			   size_t size, int offs)
+{
+	op->fd = fd;
+	op->buf = buf;
+	op->size = size;
+	op->offs = offs;
+#ifdef CONFIG_OPTEE_FS_WORKER
+	fs_worker_submit(&op->req, tee_fs_rpc_read_op, op);
+#else
+	op->req.res = tee_fs_rpc_read_op(op);
+	op->req.done = true;
+#endif
+}
+
+static TEE_Result tee_fs_rpc_write_op(void *arg)
+{
+	struct tee_fs_rpc_op *op = arg;
+	size_t size = op->size;
+	TEE_Result res;
+
+	res = tee_fs_rpc_write(op->fd, op->buf, &size, op->offs);
+	if (res == TEE_SUCCESS && size != op->size) {
+		EMSG(ERR_MSG_GENERIC ": %zu\n", size);
+		res = TEE_ERROR_GENERIC;
+	}
+	return res;
+}
+
+void tee_fs_rpc_write_async(struct tee_fs_rpc_op *op, int fd, void *buf,
+			    size_t size, int offs)
+{
+	op->fd = fd;
+	op->buf = buf;
+	op->size = size;
+	op->offs = offs;
+#ifdef CONFIG_OPTEE_FS_WORKER
+	fs_worker_submit(&op->req, tee_fs_rpc_write_op, op);
+#else
+	op->req.res = tee_fs_rpc_write_op(op);
+	op->req.done = true;
+#endif
+}
+
+TEE_Result tee_fs_rpc_wait(struct tee_fs_rpc_op *op)
+{
+#ifdef CONFIG_OPTEE_FS_WORKER
+	return fs_worker_wait(&op->req);
+#else
+	return op->req.res;
+#endif
+}
@@ -23,6 +23,7 @@
 #include <tee/tee_pobj.h>
 #include <tee/tee_obj.h>
 #include <tee/tee_svc_cryp.h>
+#include <tee/tee_svc_storage.h>
 
 void tee_obj_add(struct user_ta_ctx *utc, struct tee_obj *o)
 {
@@ -48,7 +49,8 @@ void tee_obj_close(struct user_ta_ctx *utc, struct tee_obj *o)
 	TAILQ_REMOVE(&utc->objects, o, link);
 
 	if ((o->info.handleFlags & TEE_HANDLE_FLAG_PERSISTENT)) {
-		o->pobj->fops->close(&o->fh);
+		if (!tee_svc_storage_park_fh(o))
+			o->pobj->fops->close(&o->fh);
 		tee_pobj_release(o->pobj);
 	}
 
@@ -0,0 +1,1402 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string_ext.h>
+#include <sys/queue.h>
+#include <tee/tee_fs.h>
+#include <tee/tee_fs_rpc.h>
+#include <tee/tee_fs_key_manager.h>
+#include <trace.h>
+#include <util.h>
+#include <tee/error_messages.h>
+#include <kernel/tee_ta_manager.h>
+
+/*
+ * This file implements the tee_file_operations structure for a secure
+ * filesystem packing all objects of one TA and storage ID in a single
+ * log-structured container file in normal world, instead of one file per
+ * object as ree_fs_ops does. "/sst/<storage_id>/<uuid>/<object_id>" is
+ * stored as record <object_id> of "/sst/<storage_id>/<uuid>.pack":
+ *
+ * [ struct pack_file_header ]
+ * [ struct pack_rec_header | struct block_header | encrypted record ]
+ * ...
+ * [ struct pack_rec_header | struct block_header | encrypted record ]
+ *
+ * One record is built up as:
+ * [ struct pack_rec_info | name | data ]
+ *
+ * and encrypted with the FEK of the container. A PUT record holds the
+ * whole content of an object, DEL and RENAME records only names. Records
+ * are only ever appended, the in-memory index built by replaying the
+ * container on first use maps each name to its latest PUT record.
+ *
+ * The handles of an object share its content in memory, every write or
+ * truncate appends a PUT record with the new content before it returns.
+ *
+ * Records carry consecutive sequence numbers. A record torn by a power
+ * cut at the end of the container is truncated by the replay, a record
+ * which does not decrypt or is out of sequence anywhere else makes the
+ * whole container TEE_ERROR_CORRUPT_OBJECT. Once superseded records take
+ * more room than live ones, the container is rewritten with live objects
+ * only when its last handle is closed.
+ */
+
+#define PACK_FILE_MAGIC		0x4b415053	/* "SPAK" */
+#define PACK_FILE_VERSION	0
+#define PACK_REC_MAGIC		0x43455253	/* "SREC" */
+
+/* Same limit as ree_fs, objects are held in memory while open */
+#define PACK_MAX_FILE_SIZE	(256 * NUM_BLOCKS_PER_FILE)
+
+#define PACK_INDEX_BUCKETS	32
+#define PACK_COMPACT_MIN	4096
+
+enum pack_rec_type {
+	PACK_REC_PUT,
+	PACK_REC_DEL,
+	PACK_REC_RENAME,	/* data is the new name */
+};
+
+struct pack_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint8_t encrypted_fek[TEE_FS_KM_FEK_SIZE];
+};
+
+struct pack_rec_header {
+	uint32_t magic;
+	uint32_t size;		/* of the encrypted record that follows */
+};
+
+struct pack_rec_info {
+	uint32_t seq;
+	uint16_t type;
+	uint16_t name_len;
+	uint32_t data_len;
+};
+
+#define PACK_MAX_REC_SIZE	(sizeof(struct block_header) + \
+				 sizeof(struct pack_rec_info) + \
+				 2 * TEE_FS_NAME_MAX + PACK_MAX_FILE_SIZE)
+
+/*
+ * rec_pos is 0 until the object is first stored, removed objects are
+ * unlinked from the index and freed once their last handle is closed.
+ * data is the plaintext content while a handle is open.
+ */
+struct pack_object {
+	TAILQ_ENTRY(pack_object) link;
+	char *name;
+	size_t rec_pos;
+	size_t rec_size;
+	size_t new_pos;		/* used while compacting */
+	size_t new_size;
+	uint8_t *data;
+	size_t len;
+	size_t cap;
+	uint32_t refcount;
+	bool removed;
+	bool dirty;		/* created but not stored yet */
+};
+
+TAILQ_HEAD(pack_object_head, pack_object);
+
+struct pack_container {
+	TAILQ_ENTRY(pack_container) link;
+	struct pack_object_head index[PACK_INDEX_BUCKETS];
+	char *path;
+	int fd;			/* -1 while no handle is open */
+	uint32_t refcount;
+	uint32_t next_seq;
+	size_t end;
+	size_t live_size;	/* bytes of records still in use */
+	size_t dead_size;	/* bytes of superseded records */
+	uint8_t encrypted_fek[TEE_FS_KM_FEK_SIZE];
+	struct tee_fs_fek fek;
+};
+
+struct pack_fd {
+	struct pack_container *c;
+	struct pack_object *obj;
+	tee_fs_off_t pos;
+};
+
+struct tee_fs_dir {
+	char **names;
+	size_t count;
+	size_t next;
+	struct tee_fs_dirent ent;
+};
+
+static TAILQ_HEAD(pack_container_head, pack_container) pack_containers =
+	TAILQ_HEAD_INITIALIZER(pack_containers);
+static pthread_mutex_t pack_fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct pack_object_head *pack_bucket(struct pack_container *c,
+					    const char *name)
+{
+	uint32_t h = 5381;
+
+	while (*name)
+		h = h * 33 + (uint8_t)*name++;
+	return &c->index[h % PACK_INDEX_BUCKETS];
+}
+
+static struct pack_object *pack_obj_find(struct pack_container *c,
+					 const char *name)
+{
+	struct pack_object *obj;
+
+	TAILQ_FOREACH(obj, pack_bucket(c, name), link)
+		if (!strcmp(obj->name, name))
+			return obj;
+	return NULL;
+}
+
+static void pack_obj_release_data(struct pack_object *obj)
+{
+	if (obj->data) {
+		memzero_explicit(obj->data, obj->cap);
+		free(obj->data);
+	}
+	obj->data = NULL;
+	obj->len = 0;
+	obj->cap = 0;
+}
+
+static void pack_obj_free(struct pack_object *obj)
+{
+	pack_obj_release_data(obj);
+	free(obj->name);
+	free(obj);
+}
+
+static TEE_Result pack_obj_add(struct pack_container *c, const char *name,
+			       struct pack_object **obj)
+{
+	struct pack_object *o;
+
+	o = calloc(1, sizeof(*o));
+	if (!o) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY ": %zu\n", sizeof(*o));
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+	o->name = strdup(name);
+	if (!o->name) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY "\n");
+		free(o);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+
+	TAILQ_INSERT_TAIL(pack_bucket(c, name), o, link);
+	*obj = o;
+	return TEE_SUCCESS;
+}
+
+static void pack_obj_unlink(struct pack_container *c, struct pack_object *obj)
+{
+	TAILQ_REMOVE(pack_bucket(c, obj->name), obj, link);
+	c->live_size -= obj->rec_size;
+	c->dead_size += obj->rec_size;
+	obj->removed = true;
+	if (!obj->refcount)
+		pack_obj_free(obj);
+}
+
+/* Takes ownership of name */
+static void pack_obj_rename(struct pack_container *c, struct pack_object *obj,
+			    char *name)
+{
+	TAILQ_REMOVE(pack_bucket(c, obj->name), obj, link);
+	free(obj->name);
+	obj->name = name;
+	TAILQ_INSERT_TAIL(pack_bucket(c, name), obj, link);
+}
+
+/* "/sst/<storage_id>/<uuid>/<object_id>" */
+static TEE_Result pack_split_name(const char *file, char **path,
+				  const char **name)
+{
+	const char *base;
+	size_t len;
+
+	if (!file) {
+		EMSG(ERR_MSG_BAD_PARAMETERS "\n");
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	base = strrchr(file, '/');
+	if (!base || base == file || !base[1] ||
+	    strlen(base + 1) >= TEE_FS_NAME_MAX) {
+		EMSG(ERR_MSG_BAD_PARAMETERS ": %s\n", file);
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	len = base - file;
+	*path = malloc(len + sizeof(".pack"));
+	if (!*path) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY "\n");
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+	memcpy(*path, file, len);
+	strcpy(*path + len, ".pack");
+	*name = base + 1;
+	return TEE_SUCCESS;
+}
+
+static TEE_Result pack_write_rec(struct pack_container *c, int fd,
+				 size_t offs, uint32_t seq,
+				 enum pack_rec_type type, const char *name,
+				 const void *data, size_t data_len,
+				 size_t *rec_size)
+{
+	TEE_Result res;
+	struct pack_rec_info info;
+	struct pack_rec_header *hdr;
+	size_t name_len = strlen(name);
+	size_t plain_size = sizeof(info) + name_len + data_len;
+	size_t enc_size = tee_fs_get_header_size(BLOCK_FILE) + plain_size;
+	size_t size = sizeof(*hdr) + enc_size;
+	uint8_t *plain;
+	uint8_t *buf;
+
+	buf = malloc(plain_size + size);
+	if (!buf) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY ": %zu\n", plain_size + size);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+
+	info.seq = seq;
+	info.type = type;
+	info.name_len = name_len;
+	info.data_len = data_len;
+
+	plain = buf + size;
+	memcpy(plain, &info, sizeof(info));
+	memcpy(plain + sizeof(info), name, name_len);
+	if (data_len)
+		memcpy(plain + sizeof(info) + name_len, data, data_len);
+
+	hdr = (struct pack_rec_header *)buf;
+	hdr->magic = PACK_REC_MAGIC;
+	hdr->size = enc_size;
+
+	res = tee_fs_encrypt_file(BLOCK_FILE, plain, plain_size,
+				  buf + sizeof(*hdr), &enc_size,
+				  c->encrypted_fek, &c->fek);
+	memzero_explicit(plain, plain_size);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		goto exit;
+	}
+
+	*rec_size = size;
+	res = tee_fs_rpc_write(fd, buf, rec_size, offs);
+	if (res == TEE_SUCCESS && *rec_size != size) {
+		EMSG(ERR_MSG_GENERIC ": %zu\n", *rec_size);
+		res = TEE_ERROR_GENERIC;
+	}
+exit:
+	free(buf);
+	if (res) {
+		DMSG("res: 0x%08lx\n", res);
+	}
+	return res;
+}
+
+static TEE_Result pack_append(struct pack_container *c,
+			      enum pack_rec_type type, const char *name,
+			      const void *data, size_t data_len,
+			      size_t *rec_pos, size_t *rec_size)
+{
+	TEE_Result res;
+
+	res = pack_write_rec(c, c->fd, c->end, c->next_seq, type, name, data,
+			     data_len, rec_size);
+	if (res == TEE_SUCCESS)
+		res = tee_fs_rpc_fdatasync(c->fd);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	*rec_pos = c->end;
+	c->end += *rec_size;
+	c->next_seq++;
+	return TEE_SUCCESS;
+}
+
+/*
+ * Returns the decrypted record at offs in a buffer the caller wipes and
+ * frees, TEE_ERROR_CORRUPT_OBJECT if there is no valid record there.
+ * rec_size is set in both cases, to the size of the header alone if the
+ * header is not valid either.
+ */
+static TEE_Result pack_read_rec(struct pack_container *c, int fd,
+				size_t offs, uint8_t **plain,
+				size_t *plain_size, size_t *rec_size)
+{
+	TEE_Result res;
+	struct pack_rec_header hdr;
+	struct pack_rec_info *info;
+	uint8_t *buf = NULL;
+	size_t size = sizeof(hdr);
+
+	res = tee_fs_rpc_read(fd, &hdr, &size, offs);
+	if (res != TEE_SUCCESS)
+		return res;
+	*rec_size = sizeof(hdr);
+	if (size != sizeof(hdr) || hdr.magic != PACK_REC_MAGIC ||
+	    hdr.size > PACK_MAX_REC_SIZE ||
+	    hdr.size < tee_fs_get_header_size(BLOCK_FILE) + sizeof(*info))
+		return TEE_ERROR_CORRUPT_OBJECT;
+	*rec_size = sizeof(hdr) + hdr.size;
+
+	/* the plaintext is smaller, it is decrypted in place after it */
+	buf = malloc(2 * hdr.size);
+	if (!buf) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY ": %lu\n", 2 * hdr.size);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+
+	size = hdr.size;
+	res = tee_fs_rpc_read(fd, buf, &size, offs + sizeof(hdr));
+	if (res != TEE_SUCCESS)
+		goto exit;
+	if (size != hdr.size) {
+		res = TEE_ERROR_CORRUPT_OBJECT;
+		goto exit;
+	}
+
+	*plain_size = hdr.size;
+	res = tee_fs_decrypt_file(BLOCK_FILE, buf, hdr.size, buf + hdr.size,
+				  plain_size, c->encrypted_fek, &c->fek);
+	if (res != TEE_SUCCESS) {
+		res = TEE_ERROR_CORRUPT_OBJECT;
+		goto exit;
+	}
+
+	info = (struct pack_rec_info *)(buf + hdr.size);
+	if (*plain_size < sizeof(*info) ||
+	    *plain_size != sizeof(*info) + info->name_len + info->data_len ||
+	    !info->name_len || info->name_len >= TEE_FS_NAME_MAX) {
+		memzero_explicit(info, *plain_size);
+		res = TEE_ERROR_CORRUPT_OBJECT;
+		goto exit;
+	}
+
+	memmove(buf, info, *plain_size);
+	*plain = buf;
+	buf = NULL;
+exit:
+	free(buf);
+	return res;
+}
+
+static void pack_free_rec(uint8_t *plain, size_t plain_size)
+{
+	memzero_explicit(plain, plain_size);
+	free(plain);
+}
+
+static TEE_Result pack_apply_rec(struct pack_container *c, size_t rec_pos,
+				 size_t rec_size, const uint8_t *plain)
+{
+	TEE_Result res;
+	const struct pack_rec_info *info = (const void *)plain;
+	struct pack_object *obj;
+	struct pack_object *dst;
+	char name[TEE_FS_NAME_MAX];
+	char *new_name;
+
+	memcpy(name, plain + sizeof(*info), info->name_len);
+	name[info->name_len] = '\0';
+	obj = pack_obj_find(c, name);
+
+	switch (info->type) {
+	case PACK_REC_PUT:
+		if (obj) {
+			c->live_size -= obj->rec_size;
+			c->dead_size += obj->rec_size;
+		} else {
+			res = pack_obj_add(c, name, &obj);
+			if (res != TEE_SUCCESS)
+				return res;
+		}
+		obj->rec_pos = rec_pos;
+		obj->rec_size = rec_size;
+		c->live_size += rec_size;
+		return TEE_SUCCESS;
+
+	case PACK_REC_DEL:
+		if (obj)
+			pack_obj_unlink(c, obj);
+		c->dead_size += rec_size;
+		return TEE_SUCCESS;
+
+	case PACK_REC_RENAME:
+		c->dead_size += rec_size;
+		if (!obj || !info->data_len || info->data_len >= TEE_FS_NAME_MAX)
+			return TEE_SUCCESS;
+
+		new_name = strndup((const char *)plain + sizeof(*info) +
+				   info->name_len, info->data_len);
+		if (!new_name) {
+			EMSG(ERR_MSG_OUT_OF_MEMORY "\n");
+			return TEE_ERROR_OUT_OF_MEMORY;
+		}
+		dst = pack_obj_find(c, new_name);
+		if (dst)
+			pack_obj_unlink(c, dst);
+		pack_obj_rename(c, obj, new_name);
+		return TEE_SUCCESS;
+
+	default:
+		EMSG(ERR_MSG_CORRUPT_OBJECT ": %u\n", info->type);
+		return TEE_ERROR_CORRUPT_OBJECT;
+	}
+}
+
+/*
+ * Looks for a valid record past the invalid one at offs, a record torn
+ * while being appended is never followed by one. The garbage left by an
+ * append which failed may be longer than the record written over it, so
+ * the bytes after the invalid record are scanned for a record header
+ * rather than trusting its size.
+ */
+static TEE_Result pack_rec_follows(struct pack_container *c, size_t offs,
+				   bool *follows)
+{
+	TEE_Result res;
+	const uint32_t magic = PACK_REC_MAGIC;
+	const struct pack_rec_info *info;
+	uint8_t buf[256];
+	size_t plain_size;
+	size_t rec_size;
+	size_t size;
+	uint8_t *plain;
+
+	*follows = false;
+	for (offs++; ; offs += size - sizeof(magic) + 1) {
+		size = sizeof(buf);
+		res = tee_fs_rpc_read(c->fd, buf, &size, offs);
+		if (res != TEE_SUCCESS)
+			return res;
+		if (size < sizeof(magic))
+			return TEE_SUCCESS;
+
+		for (size_t i = 0; i <= size - sizeof(magic); i++) {
+			if (memcmp(buf + i, &magic, sizeof(magic)))
+				continue;
+
+			res = pack_read_rec(c, c->fd, offs + i, &plain,
+					    &plain_size, &rec_size);
+			if (res == TEE_ERROR_CORRUPT_OBJECT)
+				continue;
+			if (res != TEE_SUCCESS)
+				return res;
+
+			info = (const void *)plain;
+			*follows = info->seq > c->next_seq;
+			pack_free_rec(plain, plain_size);
+			if (*follows)
+				return TEE_SUCCESS;
+		}
+	}
+}
+
+/*
+ * Builds the index. A final record torn by a power cut is cut off, an
+ * invalid record with valid ones after it means the container is corrupt.
+ */
+static TEE_Result pack_replay(struct pack_container *c)
+{
+	TEE_Result res;
+	const struct pack_rec_info *info;
+	size_t offs = sizeof(struct pack_file_header);
+	size_t plain_size;
+	size_t rec_size;
+	uint8_t *plain;
+	bool follows;
+
+	while (true) {
+		res = pack_read_rec(c, c->fd, offs, &plain, &plain_size,
+				    &rec_size);
+		if (res == TEE_ERROR_CORRUPT_OBJECT) {
+			res = pack_rec_follows(c, offs, &follows);
+			if (res != TEE_SUCCESS)
+				return res;
+			if (follows) {
+				EMSG(ERR_MSG_CORRUPT_OBJECT ": %s, %zu\n",
+				     c->path, offs);
+				return TEE_ERROR_CORRUPT_OBJECT;
+			}
+
+			/* torn tail, the next append reuses its room */
+			if (tee_fs_rpc_truncate(c->fd, offs) != TEE_SUCCESS)
+				EMSG(ERR_MSG_GENERIC ": %s\n", c->path);
+			break;
+		}
+		if (res != TEE_SUCCESS)
+			return res;
+
+		info = (const void *)plain;
+		if (info->seq != c->next_seq) {
+			EMSG(ERR_MSG_CORRUPT_OBJECT ": %lu, %lu\n", info->seq,
+			     c->next_seq);
+			pack_free_rec(plain, plain_size);
+			return TEE_ERROR_CORRUPT_OBJECT;
+		}
+
+		res = pack_apply_rec(c, offs, rec_size, plain);
+		pack_free_rec(plain, plain_size);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		offs += rec_size;
+		c->next_seq++;
+	}
+
+	DMSG("%s: %lu records, end: %zu\n", c->path, c->next_seq - 1, offs);
+	c->end = offs;
+	return TEE_SUCCESS;
+}
+
+static TEE_Result pack_init_header(struct pack_container *c, bool create)
+{
+	TEE_Result res;
+	struct ts_session *ts_sess = ts_get_current_session();
+	struct pack_file_header hdr;
+	size_t size = sizeof(hdr);
+
+	res = tee_fs_rpc_read(c->fd, &hdr, &size, 0);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (!size) {
+		/* empty container, created but never written */
+		if (!create)
+			return TEE_ERROR_ITEM_NOT_FOUND;
+
+		res = tee_fs_generate_fek(&ts_sess->ctx->uuid,
+					  c->encrypted_fek, TEE_FS_KM_FEK_SIZE);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		hdr.magic = PACK_FILE_MAGIC;
+		hdr.version = PACK_FILE_VERSION;
+		memcpy(hdr.encrypted_fek, c->encrypted_fek, TEE_FS_KM_FEK_SIZE);
+		size = sizeof(hdr);
+		res = tee_fs_rpc_write(c->fd, &hdr, &size, 0);
+		if (res == TEE_SUCCESS && size != sizeof(hdr))
+			res = TEE_ERROR_GENERIC;
+		if (res == TEE_SUCCESS)
+			res = tee_fs_rpc_fdatasync(c->fd);
+		if (res != TEE_SUCCESS)
+			return res;
+	} else if (size != sizeof(hdr) || hdr.magic != PACK_FILE_MAGIC ||
+		   hdr.version != PACK_FILE_VERSION) {
+		EMSG(ERR_MSG_CORRUPT_OBJECT ": %s\n", c->path);
+		return TEE_ERROR_CORRUPT_OBJECT;
+	} else {
+		memcpy(c->encrypted_fek, hdr.encrypted_fek, TEE_FS_KM_FEK_SIZE);
+	}
+
+	return tee_fs_fek_unwrap(&ts_sess->ctx->uuid, c->encrypted_fek,
+				 &c->fek);
+}
+
+static void pack_container_free(struct pack_container *c)
+{
+	if (c->fd != -1)
+		tee_fs_rpc_close(c->fd);
+	for (size_t i = 0; i < PACK_INDEX_BUCKETS; i++) {
+		struct pack_object *obj;
+
+		while ((obj = TAILQ_FIRST(&c->index[i]))) {
+			TAILQ_REMOVE(&c->index[i], obj, link);
+			pack_obj_free(obj);
+		}
+	}
+	tee_fs_fek_clear(&c->fek);
+	free(c->path);
+	free(c);
+}
+
+/*
+ * Returns the container at path with its file open, loading its index on
+ * first use. Must be called with pack_fs_lock held. Takes ownership of
+ * path.
+ */
+static TEE_Result pack_container_get(char *path, bool create,
+				     struct pack_container **container)
+{
+	TEE_Result res;
+	struct pack_container *c;
+
+	TAILQ_FOREACH(c, &pack_containers, link) {
+		if (strcmp(c->path, path))
+			continue;
+
+		free(path);
+		if (c->fd == -1) {
+			res = tee_fs_rpc_open(c->path, false, &c->fd);
+			if (res != TEE_SUCCESS) {
+				c->fd = -1;
+				return res;
+			}
+		}
+		c->refcount++;
+		*container = c;
+		return TEE_SUCCESS;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY ": %zu\n", sizeof(*c));
+		free(path);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+	for (size_t i = 0; i < PACK_INDEX_BUCKETS; i++)
+		TAILQ_INIT(&c->index[i]);
+	c->path = path;
+	c->next_seq = 1;
+
+	res = tee_fs_rpc_open(path, create, &c->fd);
+	if (res != TEE_SUCCESS) {
+		c->fd = -1;
+		goto err;
+	}
+
+	res = pack_init_header(c, create);
+	if (res != TEE_SUCCESS)
+		goto err;
+
+	res = pack_replay(c);
+	if (res != TEE_SUCCESS)
+		goto err;
+
+	c->refcount = 1;
+	TAILQ_INSERT_TAIL(&pack_containers, c, link);
+	*container = c;
+	return TEE_SUCCESS;
+err:
+	pack_container_free(c);
+	if (res) {
+		DMSG("res: 0x%08lx\n", res);
+	}
+	return res;
+}
+
+/* Rewrites the container with the live objects only */
+static TEE_Result pack_compact(struct pack_container *c)
+{
+	TEE_Result res;
+	struct pack_file_header hdr;
+	struct pack_object *obj;
+	size_t offs = sizeof(hdr);
+	size_t plain_size;
+	size_t rec_size;
+	size_t size;
+	uint32_t seq = 1;
+	uint8_t *plain;
+	char *tmp;
+	int fd;
+
+	tmp = malloc(strlen(c->path) + sizeof(".tmp"));
+	if (!tmp) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY "\n");
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+	strcpy(tmp, c->path);
+	strcat(tmp, ".tmp");
+
+	DMSG("compact %s, live: %zu, dead: %zu\n", c->path, c->live_size,
+	     c->dead_size);
+	tee_fs_rpc_remove(tmp);
+	res = tee_fs_rpc_open(tmp, true, &fd);
+	if (res != TEE_SUCCESS) {
+		free(tmp);
+		return res;
+	}
+
+	hdr.magic = PACK_FILE_MAGIC;
+	hdr.version = PACK_FILE_VERSION;
+	memcpy(hdr.encrypted_fek, c->encrypted_fek, TEE_FS_KM_FEK_SIZE);
+	size = sizeof(hdr);
+	res = tee_fs_rpc_write(fd, &hdr, &size, 0);
+	if (res == TEE_SUCCESS && size != sizeof(hdr))
+		res = TEE_ERROR_GENERIC;
+
+	for (size_t i = 0; res == TEE_SUCCESS && i < PACK_INDEX_BUCKETS; i++) {
+		TAILQ_FOREACH(obj, &c->index[i], link) {
+			const struct pack_rec_info *info;
+
+			if (!obj->rec_pos)
+				continue;
+
+			res = pack_read_rec(c, c->fd, obj->rec_pos, &plain,
+					    &plain_size, &rec_size);
+			if (res != TEE_SUCCESS)
+				break;
+
+			info = (const void *)plain;
+			res = pack_write_rec(c, fd, offs, seq, PACK_REC_PUT,
+					     obj->name,
+					     plain + sizeof(*info) +
+					     info->name_len,
+					     info->data_len, &rec_size);
+			pack_free_rec(plain, plain_size);
+			if (res != TEE_SUCCESS)
+				break;
+
+			obj->new_pos = offs;
+			obj->new_size = rec_size;
+			offs += rec_size;
+			seq++;
+		}
+	}
+
+	if (res == TEE_SUCCESS)
+		res = tee_fs_rpc_fdatasync(fd);
+	if (res == TEE_SUCCESS)
+		res = tee_fs_rpc_rename(tmp, c->path, true);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		tee_fs_rpc_close(fd);
+		tee_fs_rpc_remove(tmp);
+		free(tmp);
+		return res;
+	}
+	free(tmp);
+
+	tee_fs_rpc_close(c->fd);
+	c->fd = fd;
+	c->live_size = 0;
+	for (size_t i = 0; i < PACK_INDEX_BUCKETS; i++) {
+		TAILQ_FOREACH(obj, &c->index[i], link) {
+			if (!obj->rec_pos)
+				continue;
+			obj->rec_pos = obj->new_pos;
+			obj->rec_size = obj->new_size;
+			c->live_size += obj->rec_size;
+		}
+	}
+	c->dead_size = 0;
+	c->end = offs;
+	c->next_seq = seq;
+	return TEE_SUCCESS;
+}
+
+/* Must be called with pack_fs_lock held */
+static void pack_container_put(struct pack_container *c)
+{
+	if (--c->refcount)
+		return;
+
+	if (c->dead_size >= PACK_COMPACT_MIN && c->dead_size > c->live_size)
+		pack_compact(c);
+
+	tee_fs_rpc_close(c->fd);
+	c->fd = -1;
+}
+
+static TEE_Result pack_reserve(struct pack_object *obj, size_t size)
+{
+	size_t cap = MAX(obj->cap * 2, (size_t)64);
+	uint8_t *data;
+
+	if (size <= obj->cap)
+		return TEE_SUCCESS;
+
+	cap = MIN(MAX(cap, size), (size_t)PACK_MAX_FILE_SIZE);
+	data = malloc(cap);
+	if (!data) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY ": %zu\n", cap);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+
+	/* the content is plaintext */
+	if (obj->data) {
+		memcpy(data, obj->data, obj->len);
+		memzero_explicit(obj->data, obj->cap);
+		free(obj->data);
+	}
+	obj->data = data;
+	obj->cap = cap;
+	return TEE_SUCCESS;
+}
+
+/* Stores the content of obj, must be called with pack_fs_lock held */
+static TEE_Result pack_persist(struct pack_container *c,
+			       struct pack_object *obj)
+{
+	TEE_Result res;
+	size_t rec_pos;
+	size_t rec_size;
+
+	if (obj->removed)
+		return TEE_SUCCESS;
+
+	res = pack_append(c, PACK_REC_PUT, obj->name, obj->data, obj->len,
+			  &rec_pos, &rec_size);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		return res;
+	}
+
+	c->live_size -= obj->rec_size;
+	c->dead_size += obj->rec_size;
+	obj->rec_pos = rec_pos;
+	obj->rec_size = rec_size;
+	c->live_size += rec_size;
+	obj->dirty = false;
+	return TEE_SUCCESS;
+}
+
+static TEE_Result pack_load_data(struct pack_container *c,
+				 struct pack_object *obj)
+{
+	TEE_Result res;
+	const struct pack_rec_info *info;
+	size_t plain_size;
+	size_t rec_size;
+	uint8_t *plain;
+
+	if (!obj->rec_pos)
+		return TEE_SUCCESS;
+
+	res = pack_read_rec(c, c->fd, obj->rec_pos, &plain, &plain_size,
+			    &rec_size);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		return res;
+	}
+
+	info = (const void *)plain;
+	res = pack_reserve(obj, info->data_len);
+	if (res == TEE_SUCCESS) {
+		memcpy(obj->data, plain + sizeof(*info) + info->name_len,
+		       info->data_len);
+		obj->len = info->data_len;
+	}
+	pack_free_rec(plain, plain_size);
+	return res;
+}
+
+static TEE_Result pack_fs_open_internal(const char *file, bool create,
+					struct tee_file_handle **fh)
+{
+	TEE_Result res;
+	struct pack_container *c = NULL;
+	struct pack_object *obj;
+	struct pack_fd *fdp;
+	const char *name;
+	char *path;
+
+	res = pack_split_name(file, &path, &name);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	fdp = calloc(1, sizeof(*fdp));
+	if (!fdp) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY ": %zu\n", sizeof(*fdp));
+		free(path);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+
+	pthread_mutex_lock(&pack_fs_lock);
+	res = pack_container_get(path, create, &c);
+	if (res != TEE_SUCCESS)
+		goto err;
+
+	obj = pack_obj_find(c, name);
+	if (create) {
+		/* replaced once the new content is stored */
+		if (obj)
+			pack_obj_unlink(c, obj);
+		res = pack_obj_add(c, name, &obj);
+		if (res != TEE_SUCCESS)
+			goto err;
+		obj->dirty = true;
+	} else if (!obj) {
+		res = TEE_ERROR_ITEM_NOT_FOUND;
+		goto err;
+	}
+
+	/* the first handle loads the content the others share */
+	if (!obj->refcount) {
+		res = pack_load_data(c, obj);
+		if (res != TEE_SUCCESS) {
+			pack_obj_release_data(obj);
+			goto err;
+		}
+	}
+	fdp->c = c;
+	fdp->obj = obj;
+	obj->refcount++;
+	pthread_mutex_unlock(&pack_fs_lock);
+
+	*fh = (struct tee_file_handle *)fdp;
+	return TEE_SUCCESS;
+err:
+	if (c)
+		pack_container_put(c);
+	pthread_mutex_unlock(&pack_fs_lock);
+	free(fdp);
+	if (res) {
+		DMSG("res: 0x%08lx\n", res);
+	}
+	return res;
+}
+
+static TEE_Result pack_fs_open(const char *file, struct tee_file_handle **fh)
+{
+	return pack_fs_open_internal(file, false, fh);
+}
+
+static TEE_Result pack_fs_create(const char *file, struct tee_file_handle **fh)
+{
+	return pack_fs_open_internal(file, true, fh);
+}
+
+static void pack_fs_close(struct tee_file_handle **fh)
+{
+	struct pack_fd *fdp = (struct pack_fd *)*fh;
+	struct pack_object *obj;
+
+	if (!fdp)
+		return;
+
+	obj = fdp->obj;
+	pthread_mutex_lock(&pack_fs_lock);
+	/* created and never written, store it empty */
+	if (obj->dirty && pack_persist(fdp->c, obj) != TEE_SUCCESS &&
+	    !obj->rec_pos && !obj->removed) {
+		EMSG(ERR_MSG_GENERIC ": %s not stored\n", obj->name);
+		pack_obj_unlink(fdp->c, obj);
+	}
+	if (!--obj->refcount) {
+		if (obj->removed)
+			pack_obj_free(obj);
+		else
+			pack_obj_release_data(obj);
+	}
+	pack_container_put(fdp->c);
+	pthread_mutex_unlock(&pack_fs_lock);
+
+	free(fdp);
+	*fh = NULL;
+}
+
+static TEE_Result pack_fs_read(struct tee_file_handle *fh, void *buf,
+			       size_t *len)
+{
+	struct pack_fd *fdp = (struct pack_fd *)fh;
+	struct pack_object *obj = fdp->obj;
+	size_t remain_bytes = *len;
+
+	pthread_mutex_lock(&pack_fs_lock);
+	if ((fdp->pos + remain_bytes) < remain_bytes ||
+	    fdp->pos > (tee_fs_off_t)obj->len)
+		remain_bytes = 0;
+	else if (fdp->pos + (tee_fs_off_t)remain_bytes > (tee_fs_off_t)obj->len)
+		remain_bytes = obj->len - fdp->pos;
+
+	if (remain_bytes)
+		memcpy(buf, obj->data + fdp->pos, remain_bytes);
+	pthread_mutex_unlock(&pack_fs_lock);
+	fdp->pos += remain_bytes;
+	*len = remain_bytes;
+	return TEE_SUCCESS;
+}
+
+static TEE_Result pack_fs_write(struct tee_file_handle *fh, const void *buf,
+				size_t len)
+{
+	TEE_Result res;
+	struct pack_fd *fdp = (struct pack_fd *)fh;
+	struct pack_object *obj = fdp->obj;
+	size_t pos = fdp->pos;
+	size_t old_len;
+	size_t undo_len = 0;
+	uint8_t *undo = NULL;
+
+	if (!len)
+		return TEE_SUCCESS;
+
+	if ((fdp->pos + len) > PACK_MAX_FILE_SIZE || (fdp->pos + len) < len) {
+		EMSG(ERR_MSG_BAD_PARAMETERS ": %lld\n", fdp->pos + len);
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	pthread_mutex_lock(&pack_fs_lock);
+	res = pack_reserve(obj, pos + len);
+	if (res != TEE_SUCCESS)
+		goto exit;
+
+	/* keep the bytes written over in case the record can't be stored */
+	old_len = obj->len;
+	if (pos < old_len) {
+		undo_len = MIN(len, old_len - pos);
+		undo = malloc(undo_len);
+		if (!undo) {
+			EMSG(ERR_MSG_OUT_OF_MEMORY ": %zu\n", undo_len);
+			res = TEE_ERROR_OUT_OF_MEMORY;
+			goto exit;
+		}
+		memcpy(undo, obj->data + pos, undo_len);
+	}
+
+	if (pos > obj->len)
+		memset(obj->data + obj->len, 0, pos - obj->len);
+	memcpy(obj->data + pos, buf, len);
+	if (pos + len > obj->len)
+		obj->len = pos + len;
+
+	res = pack_persist(fdp->c, obj);
+	if (res != TEE_SUCCESS) {
+		if (undo_len)
+			memcpy(obj->data + pos, undo, undo_len);
+		if (obj->len > old_len)
+			memzero_explicit(obj->data + old_len,
+					 obj->len - old_len);
+		obj->len = old_len;
+		goto exit;
+	}
+	fdp->pos += len;
+exit:
+	pthread_mutex_unlock(&pack_fs_lock);
+	if (undo) {
+		memzero_explicit(undo, undo_len);
+		free(undo);
+	}
+	return res;
+}
+
+static TEE_Result pack_fs_seek(struct tee_file_handle *fh, int32_t offset,
+			       TEE_Whence whence, int32_t *new_offs)
+{
+	struct pack_fd *fdp = (struct pack_fd *)fh;
+	tee_fs_off_t new_pos;
+
+	switch (whence) {
+	case TEE_DATA_SEEK_SET:
+		new_pos = offset;
+		break;
+
+	case TEE_DATA_SEEK_CUR:
+		new_pos = fdp->pos + offset;
+		break;
+
+	case TEE_DATA_SEEK_END:
+		pthread_mutex_lock(&pack_fs_lock);
+		new_pos = fdp->obj->len + offset;
+		pthread_mutex_unlock(&pack_fs_lock);
+		break;
+
+	default:
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	if (new_pos < 0)
+		new_pos = 0;
+
+	if (new_pos > TEE_DATA_MAX_POSITION) {
+		EMSG(ERR_MSG_BAD_PARAMETERS ": %lld\n", new_pos);
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	fdp->pos = new_pos;
+	if (new_offs)
+		*new_offs = new_pos;
+	return TEE_SUCCESS;
+}
+
+static TEE_Result pack_fs_truncate(struct tee_file_handle *fh, size_t len)
+{
+	TEE_Result res;
+	struct pack_fd *fdp = (struct pack_fd *)fh;
+	struct pack_object *obj = fdp->obj;
+	size_t old_len;
+
+	if (len > PACK_MAX_FILE_SIZE) {
+		EMSG(ERR_MSG_BAD_PARAMETERS ": %zu\n", len);
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	pthread_mutex_lock(&pack_fs_lock);
+	res = pack_reserve(obj, len);
+	if (res != TEE_SUCCESS)
+		goto exit;
+
+	/* the cut off bytes are only wiped once the record is stored */
+	old_len = obj->len;
+	if (len > old_len)
+		memset(obj->data + old_len, 0, len - old_len);
+	obj->len = len;
+
+	res = pack_persist(fdp->c, obj);
+	if (res != TEE_SUCCESS)
+		obj->len = old_len;
+	else if (len < old_len)
+		memzero_explicit(obj->data + len, old_len - len);
+exit:
+	pthread_mutex_unlock(&pack_fs_lock);
+	return res;
+}
+
+static TEE_Result pack_fs_rename(const char *old, const char *new,
+				 bool overwrite)
+{
+	TEE_Result res;
+	struct pack_container *c = NULL;
+	struct pack_object *obj;
+	struct pack_object *dst;
+	const char *old_name;
+	const char *new_name;
+	char *old_path;
+	char *new_path;
+	char *name = NULL;
+	size_t rec_pos;
+	size_t rec_size;
+
+	res = pack_split_name(old, &old_path, &old_name);
+	if (res != TEE_SUCCESS)
+		return res;
+	res = pack_split_name(new, &new_path, &new_name);
+	if (res != TEE_SUCCESS) {
+		free(old_path);
+		return res;
+	}
+
+	/* objects only move within the container of their TA */
+	if (strcmp(old_path, new_path)) {
+		EMSG(ERR_MSG_NOT_SUPPORTED ": %s, %s\n", old, new);
+		free(old_path);
+		free(new_path);
+		return TEE_ERROR_NOT_SUPPORTED;
+	}
+	free(new_path);
+
+	pthread_mutex_lock(&pack_fs_lock);
+	res = pack_container_get(old_path, false, &c);
+	if (res != TEE_SUCCESS)
+		goto exit;
+
+	obj = pack_obj_find(c, old_name);
+	if (!obj) {
+		res = TEE_ERROR_ITEM_NOT_FOUND;
+		goto exit;
+	}
+
+	dst = pack_obj_find(c, new_name);
+	if (dst && !overwrite) {
+		EMSG(ERR_MSG_ACCESS_CONFLICT "\n");
+		res = TEE_ERROR_ACCESS_CONFLICT;
+		goto exit;
+	}
+
+	name = strdup(new_name);
+	if (!name) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY "\n");
+		res = TEE_ERROR_OUT_OF_MEMORY;
+		goto exit;
+	}
+
+	res = pack_append(c, PACK_REC_RENAME, old_name, new_name,
+			  strlen(new_name), &rec_pos, &rec_size);
+	if (res != TEE_SUCCESS)
+		goto exit;
+
+	c->dead_size += rec_size;
+	if (dst)
+		pack_obj_unlink(c, dst);
+	pack_obj_rename(c, obj, name);
+	name = NULL;
+exit:
+	if (c)
+		pack_container_put(c);
+	pthread_mutex_unlock(&pack_fs_lock);
+	free(name);
+	if (res) {
+		DMSG("res: 0x%08lx\n", res);
+	}
+	return res;
+}
+
+static TEE_Result pack_fs_remove(const char *file)
+{
+	TEE_Result res;
+	struct pack_container *c = NULL;
+	struct pack_object *obj;
+	const char *name;
+	char *path;
+	size_t rec_pos;
+	size_t rec_size;
+
+	res = pack_split_name(file, &path, &name);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	pthread_mutex_lock(&pack_fs_lock);
+	res = pack_container_get(path, false, &c);
+	if (res != TEE_SUCCESS)
+		goto exit;
+
+	obj = pack_obj_find(c, name);
+	if (!obj) {
+		res = TEE_ERROR_ITEM_NOT_FOUND;
+		goto exit;
+	}
+
+	/* also needed if obj is not stored yet, it may replace a stored one */
+	res = pack_append(c, PACK_REC_DEL, name, NULL, 0, &rec_pos, &rec_size);
+	if (res != TEE_SUCCESS)
+		goto exit;
+
+	c->dead_size += rec_size;
+	pack_obj_unlink(c, obj);
+exit:
+	if (c)
+		pack_container_put(c);
+	pthread_mutex_unlock(&pack_fs_lock);
+	if (res) {
+		DMSG("res: 0x%08lx\n", res);
+	}
+	return res;
+}
+
+static TEE_Result pack_fs_fsync(struct tee_file_handle **fh)
+{
+	TEE_Result res = TEE_SUCCESS;
+	struct pack_fd *fdp = (struct pack_fd *)*fh;
+
+	if (fdp) {
+		pthread_mutex_lock(&pack_fs_lock);
+		if (fdp->obj->dirty)
+			res = pack_persist(fdp->c, fdp->obj);
+		if (res == TEE_SUCCESS)
+			res = tee_fs_rpc_fsync(fdp->c->fd);
+		pthread_mutex_unlock(&pack_fs_lock);
+	}
+	return res;
+}
+
+static void pack_fs_closedir(struct tee_fs_dir *d)
+{
+	if (!d)
+		return;
+
+	while (d->count)
+		free(d->names[--d->count]);
+	free(d->names);
+	free(d);
+}
+
+/* "/sst/<storage_id>/<uuid>", lists a snapshot of the stored names */
+static TEE_Result pack_fs_opendir(const char *name, struct tee_fs_dir **dir)
+{
+	TEE_Result res;
+	struct pack_container *c = NULL;
+	struct pack_object *obj;
+	struct tee_fs_dir *d;
+	size_t count = 0;
+	char *path;
+
+	if (!name) {
+		EMSG(ERR_MSG_BAD_PARAMETERS "\n");
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	d = calloc(1, sizeof(*d));
+	path = malloc(strlen(name) + sizeof(".pack"));
+	if (!d || !path) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY "\n");
+		free(d);
+		free(path);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+	strcpy(path, name);
+	strcat(path, ".pack");
+
+	pthread_mutex_lock(&pack_fs_lock);
+	res = pack_container_get(path, false, &c);
+	if (res != TEE_SUCCESS)
+		goto exit;
+
+	for (size_t i = 0; i < PACK_INDEX_BUCKETS; i++)
+		TAILQ_FOREACH(obj, &c->index[i], link)
+			count++;
+
+	d->names = calloc(count ? count : 1, sizeof(*d->names));
+	if (!d->names) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY "\n");
+		res = TEE_ERROR_OUT_OF_MEMORY;
+		goto exit;
+	}
+
+	for (size_t i = 0; i < PACK_INDEX_BUCKETS; i++) {
+		TAILQ_FOREACH(obj, &c->index[i], link) {
+			d->names[d->count] = strdup(obj->name);
+			if (!d->names[d->count]) {
+				EMSG(ERR_MSG_OUT_OF_MEMORY "\n");
+				res = TEE_ERROR_OUT_OF_MEMORY;
+				goto exit;
+			}
+			d->count++;
+		}
+	}
+exit:
+	if (c)
+		pack_container_put(c);
+	pthread_mutex_unlock(&pack_fs_lock);
+	if (res != TEE_SUCCESS) {
+		pack_fs_closedir(d);
+		return res;
+	}
+	*dir = d;
+	return TEE_SUCCESS;
+}
+
+static TEE_Result pack_fs_readdir(struct tee_fs_dir *d,
+				  struct tee_fs_dirent **ent)
+{
+	if (d->next == d->count)
+		return TEE_ERROR_ITEM_NOT_FOUND;
+
+	d->ent.d_name = d->names[d->next++];
+	*ent = &d->ent;
+	return TEE_SUCCESS;
+}
+
+const struct tee_file_operations pack_fs_ops = {
+	.open = pack_fs_open,
+	.create = pack_fs_create,
+	.close = pack_fs_close,
+	.read = pack_fs_read,
+	.write = pack_fs_write,
+	.seek = pack_fs_seek,
+	.truncate = pack_fs_truncate,
+	.rename = pack_fs_rename,
+	.remove = pack_fs_remove,
+	.opendir = pack_fs_opendir,
+	.readdir = pack_fs_readdir,
+	.closedir = pack_fs_closedir,
+	.fsync = pack_fs_fsync,
+};
@@ -16,6 +16,7 @@
  */
 
 #include <assert.h>
+#include <fs_crypt_pool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -63,6 +64,15 @@
  * struct meta_header and struct block_header are defined in
  * tee_fs_key_manager.h.
  *
+ * Files created with CONFIG_OPTEE_REE_FS_INLINE_SIZE set carry inline
+ * data in their meta-data, flagged by META_COUNTER_INLINE in the
+ * meta-counter together with the inline size, so the layout of a file is
+ * known before its meta-data is read:
+ * [ struct tee_fs_file_info | flags | inline_size bytes ]
+ * While INLINE_DATA is set the whole file content lives there and no data
+ * block exists, so opening and reading a small object takes one meta read
+ * and decrypt. Once the file outgrows inline_size its content moves to
+ * the data blocks for good.
  */
 extern void dump_buf(char *title, void *buf, uint32_t size);
 
@@ -72,13 +82,91 @@ extern void dump_buf(char *title, void *buf, uint32_t size);
 
 #define MAX_FILE_SIZE	(BLOCK_SIZE * NUM_BLOCKS_PER_FILE)
 
+#ifdef CONFIG_OPTEE_REE_FS_INLINE_SIZE
+#define INLINE_SIZE	CONFIG_OPTEE_REE_FS_INLINE_SIZE
+#else
+#define INLINE_SIZE	0
+#endif
+
+#define META_COUNTER_INLINE		0x80000000U
+#define META_COUNTER_INLINE_SHIFT	24
+#define META_COUNTER_INLINE_UNIT	16
+#define META_COUNTER_MASK		0x00ffffffU
+
+#if INLINE_SIZE > 0x7f * META_COUNTER_INLINE_UNIT
+#error "CONFIG_OPTEE_REE_FS_INLINE_SIZE does not fit in the meta-counter"
+#endif
+
+#define INLINE_DATA	BIT(0)
+
+#ifdef CONFIG_OPTEE_REE_FS_BLOCK_CACHE_SLOTS
+#define BLOCK_CACHE_SLOTS	CONFIG_OPTEE_REE_FS_BLOCK_CACHE_SLOTS
+#else
+#define BLOCK_CACHE_SLOTS	0
+#endif
+
+#ifdef CONFIG_OPTEE_REE_FS_READAHEAD_BLOCKS
+#define READAHEAD_BLOCKS	CONFIG_OPTEE_REE_FS_READAHEAD_BLOCKS
+#else
+#define READAHEAD_BLOCKS	0
+#endif
+
+/* Sequential reads in a row before the following blocks are read ahead */
+#define READAHEAD_TRIGGER	2
+
+/*
+ * Decrypted data block, keyed by its raw position in the REE file. A
+ * position holds one backup version of one block, and is only ever
+ * rewritten through write_block(), which refreshes the entry. pos 0 is
+ * the meta-counter, so it marks a free slot.
+ */
+struct block_cache_entry {
+	size_t pos;
+	uint32_t last_used;
+	uint8_t data[BLOCK_SIZE];
+};
+
+/*
+ * meta is the working meta, including writes not yet committed, and
+ * committed_meta the one the meta-counter currently points at. Blocks in
+ * dirty_table have had their new version written since the last commit,
+ * further writes in the same transaction go to that version in place.
+ */
 struct tee_fs_fd {
 	uint32_t meta_counter;
 	struct tee_fs_file_meta meta;
+	struct tee_fs_file_meta committed_meta;
+	uint32_t dirty_table[NUM_BLOCKS_PER_FILE / 32];
+	bool meta_dirty;
+	struct tee_fs_fek fek;		/* meta.encrypted_fek unwrapped */
+	size_t inline_size;		/* 0 if the meta has no inline data */
+	uint32_t inline_flags;
+	uint32_t committed_inline_flags;
+	uint8_t *inline_data;		/* zero past meta.info.length */
+	uint8_t *committed_inline_data;
 	tee_fs_off_t pos;
 	uint32_t flags;
 	bool is_new_file;
 	int fd;
+#if BLOCK_CACHE_SLOTS > 0
+	uint32_t cache_tick;
+	struct block_cache_entry cache[BLOCK_CACHE_SLOTS];
+#endif
+#if READAHEAD_BLOCKS > 0
+	/*
+	 * Encrypted span [ra_pos, ra_pos + ra_size) of the REE file, read on
+	 * the I/O worker ahead of a sequential reader. ra_end is the position
+	 * the last read ended at, ra_seq the sequential reads in a row.
+	 */
+	struct tee_fs_rpc_op ra_op;
+	bool ra_pending;
+	bool ra_sequential;
+	uint8_t *ra_buf;
+	size_t ra_pos;
+	size_t ra_size;
+	tee_fs_off_t ra_end;
+	uint32_t ra_seq;
+#endif
 };
 
 static inline int pos_to_block_num(int position)
@@ -100,6 +188,24 @@ static bool get_backup_version_of_block(struct tee_fs_file_meta *meta,
 	return !!(meta->info.backup_version_table[index] & block_mask);
 }
 
+static bool test_and_set_dirty_block(struct tee_fs_fd *fdp, size_t block_num)
+{
+	uint32_t index = (block_num / 32);
+	uint32_t block_mask = 1 << (block_num % 32);
+	bool dirty = !!(fdp->dirty_table[index] & block_mask);
+
+	fdp->dirty_table[index] |= block_mask;
+	return dirty;
+}
+
+static bool is_dirty_block(struct tee_fs_fd *fdp, size_t block_num)
+{
+	uint32_t index = (block_num / 32);
+	uint32_t block_mask = 1 << (block_num % 32);
+
+	return !!(fdp->dirty_table[index] & block_mask);
+}
+
 static inline void toggle_backup_version_of_block(
 		struct tee_fs_file_meta *meta,
 		size_t block_num)
@@ -110,10 +216,14 @@ static inline void toggle_backup_version_of_block(
 	meta->info.backup_version_table[index] ^= block_mask;
 }
 
-static size_t meta_size(void)
+static size_t meta_size(struct tee_fs_fd *fdp)
 {
-	return tee_fs_get_header_size(META_FILE) +
-	       sizeof(struct tee_fs_file_meta);
+	size_t size = tee_fs_get_header_size(META_FILE) +
+		      sizeof(struct tee_fs_file_meta);
+
+	if (fdp->inline_size)
+		size += sizeof(uint32_t) + fdp->inline_size;
+	return size;
 }
 
 static size_t meta_pos_raw(struct tee_fs_fd *fdp, bool active)
@@ -121,16 +231,54 @@ static size_t meta_pos_raw(struct tee_fs_fd *fdp, bool active)
 	size_t offs = sizeof(uint32_t);
 
 	if ((fdp->meta_counter & 1) == active)
-		offs += meta_size();
+		offs += meta_size(fdp);
 	return offs;
 }
 
+/* Inline files keep their inline size in the top bits of the counter */
+static uint32_t next_meta_counter(uint32_t counter)
+{
+	if (!(counter & META_COUNTER_INLINE))
+		return counter + 1;
+
+	return (counter & ~META_COUNTER_MASK) |
+	       ((counter + 1) & META_COUNTER_MASK);
+}
+
+static TEE_Result alloc_inline_data(struct tee_fs_fd *fdp, size_t size)
+{
+	uint8_t *buf;
+
+	buf = calloc(2, size);
+	if (!buf) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY ": %zu\n", 2 * size);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+	fdp->inline_size = size;
+	fdp->inline_data = buf;
+	fdp->committed_inline_data = buf + size;
+	return TEE_SUCCESS;
+}
+
+static void free_inline_data(struct tee_fs_fd *fdp)
+{
+	if (!fdp->inline_data)
+		return;
+
+	/* inline data is plaintext */
+	memzero_explicit(fdp->inline_data, 2 * fdp->inline_size);
+	free(fdp->inline_data);
+	fdp->inline_data = NULL;
+	fdp->committed_inline_data = NULL;
+}
+
 static size_t block_size_raw(void)
 {
 	return tee_fs_get_header_size(BLOCK_FILE) + BLOCK_SIZE;
 }
 
-static size_t block_pos_raw(struct tee_fs_file_meta *meta, size_t block_num,
+static size_t block_pos_raw(struct tee_fs_fd *fdp,
+			    struct tee_fs_file_meta *meta, size_t block_num,
 			    bool active)
 {
 	size_t n = block_num * 2;
@@ -138,9 +286,186 @@ static size_t block_pos_raw(struct tee_fs_file_meta *meta, size_t block_num,
 	if (active == get_backup_version_of_block(meta, block_num))
 		n++;
 
-	return sizeof(uint32_t) + meta_size() * 2 + n * block_size_raw();
+	return sizeof(uint32_t) + meta_size(fdp) * 2 + n * block_size_raw();
+}
+
+#if BLOCK_CACHE_SLOTS > 0
+static bool block_cache_get(struct tee_fs_fd *fdp, size_t pos, uint8_t *data)
+{
+	size_t n;
+
+	for (n = 0; n < BLOCK_CACHE_SLOTS; n++) {
+		if (fdp->cache[n].pos == pos) {
+			fdp->cache[n].last_used = ++fdp->cache_tick;
+			memcpy(data, fdp->cache[n].data, BLOCK_SIZE);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void block_cache_put(struct tee_fs_fd *fdp, size_t pos,
+			    const uint8_t *data)
+{
+	struct block_cache_entry *e = &fdp->cache[0];
+	size_t n;
+
+	/* reuse the entry of pos if cached, else the least recently used */
+	for (n = 0; n < BLOCK_CACHE_SLOTS; n++) {
+		if (fdp->cache[n].pos == pos) {
+			e = &fdp->cache[n];
+			break;
+		}
+		if (fdp->cache[n].last_used < e->last_used)
+			e = &fdp->cache[n];
+	}
+
+	e->pos = pos;
+	e->last_used = ++fdp->cache_tick;
+	memcpy(e->data, data, BLOCK_SIZE);
+}
+
+static void block_cache_drop(struct tee_fs_fd *fdp, size_t pos)
+{
+	size_t n;
+
+	for (n = 0; n < BLOCK_CACHE_SLOTS; n++) {
+		if (fdp->cache[n].pos == pos) {
+			memzero_explicit(&fdp->cache[n], sizeof(fdp->cache[n]));
+			return;
+		}
+	}
+}
+#else
+static bool block_cache_get(struct tee_fs_fd *fdp __unused,
+			    size_t pos __unused, uint8_t *data __unused)
+{
+	return false;
+}
+
+static void block_cache_put(struct tee_fs_fd *fdp __unused,
+			    size_t pos __unused, const uint8_t *data __unused)
+{
+}
+
+static void block_cache_drop(struct tee_fs_fd *fdp __unused,
+			     size_t pos __unused)
+{
+}
+#endif
+
+#if READAHEAD_BLOCKS > 0
+/* Wait for the read ahead in flight, its span is empty if it failed */
+static void readahead_wait(struct tee_fs_fd *fdp)
+{
+	if (!fdp->ra_pending)
+		return;
+
+	fdp->ra_pending = false;
+	if (tee_fs_rpc_wait(&fdp->ra_op) == TEE_SUCCESS)
+		fdp->ra_size = fdp->ra_op.size;
+	else
+		fdp->ra_size = 0;
+}
+
+/* Forget the span, which a write or truncate may have made stale */
+static void readahead_drop(struct tee_fs_fd *fdp)
+{
+	readahead_wait(fdp);
+	fdp->ra_size = 0;
+	fdp->ra_seq = 0;
+}
+
+static void readahead_free(struct tee_fs_fd *fdp)
+{
+	readahead_drop(fdp);
+	free(fdp->ra_buf);
+	fdp->ra_buf = NULL;
+}
+
+/* Raw block at pos, if the span holds all of it */
+static bool readahead_get(struct tee_fs_fd *fdp, size_t pos, size_t bsr,
+			  void **ct)
+{
+	if (!fdp->ra_buf)
+		return false;
+
+	readahead_wait(fdp);
+	if (pos < fdp->ra_pos || pos + bsr > fdp->ra_pos + fdp->ra_size)
+		return false;
+
+	*ct = fdp->ra_buf + (pos - fdp->ra_pos);
+	return true;
 }
 
+/*
+ * Called after a read that ended at fdp->pos, starts reading the next
+ * READAHEAD_BLOCKS blocks once the reads look sequential and the span
+ * doesn't hold the next block anymore.
+ */
+static void readahead_next(struct tee_fs_fd *fdp, tee_fs_off_t start)
+{
+	size_t bsr = block_size_raw();
+	int bnum = pos_to_block_num(fdp->pos);
+	int last_bnum;
+	size_t pos;
+	size_t end;
+
+	if (start == fdp->ra_end)
+		fdp->ra_seq++;
+	else
+		fdp->ra_seq = 0;
+	fdp->ra_end = fdp->pos;
+
+	if (!fdp->ra_sequential && fdp->ra_seq < READAHEAD_TRIGGER)
+		return;
+	if ((size_t)fdp->pos >= fdp->meta.info.length)
+		return;
+
+	pos = block_pos_raw(fdp, &fdp->meta, bnum, true);
+	if (fdp->ra_pending || (pos >= fdp->ra_pos &&
+				pos + bsr <= fdp->ra_pos + fdp->ra_size))
+		return;
+
+	if (!fdp->ra_buf) {
+		fdp->ra_buf = malloc(2 * READAHEAD_BLOCKS * bsr);
+		if (!fdp->ra_buf)
+			return;
+	}
+
+	last_bnum = MIN(bnum + READAHEAD_BLOCKS - 1,
+			get_last_block_num(fdp->meta.info.length));
+	end = block_pos_raw(fdp, &fdp->meta, last_bnum, true) + bsr;
+
+	DMSG("read ahead data blocks %d..%d\n", bnum, last_bnum);
+	fdp->ra_pos = pos;
+	fdp->ra_size = 0;
+	fdp->ra_pending = true;
+	tee_fs_rpc_read_async(&fdp->ra_op, fdp->fd, fdp->ra_buf, end - pos,
+			      pos);
+}
+#else
+static void readahead_drop(struct tee_fs_fd *fdp __unused)
+{
+}
+
+static void readahead_free(struct tee_fs_fd *fdp __unused)
+{
+}
+
+static bool readahead_get(struct tee_fs_fd *fdp __unused,
+			  size_t pos __unused, size_t bsr __unused,
+			  void **ct __unused)
+{
+	return false;
+}
+
+static void readahead_next(struct tee_fs_fd *fdp __unused,
+			   tee_fs_off_t start __unused)
+{
+}
+#endif
+
 /*
  * encrypted_fek: as input for META_FILE and BLOCK_FILE
  */
@@ -161,7 +486,8 @@ static TEE_Result encrypt_and_write_file(struct tee_fs_fd *fdp,
 	}
 
 	res = tee_fs_encrypt_file(file_type, data_in, data_in_size,
-				  ciphertext, &ciphertext_size, encrypted_fek);
+				  ciphertext, &ciphertext_size, encrypted_fek,
+				  &fdp->fek);
 	if (res != TEE_SUCCESS) {
 		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
 		goto exit;
@@ -179,6 +505,8 @@ exit:
 /*
  * encrypted_fek: as output for META_FILE
  *                as input for BLOCK_FILE
+ *
+ * Only used to read the meta at open, before fdp->fek is known.
  */
 static TEE_Result read_and_decrypt_file(struct tee_fs_fd *fdp,
 		enum tee_fs_file_type file_type, size_t offs,
@@ -209,7 +537,7 @@ static TEE_Result read_and_decrypt_file(struct tee_fs_fd *fdp,
 	}
 
 	res = tee_fs_decrypt_file(file_type, ciphertext, bytes, data_out,
-				  data_out_size, encrypted_fek);
+				  data_out_size, encrypted_fek, NULL);
 	if (res != TEE_SUCCESS) {
 		EMSG(ERR_MSG_CORRUPT_OBJECT "\n");
 		res = TEE_ERROR_CORRUPT_OBJECT;
@@ -225,12 +553,33 @@ exit:
 static TEE_Result write_meta_file(struct tee_fs_fd *fdp,
 		struct tee_fs_file_meta *meta)
 {
+	TEE_Result res;
 	size_t offs = meta_pos_raw(fdp, false);
+	size_t size = sizeof(meta->info) + sizeof(uint32_t) + fdp->inline_size;
+	uint8_t *buf;
 
 	DMSG("meta file --active: %d, --offs: %zd\n", (unsigned int)false, offs);
-	return encrypt_and_write_file(fdp, META_FILE, offs,
-			(void *)&meta->info, sizeof(meta->info),
-			meta->encrypted_fek);
+	if (!fdp->inline_size)
+		return encrypt_and_write_file(fdp, META_FILE, offs,
+				(void *)&meta->info, sizeof(meta->info),
+				meta->encrypted_fek);
+
+	/* |info|flags|inline data| */
+	buf = malloc(size);
+	if (!buf) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY ": %zu\n", size);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+	memcpy(buf, &meta->info, sizeof(meta->info));
+	memcpy(buf + sizeof(meta->info), &fdp->inline_flags, sizeof(uint32_t));
+	memcpy(buf + sizeof(meta->info) + sizeof(uint32_t), fdp->inline_data,
+	       fdp->inline_size);
+
+	res = encrypt_and_write_file(fdp, META_FILE, offs, buf, size,
+				     meta->encrypted_fek);
+	memzero_explicit(buf, size);
+	free(buf);
+	return res;
 }
 
 static TEE_Result write_meta_counter(struct tee_fs_fd *fdp)
@@ -248,6 +597,33 @@ static TEE_Result write_meta_counter(struct tee_fs_fd *fdp)
 	return res;
 }
 
+/*
+ * The meta-counter may only switch once the blocks and meta it selects
+ * are stable, and must be stable itself before success is reported.
+ */
+static TEE_Result write_meta_counter_synced(struct tee_fs_fd *fdp)
+{
+	TEE_Result res;
+
+	res = tee_fs_rpc_fdatasync(fdp->fd);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = write_meta_counter(fdp);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	return tee_fs_rpc_fdatasync(fdp->fd);
+}
+
+static TEE_Result unwrap_fek(struct tee_fs_fd *fdp)
+{
+	struct ts_session *ts_sess = ts_get_current_session();
+
+	return tee_fs_fek_unwrap(&ts_sess->ctx->uuid, fdp->meta.encrypted_fek,
+				 &fdp->fek);
+}
+
 static TEE_Result create_meta(struct tee_fs_fd *fdp, const char *fname)
 {
 	TEE_Result res;
@@ -267,19 +643,37 @@ static TEE_Result create_meta(struct tee_fs_fd *fdp, const char *fname)
 	dump_buf("WARNING: meta.encrypted_fek", fdp->meta.encrypted_fek, TEE_FS_KM_FEK_SIZE);
 #endif
 
+	res = unwrap_fek(fdp);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		return res;
+	}
+
 	res = tee_fs_rpc_open(fname, true, &fdp->fd);
 	if (res != TEE_SUCCESS) {
 		EMSG(ERR_MSG_GENERIC ": %s, 0x%08lx\n", fname, res);
 		return res;
 	}
+	if (INLINE_SIZE) {
+		res = alloc_inline_data(fdp, ROUNDUP(INLINE_SIZE,
+					META_COUNTER_INLINE_UNIT));
+		if (res != TEE_SUCCESS)
+			return res;
+		fdp->inline_flags = INLINE_DATA;
+		fdp->committed_inline_flags = INLINE_DATA;
+		fdp->meta_counter = META_COUNTER_INLINE |
+			(fdp->inline_size / META_COUNTER_INLINE_UNIT) <<
+			META_COUNTER_INLINE_SHIFT;
+	}
 	fdp->meta.counter = fdp->meta_counter;
+	fdp->committed_meta = fdp->meta;
 
 	res = write_meta_file(fdp, &fdp->meta);
 	if (res != TEE_SUCCESS) {
 		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
 		return res;
 	}
-	return write_meta_counter(fdp);
+	return write_meta_counter_synced(fdp);
 }
 
 static TEE_Result commit_meta_file(struct tee_fs_fd *fdp,
@@ -287,7 +681,7 @@ static TEE_Result commit_meta_file(struct tee_fs_fd *fdp,
 {
 	TEE_Result res;
 
-	new_meta->counter = fdp->meta_counter + 1;
+	new_meta->counter = next_meta_counter(fdp->meta_counter);
 
 	DMSG("new meta counter: 0x%08lx\n", new_meta->counter);
 	res = write_meta_file(fdp, new_meta);
@@ -302,20 +696,165 @@ static TEE_Result commit_meta_file(struct tee_fs_fd *fdp,
 	 */
 	fdp->meta = *new_meta;
 	fdp->meta_counter = fdp->meta.counter;
+	fdp->committed_meta = fdp->meta;
+	fdp->committed_inline_flags = fdp->inline_flags;
+	if (fdp->inline_size)
+		memcpy(fdp->committed_inline_data, fdp->inline_data,
+		       fdp->inline_size);
+	memset(fdp->dirty_table, 0, sizeof(fdp->dirty_table));
+	fdp->meta_dirty = false;
+
+	return write_meta_counter_synced(fdp);
+}
+
+/*
+ * A failed commit leaves the pending changes in place, the inactive meta
+ * is simply written again by the next attempt.
+ */
+static TEE_Result commit_pending_meta(struct tee_fs_fd *fdp)
+{
+	TEE_Result res;
+	struct tee_fs_file_meta new_meta;
+
+	if (!fdp->meta_dirty)
+		return TEE_SUCCESS;
+
+	new_meta = fdp->meta;
+	res = commit_meta_file(fdp, &new_meta);
+	if (res != TEE_SUCCESS)
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+	return res;
+}
 
-	return write_meta_counter(fdp);
+/*
+ * Called once the working meta holds a complete operation, commits it
+ * unless transactions are batched until fsync or close.
+ */
+static TEE_Result update_meta(struct tee_fs_fd *fdp,
+			      struct tee_fs_file_meta *new_meta)
+{
+	fdp->meta = *new_meta;
+	fdp->meta_dirty = true;
+#ifdef CONFIG_OPTEE_REE_FS_BATCHED_COMMIT
+	return TEE_SUCCESS;
+#else
+	return commit_pending_meta(fdp);
+#endif
+}
+
+/*
+ * Working state an operation starts from. A failing write or truncate
+ * only rolls back to it, earlier writes of a batch stay pending.
+ */
+struct meta_op {
+	struct tee_fs_file_meta meta;
+	uint32_t dirty_table[NUM_BLOCKS_PER_FILE / 32];
+	uint32_t inline_flags;
+	bool meta_dirty;
+};
+
+/*
+ * A block already written in the pending batch is rewritten in place, a
+ * failure there would destroy the batch's version of it. Commit the
+ * batch first if [pos, pos + len) touches such a block.
+ */
+static TEE_Result begin_meta_op(struct tee_fs_fd *fdp, struct meta_op *op,
+				size_t pos, size_t len)
+{
+	TEE_Result res;
+
+	if (fdp->meta_dirty && len) {
+		for (int n = pos_to_block_num(pos);
+		     n <= pos_to_block_num(pos + len - 1); n++) {
+			if (!is_dirty_block(fdp, n))
+				continue;
+
+			res = commit_pending_meta(fdp);
+			if (res != TEE_SUCCESS)
+				return res;
+			break;
+		}
+	}
+
+	op->meta = fdp->meta;
+	memcpy(op->dirty_table, fdp->dirty_table, sizeof(op->dirty_table));
+	op->inline_flags = fdp->inline_flags;
+	op->meta_dirty = fdp->meta_dirty;
+	return TEE_SUCCESS;
+}
+
+/*
+ * Drop the changes of a failed operation, the blocks it wrote are
+ * inactive versions again. Inline data is only changed by operations
+ * which cannot fail once they changed it, short of the commit itself
+ * when nothing else was pending.
+ */
+static void abort_meta_op(struct tee_fs_fd *fdp, struct meta_op *op)
+{
+	fdp->meta = op->meta;
+	memcpy(fdp->dirty_table, op->dirty_table, sizeof(fdp->dirty_table));
+	fdp->inline_flags = op->inline_flags;
+	fdp->meta_dirty = op->meta_dirty;
+	if (!op->meta_dirty && fdp->inline_size)
+		memcpy(fdp->inline_data, fdp->committed_inline_data,
+		       fdp->inline_size);
+}
+
+/* As update_meta(), rolling back the operation if its commit fails */
+static TEE_Result end_meta_op(struct tee_fs_fd *fdp, struct meta_op *op,
+			      struct tee_fs_file_meta *new_meta)
+{
+	TEE_Result res;
+
+	res = update_meta(fdp, new_meta);
+	/* still dirty unless only the meta-counter write failed */
+	if (res != TEE_SUCCESS && fdp->meta_dirty)
+		abort_meta_op(fdp, op);
+	return res;
 }
 
 static TEE_Result read_meta_file(struct tee_fs_fd *fdp,
 		struct tee_fs_file_meta *meta)
 {
+	TEE_Result res;
 	size_t meta_info_size = sizeof(struct tee_fs_file_info);
 	size_t offs = meta_pos_raw(fdp, true);
+	size_t size = meta_info_size + sizeof(uint32_t) + fdp->inline_size;
+	uint8_t *buf;
 
 	DMSG("meta file --active: %ld, --offs: %zd\n", (uint32_t)true, offs);
-	return read_and_decrypt_file(fdp, META_FILE, offs,
-				     &meta->info, &meta_info_size,
-				     meta->encrypted_fek);
+	if (!fdp->inline_size)
+		return read_and_decrypt_file(fdp, META_FILE, offs,
+					     &meta->info, &meta_info_size,
+					     meta->encrypted_fek);
+
+	buf = malloc(size);
+	if (!buf) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY ": %zu\n", size);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+
+	meta_info_size = size;
+	res = read_and_decrypt_file(fdp, META_FILE, offs, buf, &meta_info_size,
+				    meta->encrypted_fek);
+	if (res == TEE_SUCCESS && meta_info_size != size) {
+		EMSG(ERR_MSG_CORRUPT_OBJECT ": %zu\n", meta_info_size);
+		res = TEE_ERROR_CORRUPT_OBJECT;
+	}
+	if (res == TEE_SUCCESS) {
+		memcpy(&meta->info, buf, sizeof(meta->info));
+		memcpy(&fdp->inline_flags, buf + sizeof(meta->info),
+		       sizeof(uint32_t));
+		memcpy(fdp->inline_data,
+		       buf + sizeof(meta->info) + sizeof(uint32_t),
+		       fdp->inline_size);
+		fdp->committed_inline_flags = fdp->inline_flags;
+		memcpy(fdp->committed_inline_data, fdp->inline_data,
+		       fdp->inline_size);
+	}
+	memzero_explicit(buf, size);
+	free(buf);
+	return res;
 }
 
 static TEE_Result read_meta_counter(struct tee_fs_fd *fdp)
@@ -359,62 +898,443 @@ static TEE_Result read_meta(struct tee_fs_fd *fdp, const char *fname)
 		return res;
 	}
 
-	return read_meta_file(fdp, &fdp->meta);
+	if (fdp->meta_counter & META_COUNTER_INLINE) {
+		size_t size = ((fdp->meta_counter & ~META_COUNTER_INLINE) >>
+			       META_COUNTER_INLINE_SHIFT) *
+			      META_COUNTER_INLINE_UNIT;
+
+		if (!size) {
+			EMSG(ERR_MSG_CORRUPT_OBJECT ": 0x%08lx\n",
+			     fdp->meta_counter);
+			return TEE_ERROR_CORRUPT_OBJECT;
+		}
+		res = alloc_inline_data(fdp, size);
+		if (res != TEE_SUCCESS)
+			return res;
+	}
+
+	res = read_meta_file(fdp, &fdp->meta);
+	if (res != TEE_SUCCESS)
+		return res;
+	fdp->committed_meta = fdp->meta;
+
+	return unwrap_fek(fdp);
 }
 
-static TEE_Result read_block(struct tee_fs_fd *fdp, int bnum, uint8_t *data)
+/*
+ * Runs of blocks are moved with one file access: reads fetch the raw span
+ * from the first to the last active block of up to IO_BATCH_BLOCKS
+ * blocks, inactive versions included, writes merge blocks whose new
+ * versions are adjacent in the file.
+ *
+ * Write batches alternate between the two halves of buf, so the next
+ * batch is encrypted while the previous one is written by
+ * tee_fs_rpc_write_async().
+ *
+ * With CONFIG_OPTEE_FS_CRYPT_POOL the blocks of a batch are independent
+ * AES-GCM messages handed to the crypt workers together: a write batch
+ * stages the plaintext in pt and encrypts it all when flushed, a read
+ * batch decrypts its whole span into pt when fetched. Batches grow with
+ * the workers so each core gets a run of blocks.
+ */
+#ifdef CONFIG_OPTEE_FS_CRYPT_POOL
+#define IO_BATCH_BLOCKS	(8 * (CONFIG_OPTEE_FS_CRYPT_WORKERS + 1))
+#else
+#define IO_BATCH_BLOCKS	8
+#endif
+
+struct block_batch {
+	uint8_t *buf;
+	size_t pos;	/* raw position of the pending or valid bytes */
+	size_t size;	/* valid (read) or pending (write) bytes */
+	int bnum;	/* first pending block of a write batch */
+	int half;	/* half of buf the pending blocks are encrypted to */
+	struct tee_fs_rpc_op op;
+	size_t op_size;	/* bytes being written by op, 0 if idle */
+	int op_bnum;
+#ifdef CONFIG_OPTEE_FS_CRYPT_POOL
+	uint8_t *pt;
+	bool decrypt_span;	/* read batch, decrypt all the span at once */
+	int pt_bnum;		/* first block decrypted to pt */
+	int pt_blocks;		/* blocks decrypted to pt, 0 if none */
+#endif
+};
+
+static TEE_Result block_batch_alloc(struct block_batch *batch)
 {
-	TEE_Result res = TEE_ERROR_GENERIC;
-	size_t ct_size = block_size_raw();
-	size_t out_size = BLOCK_SIZE;
-	ssize_t pos = block_pos_raw(&fdp->meta, bnum, true);
-	void *ct = NULL;
-	ct = malloc(ct_size);
-	if (!ct) {
-		EMSG(ERR_MSG_OUT_OF_MEMORY ": %zu\n", ct_size);
+	size_t bsr = block_size_raw();
+
+	if (batch->buf)
+		return TEE_SUCCESS;
+
+	batch->buf = malloc(2 * IO_BATCH_BLOCKS * bsr);
+	if (!batch->buf) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY ": %zu\n", 2 * IO_BATCH_BLOCKS * bsr);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+	batch->size = 0;
+#ifdef CONFIG_OPTEE_FS_CRYPT_POOL
+	batch->pt = malloc(IO_BATCH_BLOCKS * BLOCK_SIZE);
+	if (!batch->pt) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY ": %d\n",
+		     IO_BATCH_BLOCKS * BLOCK_SIZE);
+		free(batch->buf);
+		batch->buf = NULL;
 		return TEE_ERROR_OUT_OF_MEMORY;
 	}
+	batch->pt_blocks = 0;
+#endif
+	return TEE_SUCCESS;
+}
 
-	DMSG("read data block from file\n");
-	res = tee_fs_rpc_read(fdp->fd, ct, &ct_size, pos);
-	if (res != TEE_SUCCESS) {
-		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
-		goto exit;
+static void block_batch_free(struct block_batch *batch)
+{
+	assert(!batch->op_size);
+	free(batch->buf);
+	batch->buf = NULL;
+#ifdef CONFIG_OPTEE_FS_CRYPT_POOL
+	if (batch->pt) {
+		/* the blocks are plaintext */
+		memzero_explicit(batch->pt, IO_BATCH_BLOCKS * BLOCK_SIZE);
+		free(batch->pt);
+		batch->pt = NULL;
 	}
+#endif
+}
+
+static TEE_Result decrypt_block(struct tee_fs_fd *fdp, size_t pos,
+				void *ct, size_t ct_size, uint8_t *data)
+{
+	TEE_Result res;
+	size_t out_size = BLOCK_SIZE;
 
 	if (!ct_size) {
 		memset(data, 0, BLOCK_SIZE);
-		res = TEE_SUCCESS; /* Block does not exist */
-		goto exit;
+		return TEE_SUCCESS; /* Block does not exist */
 	}
 	DMSG("data block size: %zd\n", ct_size);
 	DMSG("decrypt data block\n");
 	res = tee_fs_decrypt_file(BLOCK_FILE, ct, ct_size, data,
-				   &out_size, fdp->meta.encrypted_fek);
-exit:
-	free(ct);
+				   &out_size, fdp->meta.encrypted_fek, &fdp->fek);
+	if (res == TEE_SUCCESS)
+		block_cache_put(fdp, pos, data);
+	return res;
+}
+
+#ifdef CONFIG_OPTEE_FS_CRYPT_POOL
+struct block_crypt_job {
+	struct tee_fs_fd *fdp;
+	struct block_batch *batch;
+	struct tee_fs_file_meta *meta;
+};
+
+/* Runs on a crypt worker, must not touch the block cache */
+static TEE_Result decrypt_span_block(void *arg, size_t n)
+{
+	struct block_crypt_job *job = arg;
+	struct block_batch *batch = job->batch;
+	size_t bsr = block_size_raw();
+	size_t pos = block_pos_raw(job->fdp, job->meta, batch->pt_bnum + n,
+				   true);
+	size_t end = batch->pos + batch->size;
+	size_t out_size = BLOCK_SIZE;
+	uint8_t *data = batch->pt + n * BLOCK_SIZE;
+
+	if (end <= pos) {
+		memset(data, 0, BLOCK_SIZE);
+		return TEE_SUCCESS; /* Block does not exist */
+	}
+	return tee_fs_decrypt_file(BLOCK_FILE, batch->buf + (pos - batch->pos),
+				   MIN(bsr, end - pos), data, &out_size,
+				   job->meta->encrypted_fek, &job->fdp->fek);
+}
+
+/* Decrypt blocks bnum..last_bnum of the span just read on all cores */
+static TEE_Result decrypt_span(struct tee_fs_fd *fdp,
+			       struct block_batch *batch,
+			       struct tee_fs_file_meta *meta, int bnum,
+			       int last_bnum)
+{
+	struct block_crypt_job job = {
+		.fdp = fdp,
+		.batch = batch,
+		.meta = meta,
+	};
+	TEE_Result res;
+
+	batch->pt_bnum = bnum;
+	res = fs_crypt_pool_run(decrypt_span_block, &job,
+				last_bnum - bnum + 1);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		batch->pt_blocks = 0;
+		batch->size = 0;
+		return res;
+	}
+	batch->pt_blocks = last_bnum - bnum + 1;
+	return TEE_SUCCESS;
+}
+
+/* Block bnum, if the span decrypted to pt holds it */
+static bool decrypted_block_get(struct block_batch *batch, int bnum,
+				uint8_t *data)
+{
+	if (!batch->pt_blocks || bnum < batch->pt_bnum ||
+	    bnum >= batch->pt_bnum + batch->pt_blocks)
+		return false;
+
+	memcpy(data, batch->pt + (bnum - batch->pt_bnum) * BLOCK_SIZE,
+	       BLOCK_SIZE);
+	return true;
+}
+
+/* Runs on a crypt worker, encrypts pending block n of the batch */
+static TEE_Result encrypt_pending_block(void *arg, size_t n)
+{
+	struct block_crypt_job *job = arg;
+	struct block_batch *batch = job->batch;
+	size_t bsr = block_size_raw();
+	size_t ct_size = bsr;
+
+	return tee_fs_encrypt_file(BLOCK_FILE, batch->pt + n * BLOCK_SIZE,
+				   BLOCK_SIZE, batch->buf + batch->half *
+				   IO_BATCH_BLOCKS * bsr + n * bsr, &ct_size,
+				   job->meta->encrypted_fek, &job->fdp->fek);
+}
+
+static TEE_Result encrypt_pending_blocks(struct tee_fs_fd *fdp,
+					 struct block_batch *batch,
+					 struct tee_fs_file_meta *new_meta)
+{
+	struct block_crypt_job job = {
+		.fdp = fdp,
+		.batch = batch,
+		.meta = new_meta,
+	};
+	TEE_Result res;
+
+	res = fs_crypt_pool_run(encrypt_pending_block, &job,
+				batch->size / block_size_raw());
+	if (res != TEE_SUCCESS)
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+	return res;
+}
+
+/* Stage block data as the next pending block, encrypted when flushed */
+static TEE_Result add_pending_block(struct tee_fs_fd *fdp __unused,
+				    struct block_batch *batch,
+				    const uint8_t *data,
+				    struct tee_fs_file_meta *new_meta __unused)
+{
+	memcpy(batch->pt + batch->size / block_size_raw() * BLOCK_SIZE, data,
+	       BLOCK_SIZE);
+	return TEE_SUCCESS;
+}
+#else
+static bool decrypted_block_get(struct block_batch *batch __unused,
+				int bnum __unused, uint8_t *data __unused)
+{
+	return false;
+}
+
+static TEE_Result encrypt_pending_blocks(struct tee_fs_fd *fdp __unused,
+					 struct block_batch *batch __unused,
+					 struct tee_fs_file_meta *new_meta __unused)
+{
+	return TEE_SUCCESS;
+}
+
+/* Encrypt block data as the next pending block */
+static TEE_Result add_pending_block(struct tee_fs_fd *fdp,
+				    struct block_batch *batch,
+				    const uint8_t *data,
+				    struct tee_fs_file_meta *new_meta)
+{
+	size_t bsr = block_size_raw();
+	size_t ct_size = bsr;
+	TEE_Result res;
+
+	res = tee_fs_encrypt_file(BLOCK_FILE, data, BLOCK_SIZE,
+				  batch->buf + batch->half * IO_BATCH_BLOCKS *
+				  bsr + batch->size, &ct_size,
+				  new_meta->encrypted_fek, &fdp->fek);
+	if (res != TEE_SUCCESS)
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+	return res;
+}
+#endif
+
+/* Read block bnum through the batch, which is refilled with the span up
+ * to IO_BATCH_BLOCKS blocks ahead (at most last_bnum) when it misses.
+ * meta locates the blocks: a write passes its working meta, so a block
+ * already written in the same transaction is read in its new version.
+ */
+static TEE_Result read_block(struct tee_fs_fd *fdp, struct block_batch *batch,
+			     struct tee_fs_file_meta *meta, int bnum,
+			     int last_bnum, uint8_t *data)
+{
+	TEE_Result res = TEE_ERROR_GENERIC;
+	size_t bsr = block_size_raw();
+	size_t pos = block_pos_raw(fdp, meta, bnum, true);
+	size_t end;
+	void *ct = NULL;
+
+	if (block_cache_get(fdp, pos, data))
+		return TEE_SUCCESS;
+
+	if (decrypted_block_get(batch, bnum, data)) {
+		block_cache_put(fdp, pos, data);
+		return TEE_SUCCESS;
+	}
+
+	if (readahead_get(fdp, pos, bsr, &ct))
+		return decrypt_block(fdp, pos, ct, bsr, data);
+
+	res = block_batch_alloc(batch);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (pos < batch->pos || pos + bsr > batch->pos + batch->size) {
+		last_bnum = MIN(last_bnum, bnum + IO_BATCH_BLOCKS - 1);
+		end = block_pos_raw(fdp, meta, last_bnum, true) + bsr;
+
+		DMSG("read data blocks %d..%d from file\n", bnum, last_bnum);
+		batch->pos = pos;
+		batch->size = end - pos;
+		res = tee_fs_rpc_read(fdp->fd, batch->buf, &batch->size, pos);
+		if (res != TEE_SUCCESS) {
+			EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+			batch->size = 0;
+			return res;
+		}
+
+#ifdef CONFIG_OPTEE_FS_CRYPT_POOL
+		if (batch->decrypt_span && last_bnum > bnum) {
+			res = decrypt_span(fdp, batch, meta, bnum, last_bnum);
+			if (res != TEE_SUCCESS)
+				return res;
+			decrypted_block_get(batch, bnum, data);
+			block_cache_put(fdp, pos, data);
+			return TEE_SUCCESS;
+		}
+		batch->pt_blocks = 0;
+#endif
+	}
+
+	/* the span may end early at the end of the file */
+	end = batch->pos + batch->size;
+	res = decrypt_block(fdp, pos, batch->buf + (pos - batch->pos),
+			    end > pos ? MIN(bsr, end - pos) : 0, data);
 	if (res) {
 		DMSG("res: 0x%08lx\n", res);
 	}
 	return res;
 }
 
-static TEE_Result write_block(struct tee_fs_fd *fdp, size_t bnum, uint8_t *data,
-			      struct tee_fs_file_meta *new_meta)
+/* Wait for the batch being written, if any, and account for its blocks */
+static TEE_Result complete_blocks(struct tee_fs_fd *fdp,
+				  struct block_batch *batch,
+				  struct tee_fs_file_meta *new_meta)
 {
 	TEE_Result res;
-	size_t offs = block_pos_raw(new_meta, bnum, false);
+	size_t bsr = block_size_raw();
+	size_t n;
 
-	res = encrypt_and_write_file(fdp, BLOCK_FILE, offs, data,
-				     BLOCK_SIZE, new_meta->encrypted_fek);
-	if (res == TEE_SUCCESS)
-		toggle_backup_version_of_block(new_meta, bnum);
+	if (!batch->op_size)
+		return TEE_SUCCESS;
+
+	res = tee_fs_rpc_wait(&batch->op);
+	for (n = 0; n < batch->op_size / bsr; n++) {
+		if (res == TEE_SUCCESS) {
+			if (!test_and_set_dirty_block(fdp, batch->op_bnum + n))
+				toggle_backup_version_of_block(new_meta,
+							batch->op_bnum + n);
+		} else
+			/* the positions may hold a partial write now */
+			block_cache_drop(fdp, batch->op.offs + n * bsr);
+	}
+	batch->op_size = 0;
 	if (res) {
 		DMSG("res: 0x%08lx\n", res);
 	}
 	return res;
 }
 
+/* Drop the pending blocks, which never reached the file */
+static void discard_blocks(struct tee_fs_fd *fdp, struct block_batch *batch)
+{
+	while (batch->size) {
+		batch->size -= block_size_raw();
+		block_cache_drop(fdp, batch->pos + batch->size);
+	}
+}
+
+/* Start writing the pending blocks, once the previous batch is written */
+static TEE_Result flush_blocks(struct tee_fs_fd *fdp,
+			       struct block_batch *batch,
+			       struct tee_fs_file_meta *new_meta)
+{
+	TEE_Result res;
+
+	if (!batch->size)
+		return TEE_SUCCESS;
+
+	/* the other half may still be in flight, this one is free */
+	res = encrypt_pending_blocks(fdp, batch, new_meta);
+	if (res == TEE_SUCCESS)
+		res = complete_blocks(fdp, batch, new_meta);
+	if (res != TEE_SUCCESS) {
+		discard_blocks(fdp, batch);
+		return res;
+	}
+
+	tee_fs_rpc_write_async(&batch->op, fdp->fd,
+			       batch->buf + batch->half * IO_BATCH_BLOCKS *
+			       block_size_raw(), batch->size, batch->pos);
+	batch->op_size = batch->size;
+	batch->op_bnum = batch->bnum;
+	batch->half ^= 1;
+	batch->size = 0;
+	return TEE_SUCCESS;
+}
+
+/* Add block bnum to the batch, flushing it first unless the new
+ * version of bnum directly follows the pending ones in the file. A block
+ * already written in this transaction keeps its new version.
+ */
+static TEE_Result write_block(struct tee_fs_fd *fdp, struct block_batch *batch,
+			      size_t bnum, const uint8_t *data,
+			      struct tee_fs_file_meta *new_meta)
+{
+	TEE_Result res;
+	size_t bsr = block_size_raw();
+	size_t offs = block_pos_raw(fdp, new_meta, bnum,
+				     is_dirty_block(fdp, bnum));
+
+	res = block_batch_alloc(batch);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (batch->size && (offs != batch->pos + batch->size ||
+			    batch->size == IO_BATCH_BLOCKS * bsr)) {
+		res = flush_blocks(fdp, batch, new_meta);
+		if (res != TEE_SUCCESS)
+			return res;
+	}
+	if (!batch->size) {
+		batch->pos = offs;
+		batch->bnum = bnum;
+	}
+
+	res = add_pending_block(fdp, batch, data, new_meta);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	batch->size += bsr;
+	block_cache_put(fdp, offs, data);
+	return TEE_SUCCESS;
+}
+
 static TEE_Result out_of_place_write(struct tee_fs_fd *fdp, const void *buf,
 		size_t len, struct tee_fs_file_meta *new_meta)
 {
@@ -424,7 +1344,10 @@ static TEE_Result out_of_place_write(struct tee_fs_fd *fdp, const void *buf,
 	size_t remain_bytes = len;
 	uint8_t *data_ptr = (uint8_t *)buf;
 	uint8_t block[BLOCK_SIZE];
+	uint8_t *src = NULL;
 	int orig_pos = fdp->pos;
+	struct block_batch rd = { 0 };
+	struct block_batch wr = { 0 };
 
 	DMSG("start_block_num: %d, end_block_num: %d\n", start_block_num, end_block_num);
 	while (start_block_num <= end_block_num) {
@@ -434,20 +1357,33 @@ static TEE_Result out_of_place_write(struct tee_fs_fd *fdp, const void *buf,
 		if (size_to_write + offset > BLOCK_SIZE)
 			size_to_write = BLOCK_SIZE - offset;
 
-		res = read_block(fdp, start_block_num, block);
-		if (res == TEE_ERROR_ITEM_NOT_FOUND)
-			memset(block, 0, BLOCK_SIZE);
-		else if (res != TEE_SUCCESS) {
-			EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
-			goto exit;
+		if (size_to_write == BLOCK_SIZE) {
+			/*
+			 * The old contents are all overwritten, encrypt
+			 * straight from the caller's buffer
+			 */
+			if (data_ptr)
+				src = data_ptr;
+			else
+				src = memset(block, 0, BLOCK_SIZE);
+		} else {
+			res = read_block(fdp, &rd, new_meta, start_block_num,
+					 end_block_num, block);
+			if (res == TEE_ERROR_ITEM_NOT_FOUND)
+				memset(block, 0, BLOCK_SIZE);
+			else if (res != TEE_SUCCESS) {
+				EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+				goto exit;
+			}
+
+			if (data_ptr)
+				memcpy(block + offset, data_ptr, size_to_write);
+			else
+				memset(block + offset, 0, size_to_write);
+			src = block;
 		}
 
-		if (data_ptr)
-			memcpy(block + offset, data_ptr, size_to_write);
-		else
-			memset(block + offset, 0, size_to_write);
-
-		res = write_block(fdp, start_block_num, block, new_meta);
+		res = write_block(fdp, &wr, start_block_num, src, new_meta);
 		if (res != TEE_SUCCESS) {
 			EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
 			goto exit;
@@ -460,18 +1396,59 @@ static TEE_Result out_of_place_write(struct tee_fs_fd *fdp, const void *buf,
 		fdp->pos += size_to_write;
 	}
 
+	res = flush_blocks(fdp, &wr, new_meta);
+	if (res == TEE_SUCCESS)
+		res = complete_blocks(fdp, &wr, new_meta);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		goto exit;
+	}
+
 	if (fdp->pos > (tee_fs_off_t)new_meta->info.length)
 		new_meta->info.length = fdp->pos;
 	DMSG("updated meta.info.length: %ld\n", (uint32_t)fdp->pos);
 exit:
-	if (res != TEE_SUCCESS)
+	if (res != TEE_SUCCESS) {
+		/* the meta is aborted, the write in flight must still end */
+		complete_blocks(fdp, &wr, new_meta);
+		discard_blocks(fdp, &wr);
 		fdp->pos = orig_pos;
+	}
+	block_batch_free(&rd);
+	block_batch_free(&wr);
 	if (res) {
 		DMSG("res: 0x%08lx\n", res);
 	}
 	return res;
 }
 
+/*
+ * Move the inline content of the file to the data blocks as part of the
+ * working transaction, the file stays block based from then on.
+ */
+static TEE_Result spill_inline_data(struct tee_fs_fd *fdp,
+				    struct tee_fs_file_meta *new_meta)
+{
+	TEE_Result res = TEE_SUCCESS;
+	int orig_pos = fdp->pos;
+
+	DMSG("spill inline data, len: %zu\n", (size_t)new_meta->info.length);
+	if (new_meta->info.length) {
+		fdp->pos = 0;
+		res = out_of_place_write(fdp, fdp->inline_data,
+					 new_meta->info.length, new_meta);
+		fdp->pos = orig_pos;
+		if (res != TEE_SUCCESS) {
+			EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+			return res;
+		}
+	}
+
+	fdp->inline_flags &= ~INLINE_DATA;
+	memzero_explicit(fdp->inline_data, fdp->inline_size);
+	return res;
+}
+
 static TEE_Result open_internal(const char *file, bool create,
 				struct tee_file_handle **fh)
 {
@@ -510,6 +1487,8 @@ static TEE_Result open_internal(const char *file, bool create,
 			tee_fs_rpc_close(fdp->fd);
 		if (create)
 			tee_fs_rpc_remove(file);
+		free_inline_data(fdp);
+		memzero_explicit(fdp, sizeof(*fdp));
 		free(fdp);
 	}
 	if (res) {
@@ -533,7 +1512,13 @@ static void ree_fs_close(struct tee_file_handle **fh)
 	struct tee_fs_fd *fdp = (struct tee_fs_fd *)*fh;
 
 	if (fdp) {
+		if (commit_pending_meta(fdp) != TEE_SUCCESS)
+			EMSG(ERR_MSG_GENERIC ": uncommitted writes lost\n");
+		readahead_free(fdp);
 		tee_fs_rpc_close(fdp->fd);
+		free_inline_data(fdp);
+		/* the FEK and the block cache are plaintext */
+		memzero_explicit(fdp, sizeof(*fdp));
 		free(fdp);
 		*fh = NULL;
 	}
@@ -606,13 +1591,39 @@ static TEE_Result ree_fs_ftruncate_internal(struct tee_fs_fd *fdp,
 	TEE_Result res;
 	size_t old_file_len = fdp->meta.info.length;
 	struct tee_fs_file_meta new_meta;
+	struct meta_op op;
 
 	if (new_file_len > MAX_FILE_SIZE) {
 		EMSG(ERR_MSG_BAD_PARAMETERS ": %lld\n", new_file_len);
 		return TEE_ERROR_BAD_PARAMETERS;
 	}
 
+	/* only an extension writes blocks, from the old end on */
+	res = begin_meta_op(fdp, &op, old_file_len,
+			    (size_t)new_file_len > old_file_len ?
+			    new_file_len - old_file_len : 0);
+	if (res != TEE_SUCCESS)
+		return res;
+
 	new_meta = fdp->meta;
+
+	if (fdp->inline_flags & INLINE_DATA) {
+		if ((size_t)new_file_len <= fdp->inline_size) {
+			if ((size_t)new_file_len < old_file_len)
+				memzero_explicit(fdp->inline_data + new_file_len,
+						 old_file_len - new_file_len);
+			new_meta.info.length = new_file_len;
+			return end_meta_op(fdp, &op, &new_meta);
+		}
+
+		res = spill_inline_data(fdp, &new_meta);
+		if (res != TEE_SUCCESS) {
+			EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+			abort_meta_op(fdp, &op);
+			return res;
+		}
+	}
+
 	new_meta.info.length = new_file_len;
 
 	if ((size_t)new_file_len > old_file_len) {
@@ -624,11 +1635,12 @@ static TEE_Result ree_fs_ftruncate_internal(struct tee_fs_fd *fdp,
 		fdp->pos = orig_pos;
 		if (res != TEE_SUCCESS) {
 			EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+			abort_meta_op(fdp, &op);
 			return res;
 		}
 	}
 
-	return commit_meta_file(fdp, &new_meta);
+	return end_meta_op(fdp, &op, &new_meta);
 }
 
 static TEE_Result ree_fs_read(struct tee_file_handle *fh, void *buf,
@@ -641,6 +1653,12 @@ static TEE_Result ree_fs_read(struct tee_file_handle *fh, void *buf,
 	uint8_t *data_ptr = buf;
 	uint8_t block[BLOCK_SIZE];
 	struct tee_fs_fd *fdp = (struct tee_fs_fd *)fh;
+	struct block_batch batch = { 0 };
+	tee_fs_off_t start = fdp->pos;
+
+#ifdef CONFIG_OPTEE_FS_CRYPT_POOL
+	batch.decrypt_span = true;
+#endif
 
 	remain_bytes = *len;
 	if ((fdp->pos + remain_bytes) < remain_bytes ||
@@ -656,6 +1674,13 @@ static TEE_Result ree_fs_read(struct tee_file_handle *fh, void *buf,
 		goto exit;
 	}
 
+	if (fdp->inline_flags & INLINE_DATA) {
+		memcpy(data_ptr, fdp->inline_data + fdp->pos, remain_bytes);
+		fdp->pos += remain_bytes;
+		res = TEE_SUCCESS;
+		goto exit;
+	}
+
 	start_block_num = pos_to_block_num(fdp->pos);
 	end_block_num = pos_to_block_num(fdp->pos + remain_bytes - 1);
 
@@ -666,7 +1691,8 @@ static TEE_Result ree_fs_read(struct tee_file_handle *fh, void *buf,
 		if (size_to_read + offset > BLOCK_SIZE)
 			size_to_read = BLOCK_SIZE - offset;
 
-		res = read_block(fdp, start_block_num, block);
+		res = read_block(fdp, &batch, &fdp->meta, start_block_num,
+				 end_block_num, block);
 		if (res != TEE_SUCCESS) {
 			EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
 			if (res == TEE_ERROR_MAC_INVALID)
@@ -683,14 +1709,72 @@ static TEE_Result ree_fs_read(struct tee_file_handle *fh, void *buf,
 		start_block_num++;
 	}
 	res = TEE_SUCCESS;
+	readahead_next(fdp, start);
 exit:
+	block_batch_free(&batch);
 	if (res) {
 		DMSG("res: 0x%08lx\n", res);
 	}
 	return res;
 }
 
+static TEE_Result ree_fs_write_prepare(struct tee_fs_fd *fdp, size_t len)
+{
+	TEE_Result res;
+	size_t file_size = fdp->meta.info.length;
+
+	readahead_drop(fdp);
+	if ((fdp->pos + len) > MAX_FILE_SIZE || (fdp->pos + len) < len) {
+		EMSG(ERR_MSG_BAD_PARAMETERS ": %lld\n", fdp->pos + len);
+		return TEE_ERROR_BAD_PARAMETERS;
+	}
+
+	if (file_size < (size_t)fdp->pos) {
+		DMSG("ftruncate, pos: %zd\n", (size_t)fdp->pos);
+		res = ree_fs_ftruncate_internal(fdp, fdp->pos);
+		if (res != TEE_SUCCESS) {
+			EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+			return res;
+		}
+	}
+
+	return TEE_SUCCESS;
+}
+
+/* Write at fdp->pos into new_meta, the caller commits or aborts it */
+static TEE_Result ree_fs_write_internal(struct tee_fs_fd *fdp,
+					const void *buf, size_t len,
+					struct tee_fs_file_meta *new_meta)
+{
+	TEE_Result res;
+
+	if (fdp->inline_flags & INLINE_DATA) {
+		if (fdp->pos + len <= fdp->inline_size) {
+			DMSG("inline write, len: %zd\n", len);
+			memcpy(fdp->inline_data + fdp->pos, buf, len);
+			fdp->pos += len;
+			if ((size_t)fdp->pos > new_meta->info.length)
+				new_meta->info.length = fdp->pos;
+			return TEE_SUCCESS;
+		}
+
+		res = spill_inline_data(fdp, new_meta);
+		if (res != TEE_SUCCESS) {
+			EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+			return res;
+		}
+	}
+
+	DMSG("out of place write, len: %zd\n", len);
+	return out_of_place_write(fdp, buf, len, new_meta);
+}
+
 /*
+ * With CONFIG_OPTEE_REE_FS_BATCHED_COMMIT the new meta is only written
+ * on fsync or close, so several writes form one atomic transaction. A
+ * write to a block the batch already wrote commits the batch first, and
+ * a failed write only loses itself.
+ *
  * To ensure atomicity of write operation, we need to
  * do the following steps:
  * (The sequence of operations is very important)
@@ -712,37 +1796,83 @@ static TEE_Result ree_fs_write(struct tee_file_handle *fh, const void *buf,
 	TEE_Result res;
 	struct tee_fs_file_meta new_meta;
 	struct tee_fs_fd *fdp = (struct tee_fs_fd *)fh;
-	size_t file_size;
+	struct meta_op op;
 
 	if (!len)
 		return TEE_SUCCESS;
 
-	file_size = fdp->meta.info.length;
+	res = ree_fs_write_prepare(fdp, len);
+	if (res != TEE_SUCCESS)
+		goto exit;
 
-	if ((fdp->pos + len) > MAX_FILE_SIZE || (fdp->pos + len) < len) {
-		EMSG(ERR_MSG_BAD_PARAMETERS ": %lld\n", fdp->pos + len);
-		res = TEE_ERROR_BAD_PARAMETERS;
+	res = begin_meta_op(fdp, &op, fdp->pos, len);
+	if (res != TEE_SUCCESS)
+		goto exit;
+
+	new_meta = fdp->meta;
+	res = ree_fs_write_internal(fdp, buf, len, &new_meta);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		abort_meta_op(fdp, &op);
 		goto exit;
 	}
 
-	if (file_size < (size_t)fdp->pos) {
-		DMSG("ftruncate, pos: %zd\n", (size_t)fdp->pos);
-		res = ree_fs_ftruncate_internal(fdp, fdp->pos);
-		if (res != TEE_SUCCESS) {
-			EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
-			goto exit;
-		}
+	res = end_meta_op(fdp, &op, &new_meta);
+exit:
+	if (res) {
+		DMSG("res: 0x%08lx\n", res);
 	}
+	return res;
+}
 
+/*
+ * As ree_fs_write(), with the head bytes written into the same working
+ * meta, so a growing write and the size kept in the object head take a
+ * single meta commit.
+ */
+static TEE_Result ree_fs_write_head(struct tee_file_handle *fh,
+				    const void *buf, size_t len,
+				    size_t head_offs, const void *head,
+				    size_t head_len)
+{
+	TEE_Result res;
+	struct tee_fs_file_meta new_meta;
+	struct tee_fs_fd *fdp = (struct tee_fs_fd *)fh;
+	tee_fs_off_t orig_pos;
+	tee_fs_off_t pos;
+	struct meta_op op;
+
+	if (!len)
+		return TEE_SUCCESS;
+
+	res = ree_fs_write_prepare(fdp, len);
+	if (res != TEE_SUCCESS)
+		goto exit;
+
+	/* a dirty head block commits the batch, as a dirty data block does */
+	res = begin_meta_op(fdp, &op, head_offs, head_len);
+	if (res == TEE_SUCCESS && fdp->meta_dirty)
+		res = begin_meta_op(fdp, &op, fdp->pos, len);
+	if (res != TEE_SUCCESS)
+		goto exit;
+
+	orig_pos = fdp->pos;
 	new_meta = fdp->meta;
-	DMSG("out of place write, len: %zd\n", len);
-	res = out_of_place_write(fdp, buf, len, &new_meta);
+	res = ree_fs_write_internal(fdp, buf, len, &new_meta);
+	if (res == TEE_SUCCESS) {
+		pos = fdp->pos;
+		fdp->pos = head_offs;
+		res = ree_fs_write_internal(fdp, head, head_len, &new_meta);
+		fdp->pos = pos;
+	}
 	if (res != TEE_SUCCESS) {
 		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		fdp->pos = orig_pos;
+		abort_meta_op(fdp, &op);
 		goto exit;
 	}
 
-	res = commit_meta_file(fdp, &new_meta);
+	res = end_meta_op(fdp, &op, &new_meta);
 exit:
 	if (res) {
 		DMSG("res: 0x%08lx\n", res);
@@ -750,6 +1880,15 @@ exit:
 	return res;
 }
 
+#if READAHEAD_BLOCKS > 0
+static void ree_fs_set_sequential(struct tee_file_handle *fh, bool sequential)
+{
+	struct tee_fs_fd *fdp = (struct tee_fs_fd *)fh;
+
+	fdp->ra_sequential = sequential;
+}
+#endif
+
 static TEE_Result ree_fs_rename(const char *old, const char *new,
 				bool overwrite)
 {
@@ -765,6 +1904,8 @@ static TEE_Result ree_fs_truncate(struct tee_file_handle *fh, size_t len)
 {
 	TEE_Result res;
 	struct tee_fs_fd *fdp = (struct tee_fs_fd *)fh;
+
+	readahead_drop(fdp);
 	res = ree_fs_ftruncate_internal(fdp, len);
 
 	return res;
@@ -776,7 +1917,9 @@ static TEE_Result ree_fs_fsync(struct tee_file_handle **fh)
 	struct tee_fs_fd *fdp = (struct tee_fs_fd *)*fh;
 
 	if (fdp) {
-		res = tee_fs_rpc_fsync(fdp->fd);
+		res = commit_pending_meta(fdp);
+		if (res == TEE_SUCCESS)
+			res = tee_fs_rpc_fsync(fdp->fd);
 	}
 	return res;
 }
@@ -787,7 +1930,11 @@ const struct tee_file_operations ree_fs_ops = {
 	.close = ree_fs_close,
 	.read = ree_fs_read,
 	.write = ree_fs_write,
+	.write_head = ree_fs_write_head,
 	.seek = ree_fs_seek,
+#if READAHEAD_BLOCKS > 0
+	.set_sequential = ree_fs_set_sequential,
+#endif
 	.truncate = ree_fs_truncate,
 	.rename = ree_fs_rename,
 	.remove = ree_fs_remove,
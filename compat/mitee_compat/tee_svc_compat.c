@@ -18,6 +18,8 @@
 #include <string.h>
 #include <tee/tee_svc_compat.h>
 
+#undef tee_svc_copy_to_user
+
 TEE_Result tee_svc_copy_kaddr_to_uref(uint32_t *uref, void *kaddr)
 {
 	uint32_t ref = tee_svc_kaddr_to_uref(kaddr);
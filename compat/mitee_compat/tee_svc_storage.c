@@ -15,8 +15,13 @@
  * limitations under the License.
  */
 
+#include <compiler.h>
+#include <dirent.h>
 #include <kernel/tee_misc.h>
 #include <kernel/tee_ta_manager.h>
+#include <mem_budget.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <tee_api_defines_extensions.h>
 #include <tee_api_defines.h>
@@ -40,7 +45,11 @@ static const struct tee_file_operations *file_ops(uint32_t storage_id)
 	switch (storage_id) {
 	case TEE_STORAGE_PRIVATE:
 	case TEE_STORAGE_USER:
+#ifdef CONFIG_OPTEE_STORAGE_PACK_FS
+		return &pack_fs_ops;
+#else
 		return &ree_fs_ops;
+#endif
 	default:
 		EMSG(ERR_MSG_ITEM_NOT_FOUND ": 0x%08lx\n", storage_id);
 		return NULL;
@@ -63,6 +72,267 @@ struct tee_svc_storage_head {
 	uint32_t have_attrs;
 };
 
+#ifdef CONFIG_OPTEE_STORAGE_OBJ_CACHE_SIZE
+#define OBJ_CACHE_SIZE	CONFIG_OPTEE_STORAGE_OBJ_CACHE_SIZE
+#else
+#define OBJ_CACHE_SIZE	0
+#endif
+
+#if OBJ_CACHE_SIZE > 0
+/*
+ * Parsed head and attributes of recently opened objects, plus the file
+ * handle of the last read-only open once it is closed, so reopening the
+ * object skips the filename, the open and the head and attribute reads.
+ * Entries are dropped whenever the object is written, truncated,
+ * renamed or deleted.
+ *
+ * Every drop bumps obj_cache_gen. An entry carries the generation its
+ * head was read under and an open handle the generation it was opened
+ * under, so neither a head read racing a write nor a handle opened
+ * before it ends up in the cache.
+ */
+struct obj_cache_entry {
+	TAILQ_ENTRY(obj_cache_entry) link;
+	TEE_UUID uuid;
+	uint32_t storage_id;
+	uint8_t obj_id[TEE_OBJECT_ID_MAX_LEN];
+	uint32_t obj_id_len;
+	struct tee_svc_storage_head head;
+	void *attr;
+	struct tee_file_handle *fh;	/* parked read-only handle or NULL */
+	const struct tee_file_operations *fops;
+	uint32_t gen;
+};
+
+static TAILQ_HEAD(obj_cache_head, obj_cache_entry) obj_cache =
+	TAILQ_HEAD_INITIALIZER(obj_cache);
+static size_t obj_cache_count;
+static size_t obj_cache_bytes;
+static uint32_t obj_cache_gen = 1;
+static pthread_mutex_t obj_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t obj_cache_shrink(size_t bytes);
+static struct mem_budget_cache obj_cache_budget =
+	MEM_BUDGET_CACHE_INITIALIZER("storage object", obj_cache_shrink);
+
+static size_t obj_cache_entry_size(struct obj_cache_entry *e)
+{
+	return sizeof(*e) + e->head.meta_size;
+}
+
+static struct obj_cache_entry *obj_cache_find(const TEE_UUID *uuid,
+					      struct tee_pobj *po)
+{
+	struct obj_cache_entry *e;
+
+	TAILQ_FOREACH(e, &obj_cache, link) {
+		if (e->storage_id == po->storage_id &&
+		    e->obj_id_len == po->obj_id_len &&
+		    !memcmp(&e->uuid, uuid, sizeof(*uuid)) &&
+		    !memcmp(e->obj_id, po->obj_id, po->obj_id_len))
+			return e;
+	}
+	return NULL;
+}
+
+static void obj_cache_free(struct obj_cache_entry *e)
+{
+	if (e->fh)
+		e->fops->close(&e->fh);
+	free(e->attr);
+	free(e);
+}
+
+/* Must be called with the lock held */
+static void obj_cache_remove(struct obj_cache_entry *e)
+{
+	TAILQ_REMOVE(&obj_cache, e, link);
+	obj_cache_count--;
+	obj_cache_bytes -= obj_cache_entry_size(e);
+}
+
+/*
+ * Memory budget shrink: drop the least recently used entries. Entries
+ * parking a file handle are left alone, closing a file from a failed
+ * allocation could wait on the file system.
+ */
+static size_t obj_cache_shrink(size_t bytes)
+{
+	TAILQ_HEAD(, obj_cache_entry) dropped = TAILQ_HEAD_INITIALIZER(dropped);
+	struct obj_cache_entry *e;
+	struct obj_cache_entry *prev;
+	size_t freed = 0;
+	size_t size;
+
+	if (pthread_mutex_trylock(&obj_cache_lock))
+		return 0;
+
+	for (e = TAILQ_LAST(&obj_cache, obj_cache_head); e && freed < bytes;
+	     e = prev) {
+		prev = TAILQ_PREV(e, obj_cache_head, link);
+		if (e->fh)
+			continue;
+		freed += obj_cache_entry_size(e);
+		obj_cache_remove(e);
+		TAILQ_INSERT_TAIL(&dropped, e, link);
+	}
+	size = obj_cache_bytes;
+	pthread_mutex_unlock(&obj_cache_lock);
+
+	while ((e = TAILQ_FIRST(&dropped))) {
+		TAILQ_REMOVE(&dropped, e, link);
+		obj_cache_free(e);
+	}
+
+	mem_budget_update(&obj_cache_budget, size);
+	return freed;
+}
+
+/* Copy out the cached head and attributes, taking the parked handle */
+static bool obj_cache_get(const TEE_UUID *uuid, struct tee_obj *o,
+			  struct tee_svc_storage_head *head, void **attr)
+{
+	struct obj_cache_entry *e;
+	bool hit = false;
+
+	pthread_mutex_lock(&obj_cache_lock);
+	o->cache_gen = obj_cache_gen;
+	e = obj_cache_find(uuid, o->pobj);
+	if (!e)
+		goto out;
+
+	*attr = NULL;
+	if (e->head.meta_size) {
+		*attr = malloc(e->head.meta_size);
+		if (!*attr)
+			goto out;
+		memcpy(*attr, e->attr, e->head.meta_size);
+	}
+	*head = e->head;
+	o->fh = e->fh;
+	o->cache_gen = e->gen;
+	e->fh = NULL;
+	TAILQ_REMOVE(&obj_cache, e, link);
+	TAILQ_INSERT_HEAD(&obj_cache, e, link);
+	hit = true;
+out:
+	pthread_mutex_unlock(&obj_cache_lock);
+	return hit;
+}
+
+static void obj_cache_add(const TEE_UUID *uuid, struct tee_obj *o,
+			  const struct tee_svc_storage_head *head,
+			  const void *attr)
+{
+	struct obj_cache_entry *e;
+	struct obj_cache_entry *old = NULL;
+	size_t size;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return;
+	if (head->meta_size) {
+		e->attr = malloc(head->meta_size);
+		if (!e->attr) {
+			free(e);
+			return;
+		}
+		memcpy(e->attr, attr, head->meta_size);
+	}
+	e->uuid = *uuid;
+	e->storage_id = o->pobj->storage_id;
+	memcpy(e->obj_id, o->pobj->obj_id, o->pobj->obj_id_len);
+	e->obj_id_len = o->pobj->obj_id_len;
+	e->head = *head;
+	e->fops = o->pobj->fops;
+	e->gen = o->cache_gen;
+
+	pthread_mutex_lock(&obj_cache_lock);
+	if (obj_cache_gen != e->gen || obj_cache_find(uuid, o->pobj)) {
+		pthread_mutex_unlock(&obj_cache_lock);
+		obj_cache_free(e);
+		return;
+	}
+	TAILQ_INSERT_HEAD(&obj_cache, e, link);
+	obj_cache_bytes += obj_cache_entry_size(e);
+	if (++obj_cache_count > OBJ_CACHE_SIZE) {
+		old = TAILQ_LAST(&obj_cache, obj_cache_head);
+		obj_cache_remove(old);
+	}
+	size = obj_cache_bytes;
+	pthread_mutex_unlock(&obj_cache_lock);
+
+	if (old)
+		obj_cache_free(old);
+	mem_budget_update(&obj_cache_budget, size);
+}
+
+static void obj_cache_invalidate(const TEE_UUID *uuid, struct tee_pobj *po)
+{
+	struct obj_cache_entry *e;
+	size_t size;
+
+	pthread_mutex_lock(&obj_cache_lock);
+	if (!++obj_cache_gen)
+		obj_cache_gen = 1;
+	e = obj_cache_find(uuid, po);
+	if (e)
+		obj_cache_remove(e);
+	size = obj_cache_bytes;
+	pthread_mutex_unlock(&obj_cache_lock);
+
+	if (e) {
+		obj_cache_free(e);
+		mem_budget_update(&obj_cache_budget, size);
+	}
+}
+
+bool tee_svc_storage_park_fh(struct tee_obj *o)
+{
+	struct obj_cache_entry *e;
+	bool parked = false;
+
+	if (!o->fh || (o->flags & (TEE_DATA_FLAG_ACCESS_WRITE |
+				   TEE_DATA_FLAG_ACCESS_WRITE_META)))
+		return false;
+
+	pthread_mutex_lock(&obj_cache_lock);
+	e = obj_cache_find(&o->pobj->uuid, o->pobj);
+	if (e && !e->fh && e->gen == o->cache_gen) {
+		e->fh = o->fh;
+		o->fh = NULL;
+		parked = true;
+	}
+	pthread_mutex_unlock(&obj_cache_lock);
+	return parked;
+}
+#else
+static bool obj_cache_get(const TEE_UUID *uuid __unused,
+			  struct tee_obj *o __unused,
+			  struct tee_svc_storage_head *head __unused,
+			  void **attr __unused)
+{
+	return false;
+}
+
+static void obj_cache_add(const TEE_UUID *uuid __unused,
+			  struct tee_obj *o __unused,
+			  const struct tee_svc_storage_head *head __unused,
+			  const void *attr __unused)
+{
+}
+
+static void obj_cache_invalidate(const TEE_UUID *uuid __unused,
+				 struct tee_pobj *po __unused)
+{
+}
+
+bool tee_svc_storage_park_fh(struct tee_obj *o __unused)
+{
+	return false;
+}
+#endif
+
 /* #define FS_STORAGE_DIR_PRIVATE "/data/", "/mnt/lfs/" */
 /* "/TA_uuid/object_id" or "/TA_uuid/.object_id" */
 char *tee_svc_storage_create_filename(struct ts_session *ts_sess,
@@ -109,23 +379,256 @@ char *tee_svc_storage_create_filename(struct ts_session *ts_sess,
 	return (char *)file;
 }
 
-/* "/TA_uuid" */
-char *tee_svc_storage_create_dirname(struct ts_session *ts_sess)
+/* "/storage_id/TA_uuid", the directory of tee_svc_storage_create_filename() */
+char *tee_svc_storage_create_dirname(struct ts_session *ts_sess,
+				     uint32_t storage_id)
 {
 	uint8_t *dir;
-	uint32_t hslen = TEE_B2HS_HSBUF_SIZE(sizeof(TEE_UUID)) + 1;
+	uint32_t pos = 0;
+	uint32_t hslen;
+
+	hslen = strlen(FS_STORAGE_DIR_PRIVATE)
+			+ TEE_B2HS_HSBUF_SIZE(sizeof(storage_id)) + 1
+			+ TEE_B2HS_HSBUF_SIZE(sizeof(TEE_UUID));
 
 	dir = malloc(hslen);
-	if (!dir)
+	if (!dir) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY ": %lu\n", hslen);
 		return NULL;
+	}
 
-	dir[0] = '/';
-	tee_b2hs((uint8_t *)&ts_sess->ctx->uuid, dir + 1, sizeof(TEE_UUID),
-		 hslen);
+	memcpy(dir, FS_STORAGE_DIR_PRIVATE, strlen(FS_STORAGE_DIR_PRIVATE));
+	pos += strlen(FS_STORAGE_DIR_PRIVATE);
+
+	pos += tee_b2hs((uint8_t *)&storage_id, &dir[pos],
+			sizeof(storage_id), hslen - pos);
+	dir[pos++] = '/';
+
+	tee_b2hs((uint8_t *)&ts_sess->ctx->uuid, &dir[pos], sizeof(TEE_UUID),
+		 hslen - pos);
 
 	return (char *)dir;
 }
 
+/*
+ * Object ids of each TA and storage id, read from the directory by the
+ * first enumeration and kept in sync by create, delete and rename, so a
+ * TA enumerating its objects does not go through the REE FS again.
+ */
+struct storage_index_entry {
+	TAILQ_ENTRY(storage_index_entry) link;
+	uint32_t obj_id_len;
+	uint8_t obj_id[];
+};
+
+struct storage_index {
+	TAILQ_ENTRY(storage_index) link;
+	TEE_UUID uuid;
+	uint32_t storage_id;
+	TAILQ_HEAD(, storage_index_entry) entries;
+	TAILQ_HEAD(, tee_storage_enum) enums;
+};
+
+/*
+ * struct tee_storage_enum - persistent object enumerator
+ * @link:	Link in user_ta_ctx.storage_enums
+ * @index_link:	Link in storage_index.enums while started
+ * @index:	Index being enumerated, NULL until started
+ * @next:	Entry returned by the next call, NULL at the end
+ */
+struct tee_storage_enum {
+	TAILQ_ENTRY(tee_storage_enum) link;
+	TAILQ_ENTRY(tee_storage_enum) index_link;
+	struct storage_index *index;
+	struct storage_index_entry *next;
+};
+
+static TAILQ_HEAD(, storage_index) storage_indexes =
+	TAILQ_HEAD_INITIALIZER(storage_indexes);
+static pthread_mutex_t storage_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct storage_index *storage_index_find(const TEE_UUID *uuid,
+						uint32_t storage_id)
+{
+	struct storage_index *idx;
+
+	TAILQ_FOREACH(idx, &storage_indexes, link) {
+		if (idx->storage_id == storage_id &&
+		    !memcmp(&idx->uuid, uuid, sizeof(*uuid)))
+			return idx;
+	}
+	return NULL;
+}
+
+static struct storage_index_entry *storage_index_lookup(
+			struct storage_index *idx,
+			const void *obj_id, uint32_t obj_id_len)
+{
+	struct storage_index_entry *ie;
+
+	TAILQ_FOREACH(ie, &idx->entries, link) {
+		if (ie->obj_id_len == obj_id_len &&
+		    !memcmp(ie->obj_id, obj_id, obj_id_len))
+			return ie;
+	}
+	return NULL;
+}
+
+static TEE_Result storage_index_insert(struct storage_index *idx,
+				       const void *obj_id, uint32_t obj_id_len)
+{
+	struct storage_index_entry *ie;
+
+	if (storage_index_lookup(idx, obj_id, obj_id_len))
+		return TEE_SUCCESS;
+
+	ie = malloc(sizeof(*ie) + obj_id_len);
+	if (!ie) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY ": %lu\n", obj_id_len);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+	ie->obj_id_len = obj_id_len;
+	memcpy(ie->obj_id, obj_id, obj_id_len);
+	TAILQ_INSERT_TAIL(&idx->entries, ie, link);
+	return TEE_SUCCESS;
+}
+
+static void storage_index_free(struct storage_index *idx)
+{
+	struct storage_index_entry *ie;
+
+	while ((ie = TAILQ_FIRST(&idx->entries))) {
+		TAILQ_REMOVE(&idx->entries, ie, link);
+		free(ie);
+	}
+	free(idx);
+}
+
+/* Adds a directory entry, skipping ".", ".." and temporary objects */
+static TEE_Result storage_index_insert_name(struct storage_index *idx,
+					    const char *d_name)
+{
+	uint8_t obj_id[TEE_OBJECT_ID_MAX_LEN];
+	uint32_t obj_id_len;
+	size_t name_len = strlen(d_name);
+
+	if (d_name[0] == '.' || !name_len || name_len % 2 ||
+	    name_len > 2 * sizeof(obj_id))
+		return TEE_SUCCESS;
+
+	obj_id_len = tee_hs2b((uint8_t *)d_name, obj_id, name_len,
+			      sizeof(obj_id));
+	if (!obj_id_len)
+		return TEE_SUCCESS;
+
+	return storage_index_insert(idx, obj_id, obj_id_len);
+}
+
+/* Build the index from the directory, must be called with the lock held */
+static TEE_Result storage_index_load(struct ts_session *ts_sess,
+				     uint32_t storage_id,
+				     struct storage_index **index)
+{
+	TEE_Result res = TEE_SUCCESS;
+	const struct tee_file_operations *fops = file_ops(storage_id);
+	struct storage_index *idx;
+	struct tee_fs_dirent *fs_dent;
+	struct tee_fs_dir *fs_dir;
+	struct dirent *dent;
+	char *dirname;
+	DIR *dir;
+
+	idx = calloc(1, sizeof(*idx));
+	if (!idx) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY "\n");
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+	idx->uuid = ts_sess->ctx->uuid;
+	idx->storage_id = storage_id;
+	TAILQ_INIT(&idx->entries);
+	TAILQ_INIT(&idx->enums);
+
+	dirname = tee_svc_storage_create_dirname(ts_sess, storage_id);
+	if (!dirname) {
+		free(idx);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+
+	/* no directory yet means no objects */
+	if (fops && fops->opendir) {
+		if (fops->opendir(dirname, &fs_dir) == TEE_SUCCESS) {
+			while (fops->readdir(fs_dir, &fs_dent) == TEE_SUCCESS) {
+				res = storage_index_insert_name(idx,
+							fs_dent->d_name);
+				if (res != TEE_SUCCESS)
+					break;
+			}
+			fops->closedir(fs_dir);
+		}
+	} else {
+		dir = opendir(dirname);
+		if (dir) {
+			while ((dent = readdir(dir))) {
+				res = storage_index_insert_name(idx,
+								dent->d_name);
+				if (res != TEE_SUCCESS)
+					break;
+			}
+			closedir(dir);
+		}
+	}
+	free(dirname);
+
+	if (res != TEE_SUCCESS) {
+		storage_index_free(idx);
+		return res;
+	}
+
+	TAILQ_INSERT_TAIL(&storage_indexes, idx, link);
+	*index = idx;
+	return TEE_SUCCESS;
+}
+
+/* Indexes are only updated once loaded, a missing one is read later */
+static void storage_index_add(const TEE_UUID *uuid, uint32_t storage_id,
+			      const void *obj_id, uint32_t obj_id_len)
+{
+	struct storage_index *idx;
+
+	pthread_mutex_lock(&storage_index_lock);
+	idx = storage_index_find(uuid, storage_id);
+	if (idx && storage_index_insert(idx, obj_id, obj_id_len)) {
+		/* reload on the next enumeration rather than miss the object */
+		if (TAILQ_EMPTY(&idx->enums)) {
+			TAILQ_REMOVE(&storage_indexes, idx, link);
+			storage_index_free(idx);
+		}
+	}
+	pthread_mutex_unlock(&storage_index_lock);
+}
+
+static void storage_index_remove(const TEE_UUID *uuid, uint32_t storage_id,
+				 const void *obj_id, uint32_t obj_id_len)
+{
+	struct storage_index *idx;
+	struct storage_index_entry *ie = NULL;
+	struct tee_storage_enum *e;
+
+	pthread_mutex_lock(&storage_index_lock);
+	idx = storage_index_find(uuid, storage_id);
+	if (idx)
+		ie = storage_index_lookup(idx, obj_id, obj_id_len);
+	if (ie) {
+		TAILQ_FOREACH(e, &idx->enums, index_link) {
+			if (e->next == ie)
+				e->next = TAILQ_NEXT(ie, link);
+		}
+		TAILQ_REMOVE(&idx->entries, ie, link);
+		free(ie);
+	}
+	pthread_mutex_unlock(&storage_index_lock);
+}
+
 static TEE_Result tee_svc_storage_remove_corrupt_obj(
 					struct ts_session *ts_sess,
 					struct tee_obj *o)
@@ -142,6 +645,7 @@ static TEE_Result tee_svc_storage_remove_corrupt_obj(
 		goto exit;
 	}
 
+	obj_cache_invalidate(&ts_sess->ctx->uuid, o->pobj);
 	tee_obj_close(to_user_ta_ctx(ts_sess->ctx), o);
 	EMSG(ERR_MSG_CORRUPT_OBJECT ": %s", file);
 	free(file);
@@ -161,6 +665,7 @@ static TEE_Result tee_svc_storage_read_head(struct ts_session *ts_sess,
 	char *file = NULL;
 	const struct tee_file_operations *fops;
 	void *attr = NULL;
+	bool cached;
 
 	if (o == NULL || o->pobj == NULL) {
 		EMSG(ERR_MSG_BAD_PARAMETERS "\n");
@@ -168,6 +673,12 @@ static TEE_Result tee_svc_storage_read_head(struct ts_session *ts_sess,
 	}
 	fops = o->pobj->fops;
 
+	cached = obj_cache_get(&ts_sess->ctx->uuid, o, &head, &attr);
+	if (cached && o->fh) {
+		DMSG("object cache hit\n");
+		goto parse;
+	}
+
 	file = tee_svc_storage_create_filename(ts_sess,
 					       o->pobj->storage_id,
 					       o->pobj->obj_id, o->pobj->obj_id_len, false);
@@ -183,6 +694,12 @@ static TEE_Result tee_svc_storage_read_head(struct ts_session *ts_sess,
 		goto exit;
 	}
 
+	if (cached) {
+		/* the handle is positioned by the caller */
+		DMSG("object cache hit, no handle\n");
+		goto parse;
+	}
+
 	/* read head */
 	bytes = sizeof(struct tee_svc_storage_head);
 	res = fops->read(o->fh, &head, &bytes);
@@ -200,12 +717,6 @@ static TEE_Result tee_svc_storage_read_head(struct ts_session *ts_sess,
 		goto exit;
 	}
 
-	res = tee_obj_set_type(o, head.objectType, head.maxKeySize);
-	if (res != TEE_SUCCESS) {
-		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
-		goto exit;
-	}
-
 	if (head.meta_size) {
 		attr = malloc(head.meta_size);
 		if (!attr) {
@@ -224,6 +735,13 @@ static TEE_Result tee_svc_storage_read_head(struct ts_session *ts_sess,
 		}
 	}
 
+parse:
+	res = tee_obj_set_type(o, head.objectType, head.maxKeySize);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		goto exit;
+	}
+
 	res = tee_obj_attr_from_binary(o, attr, head.meta_size);
 	if (res != TEE_SUCCESS) {
 		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
@@ -236,6 +754,9 @@ static TEE_Result tee_svc_storage_read_head(struct ts_session *ts_sess,
 	o->info.objectType = head.objectType;
 	o->have_attrs = head.have_attrs;
 
+	if (!cached)
+		obj_cache_add(&ts_sess->ctx->uuid, o, &head, attr);
+
 exit:
 	free(attr);
 	free(file);
@@ -478,6 +999,10 @@ TEE_Result syscall_storage_obj_open(unsigned long storage_id, void *object_id,
 		goto oclose;
 	}
 
+	if (fops->set_sequential)
+		fops->set_sequential(o->fh,
+				     !!(flags & TEE_DATA_FLAG_SEQUENTIAL));
+
 	res = fops->seek(o->fh, sizeof(struct tee_svc_storage_head) + attr_size,
 			 TEE_DATA_SEEK_SET, NULL);
 	if (res  != TEE_SUCCESS) {
@@ -539,6 +1064,8 @@ TEE_Result syscall_storage_obj_create(unsigned long storage_id, void *object_id,
 		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
 		goto err;
 	}
+	po->storage_id = storage_id;
+	obj_cache_invalidate(&ts_sess->ctx->uuid, po);
 
 	o = tee_obj_alloc();
 	if (o == NULL) {
@@ -595,6 +1122,9 @@ TEE_Result syscall_storage_obj_create(unsigned long storage_id, void *object_id,
 		goto rmfile;
 	}
 
+	storage_index_add(&ts_sess->ctx->uuid, storage_id, object_id,
+			  object_id_len);
+
 	res = fops->open(file, &o->fh);
 	if (res != TEE_SUCCESS) {
 		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
@@ -691,6 +1221,9 @@ TEE_Result syscall_storage_obj_del(unsigned long obj)
 	}
 
 	fops = o->pobj->fops;
+	obj_cache_invalidate(&ts_sess->ctx->uuid, o->pobj);
+	storage_index_remove(&ts_sess->ctx->uuid, o->pobj->storage_id,
+			     o->pobj->obj_id, o->pobj->obj_id_len);
 	tee_obj_close(utc, o);
 
 	res = fops->remove(file);
@@ -774,6 +1307,10 @@ TEE_Result syscall_storage_obj_rename(unsigned long obj, void *object_id,
 		goto exit;
 	}
 
+	po->storage_id = o->pobj->storage_id;
+	obj_cache_invalidate(&ts_sess->ctx->uuid, o->pobj);
+	obj_cache_invalidate(&ts_sess->ctx->uuid, po);
+
 	/* fsync for VELAPLATFO-1183 */
 	res = fops->fsync(&o->fh);
 	if (res != TEE_SUCCESS) {
@@ -787,6 +1324,12 @@ TEE_Result syscall_storage_obj_rename(unsigned long obj, void *object_id,
 		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
 		goto exit;
 	}
+	if (res == TEE_SUCCESS) {
+		storage_index_remove(&ts_sess->ctx->uuid, o->pobj->storage_id,
+				     o->pobj->obj_id, o->pobj->obj_id_len);
+		storage_index_add(&ts_sess->ctx->uuid, o->pobj->storage_id,
+				  object_id, object_id_len);
+	}
 	res = tee_pobj_rename(o->pobj, object_id, object_id_len);
 
 exit:
@@ -859,6 +1402,7 @@ TEE_Result syscall_storage_obj_write(unsigned long obj, void *data, size_t len)
 	struct ts_session *ts_sess;
 	struct tee_obj *o;
 	struct user_ta_ctx *utc;
+	uint32_t ds_size;
 
 	ts_sess = ts_get_current_session();
 	utc = to_user_ta_ctx(ts_sess->ctx);
@@ -881,10 +1425,25 @@ TEE_Result syscall_storage_obj_write(unsigned long obj, void *data, size_t len)
 		goto exit;
 	}
 
+	/* a growing write carries the new head.ds_size in its transaction */
+	ds_size = o->info.dataPosition + len;
+	if (ds_size > o->info.dataSize && o->pobj->fops->write_head) {
+		res = o->pobj->fops->write_head(o->fh, data, len,
+				offsetof(struct tee_svc_storage_head, ds_size),
+				&ds_size, sizeof(ds_size));
+		if (res != TEE_SUCCESS) {
+			EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", (uint32_t)res);
+			goto invalidate;
+		}
+		o->info.dataPosition = ds_size;
+		o->info.dataSize = ds_size;
+		goto invalidate;
+	}
+
 	res = o->pobj->fops->write(o->fh, data, len);
 	if (res != TEE_SUCCESS) {
 		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", (uint32_t)res);
-		goto exit;
+		goto invalidate;
 	}
 
 	o->info.dataPosition += len;
@@ -892,11 +1451,14 @@ TEE_Result syscall_storage_obj_write(unsigned long obj, void *data, size_t len)
 		res = tee_svc_storage_update_head(o, o->info.dataPosition);
 		if (res != TEE_SUCCESS) {
 			EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", (uint32_t)res);
-			goto exit;
+			goto invalidate;
 		}
 		o->info.dataSize = o->info.dataPosition;
 	}
 
+invalidate:
+	/* after the write, a head read racing it must not stay cached */
+	obj_cache_invalidate(&ts_sess->ctx->uuid, o->pobj);
 exit:
 	if (res) {
 		DMSG("res: 0x%08lx\n", res);
@@ -941,6 +1503,9 @@ TEE_Result syscall_storage_obj_trunc(unsigned long obj, size_t len)
 
 	off = sizeof(struct tee_svc_storage_head) + attr_size;
 	res = o->pobj->fops->truncate(o->fh, len + off);
+	/* after the truncate, a head read racing it must not stay cached */
+	if (res != TEE_ERROR_CORRUPT_OBJECT)
+		obj_cache_invalidate(&ts_sess->ctx->uuid, o->pobj);
 	if (res != TEE_SUCCESS) {
 		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", (uint32_t)res);
 		if (res == TEE_ERROR_CORRUPT_OBJECT) {
@@ -1013,30 +1578,238 @@ exit:
 	return res;
 }
 
+static TEE_Result tee_svc_storage_get_enum(struct user_ta_ctx *utc,
+					   vaddr_t enum_id,
+					   struct tee_storage_enum **e_out)
+{
+	struct tee_storage_enum *e;
+
+	TAILQ_FOREACH(e, &utc->storage_enums, link) {
+		if (enum_id == (vaddr_t)e) {
+			*e_out = e;
+			return TEE_SUCCESS;
+		}
+	}
+	return TEE_ERROR_BAD_PARAMETERS;
+}
+
+static void tee_svc_storage_detach_enum(struct tee_storage_enum *e)
+{
+	pthread_mutex_lock(&storage_index_lock);
+	if (e->index)
+		TAILQ_REMOVE(&e->index->enums, e, index_link);
+	e->index = NULL;
+	e->next = NULL;
+	pthread_mutex_unlock(&storage_index_lock);
+}
+
+static void tee_svc_close_enum(struct user_ta_ctx *utc,
+			       struct tee_storage_enum *e)
+{
+	TAILQ_REMOVE(&utc->storage_enums, e, link);
+	tee_svc_storage_detach_enum(e);
+	free(e);
+}
+
+void tee_svc_storage_close_all_enum(struct user_ta_ctx *utc)
+{
+	struct tee_storage_enum_head *eh = &utc->storage_enums;
+
+	/* disregard return value */
+	while (!TAILQ_EMPTY(eh))
+		tee_svc_close_enum(utc, TAILQ_FIRST(eh));
+}
+
 TEE_Result syscall_storage_alloc_enum(uint32_t *obj_enum)
 {
-	return TEE_SUCCESS;
+	TEE_Result res;
+	struct ts_session *ts_sess = ts_get_current_session();
+	struct user_ta_ctx *utc = to_user_ta_ctx(ts_sess->ctx);
+	struct tee_storage_enum *e;
+
+	e = calloc(1, sizeof(*e));
+	if (!e) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY "\n");
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+	TAILQ_INSERT_TAIL(&utc->storage_enums, e, link);
+
+	res = tee_svc_copy_kaddr_to_uref(obj_enum, e);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		tee_svc_close_enum(utc, e);
+	}
+	return res;
 }
 
 TEE_Result syscall_storage_free_enum(unsigned long obj_enum)
 {
+	TEE_Result res;
+	struct ts_session *ts_sess = ts_get_current_session();
+	struct user_ta_ctx *utc = to_user_ta_ctx(ts_sess->ctx);
+	struct tee_storage_enum *e;
+
+	res = tee_svc_storage_get_enum(utc, tee_svc_uref_to_vaddr(obj_enum),
+				       &e);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		return res;
+	}
+
+	tee_svc_close_enum(utc, e);
 	return TEE_SUCCESS;
 }
 
 TEE_Result syscall_storage_reset_enum(unsigned long obj_enum)
 {
+	TEE_Result res;
+	struct ts_session *ts_sess = ts_get_current_session();
+	struct user_ta_ctx *utc = to_user_ta_ctx(ts_sess->ctx);
+	struct tee_storage_enum *e;
+
+	res = tee_svc_storage_get_enum(utc, tee_svc_uref_to_vaddr(obj_enum),
+				       &e);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		return res;
+	}
+
+	tee_svc_storage_detach_enum(e);
 	return TEE_SUCCESS;
 }
 
 TEE_Result syscall_storage_start_enum(unsigned long obj_enum,
 				      unsigned long storage_id)
 {
-	return TEE_SUCCESS;
+	TEE_Result res;
+	struct ts_session *ts_sess = ts_get_current_session();
+	struct user_ta_ctx *utc = to_user_ta_ctx(ts_sess->ctx);
+	struct storage_index *idx;
+	struct tee_storage_enum *e;
+
+	res = tee_svc_storage_get_enum(utc, tee_svc_uref_to_vaddr(obj_enum),
+				       &e);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		return res;
+	}
+
+	if (!file_ops(storage_id)) {
+		EMSG(ERR_MSG_ITEM_NOT_FOUND "\n");
+		return TEE_ERROR_ITEM_NOT_FOUND;
+	}
+
+	tee_svc_storage_detach_enum(e);
+
+	pthread_mutex_lock(&storage_index_lock);
+	idx = storage_index_find(&ts_sess->ctx->uuid, storage_id);
+	if (!idx) {
+		res = storage_index_load(ts_sess, storage_id, &idx);
+		if (res != TEE_SUCCESS) {
+			EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+			goto out;
+		}
+	}
+
+	if (TAILQ_EMPTY(&idx->entries)) {
+		res = TEE_ERROR_ITEM_NOT_FOUND;
+		goto out;
+	}
+
+	e->index = idx;
+	e->next = TAILQ_FIRST(&idx->entries);
+	TAILQ_INSERT_TAIL(&idx->enums, e, index_link);
+out:
+	pthread_mutex_unlock(&storage_index_lock);
+	return res;
 }
 
 TEE_Result syscall_storage_next_enum(unsigned long obj_enum,
 			struct utee_object_info *info, void *obj_id,
 			uint64_t *len)
 {
-	return TEE_SUCCESS;
+	TEE_Result res;
+	struct ts_session *ts_sess = ts_get_current_session();
+	struct user_ta_ctx *utc = to_user_ta_ctx(ts_sess->ctx);
+	struct tee_storage_enum *e;
+	struct tee_obj *o = NULL;
+	struct utee_object_info bbuf;
+	uint8_t oid[TEE_OBJECT_ID_MAX_LEN];
+	uint32_t oid_len = 0;
+	uint32_t storage_id = 0;
+	uint64_t l;
+
+	res = tee_svc_storage_get_enum(utc, tee_svc_uref_to_vaddr(obj_enum),
+				       &e);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		return res;
+	}
+
+	pthread_mutex_lock(&storage_index_lock);
+	if (e->next) {
+		oid_len = e->next->obj_id_len;
+		memcpy(oid, e->next->obj_id, oid_len);
+		storage_id = e->index->storage_id;
+		e->next = TAILQ_NEXT(e->next, link);
+	}
+	pthread_mutex_unlock(&storage_index_lock);
+
+	if (!oid_len)
+		return TEE_ERROR_ITEM_NOT_FOUND;
+
+	o = tee_obj_alloc();
+	if (o == NULL) {
+		EMSG(ERR_MSG_OUT_OF_MEMORY "\n");
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+	o->flags = TEE_DATA_FLAG_SHARE_READ;
+
+	res = tee_pobj_get((void *)&ts_sess->ctx->uuid, oid, oid_len,
+			   o->flags, TEE_POBJ_USAGE_ENUM, file_ops(storage_id),
+			   &o->pobj);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		o->pobj = NULL;
+		goto exit;
+	}
+	o->pobj->storage_id = storage_id;
+
+	res = tee_svc_storage_read_head(ts_sess, o);
+	if (res != TEE_SUCCESS) {
+		EMSG(ERR_MSG_GENERIC ": 0x%08lx\n", res);
+		goto exit;
+	}
+
+	bbuf = (struct utee_object_info){
+		.obj_type = o->info.objectType,
+		.obj_size = o->info.objectSize,
+		.max_obj_size = o->info.maxObjectSize,
+		.obj_usage = o->info.objectUsage,
+		.data_size = o->info.dataSize,
+		.data_pos = o->info.dataPosition,
+		.handle_flags = o->flags,
+	};
+	res = tee_svc_copy_to_user(info, &bbuf, sizeof(bbuf));
+	if (res != TEE_SUCCESS)
+		goto exit;
+
+	res = tee_svc_copy_to_user(obj_id, oid, oid_len);
+	if (res != TEE_SUCCESS)
+		goto exit;
+
+	l = oid_len;
+	res = tee_svc_copy_to_user(len, &l, sizeof(*len));
+
+exit:
+	if (o->pobj) {
+		if (!tee_svc_storage_park_fh(o))
+			o->pobj->fops->close(&o->fh);
+		tee_pobj_release(o->pobj);
+	}
+	tee_obj_free(o);
+	if (res) {
+		DMSG("res: 0x%08lx\n", res);
+	}
+	return res;
 }
@@ -19,6 +19,7 @@
 #include <mm/vm.h>
 #include <optee_msg.h>
 #include <stdlib.h>
+#include <string.h>
 #include <tee_api_types.h>
 #include <types_ext.h>
 #include <util.h>
@@ -56,3 +57,56 @@ struct mobj* mobj_mm_alloc(struct mobj* mobj_parent, size_t size,
     m->mobj.size = size;
     return &m->mobj;
 }
+
+static TEE_Result mobj_copy(struct mobj* mobj, size_t offs, void* buf,
+    size_t len, bool to_mobj)
+{
+    uint8_t* p = buf;
+    uint8_t* va = NULL;
+    size_t n = 0;
+
+    if (!mobj)
+        return TEE_ERROR_BAD_PARAMETERS;
+
+    if (!mobj->pages) {
+        if (!len)
+            return TEE_SUCCESS;
+        if (!mobj->buffer)
+            return TEE_ERROR_BAD_PARAMETERS;
+        if (to_mobj)
+            memcpy((uint8_t*)mobj->buffer + offs, p, len);
+        else
+            memcpy(p, (uint8_t*)mobj->buffer + offs, len);
+        return TEE_SUCCESS;
+    }
+
+    /* a page at a time, the pages are never gathered in one block */
+    while (len) {
+        n = MIN(len, OPTEE_MSG_NONCONTIG_PAGE_SIZE
+                - offs % OPTEE_MSG_NONCONTIG_PAGE_SIZE);
+        va = mobj_get_va(mobj, offs, n);
+        if (!va)
+            return TEE_ERROR_BAD_PARAMETERS;
+
+        if (to_mobj)
+            memcpy(va, p, n);
+        else
+            memcpy(p, va, n);
+        offs += n;
+        p += n;
+        len -= n;
+    }
+
+    return TEE_SUCCESS;
+}
+
+TEE_Result mobj_read(struct mobj* mobj, size_t offs, void* dst, size_t len)
+{
+    return mobj_copy(mobj, offs, dst, len, false);
+}
+
+TEE_Result mobj_write(struct mobj* mobj, size_t offs, const void* src,
+    size_t len)
+{
+    return mobj_copy(mobj, offs, (void*)src, len, true);
+}
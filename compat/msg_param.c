@@ -18,11 +18,220 @@
 #include <kernel/msg_param.h>
 #include <mm/mobj.h>
 #include <stdio.h>
+#include <string.h>
+#include <trace.h>
+#include <util.h>
 
+#define NONCONTIG_PAGE_SIZE OPTEE_MSG_NONCONTIG_PAGE_SIZE
+
+/* Page addresses in a page of the list, the last entry links the next one */
+#define NONCONTIG_LIST_ENTRIES (NONCONTIG_PAGE_SIZE / sizeof(uint64_t) - 1)
+
+/*
+ * struct mobj_bounce - a range across pages gathered in one block
+ * @offset:	Offset of the range in the buffer
+ * @len:	Bytes of the range
+ * @stale:	A later bounce took the range over, it is not written back
+ * @next:	The bounce gathered before this one
+ * @buf:	The bytes of the range
+ */
+struct mobj_bounce {
+    size_t offset;
+    size_t len;
+    bool stale;
+    struct mobj_bounce* next;
+    uint8_t buf[];
+};
+
+/*
+ * struct mobj_pages - pages of a noncontiguous mobj
+ * @size:	Bytes of the buffer, starting at the beginning of page[0]
+ * @contig:	The pages follow each other, the buffer is used in place
+ * @bounce:	Ranges across pages gathered after a caller needed them in
+ *		one block, written back when the mobj is put
+ * @num_pages:	Number of pages
+ * @page:	Addresses of the pages
+ */
+struct mobj_pages {
+    size_t size;
+    bool contig;
+    struct mobj_bounce* bounce;
+    size_t num_pages;
+    void* page[];
+};
+
+/*
+ * The TEE shares the address space of its clients, buf_ptr is the address
+ * of the first page of the list and pages need not be page aligned, so
+ * the buffer always starts at its first page.
+ */
 struct mobj* msg_param_mobj_from_noncontig(paddr_t buf_ptr, size_t size,
     uint64_t shm_ref, bool map_buffer)
 {
-    return (struct mobj*)(uintptr_t)shm_ref;
+    const uint64_t* list = (const uint64_t*)(uintptr_t)buf_ptr;
+    size_t num_pages = ROUNDUP(size, NONCONTIG_PAGE_SIZE) / NONCONTIG_PAGE_SIZE;
+    struct mobj_pages* pages = NULL;
+    struct mobj* mobj = NULL;
+
+    (void)map_buffer;
+
+    /* a mobj passed by reference, as before page lists were supported */
+    if (!buf_ptr)
+        return (struct mobj*)(uintptr_t)shm_ref;
+
+    if (!num_pages)
+        return NULL;
+
+    mobj = calloc(1, sizeof(*mobj));
+    pages = calloc(1, sizeof(*pages) + num_pages * sizeof(void*));
+    if (!mobj || !pages) {
+        EMSG("%08x : %zu pages\n", TEE_ERROR_OUT_OF_MEMORY, num_pages);
+        goto err;
+    }
+
+    for (size_t n = 0; n < num_pages; n++) {
+        if (n && !(n % NONCONTIG_LIST_ENTRIES)) {
+            list = (const uint64_t*)(uintptr_t)list[NONCONTIG_LIST_ENTRIES];
+            if (!list)
+                goto err;
+        }
+
+        pages->page[n] = (void*)(uintptr_t)list[n % NONCONTIG_LIST_ENTRIES];
+        if (!pages->page[n])
+            goto err;
+    }
+
+    pages->contig = true;
+    for (size_t n = 1; n < num_pages && pages->contig; n++)
+        pages->contig = pages->page[n]
+            == (uint8_t*)pages->page[0] + n * NONCONTIG_PAGE_SIZE;
+
+    pages->size = size;
+    pages->num_pages = num_pages;
+    mobj->size = size;
+    mobj->pages = pages;
+    return mobj;
+
+err:
+    free(pages);
+    free(mobj);
+    return NULL;
+}
+
+/* Copy [offset, offset + len) of the buffer to or from buf */
+static void mobj_pages_copy(struct mobj_pages* pages, size_t offset,
+    uint8_t* buf, size_t len, bool to_pages)
+{
+    while (len) {
+        size_t in_page = offset % NONCONTIG_PAGE_SIZE;
+        size_t n = MIN(len, NONCONTIG_PAGE_SIZE - in_page);
+        uint8_t* va = (uint8_t*)pages->page[offset / NONCONTIG_PAGE_SIZE]
+            + in_page;
+
+        if (to_pages)
+            memcpy(va, buf, n);
+        else
+            memcpy(buf, va, n);
+        offset += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+static void mobj_pages_unbounce(struct mobj_pages* pages)
+{
+    struct mobj_bounce* b = pages->bounce;
+    struct mobj_bounce* prev = NULL;
+
+    /* oldest first, so a range taken over ends up with the latest bytes */
+    while (b) {
+        struct mobj_bounce* next = b->next;
+
+        b->next = prev;
+        prev = b;
+        b = next;
+    }
+
+    while (prev) {
+        b = prev;
+        prev = b->next;
+        if (!b->stale)
+            mobj_pages_copy(pages, b->offset, b->buf, b->len, true);
+        free(b);
+    }
+
+    pages->bounce = NULL;
+}
+
+void* mobj_pages_get_va(struct mobj* mobj, size_t offset, size_t len)
+{
+    struct mobj_pages* pages = mobj->pages;
+    size_t in_page = offset % NONCONTIG_PAGE_SIZE;
+    struct mobj_bounce* b = NULL;
+    size_t start = offset;
+    size_t end = offset + len;
+
+    if (offset >= pages->size || len > pages->size - offset)
+        return NULL;
+
+    if (pages->contig)
+        return (uint8_t*)pages->page[0] + offset;
+
+    for (b = pages->bounce; b; b = b->next)
+        if (!b->stale && offset >= b->offset && end <= b->offset + b->len)
+            return b->buf + offset - b->offset;
+
+    /* grow the range over the bounces it overlaps, until none is left */
+    for (b = pages->bounce; b;) {
+        if (!b->stale && start < b->offset + b->len && end > b->offset
+            && (b->offset < start || b->offset + b->len > end)) {
+            start = MIN(start, b->offset);
+            end = MAX(end, b->offset + b->len);
+            b = pages->bounce;
+            continue;
+        }
+        b = b->next;
+    }
+
+    if (start == offset && end == offset + len
+        && in_page + len <= NONCONTIG_PAGE_SIZE)
+        return (uint8_t*)pages->page[offset / NONCONTIG_PAGE_SIZE] + in_page;
+
+    /*
+     * A range across pages, the caller needs it in one block. Only the
+     * range is gathered, together with the bounces it overlaps so that
+     * their bytes are not lost.
+     */
+    b = malloc(sizeof(*b) + end - start);
+    if (!b) {
+        EMSG("%08x : %zu\n", TEE_ERROR_OUT_OF_MEMORY, end - start);
+        return NULL;
+    }
+
+    b->offset = start;
+    b->len = end - start;
+    b->stale = false;
+    mobj_pages_copy(pages, start, b->buf, b->len, false);
+    for (struct mobj_bounce* o = pages->bounce; o; o = o->next) {
+        if (o->stale || o->offset < start || o->offset + o->len > end)
+            continue;
+        memcpy(b->buf + o->offset - start, o->buf, o->len);
+        o->stale = true;
+    }
+
+    DMSG("gather %zu bytes at %zu\n", b->len, b->offset);
+    b->next = pages->bounce;
+    pages->bounce = b;
+    return b->buf + offset - start;
+}
+
+void mobj_pages_put(struct mobj* mobj)
+{
+    struct mobj_pages* pages = mobj->pages;
+
+    mobj_pages_unbounce(pages);
+    free(pages);
+    mobj->pages = NULL;
 }
 
 void mobj_reg_shm_unguard(struct mobj* mobj)
@@ -16,29 +16,137 @@
  */
 
 #include <kernel/notif.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Values are the ids of the threads waiting in wq_wait_final(), so one
+ * slot per thread that can be inside the TEE is enough, with some slack
+ * for notifications sent before their waiter got there.
+ */
+#define NOTIF_SLOTS (CFG_NUM_THREADS * 2)
+
+/* A notification lost to a full table costs one timeout, not a hang */
+#define NOTIF_WAIT_TIMEOUT_MS 100
+
+struct notif_slot {
+    uint32_t value;
+    bool used;
+    bool pending;
+    unsigned int waiters;
+    pthread_cond_t cond;
+};
+
+static struct notif_slot notif_slots[NOTIF_SLOTS];
+static pthread_mutex_t notif_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t notif_once = PTHREAD_ONCE_INIT;
+
+static void notif_init(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    for (int i = 0; i < NOTIF_SLOTS; i++) {
+        pthread_cond_init(&notif_slots[i].cond, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+}
+
+/* Find the slot of value or take a new one, must be called with the lock
+ * held. A sender may take over a pending slot nobody waits on, to not let
+ * stale notifications fill the table.
+ */
+static struct notif_slot* notif_get_slot(uint32_t value, bool evict)
+{
+    struct notif_slot* slot = NULL;
+
+    for (int i = 0; i < NOTIF_SLOTS; i++) {
+        if (notif_slots[i].used && notif_slots[i].value == value) {
+            return &notif_slots[i];
+        }
+        if (!notif_slots[i].used && !slot) {
+            slot = &notif_slots[i];
+        }
+    }
+
+    for (int i = 0; i < NOTIF_SLOTS && !slot && evict; i++) {
+        if (notif_slots[i].waiters == 0) {
+            slot = &notif_slots[i];
+        }
+    }
+
+    if (slot) {
+        slot->value = value;
+        slot->used = true;
+        slot->pending = false;
+        slot->waiters = 0;
+    }
+
+    return slot;
+}
+
+static void notif_put_slot(struct notif_slot* slot)
+{
+    if (!slot->pending && slot->waiters == 0) {
+        slot->used = false;
+    }
+}
 
 TEE_Result notif_wait(uint32_t value)
 {
-    /* This notif_wait(uint32_t) function is the core part of
-     * wq_wait_final() function, and the wq_wait_final() function will using
-     * this function to implement wait for the lock become available.
-     * So if we left current function implementation empty,
-     * then the wq_wait_final() function will enter busy-loop, and
-     * current thread will block execution.
-     * So in order to wait for the lock become available, we need to
-     * yield current cpu out, we could perform this by calling print syslog
-     * (the syslog in TEE is implemented by syslog-rpmsg, and invoke syslog
-     * will make current TEE switch to REE, thus yield current cpu out),
-     * or just perform some sleep, which could also yield current cpu out.
-     *
-     * The following yield cpu implementation is referred to:
-     * openamp/libmetal/lib/processor/arm/cpu.h$metal_cpu_yield() function
+    struct notif_slot* slot = NULL;
+    struct timespec ts;
+
+    /* This is the core part of wq_wait_final(), which checks again whether
+     * it was woken up once this returns. Block until notif_send_sync() for
+     * the same value, or a notification that came first is consumed.
      */
-    usleep(1000);
+    pthread_once(&notif_once, notif_init);
+
+    pthread_mutex_lock(&notif_lock);
+    slot = notif_get_slot(value, false);
+    if (!slot) {
+        pthread_mutex_unlock(&notif_lock);
+        usleep(1000);
+        return TEE_SUCCESS;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += NOTIF_WAIT_TIMEOUT_MS * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    slot->waiters++;
+    while (!slot->pending) {
+        if (pthread_cond_timedwait(&slot->cond, &notif_lock, &ts) != 0) {
+            break;
+        }
+    }
+    slot->pending = false;
+    slot->waiters--;
+    notif_put_slot(slot);
+    pthread_mutex_unlock(&notif_lock);
+
     return TEE_SUCCESS;
 }
 
 TEE_Result notif_send_sync(uint32_t value)
 {
+    struct notif_slot* slot = NULL;
+
+    pthread_once(&notif_once, notif_init);
+
+    pthread_mutex_lock(&notif_lock);
+    slot = notif_get_slot(value, true);
+    if (slot) {
+        slot->pending = true;
+        pthread_cond_signal(&slot->cond);
+    }
+    pthread_mutex_unlock(&notif_lock);
+
     return TEE_SUCCESS;
 }
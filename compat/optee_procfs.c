@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2020-2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <nuttx/fs/fs.h>
+#include <nuttx/fs/procfs.h>
+#include <optee_procfs.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <tee_api_types.h>
+#include <trace.h>
+#include <util.h>
+
+#define OPTEE_PROCFS_NODES 4
+
+struct optee_procfs_node {
+    struct procfs_entry_s entry;
+    optee_procfs_format_t format;
+};
+
+/* A snapshot rendered at open and read until closed */
+struct optee_procfs_file {
+    struct procfs_file_s base;
+    size_t len;
+    char text[];
+};
+
+static struct optee_procfs_node procfs_nodes[OPTEE_PROCFS_NODES];
+static size_t procfs_node_count;
+static pthread_mutex_t procfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static optee_procfs_format_t optee_procfs_lookup(const char* relpath)
+{
+    optee_procfs_format_t format = NULL;
+    size_t i = 0;
+
+    pthread_mutex_lock(&procfs_lock);
+    for (i = 0; i < procfs_node_count; i++) {
+        if (!strcmp(procfs_nodes[i].entry.pathpattern, relpath)) {
+            format = procfs_nodes[i].format;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&procfs_lock);
+
+    return format;
+}
+
+static int optee_procfs_open(FAR struct file* filep, FAR const char* relpath,
+    int oflags, mode_t mode)
+{
+    optee_procfs_format_t format = optee_procfs_lookup(relpath);
+    struct optee_procfs_file* file = NULL;
+    size_t len = 0;
+
+    if ((oflags & O_WRONLY) != 0 || (oflags & O_RDONLY) == 0) {
+        return -EACCES;
+    }
+    if (!format) {
+        return -ENOENT;
+    }
+
+    /* The source may grow between the two passes, the text is cut there */
+    len = format(NULL, 0) + 1;
+    file = calloc(1, sizeof(*file) + len);
+    if (!file) {
+        return -ENOMEM;
+    }
+
+    file->len = MIN(format(file->text, len), len - 1);
+    filep->f_priv = file;
+    return 0;
+}
+
+static int optee_procfs_close(FAR struct file* filep)
+{
+    free(filep->f_priv);
+    filep->f_priv = NULL;
+    return 0;
+}
+
+static ssize_t optee_procfs_read(FAR struct file* filep, FAR char* buffer,
+    size_t buflen)
+{
+    struct optee_procfs_file* file = filep->f_priv;
+    size_t n = 0;
+
+    if ((size_t)filep->f_pos >= file->len) {
+        return 0;
+    }
+
+    n = MIN(buflen, file->len - filep->f_pos);
+    memcpy(buffer, file->text + filep->f_pos, n);
+    filep->f_pos += n;
+    return n;
+}
+
+static int optee_procfs_dup(FAR const struct file* oldp, FAR struct file* newp)
+{
+    struct optee_procfs_file* old = oldp->f_priv;
+    struct optee_procfs_file* file = malloc(sizeof(*file) + old->len + 1);
+
+    if (!file) {
+        return -ENOMEM;
+    }
+
+    memcpy(file, old, sizeof(*file) + old->len + 1);
+    newp->f_priv = file;
+    return 0;
+}
+
+static int optee_procfs_stat(FAR const char* relpath, FAR struct stat* buf)
+{
+    memset(buf, 0, sizeof(*buf));
+    buf->st_mode = S_IFREG | S_IROTH | S_IRGRP | S_IRUSR;
+    return 0;
+}
+
+static const struct procfs_operations optee_procfs_ops = {
+    .open = optee_procfs_open,
+    .close = optee_procfs_close,
+    .read = optee_procfs_read,
+    .dup = optee_procfs_dup,
+    .stat = optee_procfs_stat,
+};
+
+int optee_procfs_register(const char* path, optee_procfs_format_t format)
+{
+    struct optee_procfs_node* node = NULL;
+    int ret = 0;
+
+    pthread_mutex_lock(&procfs_lock);
+    if (procfs_node_count == OPTEE_PROCFS_NODES) {
+        pthread_mutex_unlock(&procfs_lock);
+        EMSG("%08x : %s\n", TEE_ERROR_OUT_OF_MEMORY, path);
+        return -ENOMEM;
+    }
+
+    node = &procfs_nodes[procfs_node_count];
+    node->entry.pathpattern = path;
+    node->entry.ops = &optee_procfs_ops;
+    node->entry.type = PROCFS_FILE_TYPE;
+    node->format = format;
+
+    ret = procfs_register(&node->entry);
+    if (ret < 0) {
+        EMSG("%08x : %s, %d\n", TEE_ERROR_GENERIC, path, ret);
+    } else {
+        procfs_node_count++;
+    }
+    pthread_mutex_unlock(&procfs_lock);
+
+    return ret;
+}
@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2020-2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <initcall.h>
+#include <inttypes.h>
+#include <optee_procfs.h>
+#include <optee_stats.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <tee_time_system.h>
+#include <trace.h>
+#include <util.h>
+
+#ifdef USER_TA_WASM
+#include <user_ta_wasm_mem.h>
+#endif
+
+/* Ids per kind, the last one of each also takes all larger ids */
+#define STATS_STD_IDS 8
+#define STATS_TA_IDS 8
+#define STATS_RPC_IDS 24
+#define STATS_FS_IDS 12
+#define STATS_IDS (STATS_STD_IDS + STATS_TA_IDS + STATS_RPC_IDS + STATS_FS_IDS)
+
+static const uint32_t stats_kind_ids[OPTEE_STATS_KINDS] = {
+    STATS_STD_IDS, STATS_TA_IDS, STATS_RPC_IDS, STATS_FS_IDS
+};
+
+static const uint32_t stats_kind_base[OPTEE_STATS_KINDS] = {
+    0,
+    STATS_STD_IDS,
+    STATS_STD_IDS + STATS_TA_IDS,
+    STATS_STD_IDS + STATS_TA_IDS + STATS_RPC_IDS,
+};
+
+static const char* const stats_kind_name[OPTEE_STATS_KINDS] = {
+    "std", "ta", "rpc", "fs"
+};
+
+/*
+ * Every thread records into its own block, so the hot path takes no lock
+ * and no atomic. Readers sum the live blocks and the counters folded in
+ * from exited threads, under stats_lock which only thread start and exit
+ * contend for.
+ */
+struct stats_block {
+    TAILQ_ENTRY(stats_block) link;
+    struct optee_stats_entry entries[STATS_IDS];
+};
+
+static TAILQ_HEAD(stats_block_head, stats_block) stats_blocks = TAILQ_HEAD_INITIALIZER(stats_blocks);
+static struct optee_stats_entry stats_retired[STATS_IDS];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static bool stats_key_ready;
+
+/* TA slot 0 takes the TAs past the tracked ones */
+static TEE_UUID stats_ta_uuid[STATS_TA_IDS];
+static uint32_t stats_ta_count = 1;
+
+static void stats_entry_add(struct optee_stats_entry* dst,
+    const struct optee_stats_entry* src)
+{
+    size_t i = 0;
+
+    dst->count += src->count;
+    dst->errors += src->errors;
+    dst->total_ns += src->total_ns;
+    dst->max_ns = MAX(dst->max_ns, src->max_ns);
+    for (i = 0; i < OPTEE_STATS_BUCKETS; i++) {
+        dst->hist[i] += src->hist[i];
+    }
+}
+
+static void stats_block_destroy(void* arg)
+{
+    struct stats_block* block = arg;
+    size_t i = 0;
+
+    pthread_mutex_lock(&stats_lock);
+    TAILQ_REMOVE(&stats_blocks, block, link);
+    for (i = 0; i < STATS_IDS; i++) {
+        stats_entry_add(&stats_retired[i], &block->entries[i]);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    free(block);
+}
+
+static void stats_key_create(void)
+{
+    stats_key_ready = !pthread_key_create(&stats_key, stats_block_destroy);
+}
+
+static struct stats_block* stats_block_get(void)
+{
+    struct stats_block* block = NULL;
+
+    pthread_once(&stats_once, stats_key_create);
+    if (!stats_key_ready) {
+        return NULL;
+    }
+
+    block = pthread_getspecific(stats_key);
+    if (block) {
+        return block;
+    }
+
+    block = calloc(1, sizeof(*block));
+    if (!block) {
+        return NULL;
+    }
+    if (pthread_setspecific(stats_key, block)) {
+        free(block);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    TAILQ_INSERT_TAIL(&stats_blocks, block, link);
+    pthread_mutex_unlock(&stats_lock);
+    return block;
+}
+
+static unsigned int stats_bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    unsigned int bucket = 0;
+
+    while (us && bucket < OPTEE_STATS_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+uint64_t optee_stats_now(void)
+{
+    return tee_time_system_ns();
+}
+
+void optee_stats_record(enum optee_stats_kind kind, uint32_t id,
+    uint64_t start_ns, TEE_Result res)
+{
+    struct stats_block* block = stats_block_get();
+    struct optee_stats_entry* entry = NULL;
+    uint64_t ns = tee_time_system_ns() - start_ns;
+
+    if (!block || kind >= OPTEE_STATS_KINDS) {
+        return;
+    }
+
+    id = MIN(id, stats_kind_ids[kind] - 1);
+    entry = &block->entries[stats_kind_base[kind] + id];
+    entry->count++;
+    if (res != TEE_SUCCESS) {
+        entry->errors++;
+    }
+    entry->total_ns += ns;
+    entry->max_ns = MAX(entry->max_ns, ns);
+    entry->hist[stats_bucket(ns)]++;
+}
+
+uint32_t optee_stats_ta_id(const TEE_UUID* uuid)
+{
+    uint32_t count = __atomic_load_n(&stats_ta_count, __ATOMIC_ACQUIRE);
+    uint32_t i = 0;
+
+    for (i = 1; i < count; i++) {
+        if (!memcmp(&stats_ta_uuid[i], uuid, sizeof(*uuid))) {
+            return i;
+        }
+    }
+
+    /* Slots are only ever added, under the lock */
+    pthread_mutex_lock(&stats_lock);
+    count = stats_ta_count;
+    for (; i < count; i++) {
+        if (!memcmp(&stats_ta_uuid[i], uuid, sizeof(*uuid))) {
+            break;
+        }
+    }
+    if (i == count) {
+        if (count < STATS_TA_IDS) {
+            stats_ta_uuid[count] = *uuid;
+            __atomic_store_n(&stats_ta_count, count + 1, __ATOMIC_RELEASE);
+        } else {
+            i = 0;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    return i;
+}
+
+bool optee_stats_get(enum optee_stats_kind kind, uint32_t id,
+    struct optee_stats_entry* entry)
+{
+    struct stats_block* block = NULL;
+    size_t idx = 0;
+
+    if (kind >= OPTEE_STATS_KINDS || id >= stats_kind_ids[kind]) {
+        return false;
+    }
+
+    idx = stats_kind_base[kind] + id;
+    pthread_mutex_lock(&stats_lock);
+    *entry = stats_retired[idx];
+    TAILQ_FOREACH(block, &stats_blocks, link)
+    {
+        stats_entry_add(entry, &block->entries[idx]);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    return true;
+}
+
+static int stats_format_uuid(char* buf, size_t size, const char* name,
+    const TEE_UUID* u)
+{
+    return snprintf(buf, size, "%s %08" PRIx32 "-%04" PRIx16 "-%04" PRIx16 "-%02x%02x-%02x%02x%02x%02x%02x%02x",
+        name, u->timeLow, u->timeMid, u->timeHiAndVersion,
+        u->clockSeqAndNode[0], u->clockSeqAndNode[1],
+        u->clockSeqAndNode[2], u->clockSeqAndNode[3],
+        u->clockSeqAndNode[4], u->clockSeqAndNode[5],
+        u->clockSeqAndNode[6], u->clockSeqAndNode[7]);
+}
+
+#ifdef USER_TA_WASM
+/* WASM runtime memory of the TA, on the line after its invoke counters */
+
+static size_t stats_format_mem(char* buf, size_t size, const TEE_UUID* uuid)
+{
+    struct wasm_mem_stats mem;
+    size_t len = 0;
+
+    if (!wasm_mem_stats_read(uuid, &mem)) {
+        return 0;
+    }
+
+    len = stats_format_uuid(buf, size, "mem", uuid);
+    return len + snprintf(buf + MIN(len, size), size - MIN(len, size),
+               " %zu %zu %" PRIu32 "\n", mem.current, mem.peak, mem.failed);
+}
+#endif
+
+static size_t stats_format_entry(char* buf, size_t size,
+    enum optee_stats_kind kind, uint32_t id,
+    const struct optee_stats_entry* e)
+{
+    size_t len = 0;
+    size_t i = 0;
+    int n = 0;
+
+    if (kind == OPTEE_STATS_TA && id) {
+        n = stats_format_uuid(buf, size, "ta", &stats_ta_uuid[id]);
+    } else {
+        n = snprintf(buf, size, "%s %" PRIu32, stats_kind_name[kind], id);
+    }
+    len += n;
+
+    n = snprintf(buf + MIN(len, size), size - MIN(len, size),
+        " %" PRIu32 " %" PRIu32 " %" PRIu64 " %" PRIu64,
+        e->count, e->errors, e->total_ns / 1000, e->max_ns / 1000);
+    len += n;
+
+    for (i = 0; i < OPTEE_STATS_BUCKETS; i++) {
+        n = snprintf(buf + MIN(len, size), size - MIN(len, size),
+            " %" PRIu32, e->hist[i]);
+        len += n;
+    }
+
+    n = snprintf(buf + MIN(len, size), size - MIN(len, size), "\n");
+    len += n;
+
+#ifdef USER_TA_WASM
+    if (kind == OPTEE_STATS_TA && id) {
+        len += stats_format_mem(buf + MIN(len, size), size - MIN(len, size),
+            &stats_ta_uuid[id]);
+    }
+#endif
+
+    return len;
+}
+
+size_t optee_stats_format(char* buf, size_t size)
+{
+    struct optee_stats_entry entry;
+    size_t len = 0;
+    uint32_t kind = 0;
+    uint32_t id = 0;
+
+    len = snprintf(buf, size, "# kind id count errors total_us max_us"
+                              " hist[<1us <2us ... <2^%dus >=]\n",
+        OPTEE_STATS_BUCKETS - 2);
+#ifdef USER_TA_WASM
+    len += snprintf(buf + MIN(len, size), size - MIN(len, size),
+        "# mem uuid current peak failed\n");
+#endif
+
+    for (kind = 0; kind < OPTEE_STATS_KINDS; kind++) {
+        for (id = 0; id < stats_kind_ids[kind]; id++) {
+            if (!optee_stats_get(kind, id, &entry) || !entry.count) {
+                continue;
+            }
+            len += stats_format_entry(buf + MIN(len, size),
+                size - MIN(len, size), kind, id, &entry);
+        }
+    }
+
+    return len;
+}
+
+#ifdef CONFIG_FS_PROCFS_REGISTER
+static TEE_Result optee_stats_init(void)
+{
+    optee_procfs_register("optee/stats", optee_stats_format);
+    return TEE_SUCCESS;
+}
+
+service_init_late(optee_stats_init);
+#endif
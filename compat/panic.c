@@ -18,10 +18,14 @@
 
 #include <assert.h>
 #include <kernel/panic.h>
+#include <trace_ring.h>
 
 void __do_panic(const char* file, const int line, const char* func,
     const char* msg)
 {
+#ifdef CONFIG_OPTEE_TRACE_RING
+    trace_ring_dump();
+#endif
 #if defined(CFG_TEE_CORE_DEBUG)
     EMSG("%s, %d, %s, %s\n", file, line, func, msg);
 #else
@@ -14,23 +14,129 @@
  * limitations under the License.
  */
 
+#include <pthread.h>
 #include <rng_support.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string_ext.h>
 #include <sys/random.h>
 #include <tee_api_types.h>
+#include <util.h>
 
-TEE_Result hw_get_random_bytes(void* buf, size_t blen)
+#ifdef CONFIG_OPTEE_RANDOM_POOL_SIZE
+#define RANDOM_POOL_SIZE CONFIG_OPTEE_RANDOM_POOL_SIZE
+#else
+#define RANDOM_POOL_SIZE 0
+#endif
+
+static TEE_Result random_fill(uint8_t* buf, size_t blen)
 {
     ssize_t ret;
+
+    while (blen) {
+        ret = getrandom(buf, blen, GRND_RANDOM);
+        if (ret < 0)
+            ret = getrandom(buf, blen, 0);
+        if (ret <= 0)
+            return TEE_ERROR_GENERIC;
+
+        buf += ret;
+        blen -= ret;
+    }
+
+    return TEE_SUCCESS;
+}
+
+#if RANDOM_POOL_SIZE > 0
+/* Each thread draws small requests from its own buffer of fresh entropy,
+ * refilled with one read once used up. Bytes are wiped as handed out.
+ */
+struct random_pool {
+    size_t avail;
+    uint8_t data[RANDOM_POOL_SIZE];
+};
+
+static pthread_key_t random_pool_key;
+static pthread_once_t random_pool_once = PTHREAD_ONCE_INIT;
+static bool random_pool_ready;
+
+static void random_pool_destroy(void* arg)
+{
+    memzero_explicit(arg, sizeof(struct random_pool));
+    free(arg);
+}
+
+static void random_pool_key_create(void)
+{
+    random_pool_ready = !pthread_key_create(&random_pool_key, random_pool_destroy);
+}
+
+static struct random_pool* random_pool_get(void)
+{
+    struct random_pool* pool = NULL;
+
+    pthread_once(&random_pool_once, random_pool_key_create);
+    if (!random_pool_ready)
+        return NULL;
+
+    pool = pthread_getspecific(random_pool_key);
+    if (!pool) {
+        pool = calloc(1, sizeof(*pool));
+        if (pool && pthread_setspecific(random_pool_key, pool)) {
+            free(pool);
+            pool = NULL;
+        }
+    }
+
+    return pool;
+}
+
+static TEE_Result random_pool_read(struct random_pool* pool, uint8_t* buf,
+    size_t blen)
+{
+    TEE_Result res = TEE_SUCCESS;
+    uint8_t* src = NULL;
+    size_t n = 0;
+
+    while (blen) {
+        if (!pool->avail) {
+            res = random_fill(pool->data, sizeof(pool->data));
+            if (res != TEE_SUCCESS)
+                return res;
+            pool->avail = sizeof(pool->data);
+        }
+
+        n = MIN(blen, pool->avail);
+        src = pool->data + sizeof(pool->data) - pool->avail;
+        memcpy(buf, src, n);
+        memzero_explicit(src, n);
+        pool->avail -= n;
+        buf += n;
+        blen -= n;
+    }
+
+    return TEE_SUCCESS;
+}
+#endif
+
+TEE_Result hw_get_random_bytes(void* buf, size_t blen)
+{
+#if RANDOM_POOL_SIZE > 0
+    struct random_pool* pool = NULL;
+#endif
+
     if (!buf)
         return TEE_ERROR_BAD_PARAMETERS;
 
-    ret = getrandom(buf, blen, GRND_RANDOM);
-    if (ret < 0)
-        ret = getrandom(buf, blen, 0);
-
-    if (ret > 0)
-        return TEE_SUCCESS;
+#if RANDOM_POOL_SIZE > 0
+    if (blen < RANDOM_POOL_SIZE) {
+        pool = random_pool_get();
+        if (pool)
+            return random_pool_read(pool, buf, blen);
+    }
+#endif
 
-    return TEE_ERROR_GENERIC;
+    return random_fill(buf, blen);
 }
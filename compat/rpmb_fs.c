@@ -23,6 +23,7 @@
 #include <nuttx/drivers/rpmsgblk.h>
 #include <nuttx/mmcsd.h>
 #include <rpmb_fs.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
@@ -32,7 +33,6 @@
 /* Request */
 #define RPMB_REQ_DATA(req) ((void*)((struct rpmb_req*)(req) + 1))
 #define RPMB_CID_SZ 16
-#define RPMB_DATA_FRAME_SIZE 512
 
 /* Response to device info request */
 struct rpmb_dev_info {
@@ -45,39 +45,6 @@ struct rpmb_dev_info {
 #define RPMB_CMD_GET_DEV_INFO_RET_ERROR 0x01
 };
 
-/*
- * This structure is shared with OP-TEE and the MMC ioctl layer.
- * It is the "data frame for RPMB access" defined by JEDEC, minus the
- * start and stop bits.
- */
-struct rpmb_data_frame {
-    uint8_t stuff_bytes[196];
-    uint8_t key_mac[32];
-    uint8_t data[256];
-    uint8_t nonce[16];
-    uint32_t write_counter;
-    uint16_t address;
-    uint16_t block_count;
-    uint16_t op_result;
-#define RPMB_RESULT_OK 0x00
-#define RPMB_RESULT_GENERAL_FAILURE 0x01
-#define RPMB_RESULT_AUTH_FAILURE 0x02
-#define RPMB_RESULT_ADDRESS_FAILURE 0x04
-#define RPMB_RESULT_AUTH_KEY_NOT_PROGRAMMED 0x07
-    uint16_t msg_type;
-#define RPMB_MSG_TYPE_REQ_AUTH_KEY_PROGRAM 0x0001
-#define RPMB_MSG_TYPE_REQ_WRITE_COUNTER_VAL_READ 0x0002
-#define RPMB_MSG_TYPE_REQ_AUTH_DATA_WRITE 0x0003
-#define RPMB_MSG_TYPE_REQ_AUTH_DATA_READ 0x0004
-#define RPMB_MSG_TYPE_REQ_RESULT_READ 0x0005
-#define RPMB_MSG_TYPE_RESP_AUTH_KEY_PROGRAM 0x0100
-#define RPMB_MSG_TYPE_RESP_WRITE_COUNTER_VAL_READ 0x0200
-#define RPMB_MSG_TYPE_RESP_AUTH_DATA_WRITE 0x0300
-#define RPMB_MSG_TYPE_RESP_AUTH_DATA_READ 0x0400
-};
-
-static pthread_mutex_t rpmb_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 /* mmc_ioc_cmd.opcode */
 #define MMC_READ_MULTIPLE_BLOCK 18
 #define MMC_WRITE_MULTIPLE_BLOCK 25
@@ -103,6 +70,64 @@ static pthread_mutex_t rpmb_mutex = PTHREAD_MUTEX_INITIALIZER;
 /* Maximum number of commands used in a multiple ioc command request */
 #define RPMB_MAX_IOC_MULTI_CMDS 3
 
+/* EXT_CSD fields */
+#define EXT_CSD_RPMB_SIZE_MULT 168
+#define EXT_CSD_REL_WR_SEC_C 222
+
+/*
+ * Black magic: tested on a HiKey board with a HardKernel eMMC module.
+ * When postsleep values are zero, the kernel logs random errors:
+ * "mmc_blk_ioctl_cmd: Card Status=0x00000E00" and ioctl() fails.
+ * Cards that don't need it can set the minimum to 0.
+ */
+#ifdef CONFIG_OPTEE_RPMB_MAX_DEVICES
+#define RPMB_MAX_DEVICES CONFIG_OPTEE_RPMB_MAX_DEVICES
+#else
+#define RPMB_MAX_DEVICES 2
+#endif
+
+#ifdef CONFIG_OPTEE_RPMB_POSTSLEEP_MIN_US
+#define RPMB_POSTSLEEP_MIN_US CONFIG_OPTEE_RPMB_POSTSLEEP_MIN_US
+#else
+#define RPMB_POSTSLEEP_MIN_US 20000
+#endif
+
+#ifdef CONFIG_OPTEE_RPMB_POSTSLEEP_MAX_US
+#define RPMB_POSTSLEEP_MAX_US CONFIG_OPTEE_RPMB_POSTSLEEP_MAX_US
+#else
+#define RPMB_POSTSLEEP_MAX_US 50000
+#endif
+
+/*
+ * State of an RPMB partition, requests to one device are serialized by
+ * its lock while other devices proceed
+ * @lock:		Serializes requests to the device
+ * @used:		True once the slot is taken by @id, set under
+ *			rpmb_devs_lock and never cleared
+ * @fd:			File descriptor of the partition, -1 until opened
+ * @id:			Device ID of the partition
+ * @has_info:		True once @info holds the CID and EXT_CSD fields
+ * @info:		Device info, stable for the lifetime of the device
+ * @postsleep_min_us:	Sleep after an authenticated write, 0 disables
+ * @postsleep_max_us:	Upper bound of the sleep after a write
+ * @mcmd:		Command buffer for RPMB_MAX_IOC_MULTI_CMDS commands,
+ *			allocated once and reused by every request
+ */
+struct rpmb_dev {
+    pthread_mutex_t lock;
+    bool used;
+    int fd;
+    uint16_t id;
+    bool has_info;
+    struct rpmb_dev_info info;
+    uint32_t postsleep_min_us;
+    uint32_t postsleep_max_us;
+    struct mmc_ioc_multi_cmd* mcmd;
+};
+
+static pthread_mutex_t rpmb_devs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rpmb_dev rpmb_devs[RPMB_MAX_DEVICES];
+
 #define IOCTL(fd, request, ...)                        \
     ({                                                 \
         int ret;                                       \
@@ -150,33 +175,146 @@ static inline void set_mmc_io_cmd(struct mmc_ioc_cmd* cmd, unsigned int blocks,
     cmd->write_flag = write_flag;
 }
 
-static int mmc_rpmb_fd(uint16_t dev_id)
+static TEE_Result read_extcsd(int fd, uint8_t* ext_csd)
+{
+    struct mmc_ioc_cmd idata;
+    memset(&idata, 0, sizeof(idata));
+    memset(ext_csd, 0, RPMB_DATA_FRAME_SIZE);
+    idata.write_flag = 0;
+    idata.opcode = MMC_SEND_EXT_CSD;
+    idata.arg = 0;
+    idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+    idata.blksz = RPMB_DATA_FRAME_SIZE;
+    idata.blocks = 1;
+    mmc_ioc_cmd_set_data(idata, ext_csd);
+
+    if (IOCTL(fd, MMC_IOC_CMD, &idata) < 0)
+        return TEE_ERROR_GENERIC;
+
+    return TEE_SUCCESS;
+}
+
+static uint32_t read_cid(uint16_t dev_id, uint8_t* cid)
 {
-    static int id;
-    static int fd = -1;
+    TEE_Result res = TEE_SUCCESS;
     char path[PATH_MAX] = { 0 };
+    int fd;
+    size_t n;
 
-    DMSG("dev_id = %u", dev_id);
+    snprintf(path, sizeof(path), "/proc/mmcsd/cid%d", dev_id);
+    fd = open(path, O_RDONLY);
     if (fd < 0) {
+        EMSG("Could not open %s (%s)", path, strerror(errno));
+        return fd;
+    }
+
+    n = read(fd, cid, RPMB_CID_SZ);
+    if (n != RPMB_CID_SZ) {
+        EMSG("Read CID error");
+        if (errno)
+            EMSG("%s", strerror(errno));
+
+        res = TEE_ERROR_NO_DATA;
+    }
+
+    close(fd);
+    return res;
+}
+
+static TEE_Result rpmb_dev_read_info(struct rpmb_dev* dev)
+{
+    TEE_Result res = TEE_SUCCESS;
+    uint8_t ext_csd[RPMB_DATA_FRAME_SIZE];
+
+    res = read_cid(dev->id, dev->info.cid);
+    if (res != TEE_SUCCESS)
+        return res;
+
+    res = read_extcsd(dev->fd, ext_csd);
+    if (res != TEE_SUCCESS)
+        return res;
+
+    dev->info.rpmb_size_mult = ext_csd[EXT_CSD_RPMB_SIZE_MULT];
+    dev->info.rel_wr_sec_c = ext_csd[EXT_CSD_REL_WR_SEC_C];
+    dev->info.ret_code = RPMB_CMD_GET_DEV_INFO_RET_OK;
+    dev->has_info = true;
+
+    return res;
+}
+
+static TEE_Result rpmb_dev_open(struct rpmb_dev* dev)
+{
+    char path[PATH_MAX] = { 0 };
+
+    dev->mcmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) + RPMB_MAX_IOC_MULTI_CMDS * sizeof(struct mmc_ioc_cmd));
+    if (!dev->mcmd)
+        return TEE_ERROR_OUT_OF_MEMORY;
+
+    snprintf(path, sizeof(path), "/dev/mmcsd%urpmb", dev->id);
 #ifdef CONFIG_BLK_RPMSG
-        rpmsgblk_register(CONFIG_OPTEE_RPMB_REMOTE_CPU, "/dev/mmcsd0rpmb", NULL);
+    rpmsgblk_register(CONFIG_OPTEE_RPMB_REMOTE_CPU, path, NULL);
 #endif
-        snprintf(path, sizeof(path), "/dev/mmcsd%urpmb", dev_id);
-        fd = open(path, O_RDWR);
-        if (fd < 0) {
-            EMSG("Could not open %s (%s)", path, strerror(errno));
-            return -1;
+    dev->fd = open(path, O_RDWR);
+    if (dev->fd < 0) {
+        EMSG("Could not open %s (%s)", path, strerror(errno));
+        free(dev->mcmd);
+        dev->mcmd = NULL;
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+    dev->postsleep_min_us = RPMB_POSTSLEEP_MIN_US;
+    dev->postsleep_max_us = RPMB_POSTSLEEP_MAX_US;
+
+    /* Retried on the next device info request if this fails */
+    rpmb_dev_read_info(dev);
+    return TEE_SUCCESS;
+}
+
+/*
+ * Find the slot of dev_id, taking a free one on first use, and return it
+ * locked with the partition opened. Release with mmc_rpmb_dev_put().
+ */
+static struct rpmb_dev* mmc_rpmb_dev_get(uint16_t dev_id)
+{
+    struct rpmb_dev* dev = NULL;
+    size_t i = 0;
+
+    DMSG("dev_id = %u", dev_id);
+    rpmb_mutex_lock(&rpmb_devs_lock);
+    for (i = 0; i < RPMB_MAX_DEVICES; i++) {
+        if (rpmb_devs[i].used && rpmb_devs[i].id == dev_id) {
+            dev = &rpmb_devs[i];
+            break;
         }
-        id = dev_id;
+        if (!rpmb_devs[i].used && !dev)
+            dev = &rpmb_devs[i];
     }
-    if (id != dev_id) {
-        EMSG("Only one MMC device is supported");
-        return -1;
+    if (dev && !dev->used) {
+        pthread_mutex_init(&dev->lock, NULL);
+        dev->used = true;
+        dev->fd = -1;
+        dev->id = dev_id;
     }
-    return fd;
+    rpmb_mutex_unlock(&rpmb_devs_lock);
+
+    if (!dev) {
+        EMSG("At most %d RPMB devices are supported", RPMB_MAX_DEVICES);
+        return NULL;
+    }
+
+    rpmb_mutex_lock(&dev->lock);
+    if (dev->fd < 0 && rpmb_dev_open(dev) != TEE_SUCCESS) {
+        rpmb_mutex_unlock(&dev->lock);
+        return NULL;
+    }
+    return dev;
 }
 
-static uint32_t rpmb_data_req(int fd, struct rpmb_data_frame* req_frm,
+static void mmc_rpmb_dev_put(struct rpmb_dev* dev)
+{
+    rpmb_mutex_unlock(&dev->lock);
+}
+
+static uint32_t rpmb_data_req(struct rpmb_dev* dev, struct rpmb_data_frame* req_frm,
     size_t req_nfrm, struct rpmb_data_frame* rsp_frm,
     size_t rsp_nfrm)
 {
@@ -184,7 +322,7 @@ static uint32_t rpmb_data_req(int fd, struct rpmb_data_frame* req_frm,
     int st = 0;
     size_t i = 0;
     uint16_t msg_type = ntohs(req_frm->msg_type);
-    struct mmc_ioc_multi_cmd* mcmd = NULL;
+    struct mmc_ioc_multi_cmd* mcmd = dev->mcmd;
     struct mmc_ioc_cmd* cmd = NULL;
 
     for (i = 1; i < req_nfrm; i++) {
@@ -197,10 +335,7 @@ static uint32_t rpmb_data_req(int fd, struct rpmb_data_frame* req_frm,
     DMSG("Req: %zu frame(s) of type 0x%04x", req_nfrm, msg_type);
     DMSG("Rsp: %zu frame(s)", rsp_nfrm);
 
-    mcmd = (struct mmc_ioc_multi_cmd*)
-        calloc(1, sizeof(struct mmc_ioc_multi_cmd) + RPMB_MAX_IOC_MULTI_CMDS * sizeof(struct mmc_ioc_cmd));
-    if (!mcmd)
-        return TEE_ERROR_OUT_OF_MEMORY;
+    memset(mcmd, 0, sizeof(struct mmc_ioc_multi_cmd) + RPMB_MAX_IOC_MULTI_CMDS * sizeof(struct mmc_ioc_cmd));
 
     DMSG("msg_type = %d", msg_type);
     switch (msg_type) {
@@ -208,8 +343,19 @@ static uint32_t rpmb_data_req(int fd, struct rpmb_data_frame* req_frm,
     case RPMB_MSG_TYPE_REQ_AUTH_DATA_WRITE:
         if (rsp_nfrm != 1) {
             EMSG("Expected only one response frame");
-            res = TEE_ERROR_BAD_PARAMETERS;
-            goto out;
+            return TEE_ERROR_BAD_PARAMETERS;
+        }
+
+        /*
+         * All frames of a write share one MAC and write counter, so they
+         * go to the card as one reliable write. The core packs them up
+         * to two frames per reliable write sector, refuse more than that
+         * here instead of failing in the card.
+         */
+        if (dev->has_info && dev->info.rel_wr_sec_c
+            && req_nfrm > dev->info.rel_wr_sec_c * 2U) {
+            EMSG("%zu frames exceed the reliable write limit", req_nfrm);
+            return TEE_ERROR_BAD_PARAMETERS;
         }
 
         mcmd->num_of_cmds = 3;
@@ -218,15 +364,8 @@ static uint32_t rpmb_data_req(int fd, struct rpmb_data_frame* req_frm,
         cmd = &mcmd->cmds[0];
         set_mmc_io_cmd(cmd, req_nfrm, MMC_WRITE_MULTIPLE_BLOCK,
             1 | MMC_CMD23_ARG_REL_WR);
-
-        /*
-         * Black magic: tested on a HiKey board with a HardKernel eMMC
-         * module. When postsleep values are zero, the kernel logs
-         * random errors: "mmc_blk_ioctl_cmd: Card Status=0x00000E00"
-         * and ioctl() fails.
-         */
-        cmd->postsleep_min_us = 20000;
-        cmd->postsleep_max_us = 50000;
+        cmd->postsleep_min_us = dev->postsleep_min_us;
+        cmd->postsleep_max_us = dev->postsleep_max_us;
         mmc_ioc_cmd_set_data((*cmd), (uintptr_t)req_frm);
 
         /* Send result request frame */
@@ -245,15 +384,13 @@ static uint32_t rpmb_data_req(int fd, struct rpmb_data_frame* req_frm,
     case RPMB_MSG_TYPE_REQ_WRITE_COUNTER_VAL_READ:
         if (rsp_nfrm != 1) {
             EMSG("Expected only one response frame");
-            res = TEE_ERROR_BAD_PARAMETERS;
-            goto out;
+            return TEE_ERROR_BAD_PARAMETERS;
         }
 
     case RPMB_MSG_TYPE_REQ_AUTH_DATA_READ:
         if (req_nfrm != 1) {
             EMSG("Expected only one request frame");
-            res = TEE_ERROR_BAD_PARAMETERS;
-            goto out;
+            return TEE_ERROR_BAD_PARAMETERS;
         }
 
         mcmd->num_of_cmds = 2;
@@ -271,16 +408,13 @@ static uint32_t rpmb_data_req(int fd, struct rpmb_data_frame* req_frm,
 
     default:
         EMSG("Unsupported message type: %d", msg_type);
-        res = TEE_ERROR_GENERIC;
-        goto out;
+        return TEE_ERROR_GENERIC;
     }
 
-    st = IOCTL(fd, MMC_IOC_MULTI_CMD, mcmd);
+    st = IOCTL(dev->fd, MMC_IOC_MULTI_CMD, mcmd);
     if (st < 0)
         res = TEE_ERROR_GENERIC;
 
-out:
-    free(mcmd);
     return res;
 }
 
@@ -290,68 +424,20 @@ static uint32_t rpmb_data_request_internal(void* req, size_t req_size,
     struct rpmb_req* sreq = req;
     size_t req_nfrm = 0;
     size_t rsp_nfrm = 0;
-    uint16_t dev_id = sreq->dev_id;
     uint32_t res = 0;
-    int fd = 0;
+    struct rpmb_dev* dev = NULL;
 
     if (req_size < sizeof(*sreq))
         return TEE_ERROR_BAD_PARAMETERS;
 
     req_nfrm = (req_size - sizeof(struct rpmb_req)) / 512;
     rsp_nfrm = rsp_size / 512;
-    fd = mmc_rpmb_fd(dev_id);
-    if (fd < 0)
+    dev = mmc_rpmb_dev_get(sreq->dev_id);
+    if (!dev)
         return TEE_ERROR_BAD_PARAMETERS;
-    res = rpmb_data_req(fd, RPMB_REQ_DATA(req), req_nfrm, rsp,
+    res = rpmb_data_req(dev, RPMB_REQ_DATA(req), req_nfrm, rsp,
         rsp_nfrm);
-
-    return res;
-}
-
-static uint32_t read_cid(uint16_t dev_id, uint8_t* cid)
-{
-    TEE_Result res = TEE_SUCCESS;
-    char path[PATH_MAX] = { 0 };
-    int fd;
-    size_t n;
-
-    snprintf(path, sizeof(path), "/proc/mmcsd/cid%d", dev_id);
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        EMSG("Could not open %s (%s)", path, strerror(errno));
-        return fd;
-    }
-
-    n = read(fd, cid, RPMB_CID_SZ);
-    if (n != RPMB_CID_SZ) {
-        EMSG("Read CID error");
-        if (errno)
-            EMSG("%s", strerror(errno));
-
-        res = TEE_ERROR_NO_DATA;
-    }
-
-    close(fd);
-    return res;
-}
-
-static TEE_Result read_extcsd(int fd, uint8_t* ext_csd)
-{
-    TEE_Result res = TEE_SUCCESS;
-    struct mmc_ioc_cmd idata;
-    memset(&idata, 0, sizeof(idata));
-    memset(ext_csd, 0, RPMB_DATA_FRAME_SIZE);
-    idata.write_flag = 0;
-    idata.opcode = MMC_SEND_EXT_CSD;
-    idata.arg = 0;
-    idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-    idata.blksz = RPMB_DATA_FRAME_SIZE;
-    idata.blocks = 1;
-    mmc_ioc_cmd_set_data(idata, ext_csd);
-
-    res = IOCTL(fd, MMC_IOC_CMD, &idata);
-    if (res < 0)
-        res = TEE_ERROR_GENERIC;
+    mmc_rpmb_dev_put(dev);
 
     return res;
 }
@@ -359,25 +445,18 @@ static TEE_Result read_extcsd(int fd, uint8_t* ext_csd)
 static uint32_t rpmb_get_dev_info_internal(uint16_t dev_id, struct rpmb_dev_info* info)
 {
     TEE_Result res = TEE_SUCCESS;
-    uint8_t ext_csd[RPMB_DATA_FRAME_SIZE];
-    int fd;
+    struct rpmb_dev* dev = NULL;
 
-    fd = mmc_rpmb_fd(dev_id);
-    if (fd < 0)
+    dev = mmc_rpmb_dev_get(dev_id);
+    if (!dev)
         return TEE_ERROR_BAD_PARAMETERS;
 
-    res = read_cid(dev_id, info->cid);
-    if (res != TEE_SUCCESS)
-        return res;
-
-    res = read_extcsd(fd, ext_csd);
-    if (res != TEE_SUCCESS)
-        return res;
-
-    info->rpmb_size_mult = ext_csd[168];
-    info->rel_wr_sec_c = ext_csd[222];
-    info->ret_code = RPMB_CMD_GET_DEV_INFO_RET_OK;
+    if (!dev->has_info)
+        res = rpmb_dev_read_info(dev);
+    if (res == TEE_SUCCESS)
+        memcpy(info, &dev->info, sizeof(*info));
 
+    mmc_rpmb_dev_put(dev);
     return res;
 }
 
@@ -397,9 +476,7 @@ TEE_Result rpmb_data_request(size_t num_params, struct thread_param* params)
     convert_param_to_mobj(&params[0], &req);
     convert_param_to_mobj(&params[1], &rsp);
 
-    rpmb_mutex_lock(&rpmb_mutex);
     ret = rpmb_data_request_internal(req.buffer, req.size, rsp.buffer, rsp.size);
-    rpmb_mutex_unlock(&rpmb_mutex);
     return ret;
 }
 
@@ -416,8 +493,6 @@ TEE_Result rpmb_get_dev_info(size_t num_params, struct thread_param* params)
     req = (struct rpmb_req*)params[0].u.memref.mobj->buffer;
     rsp = (struct rpmb_rsp*)params[1].u.memref.mobj->buffer;
 
-    rpmb_mutex_lock(&rpmb_mutex);
     ret = rpmb_get_dev_info_internal(req->dev_id, (struct rpmb_dev_info*)rsp);
-    rpmb_mutex_unlock(&rpmb_mutex);
     return ret;
 }
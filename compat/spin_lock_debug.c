@@ -15,6 +15,9 @@
  */
 
 #include <kernel/spinlock.h>
+#include <spin_lock_debug.h>
+
+static struct spin_lock_stats spin_lock_stats;
 
 void spinlock_count_incr(void) { }
 
@@ -24,3 +27,29 @@ bool have_spinlock(void)
 {
     return false;
 }
+
+void spin_lock_debug_record(uint32_t spins)
+{
+    uint32_t max = 0;
+
+    __atomic_fetch_add(&spin_lock_stats.acquired, 1, __ATOMIC_RELAXED);
+    if (!spins)
+        return;
+
+    __atomic_fetch_add(&spin_lock_stats.contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&spin_lock_stats.spins, spins, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&spin_lock_stats.max_spins, __ATOMIC_RELAXED);
+    while (spins > max
+        && !__atomic_compare_exchange_n(&spin_lock_stats.max_spins, &max,
+            spins, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void spin_lock_debug_get_stats(struct spin_lock_stats* stats)
+{
+    stats->acquired = __atomic_load_n(&spin_lock_stats.acquired, __ATOMIC_RELAXED);
+    stats->contended = __atomic_load_n(&spin_lock_stats.contended, __ATOMIC_RELAXED);
+    stats->spins = __atomic_load_n(&spin_lock_stats.spins, __ATOMIC_RELAXED);
+    stats->max_spins = __atomic_load_n(&spin_lock_stats.max_spins, __ATOMIC_RELAXED);
+}
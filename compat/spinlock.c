@@ -15,20 +15,79 @@
  */
 
 #include <kernel/spinlock.h>
-#include <stdatomic.h>
+#include <stdint.h>
+#ifdef CFG_TEE_CORE_DEBUG
+#include <spin_lock_debug.h>
+#endif
+
+/*
+ * Ticket lock in the unsigned int of the OP-TEE spinlock API: the upper
+ * half is the next ticket to hand out, the lower half the ticket being
+ * served. Both are 0 when unlocked, so SPINLOCK_UNLOCK still
+ * initializes a lock, and waiters are served in arrival order.
+ */
+#define TICKET_SHIFT 16
+#define TICKET_MASK 0xffffU
+
+/* Waiters sleep until the holder signals the release, or pause the core */
+#if defined(__aarch64__)
+#define spin_wait() __asm__ volatile("wfe" ::: "memory")
+#define spin_wake() __asm__ volatile("dsb ish\n\tsev" ::: "memory")
+#elif defined(__arm__) && __ARM_ARCH >= 7
+#define spin_wait() __asm__ volatile("wfe" ::: "memory")
+#define spin_wake() __asm__ volatile("dsb\n\tsev" ::: "memory")
+#elif defined(__i386__) || defined(__x86_64__)
+#define spin_wait() __builtin_ia32_pause()
+#define spin_wake() \
+    do {            \
+    } while (0)
+#else
+#define spin_wait() __asm__ volatile("" ::: "memory")
+#define spin_wake() \
+    do {            \
+    } while (0)
+#endif
 
 void __cpu_spin_lock(unsigned int* lock)
 {
-    while (atomic_flag_test_and_set(lock))
-        ;
+    unsigned int ticket = __atomic_fetch_add(lock, 1U << TICKET_SHIFT, __ATOMIC_ACQUIRE) >> TICKET_SHIFT;
+#ifdef CFG_TEE_CORE_DEBUG
+    uint32_t spins = 0;
+#endif
+
+    while ((__atomic_load_n(lock, __ATOMIC_ACQUIRE) & TICKET_MASK) != ticket) {
+        spin_wait();
+#ifdef CFG_TEE_CORE_DEBUG
+        spins++;
+#endif
+    }
+
+#ifdef CFG_TEE_CORE_DEBUG
+    spin_lock_debug_record(spins);
+#endif
 }
 
 void __cpu_spin_unlock(unsigned int* lock)
 {
-    atomic_flag_clear(lock);
+    unsigned int old = __atomic_load_n(lock, __ATOMIC_RELAXED);
+    unsigned int new = 0;
+
+    /* Only the owner half moves, without carrying into the next ticket */
+    do {
+        new = (old & ~TICKET_MASK) | ((old + 1) & TICKET_MASK);
+    } while (!__atomic_compare_exchange_n(lock, &old, new, true,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    spin_wake();
 }
 
 unsigned int __cpu_spin_trylock(unsigned int* lock)
 {
-    return atomic_flag_test_and_set(lock);
+    unsigned int old = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+    if ((old >> TICKET_SHIFT) != (old & TICKET_MASK))
+        return 1;
+
+    return !__atomic_compare_exchange_n(lock, &old, old + (1U << TICKET_SHIFT),
+        false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
 }
@@ -17,23 +17,206 @@
 
 #include <kernel/tee_time.h>
 #include <kernel/time_source.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <sys/time.h>
+#include <tee_time_system.h>
 #include <time.h>
+#ifdef CONFIG_OPTEE_TIME_SOURCE_PERF
+#include <nuttx/arch.h>
+#endif
 
-static TEE_Result get_time_system(TEE_Time* time)
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+static bool system_time_ns(uint64_t* ns)
 {
     struct timespec tv;
-    if (!clock_gettime(CLOCK_MONOTONIC, &tv)) {
-        /* Convert the struct timespec to a struct TEE_Time */
-        time->seconds = (uint32_t)tv.tv_sec;
-        time->millis = (uint32_t)(tv.tv_nsec / 1000000);
-        return TEE_SUCCESS;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &tv))
+        return false;
+
+    *ns = (uint64_t)tv.tv_sec * NSEC_PER_SEC + tv.tv_nsec;
+    return true;
+}
+
+#ifdef CONFIG_OPTEE_TIME_SOURCE_PERF
+/*
+ * The counter has to be the same on every CPU, threads migrate between a
+ * reading and the anchor it is extrapolated from. On Armv7-A and Armv8-A
+ * that is the generic timer, elsewhere Kconfig limits this to UP builds,
+ * where the per-CPU perf counter will do.
+ */
+#if defined(__aarch64__)
+typedef uint64_t perf_count_t;
+
+static inline perf_count_t perf_counter(void)
+{
+    uint64_t count;
+
+    __asm__ volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(count) : : "memory");
+    return count;
+}
+
+static unsigned long perf_counter_freq(void)
+{
+    uint64_t freq;
+
+    __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+    return freq;
+}
+#elif defined(__arm__) && defined(__ARM_ARCH_PROFILE) && __ARM_ARCH_PROFILE == 'A'
+typedef uint64_t perf_count_t;
+
+static inline perf_count_t perf_counter(void)
+{
+    uint64_t count;
+
+    __asm__ volatile("isb\n\tmrrc p15, 1, %Q0, %R0, c14" : "=r"(count) : : "memory");
+    return count;
+}
+
+static unsigned long perf_counter_freq(void)
+{
+    uint32_t freq;
+
+    __asm__ volatile("mrc p15, 0, %0, c14, c0, 0" : "=r"(freq));
+    return freq;
+}
+#else
+typedef clock_t perf_count_t;
+
+#define perf_counter() up_perf_gettime()
+#define perf_counter_freq() up_perf_getfreq()
+#endif
+
+/*
+ * The counter value read together with the monotonic time. Readers
+ * extrapolate from it under a sequence count, and the first reader that
+ * finds it a second old re-anchors it, which keeps counter wrap and drift
+ * against the system clock bounded. perf_last is the latest time handed
+ * out, a re-anchor behind an extrapolation that ran ahead of the system
+ * clock must not take the time backwards.
+ */
+static struct {
+    uint32_t seq;
+    perf_count_t count;
+    uint64_t ns;
+} perf_anchor;
+
+static unsigned long perf_freq;
+static uint64_t perf_last;
+static pthread_once_t perf_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void perf_set_anchor(void)
+{
+    uint64_t ns = 0;
+    perf_count_t count = perf_counter();
+
+    if (!system_time_ns(&ns))
+        return;
+
+    __atomic_add_fetch(&perf_anchor.seq, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    perf_anchor.count = count;
+    perf_anchor.ns = ns;
+    __atomic_add_fetch(&perf_anchor.seq, 1, __ATOMIC_RELEASE);
+}
+
+static void perf_calibrate(void)
+{
+    perf_set_anchor();
+    if (perf_anchor.seq)
+        perf_freq = perf_counter_freq();
+}
+
+static uint64_t perf_monotonic(uint64_t ns)
+{
+    uint64_t last = __atomic_load_n(&perf_last, __ATOMIC_RELAXED);
+
+    do {
+        if (ns <= last)
+            return last;
+    } while (!__atomic_compare_exchange_n(&perf_last, &last, ns, true,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return ns;
+}
+
+static bool perf_time_ns(uint64_t* ns)
+{
+    uint32_t seq = 0;
+    perf_count_t count = 0;
+    perf_count_t delta = 0;
+    uint64_t base = 0;
+
+    pthread_once(&perf_once, perf_calibrate);
+    if (!perf_freq)
+        return system_time_ns(ns);
+
+    do {
+        seq = __atomic_load_n(&perf_anchor.seq, __ATOMIC_ACQUIRE);
+        count = perf_anchor.count;
+        base = perf_anchor.ns;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&perf_anchor.seq, __ATOMIC_RELAXED));
+
+    /* A stale anchor or a counter that went backwards takes the slow path */
+    delta = perf_counter() - count;
+    if (delta >= perf_freq) {
+        if (!pthread_mutex_trylock(&perf_lock)) {
+            perf_set_anchor();
+            pthread_mutex_unlock(&perf_lock);
+        }
+        if (!system_time_ns(ns))
+            return false;
+
+        *ns = perf_monotonic(*ns);
+        return true;
     }
-    return TEE_ERROR_ACCESS_DENIED;
+
+    *ns = perf_monotonic(base + (uint64_t)delta * NSEC_PER_SEC / perf_freq);
+    return true;
+}
+#endif
+
+uint64_t tee_time_system_ns(void)
+{
+    uint64_t ns = 0;
+
+#ifdef CONFIG_OPTEE_TIME_SOURCE_PERF
+    perf_time_ns(&ns);
+#else
+    system_time_ns(&ns);
+#endif
+    return ns;
+}
+
+static TEE_Result get_time_system(TEE_Time* time)
+{
+    uint64_t ns = 0;
+
+#ifdef CONFIG_OPTEE_TIME_SOURCE_PERF
+    if (!perf_time_ns(&ns))
+        return TEE_ERROR_ACCESS_DENIED;
+#else
+    if (!system_time_ns(&ns))
+        return TEE_ERROR_ACCESS_DENIED;
+#endif
+
+    /* Convert the nanoseconds to a struct TEE_Time */
+    time->seconds = (uint32_t)(ns / NSEC_PER_SEC);
+    time->millis = (uint32_t)(ns % NSEC_PER_SEC / NSEC_PER_MSEC);
+    return TEE_SUCCESS;
 }
 
 static const struct time_source system_time_source = {
+#ifdef CONFIG_OPTEE_TIME_SOURCE_PERF
+    .name = "perf counter",
+#else
     .name = "system time",
+#endif
     .protection_level = 1000,
     .get_sys_time = get_time_system,
 };
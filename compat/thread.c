@@ -17,19 +17,113 @@
  * limitations under the License.
  */
 
+#include <kernel/panic.h>
 #include <kernel/thread.h>
+#include <kernel/tee_ta_manager.h>
 #include <kernel/thread_private.h>
+#include <kernel/ts_manager.h>
+#include <mem_budget.h>
 #include <mm/mobj.h>
 #include <nuttx/irq.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/types.h>
+#include <tee_time_system.h>
 #include <util.h>
 
-static struct thread_specific_data tsd;
-/* the "struct thread_shm_cache" is a single linked list
- * consists of thread_shm_cache_entry
+#ifdef CONFIG_OPTEE_RPC_SHM_CACHE_ENTRIES
+#define THREAD_SHM_CACHE_ENTRIES CONFIG_OPTEE_RPC_SHM_CACHE_ENTRIES
+#else
+#define THREAD_SHM_CACHE_ENTRIES 2
+#endif
+
+/* Upper bound of enum thread_shm_cache_user, the cache is indexed by it */
+#define THREAD_SHM_CACHE_USERS 8
+
+struct thread_shm_cache_slot {
+    struct mobj* mobj;
+    size_t size;
+    enum thread_shm_type type;
+    unsigned int last_used;
+};
+
+/* Each pthread entering the TEE owns its thread specific data and RPC
+ * shm cache, they are allocated on first use and released when the
+ * pthread exits. The cache keeps a few buffers per user, shm_cache is
+ * only the handle thread_rpc_shm_cache_clear() is called with.
  */
-static struct thread_shm_cache shm_cache;
+struct thread_local {
+    struct thread_specific_data tsd;
+    struct thread_shm_cache shm_cache;
+    struct thread_shm_cache_slot shm_slots[THREAD_SHM_CACHE_USERS][THREAD_SHM_CACHE_ENTRIES];
+    unsigned int shm_tick;
+    struct thread_cancel* cancel;
+};
+
+static pthread_key_t thread_local_key;
+static pthread_once_t thread_local_once = PTHREAD_ONCE_INIT;
+
+#ifdef CONFIG_OPTEE_RPC_PAYLOAD_CACHE_DEPTH
+#define THREAD_PAYLOAD_CACHE_DEPTH CONFIG_OPTEE_RPC_PAYLOAD_CACHE_DEPTH
+#else
+#define THREAD_PAYLOAD_CACHE_DEPTH 4
+#endif
+
+/* Payload buffer classes are SMALL_PAGE_SIZE << class bytes */
+#define THREAD_PAYLOAD_CLASSES 5
+
+/* The mobj goes first, so payloads can be handed out as a struct mobj */
+struct thread_payload {
+    struct mobj mobj;
+    SLIST_ENTRY(thread_payload) link;
+    int class; /* -1 if larger than the largest class */
+};
+
+SLIST_HEAD(thread_payload_head, thread_payload);
+
+/* Freed payloads, header and buffer together, shared by all pthreads */
+static struct thread_payload_head payload_free[THREAD_PAYLOAD_CLASSES];
+static unsigned int payload_free_count[THREAD_PAYLOAD_CLASSES];
+static size_t payload_free_size;
+static pthread_mutex_t payload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t payload_shrink(size_t bytes);
+static struct mem_budget_cache payload_budget = MEM_BUDGET_CACHE_INITIALIZER("rpc payload", payload_shrink);
+
+/* Guards the abort hooks, the server cancels requests from its own thread */
+static pthread_mutex_t cancel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void thread_local_destroy(void* arg)
+{
+    struct thread_local* tl = arg;
+
+    thread_rpc_shm_cache_clear(&tl->shm_cache);
+    free(tl);
+}
+
+static void thread_local_key_create(void)
+{
+    if (pthread_key_create(&thread_local_key, thread_local_destroy))
+        panic();
+}
+
+static struct thread_local* thread_get_local(void)
+{
+    struct thread_local* tl = NULL;
+
+    pthread_once(&thread_local_once, thread_local_key_create);
+
+    tl = pthread_getspecific(thread_local_key);
+    if (!tl) {
+        tl = calloc(1, sizeof(*tl));
+        if (!tl || pthread_setspecific(thread_local_key, tl))
+            panic();
+
+        TAILQ_INIT(&tl->tsd.sess_stack);
+    }
+
+    return tl;
+}
 
 uint32_t thread_enter_user_mode(unsigned long a0, unsigned long a1,
     unsigned long a2, unsigned long a3, unsigned long user_sp,
@@ -71,79 +165,174 @@ bool thread_is_in_normal_mode(void)
 
 struct thread_specific_data* thread_get_tsd(void)
 {
-    return &tsd;
+    return &thread_get_local()->tsd;
 }
 
 void thread_set_foreign_intr(bool enable)
 {
 }
 
-static void free_payload(struct mobj* mobj)
+static int payload_class(size_t size)
 {
-    if (mobj && mobj->buffer) {
-        free(mobj->buffer);
-        mobj->buffer = NULL;
+    int class = 0;
+
+    while (class < THREAD_PAYLOAD_CLASSES && (SMALL_PAGE_SIZE << class) < size)
+        class++;
+
+    return class < THREAD_PAYLOAD_CLASSES ? class : -1;
+}
+
+struct mobj* thread_payload_alloc(size_t size, bool zero)
+{
+    struct thread_payload* p = NULL;
+    int class = payload_class(size);
+    size_t buf_size = class >= 0 ? SMALL_PAGE_SIZE << class : size;
+    size_t free_size = 0;
+
+    if (class >= 0) {
+        pthread_mutex_lock(&payload_lock);
+        p = SLIST_FIRST(&payload_free[class]);
+        if (p) {
+            SLIST_REMOVE_HEAD(&payload_free[class], link);
+            payload_free_count[class]--;
+            payload_free_size -= buf_size;
+        }
+        free_size = payload_free_size;
+        pthread_mutex_unlock(&payload_lock);
+
+        if (p)
+            mem_budget_update(&payload_budget, free_size);
     }
-    mobj_put(mobj);
+
+    if (!p) {
+        p = malloc(sizeof(*p));
+        if (!p)
+            return NULL;
+
+        p->class = class;
+        p->mobj.pages = NULL;
+        p->mobj.buffer = malloc(buf_size);
+        if (!p->mobj.buffer && mem_budget_reclaim(buf_size))
+            p->mobj.buffer = malloc(buf_size);
+        if (!p->mobj.buffer) {
+            free(p);
+            return NULL;
+        }
+    }
+
+    p->mobj.size = size;
+    if (zero)
+        memset(p->mobj.buffer, 0, size);
+
+    return &p->mobj;
+}
+
+void thread_payload_free(struct mobj* mobj)
+{
+    struct thread_payload* p = NULL;
+
+    if (!mobj)
+        return;
+
+    p = container_of(mobj, struct thread_payload, mobj);
+    if (p->class >= 0) {
+        size_t free_size = 0;
+
+        pthread_mutex_lock(&payload_lock);
+        if (payload_free_count[p->class] < THREAD_PAYLOAD_CACHE_DEPTH) {
+            SLIST_INSERT_HEAD(&payload_free[p->class], p, link);
+            payload_free_count[p->class]++;
+            payload_free_size += SMALL_PAGE_SIZE << p->class;
+            p = NULL;
+        }
+        free_size = payload_free_size;
+        pthread_mutex_unlock(&payload_lock);
+        if (!p) {
+            mem_budget_update(&payload_budget, free_size);
+            return;
+        }
+    }
+
+    free(p->mobj.buffer);
+    free(p);
+}
+
+/* Free all the cached payloads, returns the bytes freed */
+static size_t payload_trim_locked(void)
+{
+    struct thread_payload* p = NULL;
+    size_t freed = payload_free_size;
+    int class = 0;
+
+    for (class = 0; class < THREAD_PAYLOAD_CLASSES; class++) {
+        while ((p = SLIST_FIRST(&payload_free[class]))) {
+            SLIST_REMOVE_HEAD(&payload_free[class], link);
+            free(p->mobj.buffer);
+            free(p);
+        }
+        payload_free_count[class] = 0;
+    }
+    payload_free_size = 0;
+    return freed;
+}
+
+static void payload_trim(void)
+{
+    pthread_mutex_lock(&payload_lock);
+    payload_trim_locked();
+    pthread_mutex_unlock(&payload_lock);
+    mem_budget_update(&payload_budget, 0);
+}
+
+static size_t payload_shrink(size_t bytes)
+{
+    size_t freed = 0;
+
+    if (pthread_mutex_trylock(&payload_lock))
+        return 0;
+
+    freed = payload_trim_locked();
+    pthread_mutex_unlock(&payload_lock);
+    mem_budget_update(&payload_budget, 0);
+    return freed;
 }
 
-static void clear_shm_cache_entry(struct thread_shm_cache_entry* ce)
+static void clear_shm_cache_slot(struct thread_shm_cache_slot* slot)
 {
-    if (ce->mobj) {
-        switch (ce->type) {
+    if (slot->mobj) {
+        switch (slot->type) {
         case THREAD_SHM_TYPE_APPLICATION:
         case THREAD_SHM_TYPE_KERNEL_PRIVATE:
         case THREAD_SHM_TYPE_GLOBAL:
-            free_payload(ce->mobj);
+            thread_payload_free(slot->mobj);
             break;
         default:
             assert(0); /* "can't happen" */
             break;
         }
     }
-    ce->mobj = NULL;
-    ce->size = 0;
+    slot->mobj = NULL;
+    slot->size = 0;
 }
 
-static struct thread_shm_cache_entry*
-get_shm_cache_entry(enum thread_shm_cache_user user)
+static void clear_shm_cache(struct thread_local* tl)
 {
-    struct thread_shm_cache* cache = &shm_cache;
-    struct thread_shm_cache_entry* ce = NULL;
-
-    SLIST_FOREACH(ce, cache, link)
-    if (ce->user == user)
-        return ce;
+    size_t i = 0;
+    size_t j = 0;
 
-    ce = calloc(1, sizeof(*ce));
-    if (ce) {
-        ce->user = user;
-        SLIST_INSERT_HEAD(cache, ce, link);
-    }
-
-    return ce;
+    for (i = 0; i < THREAD_SHM_CACHE_USERS; i++)
+        for (j = 0; j < THREAD_SHM_CACHE_ENTRIES; j++)
+            clear_shm_cache_slot(&tl->shm_slots[i][j]);
 }
 
 static struct mobj* alloc_shm(enum thread_shm_type shm_type, size_t size)
 {
-    struct mobj* allocated_mobj = NULL;
     switch (shm_type) {
     case THREAD_SHM_TYPE_APPLICATION:
     case THREAD_SHM_TYPE_KERNEL_PRIVATE:
     case THREAD_SHM_TYPE_GLOBAL:
-        allocated_mobj = malloc(sizeof(struct mobj));
-        if (!allocated_mobj) {
-            return NULL;
-        }
-        memset(allocated_mobj, 0, sizeof(struct mobj));
-        allocated_mobj->size = size;
-        allocated_mobj->buffer = malloc(size);
-        if (!allocated_mobj->buffer) {
-            free(allocated_mobj);
-            return NULL;
-        }
-        memset(allocated_mobj->buffer, 0, size);
-        return allocated_mobj;
+        /* Reused cache entries aren't cleared either, callers fill it */
+        return thread_payload_alloc(size, false);
     default:
         return NULL;
     }
@@ -153,16 +342,18 @@ void* thread_rpc_shm_cache_alloc(enum thread_shm_cache_user user,
     enum thread_shm_type shm_type,
     size_t size, struct mobj** mobj)
 {
-    struct thread_shm_cache_entry* ce = NULL;
+    struct thread_local* tl = NULL;
+    struct thread_shm_cache_slot* slots = NULL;
+    struct thread_shm_cache_slot* slot = NULL;
+    struct thread_shm_cache_slot* victim = NULL;
     size_t sz = size;
+    size_t i = 0;
     void* va = NULL;
 
-    if (!size)
+    if (!size || (unsigned int)user >= THREAD_SHM_CACHE_USERS)
         return NULL;
 
-    ce = get_shm_cache_entry(user);
-    if (!ce)
-        return NULL;
+    tl = thread_get_local();
 
     /*
      * Always allocate in page chunks as normal world allocates payload
@@ -170,41 +361,142 @@ void* thread_rpc_shm_cache_alloc(enum thread_shm_cache_user user,
      */
     sz = ROUNDUP(size, SMALL_PAGE_SIZE);
 
-    if (ce->type != shm_type || sz > ce->size) {
-        clear_shm_cache_entry(ce);
+    /* Take the smallest buffer that fits, else refill an empty or the
+     * least recently used slot.
+     */
+    slots = tl->shm_slots[user];
+    for (i = 0; i < THREAD_SHM_CACHE_ENTRIES; i++) {
+        struct thread_shm_cache_slot* s = &slots[i];
 
-        ce->mobj = alloc_shm(shm_type, sz);
-        if (!ce->mobj)
-            return NULL;
+        if (!s->mobj) {
+            if (!victim || victim->mobj)
+                victim = s;
+            continue;
+        }
+        if (s->type == shm_type && s->size >= sz
+            && (!slot || s->size < slot->size))
+            slot = s;
+        if (!victim || (victim->mobj && s->last_used < victim->last_used))
+            victim = s;
+    }
 
-        va = mobj_get_va(ce->mobj, 0, sz);
-        if (!va)
-            goto err;
+    if (!slot) {
+        slot = victim;
+        clear_shm_cache_slot(slot);
 
-        ce->size = sz;
-        ce->type = shm_type;
-    } else {
-        va = mobj_get_va(ce->mobj, 0, sz);
-        if (!va)
-            goto err;
+        slot->mobj = alloc_shm(shm_type, sz);
+        if (!slot->mobj) {
+            /* Give back what this thread caches and try once more */
+            thread_rpc_shm_cache_trim();
+            slot->mobj = alloc_shm(shm_type, sz);
+            if (!slot->mobj)
+                return NULL;
+        }
+        slot->size = sz;
+        slot->type = shm_type;
+    }
+
+    va = mobj_get_va(slot->mobj, 0, sz);
+    if (!va) {
+        clear_shm_cache_slot(slot);
+        return NULL;
     }
-    *mobj = ce->mobj;
+
+    slot->last_used = ++tl->shm_tick;
+    *mobj = slot->mobj;
 
     return va;
-err:
-    clear_shm_cache_entry(ce);
-    return NULL;
 }
 
 void thread_rpc_shm_cache_clear(struct thread_shm_cache* cache)
 {
-    while (true) {
-        struct thread_shm_cache_entry* ce = SLIST_FIRST(cache);
+    clear_shm_cache(container_of(cache, struct thread_local, shm_cache));
+}
 
-        if (!ce)
-            break;
-        SLIST_REMOVE_HEAD(cache, link);
-        clear_shm_cache_entry(ce);
-        free(ce);
+/* The caches of the other threads are left alone, a thread short of
+ * memory must not empty the cache every other thread serves requests from
+ */
+void thread_rpc_shm_cache_trim(void)
+{
+    clear_shm_cache(thread_get_local());
+    payload_trim();
+}
+
+void thread_cancel_init(struct thread_cancel* c, uint32_t timeout_ms)
+{
+    c->deadline = timeout_ms ? tee_time_system_ns() + timeout_ms * 1000000ull : 0;
+    c->cancelled = false;
+    c->abort = NULL;
+    c->abort_arg = NULL;
+}
+
+void thread_set_cancel(struct thread_cancel* c)
+{
+    thread_get_local()->cancel = c;
+}
+
+void thread_cancel_fire(struct thread_cancel* c)
+{
+    pthread_mutex_lock(&cancel_lock);
+    __atomic_store_n(&c->cancelled, true, __ATOMIC_RELAXED);
+    if (c->abort)
+        c->abort(c->abort_arg);
+    pthread_mutex_unlock(&cancel_lock);
+}
+
+bool thread_cancel_fired(struct thread_cancel* c)
+{
+    return __atomic_load_n(&c->cancelled, __ATOMIC_RELAXED);
+}
+
+/* Past the deadline the request is taken for cancelled even if nobody
+ * watches the clock for it
+ */
+static bool thread_cancel_expired(struct thread_cancel* c)
+{
+    if (thread_cancel_fired(c))
+        return true;
+
+    if (c->deadline && tee_time_system_ns() >= c->deadline) {
+        __atomic_store_n(&c->cancelled, true, __ATOMIC_RELAXED);
+        return true;
     }
+
+    return false;
+}
+
+bool thread_cancel_requested(void)
+{
+    struct thread_cancel* c = thread_get_local()->cancel;
+    struct ts_session* s = NULL;
+
+    if (!c)
+        return false;
+
+    if (thread_cancel_expired(c))
+        return true;
+
+    s = ts_get_current_session_may_fail();
+    return s && tee_ta_session_is_cancelled(to_ta_session(s), NULL);
+}
+
+bool thread_cancel_set_abort(void (*abort)(void* arg), void* arg)
+{
+    struct thread_cancel* c = thread_get_local()->cancel;
+    bool ret = true;
+
+    if (!c)
+        return true;
+
+    pthread_mutex_lock(&cancel_lock);
+    if (abort)
+        ret = !thread_cancel_expired(c);
+    else
+        ret = !c->abort || !thread_cancel_fired(c);
+
+    c->abort = ret ? abort : NULL;
+    c->abort_arg = arg;
+    pthread_mutex_unlock(&cancel_lock);
+
+    return ret;
 }
@@ -15,13 +15,17 @@
  * limitations under the License.
  */
 
+#include <fs_worker.h>
 #include <host_fs.h>
+#include <kernel/thread_private.h>
 #include <mm/mobj.h>
 #include <optee_msg.h>
 #include <optee_rpc_cmd.h>
+#include <optee_stats.h>
 #include <rpmb_fs.h>
 #include <tee/tee_cryp_utl.h>
 #include <tee/tee_fs_rpc.h>
+#include <time.h>
 
 static unsigned int thread_rpc_pnum;
 
@@ -54,6 +58,7 @@ static TEE_Result handle_rpmb_op(size_t num_params, struct thread_param* params)
 
 static TEE_Result handle_fs_op(size_t num_params, struct thread_param* params)
 {
+    uint64_t start = optee_stats_now();
     TEE_Result res;
     if (num_params == 0) {
         res = TEE_ERROR_BAD_PARAMETERS;
@@ -91,18 +96,83 @@ static TEE_Result handle_fs_op(size_t num_params, struct thread_param* params)
         break;
     }
 
+    optee_stats_record(OPTEE_STATS_FS, cmd, start, res);
 out:
     return res;
 }
 
+/* REE wall clock time, seconds and nanoseconds since the epoch */
+static TEE_Result handle_get_time(size_t num_params,
+    struct thread_param* params)
+{
+    struct timespec ts;
+
+    if (num_params != 1 || params[0].attr != THREAD_PARAM_ATTR_VALUE_OUT) {
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+
+    if (clock_gettime(CLOCK_REALTIME, &ts) != 0) {
+        return TEE_ERROR_GENERIC;
+    }
+
+    params[0].u.value.a = ts.tv_sec;
+    params[0].u.value.b = ts.tv_nsec;
+    params[0].u.value.c = 0;
+    return TEE_SUCCESS;
+}
+
+#ifdef CONFIG_OPTEE_FS_WORKER
+struct fs_op_call {
+    size_t num_params;
+    struct thread_param* params;
+};
+
+static TEE_Result fs_op_call(void* arg)
+{
+    struct fs_op_call* call = arg;
+
+    return handle_fs_op(call->num_params, call->params);
+}
+
+/* Run on the I/O worker, so the flash access does not use the TEE thread stack
+ * and is serialized with the asynchronous secure storage writes.
+ */
+static TEE_Result handle_fs_op_worker(size_t num_params,
+    struct thread_param* params)
+{
+    struct fs_op_call call = { num_params, params };
+    struct fs_worker_req req;
+
+    fs_worker_submit(&req, fs_op_call, &call);
+    return fs_worker_wait(&req);
+}
+#endif
+
+static bool thread_rpc_is_fs_close(uint32_t cmd, size_t num_params,
+    struct thread_param* params)
+{
+    return cmd == OPTEE_RPC_CMD_FS && num_params > 0
+        && params[0].attr == THREAD_PARAM_ATTR_VALUE_IN
+        && params[0].u.value.a == OPTEE_RPC_FS_CLOSE;
+}
+
 uint32_t thread_rpc_cmd(uint32_t cmd, size_t num_params,
     struct thread_param* params)
 {
+    uint64_t start = optee_stats_now();
     TEE_Result res;
     /* The source CRYPTO_RNG_SRC_JITTER_RPC is safe to use here */
     plat_prng_add_jitter_entropy(CRYPTO_RNG_SRC_JITTER_RPC,
         &thread_rpc_pnum);
 
+    /* A cancelled request stops at its next RPC, closing a file still goes
+     * through so the TA doesn't leak it on the way out
+     */
+    if (thread_cancel_requested() && !thread_rpc_is_fs_close(cmd, num_params, params)) {
+        optee_stats_record(OPTEE_STATS_RPC, cmd, start, TEE_ERROR_CANCEL);
+        return TEE_ERROR_CANCEL;
+    }
+
     switch (cmd) {
     case OPTEE_RPC_CMD_LOAD_TA:
         res = TEE_ERROR_NOT_SUPPORTED;
@@ -113,48 +183,30 @@ uint32_t thread_rpc_cmd(uint32_t cmd, size_t num_params,
         break;
 #endif
     case OPTEE_RPC_CMD_FS:
+#ifdef CONFIG_OPTEE_FS_WORKER
+        res = handle_fs_op_worker(num_params, params);
+#else
         res = handle_fs_op(num_params, params);
+#endif
         break;
     case OPTEE_RPC_CMD_GET_TIME:
-        res = TEE_ERROR_NOT_SUPPORTED;
+        res = handle_get_time(num_params, params);
         break;
     default:
         res = TEE_ERROR_NOT_SUPPORTED;
         break;
     }
 
+    optee_stats_record(OPTEE_STATS_RPC, cmd, start, res);
     return res;
 }
 
 void thread_rpc_free_payload(struct mobj* mobj)
 {
-    if (mobj == NULL) {
-        return;
-    }
-
-    if (mobj->buffer != NULL) {
-        free(mobj->buffer);
-    }
-
-    free(mobj);
+    thread_payload_free(mobj);
 }
 
 struct mobj* thread_rpc_alloc_payload(size_t size)
 {
-    struct mobj* obj = (struct mobj*)malloc(sizeof(struct mobj));
-    if (obj == NULL) {
-        goto out;
-    }
-
-    obj->buffer = malloc(size);
-    if (obj->buffer == NULL) {
-        free(obj);
-        obj = NULL;
-        goto out;
-    }
-
-    obj->size = size;
-
-out:
-    return obj;
+    return thread_payload_alloc(size, false);
 }
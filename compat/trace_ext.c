@@ -16,8 +16,10 @@
 
 #include <nuttx/arch.h>
 #include <nuttx/sched.h>
+#include <string.h>
 #include <syslog.h>
 #include <trace.h>
+#include <trace_ring.h>
 
 const char trace_ext_prefix[] = "TC";
 int trace_level = TRACE_LEVEL;
@@ -34,11 +36,35 @@ int trace_ext_get_thread_id(void)
 
 #if TRACE_LEVEL > 0
 
+#ifdef CONFIG_OPTEE_TRACE_RING
+
+/* Lines go to the trace ring instead of syslog, error lines ("E/...")
+ * are logged right away as well so they are never lost
+ */
+
+void trace_ext_puts(const char* str)
+{
+    size_t len = strlen(str);
+
+    if (str[0] == 'E' && str[1] == '/') {
+        syslog(LOG_ERR, "%s", str);
+    }
+
+    while (len > 0 && str[len - 1] == '\n') {
+        len--;
+    }
+    trace_ring_text(str, len);
+}
+
+#else
+
 void trace_ext_puts(const char* str)
 {
     syslog(LOG_INFO, "%s", str);
 }
 
+#endif
+
 #else
 
 void trace_ext_puts(const char* str)
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2020-2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <initcall.h>
+#include <inttypes.h>
+#include <optee_procfs.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <tee_time_system.h>
+#include <trace.h>
+#include <trace_ring.h>
+#include <util.h>
+
+#ifdef CONFIG_OPTEE_TRACE_RING_ENTRIES
+#define TRACE_RING_ENTRIES CONFIG_OPTEE_TRACE_RING_ENTRIES
+#else
+#define TRACE_RING_ENTRIES 512
+#endif
+
+#if TRACE_RING_ENTRIES & (TRACE_RING_ENTRIES - 1)
+#error "CONFIG_OPTEE_TRACE_RING_ENTRIES must be a power of two"
+#endif
+
+#define TRACE_RING_TEXT 40
+#define TRACE_RING_TEXT_RECS 8
+#define TRACE_RING_LINE_SIZE (TRACE_RING_TEXT * TRACE_RING_TEXT_RECS + 64)
+
+/*
+ * A flight recorder: writers claim records with one atomic add and
+ * overwrite the oldest ones, nothing is ever allocated or waited for.
+ * seq is the claimed index + 1 once the record is complete and 0 while
+ * it is written, readers drop records whose seq changes under them.
+ */
+struct trace_ring_rec {
+    uint64_t ts;
+    uint32_t seq;
+    uint32_t thread;
+    uint16_t id;
+    uint8_t core;
+    uint8_t len;
+    union {
+        uintptr_t args[TRACE_RING_ARGS];
+        char text[TRACE_RING_TEXT];
+    };
+};
+
+typedef void (*trace_ring_line_fn)(void* arg, const char* line, size_t len);
+
+static struct trace_ring_rec trace_ring[TRACE_RING_ENTRIES];
+static uint32_t trace_ring_head;
+
+static struct trace_ring_rec* trace_ring_begin(uint32_t idx, uint16_t id,
+    uint64_t ts, uint8_t core, uint32_t thread)
+{
+    struct trace_ring_rec* rec = &trace_ring[idx & (TRACE_RING_ENTRIES - 1)];
+
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    rec->ts = ts;
+    rec->thread = thread;
+    rec->id = id;
+    rec->core = core;
+    return rec;
+}
+
+static void trace_ring_commit(struct trace_ring_rec* rec, uint32_t idx)
+{
+    __atomic_store_n(&rec->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+void trace_ring_event(uint16_t id, uintptr_t a0, uintptr_t a1, uintptr_t a2,
+    uintptr_t a3)
+{
+    uint32_t idx = __atomic_fetch_add(&trace_ring_head, 1, __ATOMIC_RELAXED);
+    struct trace_ring_rec* rec = trace_ring_begin(idx, id, tee_time_system_ns(),
+        trace_ext_get_core_id(), trace_ext_get_thread_id());
+
+    rec->len = 0;
+    rec->args[0] = a0;
+    rec->args[1] = a1;
+    rec->args[2] = a2;
+    rec->args[3] = a3;
+    trace_ring_commit(rec, idx);
+}
+
+void trace_ring_text(const char* str, size_t len)
+{
+    uint32_t n = MIN(DIV_ROUND_UP(MAX(len, 1), TRACE_RING_TEXT),
+        TRACE_RING_TEXT_RECS);
+    uint32_t idx = __atomic_fetch_add(&trace_ring_head, n, __ATOMIC_RELAXED);
+    uint64_t ts = tee_time_system_ns();
+    uint8_t core = trace_ext_get_core_id();
+    uint32_t thread = trace_ext_get_thread_id();
+    uint32_t i = 0;
+
+    /* Lines too long for TRACE_RING_TEXT_RECS records are cut */
+    for (i = 0; i < n; i++) {
+        struct trace_ring_rec* rec = trace_ring_begin(idx + i,
+            i ? TRACE_RING_EV_TEXT_CONT : TRACE_RING_EV_TEXT, ts, core, thread);
+        size_t chunk = MIN(len, TRACE_RING_TEXT);
+
+        memcpy(rec->text, str, chunk);
+        rec->len = chunk;
+        str += chunk;
+        len -= chunk;
+        trace_ring_commit(rec, idx + i);
+    }
+}
+
+static bool trace_ring_read(uint32_t idx, struct trace_ring_rec* out)
+{
+    const struct trace_ring_rec* rec = &trace_ring[idx & (TRACE_RING_ENTRIES - 1)];
+
+    if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != idx + 1) {
+        return false;
+    }
+
+    memcpy(out, rec, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == idx + 1;
+}
+
+/* Hand the records still in the ring to fn as text lines, oldest first,
+ * a trace line and its continuation records make a single line
+ */
+static void trace_ring_walk(trace_ring_line_fn fn, void* arg)
+{
+    uint32_t head = __atomic_load_n(&trace_ring_head, __ATOMIC_ACQUIRE);
+    uint32_t idx = head - MIN(head, TRACE_RING_ENTRIES);
+    struct trace_ring_rec rec;
+    char line[TRACE_RING_LINE_SIZE];
+    size_t len = 0;
+    bool text = false;
+
+    for (; idx != head; idx++) {
+        if (!trace_ring_read(idx, &rec)) {
+            continue;
+        }
+
+        if (rec.id == TRACE_RING_EV_TEXT_CONT) {
+            if (text && len + rec.len < sizeof(line)) {
+                memcpy(line + len, rec.text, rec.len);
+                len += rec.len;
+            }
+            continue;
+        }
+
+        if (text) {
+            fn(arg, line, len);
+            text = false;
+        }
+
+        len = snprintf(line, sizeof(line), "%" PRIu64 " %u %" PRIu32 " %u ",
+            rec.ts, rec.core, rec.thread, rec.id);
+        if (rec.id == TRACE_RING_EV_TEXT) {
+            memcpy(line + len, rec.text, rec.len);
+            len += rec.len;
+            text = true;
+        } else {
+            len += snprintf(line + len, sizeof(line) - len,
+                "0x%" PRIxPTR " 0x%" PRIxPTR " 0x%" PRIxPTR " 0x%" PRIxPTR,
+                rec.args[0], rec.args[1], rec.args[2], rec.args[3]);
+            fn(arg, line, len);
+        }
+    }
+
+    if (text) {
+        fn(arg, line, len);
+    }
+}
+
+struct trace_ring_buf {
+    char* buf;
+    size_t size;
+    size_t len;
+};
+
+static void trace_ring_format_line(void* arg, const char* line, size_t len)
+{
+    struct trace_ring_buf* b = arg;
+
+    if (b->len < b->size) {
+        snprintf(b->buf + b->len, b->size - b->len, "%.*s\n", (int)len, line);
+    }
+    b->len += len + 1;
+}
+
+size_t trace_ring_format(char* buf, size_t size)
+{
+    struct trace_ring_buf b = { buf, size, 0 };
+    const char* header = "# ts_ns core thread id text|args";
+
+    trace_ring_format_line(&b, header, strlen(header));
+    trace_ring_walk(trace_ring_format_line, &b);
+    return b.len;
+}
+
+static void trace_ring_dump_line(void* arg, const char* line, size_t len)
+{
+    syslog(LOG_INFO, "%.*s\n", (int)len, line);
+}
+
+void trace_ring_dump(void)
+{
+    trace_ring_walk(trace_ring_dump_line, NULL);
+}
+
+#ifdef CONFIG_FS_PROCFS_REGISTER
+static TEE_Result trace_ring_init(void)
+{
+    optee_procfs_register("optee/trace", trace_ring_format);
+    return TEE_SUCCESS;
+}
+
+service_init_late(trace_ring_init);
+#endif
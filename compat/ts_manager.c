@@ -22,19 +22,20 @@
 #include <kernel/ts_manager.h>
 #include <kernel/user_mode_ctx.h>
 
-static TAILQ_HEAD(, ts_session) sess_stack;
-
 void ts_push_current_session(struct ts_session* s)
 {
-    TAILQ_INSERT_HEAD(&sess_stack, s, link_tsd);
+    struct thread_specific_data* tsd = thread_get_tsd();
+
+    TAILQ_INSERT_HEAD(&tsd->sess_stack, s, link_tsd);
 }
 
 struct ts_session* ts_pop_current_session(void)
 {
-    struct ts_session* s = TAILQ_FIRST(&sess_stack);
+    struct thread_specific_data* tsd = thread_get_tsd();
+    struct ts_session* s = TAILQ_FIRST(&tsd->sess_stack);
 
     if (s) {
-        TAILQ_REMOVE(&sess_stack, s, link_tsd);
+        TAILQ_REMOVE(&tsd->sess_stack, s, link_tsd);
     }
     return s;
 }
@@ -46,7 +47,7 @@ struct ts_session* ts_get_calling_session(void)
 
 struct ts_session* ts_get_current_session_may_fail(void)
 {
-    return TAILQ_FIRST(&sess_stack);
+    return TAILQ_FIRST(&thread_get_tsd()->sess_stack);
 }
 
 struct ts_session* ts_get_current_session(void)
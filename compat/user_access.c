@@ -22,6 +22,17 @@
 #include <tee_api_types.h>
 #include <types_ext.h>
 
+/* The out of line helpers stay for the callers built without the inline
+ * ones of CONFIG_OPTEE_USER_ACCESS_DIRECT
+ */
+
+#undef copy_from_user
+#undef copy_to_user
+#undef copy_from_user_private
+#undef copy_to_user_private
+#undef kaddr_to_uref
+#undef uref_to_vaddr
+
 TEE_Result copy_from_user(void* kaddr, const void* uaddr, size_t len)
 {
     memcpy(kaddr, uaddr, len);
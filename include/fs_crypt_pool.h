@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FS_CRYPT_POOL_H
+#define FS_CRYPT_POOL_H
+
+#include <stddef.h>
+#include <tee_api_types.h>
+
+/* Run fn(arg, index) for every index below count, spread over the crypt
+ * workers and the calling thread, returns the first error. The job runs
+ * in place when the pool is busy with another caller or cannot be started.
+ */
+
+TEE_Result fs_crypt_pool_run(TEE_Result (*fn)(void* arg, size_t index),
+    void* arg, size_t count);
+
+#endif /* FS_CRYPT_POOL_H */
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FS_WORKER_H
+#define FS_WORKER_H
+
+#include <stdbool.h>
+#include <sys/queue.h>
+#include <tee_api_types.h>
+
+/*
+ * struct fs_worker_req - file system call run by the I/O worker, owned by
+ * the submitter until fs_worker_wait() returns
+ * @link:	Link in the worker queue
+ * @fn:		Function to run on the worker
+ * @arg:	Argument passed to fn
+ * @res:	Result of fn
+ * @done:	True once fn has returned
+ */
+struct fs_worker_req {
+    STAILQ_ENTRY(fs_worker_req) link;
+    TEE_Result (*fn)(void* arg);
+    void* arg;
+    TEE_Result res;
+    bool done;
+};
+
+/* Queue fn(arg) in order behind the calls already submitted, waits while
+ * the queue is full, runs it in place if the worker cannot be started
+ */
+
+void fs_worker_submit(struct fs_worker_req* req, TEE_Result (*fn)(void* arg),
+    void* arg);
+
+/* Wait for a submitted call, returns its result */
+
+TEE_Result fs_worker_wait(struct fs_worker_req* req);
+
+#endif /* FS_WORKER_H */
@@ -24,4 +24,21 @@ int hmac_memory(int hash,
     const unsigned char* in, unsigned long inlen,
     unsigned char* out, unsigned long* outlen);
 
+/* Streaming HMAC for data that doesn't fit in one buffer. init returns a
+ * handle, or -1 once the owner has 8 streams open, final releases it.
+ * Handles are only valid for the owner (the WASM instance) that opened
+ * them, hmac_stream_release() frees those it left open.
+ */
+
+int hmac_stream_init(const void* owner, int hash,
+    const unsigned char* key, unsigned long keylen);
+
+int hmac_stream_update(const void* owner, int handle,
+    const unsigned char* in, unsigned long inlen);
+
+int hmac_stream_final(const void* owner, int handle,
+    unsigned char* out, unsigned long* outlen);
+
+void hmac_stream_release(const void* owner);
+
 #endif /* HMAC_MEMORY_H */
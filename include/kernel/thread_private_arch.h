@@ -19,4 +19,68 @@
 #ifndef __KERNEL_THREAD_PRIVATE_ARCH_H
 #define __KERNEL_THREAD_PRIVATE_ARCH_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct mobj;
+
+/*
+ * Allocate an RPC payload of @size bytes, zeroed only if @zero is true.
+ * Buffers up to 64 KiB come from page sized classes and are kept for
+ * reuse when freed with thread_payload_free().
+ */
+struct mobj *thread_payload_alloc(size_t size, bool zero);
+
+void thread_payload_free(struct mobj *mobj);
+
+/*
+ * Release cached RPC payloads on memory pressure: the RPC shm cache of the
+ * calling thread, then the freed payload lists shared by all threads.
+ */
+void thread_rpc_shm_cache_trim(void);
+
+/*
+ * struct thread_cancel - cancellation of a request served by the TEE
+ * @deadline:	tee_time_system_ns() past which the request is cancelled,
+ *		0 for none
+ * @cancelled:	Set once the request is cancelled
+ * @abort:	Stops the TA entry point the request is in, set only while
+ *		that entry point runs
+ * @abort_arg:	Argument of @abort
+ */
+struct thread_cancel {
+	uint64_t deadline;
+	bool cancelled;
+	void (*abort)(void *arg);
+	void *abort_arg;
+};
+
+/* Arm c for a request due within timeout_ms, 0 for no deadline */
+void thread_cancel_init(struct thread_cancel *c, uint32_t timeout_ms);
+
+/* Attach c to the request the calling thread runs next, NULL detaches */
+void thread_set_cancel(struct thread_cancel *c);
+
+/*
+ * Cancel c from any thread. The TA entry point it runs, if any, is
+ * aborted, the RPCs it issues from then on fail with TEE_ERROR_CANCEL.
+ */
+void thread_cancel_fire(struct thread_cancel *c);
+
+bool thread_cancel_fired(struct thread_cancel *c);
+
+/*
+ * True once the request of the calling thread is cancelled, is past its
+ * deadline or its session got an unmasked OPTEE_MSG_CMD_CANCEL.
+ */
+bool thread_cancel_requested(void);
+
+/*
+ * Set the abort hook of the request of the calling thread, NULL clears
+ * it. Returns false, without setting a hook, if the request is already
+ * cancelled, or when clearing if it was cancelled while the hook was set.
+ */
+bool thread_cancel_set_abort(void (*abort)(void *arg), void *arg);
+
 #endif /*__KERNEL_THREAD_PRIVATE_ARCH_H*/
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2014, STMicroelectronics International N.V.
+ * Copyright (c) 2015-2020, 2022 Linaro Limited
+ * Copyright (C) 2020-2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __KERNEL_USER_ACCESS_COMPAT_H
+#define __KERNEL_USER_ACCESS_COMPAT_H
+
+#include_next <kernel/user_access.h>
+
+#ifdef CONFIG_OPTEE_USER_ACCESS_DIRECT
+#include <stdint.h>
+#include <string.h>
+#include <tee_api_types.h>
+#include <types_ext.h>
+
+/*
+ * TAs and the core share one flat address space and a TA waits for the
+ * whole syscall, so a user buffer is used like a kernel one once it is
+ * known not to wrap around. The copies are done inline, and skipped when
+ * the caller already works on the user buffer itself.
+ */
+static inline TEE_Result user_access_copy(void *dst, const void *src,
+					  const void *uaddr, size_t len)
+{
+	if (len && (!uaddr || (uintptr_t)uaddr + len < (uintptr_t)uaddr))
+		return TEE_ERROR_ACCESS_DENIED;
+
+	if (dst != src)
+		memcpy(dst, src, len);
+	return TEE_SUCCESS;
+}
+
+#define copy_from_user(kaddr, uaddr, len) \
+	user_access_copy((kaddr), (uaddr), (uaddr), (len))
+#define copy_to_user(uaddr, kaddr, len) \
+	user_access_copy((uaddr), (kaddr), (uaddr), (len))
+#define copy_from_user_private(kaddr, uaddr, len) \
+	copy_from_user(kaddr, uaddr, len)
+#define copy_to_user_private(uaddr, kaddr, len) \
+	copy_to_user(uaddr, kaddr, len)
+#define kaddr_to_uref(kaddr) ((uint32_t)(vaddr_t)(kaddr))
+#define uref_to_vaddr(uref) ((vaddr_t)(uref))
+#endif
+
+#endif /*__KERNEL_USER_ACCESS_COMPAT_H*/
@@ -18,7 +18,9 @@
 #include <types_ext.h>
 #include <util.h>
 #ifdef USER_TA_WASM
+#include <user_ta_wasm_cache.h>
 #include <user_ta_wasm_header.h>
+#include <user_ta_wasm_mem.h>
 #include <wasm_export.h>
 #endif
 
@@ -47,14 +49,26 @@ struct user_ta_ctx {
 	struct tee_ta_ctx ta_ctx;
 #ifdef USER_TA_WASM
 	/* the following fileds are for wasm ta implementation */
+	struct wasm_module_cache_entry *module_entry;
 	wasm_module_t wasm_module;
 	wasm_module_inst_t wasm_module_inst;
-	wasm_function_inst_t func;
+	/* entry points, resolved once when the module is instantiated */
+	wasm_function_inst_t create_entry;
+	wasm_function_inst_t destroy_entry;
+	wasm_function_inst_t open_session_entry;
+	wasm_function_inst_t close_session_entry;
+	wasm_function_inst_t invoke_command_entry;
 	wasm_exec_env_t exec_env;
-	uint8_t *wasm_file_buffer;
-	uint32_t wasm_file_size;
+	/* runtime memory charged to the TA */
+	struct wasm_mem_stats *mem_stats;
+	/* region in the app heap the entry point params are staged in */
+	uint32_t param_stage;
+	uint32_t param_stage_size;
 	uint32_t stack_size;
-	bool is_xip_file;
+	/* stack and app heap, charged to the keep-alive budget when idle */
+	uint32_t instance_size;
+	/* TA_CreateEntryPoint succeeded and no TA_DestroyEntryPoint since */
+	bool is_created;
 #endif
 };
 
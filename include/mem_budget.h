@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MEM_BUDGET_H
+#define MEM_BUDGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+/*
+ * struct mem_budget_cache - a cache accounted in the memory budget
+ * @link:	Link in the list of registered caches
+ * @name:	Name of the cache, for the traces
+ * @shrink:	Free at least bytes of the cache if it can, returns the bytes
+ *		freed. It runs on allocation failures with whatever locks the
+ *		failing caller holds, so it must only trylock the cache.
+ * @size:	Bytes the cache holds, as last reported
+ * @gen:	Reclaim pass the cache was last shrunk in
+ * @registered:	True once the cache is in the list
+ */
+struct mem_budget_cache {
+    SLIST_ENTRY(mem_budget_cache) link;
+    const char* name;
+    size_t (*shrink)(size_t bytes);
+    size_t size;
+    uint32_t gen;
+    bool registered;
+};
+
+#define MEM_BUDGET_CACHE_INITIALIZER(n, fn) \
+    {                                       \
+        .name = (n), .shrink = (fn),        \
+    }
+
+#ifdef CONFIG_OPTEE_MEM_BUDGET
+
+/* Report the bytes the cache holds now, registering it on the first call.
+ * Above CONFIG_OPTEE_MEM_BUDGET_CEILING the caches are shrunk back to it.
+ */
+
+void mem_budget_update(struct mem_budget_cache* cache, size_t size);
+
+/* Shrink the caches, largest first, until bytes are freed. Returns true if
+ * anything was freed and a failed allocation is worth retrying.
+ */
+
+bool mem_budget_reclaim(size_t bytes);
+
+#else
+
+static inline void mem_budget_update(struct mem_budget_cache* cache,
+    size_t size)
+{
+}
+
+static inline bool mem_budget_reclaim(size_t bytes)
+{
+    return false;
+}
+
+#endif
+
+#endif /* MEM_BUDGET_H */
@@ -20,6 +20,10 @@
 
 #include <tee_api_types.h>
 #include <crypto/crypto.h>
+#include <crypto/internal_aes-gcm.h>
+#ifdef CONFIG_OPTEE_CRYPTO_MBEDTLS
+#include <mbedtls/gcm.h>
+#endif
 
 /*
  * Verifies a SHA-256 hash, doesn't require tee_cryp_init() to be called in
@@ -69,4 +73,39 @@ void mitee_crypto_authenc_final(void *ctx, uint32_t algo);
 
 void mitee_crypto_authenc_free_ctx(void *ctx, uint32_t algo);
 
+/*
+ * One-shot AES-GCM with a key expanded once up front, for callers that
+ * run many operations under the same key. mbedTLS contexts can't be
+ * copied around, with that backend the key is kept as is and each
+ * operation runs the whole mbedtls_gcm_setkey() again, key expansion and
+ * GHASH table included.
+ */
+#ifdef CONFIG_OPTEE_CRYPTO_MBEDTLS
+struct mitee_aes_gcm_key {
+	uint8_t key[32];
+	size_t key_len;
+};
+#else
+struct mitee_aes_gcm_key {
+	struct internal_aes_gcm_key key;
+};
+#endif
+
+TEE_Result mitee_crypto_aes_gcm_expand_key(const uint8_t *key, size_t key_len,
+			struct mitee_aes_gcm_key *enc_key);
+
+TEE_Result mitee_crypto_aes_gcm_enc_key(
+			const struct mitee_aes_gcm_key *enc_key,
+			const uint8_t *nonce, size_t nonce_len,
+			const uint8_t *aad, size_t aad_len,
+			const uint8_t *src, size_t len, uint8_t *dst,
+			uint8_t *tag, size_t *tag_len);
+
+TEE_Result mitee_crypto_aes_gcm_dec_key(
+			const struct mitee_aes_gcm_key *enc_key,
+			const uint8_t *nonce, size_t nonce_len,
+			const uint8_t *aad, size_t aad_len,
+			const uint8_t *src, size_t len, uint8_t *dst,
+			const uint8_t *tag, size_t tag_len);
+
 #endif /* MITEE_CRYP_H */
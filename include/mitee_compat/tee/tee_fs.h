@@ -18,12 +18,21 @@
 #ifndef TEE_FS_H
 #define TEE_FS_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <tee_api_types.h>
 
 #define TEE_FS_NAME_MAX 350
 
+/*
+ * Vendor flag of TEE_OpenPersistentObject, the object is going to be read
+ * front to back so its blocks are read ahead from the first read on
+ */
+#ifndef TEE_DATA_FLAG_SEQUENTIAL
+#define TEE_DATA_FLAG_SEQUENTIAL 0x00010000
+#endif
+
 typedef int64_t tee_fs_off_t;
 typedef uint32_t tee_fs_mode_t;
 
@@ -44,8 +53,17 @@ struct tee_file_operations {
 	TEE_Result (*read)(struct tee_file_handle *fh, void *buf, size_t *len);
 	TEE_Result (*write)(struct tee_file_handle *fh, const void *buf,
 			    size_t len);
+	/*
+	 * Optional, a write at the current position that also overwrites
+	 * head_len bytes at head_offs, committed as one transaction
+	 */
+	TEE_Result (*write_head)(struct tee_file_handle *fh, const void *buf,
+				 size_t len, size_t head_offs,
+				 const void *head, size_t head_len);
 	TEE_Result (*seek)(struct tee_file_handle *fh, int32_t offs,
 			   TEE_Whence whence, int32_t *new_offs);
+	/* Optional, the file is read front to back, read ahead of the reads */
+	void (*set_sequential)(struct tee_file_handle *fh, bool sequential);
 	TEE_Result (*rename)(const char *old_name, const char *new_name,
 			     bool overwrite);
 	TEE_Result (*remove)(const char *name);
@@ -58,5 +76,6 @@ struct tee_file_operations {
 };
 
 extern const struct tee_file_operations ree_fs_ops;
+extern const struct tee_file_operations pack_fs_ops;
 
 #endif /* TEE_FS_H */
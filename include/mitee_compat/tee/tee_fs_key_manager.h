@@ -18,6 +18,7 @@
 #ifndef TEE_FS_KEY_MANAGER_H
 #define TEE_FS_KEY_MANAGER_H
 
+#include <mitee_crypt.h>
 #include <tee_api_types.h>
 #include <utee_defines.h>
 
@@ -63,17 +64,36 @@ struct block_header {
 	struct common_header common;
 };
 
+/*
+ * Plaintext FEK of an open file with its AES-GCM key expanded once, so
+ * the blocks only pay for a fresh IV. The file handle owns it and wipes
+ * it with tee_fs_fek_clear() once closed.
+ */
+struct tee_fs_fek {
+	uint8_t fek[TEE_FS_KM_FEK_SIZE];
+	struct mitee_aes_gcm_key key;
+};
+
 size_t tee_fs_get_header_size(enum tee_fs_file_type type);
 TEE_Result tee_fs_generate_fek(const TEE_UUID *uuid, void *buf,
 		size_t buf_size);
+
+TEE_Result tee_fs_fek_unwrap(const TEE_UUID *uuid,
+		const uint8_t *encrypted_fek, struct tee_fs_fek *fek);
+void tee_fs_fek_clear(struct tee_fs_fek *fek);
+
+/*
+ * fek is the unwrapped FEK when the caller already holds it, or NULL to
+ * unwrap encrypted_fek with the TSK of the current TA.
+ */
 TEE_Result tee_fs_encrypt_file(enum tee_fs_file_type file_type,
 		const uint8_t *plaintext, size_t plaintext_size,
 		uint8_t *ciphertext, size_t *ciphertext_size,
-		const uint8_t *encrypted_fek);
+		const uint8_t *encrypted_fek, const struct tee_fs_fek *fek);
 TEE_Result tee_fs_decrypt_file(enum tee_fs_file_type file_type,
 		const uint8_t *data_in, size_t data_in_size,
 		uint8_t *plaintext, size_t *plaintext_size,
-		uint8_t *encrypted_fek);
+		uint8_t *encrypted_fek, const struct tee_fs_fek *fek);
 TEE_Result tee_fs_crypt_block(const TEE_UUID *uuid, uint8_t *out,
 		const uint8_t *in, size_t size, uint16_t blk_idx,
 		const uint8_t *encrypted_fek, TEE_OperationMode mode);
@@ -18,11 +18,25 @@
 #ifndef TEE_FS_RPC_H
 #define TEE_FS_RPC_H
 
+#include <fs_worker.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <tee_api_types.h>
 #include <tee/tee_fs.h>
 
+/*
+ * Read or write started by tee_fs_rpc_read_async() or
+ * tee_fs_rpc_write_async(), buf must stay untouched until tee_fs_rpc_wait()
+ * returns. size is the number of bytes read once a read is waited for.
+ */
+struct tee_fs_rpc_op {
+	struct fs_worker_req req;
+	int fd;
+	void *buf;
+	size_t size;
+	int offs;
+};
+
 TEE_Result tee_fs_rpc_open(const char *file, bool create, int *fd);
 TEE_Result tee_fs_rpc_close(int fd);
 TEE_Result tee_fs_rpc_read(int fd, void *buf, size_t *size, int offs);
@@ -31,5 +45,17 @@ TEE_Result tee_fs_rpc_rename(const char * old_file, const char * new_file,
 			bool overwrite);
 TEE_Result tee_fs_rpc_remove(const char *file);
 TEE_Result tee_fs_rpc_fsync(int fd);
+TEE_Result tee_fs_rpc_fdatasync(int fd);
+TEE_Result tee_fs_rpc_truncate(int fd, size_t len);
+
+/*
+ * With CONFIG_OPTEE_FS_WORKER the read or write runs on the I/O worker
+ * while the caller goes on, otherwise it is done before the call returns.
+ */
+void tee_fs_rpc_read_async(struct tee_fs_rpc_op *op, int fd, void *buf,
+			   size_t size, int offs);
+void tee_fs_rpc_write_async(struct tee_fs_rpc_op *op, int fd, void *buf,
+			    size_t size, int offs);
+TEE_Result tee_fs_rpc_wait(struct tee_fs_rpc_op *op);
 
 #endif /* TEE_FS_RPC_H */
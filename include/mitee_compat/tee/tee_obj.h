@@ -35,6 +35,7 @@ struct tee_obj {
 	struct tee_pobj *pobj;	/* ptr to persistant object */
 	struct tee_file_handle *fh;
 	uint32_t flags;
+	uint32_t cache_gen;	/* object cache generation fh was opened under */
 };
 
 void tee_obj_add(struct user_ta_ctx *utc, struct tee_obj *o);
@@ -25,6 +25,12 @@ extern vaddr_t tee_svc_uref_base;
 TEE_Result tee_svc_copy_kaddr_to_uref(uint32_t *uref, void *kaddr);
 TEE_Result tee_svc_copy_to_user(void *uaddr, const void *kaddr, size_t len);
 
+#ifdef CONFIG_OPTEE_USER_ACCESS_DIRECT
+#include <kernel/user_access.h>
+
+#define tee_svc_copy_to_user(uaddr, kaddr, len) copy_to_user(uaddr, kaddr, len)
+#endif
+
 static inline uint32_t tee_svc_kaddr_to_uref(void *kaddr)
 {
 	return (vaddr_t)kaddr - tee_svc_uref_base;
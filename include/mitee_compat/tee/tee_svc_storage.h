@@ -89,6 +89,15 @@ char *tee_svc_storage_create_filename(struct ts_session *ts_sess,
 				      uint32_t object_id_len,
 				      bool transient);
 
-char *tee_svc_storage_create_dirname(struct ts_session *ts_sess);
+char *tee_svc_storage_create_dirname(struct ts_session *ts_sess,
+				     uint32_t storage_id);
+
+struct tee_obj;
+
+/*
+ * Keep the file handle of a closing read-only object for the next open of
+ * the same object, returns false if the caller has to close it.
+ */
+bool tee_svc_storage_park_fh(struct tee_obj *o);
 
 #endif /* TEE_SVC_STORAGE_H */
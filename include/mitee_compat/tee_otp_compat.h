@@ -24,4 +24,10 @@ TEE_Result tee_otp_get_hw_unique_key_compat(struct tee_hw_unique_key *hwkey,
 			uint8_t *default_key);
 int tee_otp_get_die_id_compat(uint8_t *buffer, size_t len, uint8_t default_key);
 
+/*
+ * huk_subkey_derive() caches the SSK derived from the values above, drop it
+ * so the next call reads the OTP again (e.g. after provisioning, or in tests).
+ */
+void huk_subkey_invalidate(void);
+
 #endif /* TEE_OTP_CMOPAT_H */
@@ -24,11 +24,23 @@
 #include <string_ext.h>
 #include <mm/tee_mm.h>
 
+struct mobj_pages;
+
+/*
+ * A mobj is either a flat buffer or, once pages is set, a list of
+ * OPTEE_MSG_NONCONTIG_PAGE_SIZE pages built from an OPTEE_MSG_ATTR_NONCONTIG
+ * param. Pages are reached one at a time through mobj_get_va() or all
+ * together through mobj_read() and mobj_write().
+ */
 struct mobj {
 	size_t size;
 	void *buffer;
+	struct mobj_pages *pages;
 };
 
+void *mobj_pages_get_va(struct mobj *mobj, size_t offset, size_t len);
+void mobj_pages_put(struct mobj *mobj);
+
 /**
  * mobj_inc_map() - increase map count
  * @mobj:	pointer to a MOBJ
@@ -82,6 +94,8 @@ static inline struct mobj *mobj_get(struct mobj *mobj)
  */
 static inline void *mobj_get_va(struct mobj *mobj, size_t offset, size_t len)
 {
+	if (mobj && mobj->pages)
+		return mobj_pages_get_va(mobj, offset, len);
 	if (mobj)
 		return mobj->buffer;
 	return NULL;
@@ -103,6 +117,8 @@ static inline TEE_Result mobj_get_pa(struct mobj *mobj, size_t offs,
 static inline void mobj_put(struct mobj *mobj)
 {
 	if (mobj) {
+		if (mobj->pages)
+			mobj_pages_put(mobj);
 		free(mobj);
 		mobj = NULL;
 	}
@@ -136,6 +152,17 @@ void mobj_reg_shm_unguard(struct mobj *mobj);
 
 TEE_Result mobj_reg_shm_release_by_cookie(uint64_t cookie);
 
+/*
+ * mobj_read() - copy len bytes at offs of @mobj to dst
+ * mobj_write() - copy len bytes of src to offs of @mobj
+ *
+ * Walk the pages of a noncontiguous mobj without needing them mapped in
+ * one block, return TEE_ERROR_BAD_PARAMETERS past the end of a page list.
+ */
+TEE_Result mobj_read(struct mobj *mobj, size_t offs, void *dst, size_t len);
+TEE_Result mobj_write(struct mobj *mobj, size_t offs, const void *src,
+		      size_t len);
+
 struct mobj *mobj_mm_alloc(struct mobj *mobj_parent, size_t size,
 			   tee_mm_pool_t *pool);
 
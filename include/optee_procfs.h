@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2020-2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OPTEE_PROCFS_H
+#define OPTEE_PROCFS_H
+
+#include <stddef.h>
+
+/* Render the whole file into buf, returns the length of the whole text
+ * like snprintf(), buf is NULL when size is 0
+ */
+
+typedef size_t (*optee_procfs_format_t)(char* buf, size_t size);
+
+/* Register a read-only text file at /proc/<path>. Each open renders a
+ * snapshot with format, which is read until the file is closed. Returns
+ * 0 or a negated errno.
+ */
+
+int optee_procfs_register(const char* path, optee_procfs_format_t format);
+
+#endif /* OPTEE_PROCFS_H */
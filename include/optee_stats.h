@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2020-2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OPTEE_STATS_H
+#define OPTEE_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <tee_api_types.h>
+
+/* Latency histogram buckets, bucket i counts calls that took less than
+ * 2^i us and the last one everything slower
+ */
+#define OPTEE_STATS_BUCKETS 20
+
+/*
+ * enum optee_stats_kind - what a latency sample measures, and the ids
+ * within each kind
+ * @OPTEE_STATS_STD:	tee_entry_std(), by OPTEE_MSG_CMD_*
+ * @OPTEE_STATS_TA:	TA invoke commands, by optee_stats_ta_id()
+ * @OPTEE_STATS_RPC:	thread_rpc_cmd(), by OPTEE_RPC_CMD_*
+ * @OPTEE_STATS_FS:	Storage file system RPCs, by OPTEE_RPC_FS_*
+ */
+enum optee_stats_kind {
+    OPTEE_STATS_STD,
+    OPTEE_STATS_TA,
+    OPTEE_STATS_RPC,
+    OPTEE_STATS_FS,
+    OPTEE_STATS_KINDS,
+};
+
+/*
+ * struct optee_stats_entry - counters of one id
+ * @count:	Calls
+ * @errors:	Calls that did not return TEE_SUCCESS
+ * @total_ns:	Sum of the call latencies
+ * @max_ns:	Slowest call
+ * @hist:	Latency histogram, see OPTEE_STATS_BUCKETS
+ */
+struct optee_stats_entry {
+    uint32_t count;
+    uint32_t errors;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint32_t hist[OPTEE_STATS_BUCKETS];
+};
+
+#ifdef CONFIG_OPTEE_STATS
+
+/* Start time of a sample, in tee_time_system_ns() nanoseconds */
+
+uint64_t optee_stats_now(void);
+
+/* Account a call that started at start_ns, ids past the end of their kind
+ * share the last entry. Only the calling thread's counters are touched.
+ */
+
+void optee_stats_record(enum optee_stats_kind kind, uint32_t id,
+    uint64_t start_ns, TEE_Result res);
+
+/* Id of a TA for OPTEE_STATS_TA, 0 for TAs past the tracked ones */
+
+uint32_t optee_stats_ta_id(const TEE_UUID* uuid);
+
+/* Sum of all threads' counters of one id. Returns false if the id is out
+ * of range.
+ */
+
+bool optee_stats_get(enum optee_stats_kind kind, uint32_t id,
+    struct optee_stats_entry* entry);
+
+/* Render all non-empty counters as text lines, returns the length of the
+ * whole text like snprintf()
+ */
+
+size_t optee_stats_format(char* buf, size_t size);
+
+#else
+
+static inline uint64_t optee_stats_now(void)
+{
+    return 0;
+}
+
+static inline void optee_stats_record(enum optee_stats_kind kind,
+    uint32_t id, uint64_t start_ns, TEE_Result res)
+{
+}
+
+static inline uint32_t optee_stats_ta_id(const TEE_UUID* uuid)
+{
+    return 0;
+}
+
+#endif
+
+#endif /* OPTEE_STATS_H */
@@ -20,6 +20,7 @@
 #define RPMB_FS_H
 
 #include <kernel/thread.h>
+#include <stdint.h>
 
 struct rpmb_req {
     uint16_t cmd;
@@ -30,6 +31,39 @@ struct rpmb_req {
     /* Optional data frames (rpmb_data_frame) follow */
 };
 
+#define RPMB_DATA_FRAME_SIZE 512
+
+/*
+ * This structure is shared with OP-TEE and the MMC ioctl layer.
+ * It is the "data frame for RPMB access" defined by JEDEC, minus the
+ * start and stop bits.
+ */
+struct rpmb_data_frame {
+    uint8_t stuff_bytes[196];
+    uint8_t key_mac[32];
+    uint8_t data[256];
+    uint8_t nonce[16];
+    uint32_t write_counter;
+    uint16_t address;
+    uint16_t block_count;
+    uint16_t op_result;
+#define RPMB_RESULT_OK 0x00
+#define RPMB_RESULT_GENERAL_FAILURE 0x01
+#define RPMB_RESULT_AUTH_FAILURE 0x02
+#define RPMB_RESULT_ADDRESS_FAILURE 0x04
+#define RPMB_RESULT_AUTH_KEY_NOT_PROGRAMMED 0x07
+    uint16_t msg_type;
+#define RPMB_MSG_TYPE_REQ_AUTH_KEY_PROGRAM 0x0001
+#define RPMB_MSG_TYPE_REQ_WRITE_COUNTER_VAL_READ 0x0002
+#define RPMB_MSG_TYPE_REQ_AUTH_DATA_WRITE 0x0003
+#define RPMB_MSG_TYPE_REQ_AUTH_DATA_READ 0x0004
+#define RPMB_MSG_TYPE_REQ_RESULT_READ 0x0005
+#define RPMB_MSG_TYPE_RESP_AUTH_KEY_PROGRAM 0x0100
+#define RPMB_MSG_TYPE_RESP_WRITE_COUNTER_VAL_READ 0x0200
+#define RPMB_MSG_TYPE_RESP_AUTH_DATA_WRITE 0x0300
+#define RPMB_MSG_TYPE_RESP_AUTH_DATA_READ 0x0400
+};
+
 TEE_Result rpmb_data_request(size_t num_params, struct thread_param* params);
 
 TEE_Result rpmb_get_dev_info(size_t num_params, struct thread_param* params);
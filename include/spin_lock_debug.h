@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2020-2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SPIN_LOCK_DEBUG_H
+#define SPIN_LOCK_DEBUG_H
+
+#include <stdint.h>
+
+/*
+ * struct spin_lock_stats - contention seen by __cpu_spin_lock(), only
+ * collected with CFG_TEE_CORE_DEBUG
+ * @acquired:	Locks taken
+ * @contended:	Locks that had to wait for another holder
+ * @spins:	Wait loop iterations over all contended locks
+ * @max_spins:	Longest single wait, in loop iterations
+ */
+struct spin_lock_stats {
+    uint32_t acquired;
+    uint32_t contended;
+    uint32_t spins;
+    uint32_t max_spins;
+};
+
+/* Account a lock taken after spinning the given number of times */
+
+void spin_lock_debug_record(uint32_t spins);
+
+/* Snapshot of the counters since boot */
+
+void spin_lock_debug_get_stats(struct spin_lock_stats* stats);
+
+#endif /* SPIN_LOCK_DEBUG_H */
@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2020-2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TEE_TIME_SYSTEM_H
+#define TEE_TIME_SYSTEM_H
+
+#include <stdint.h>
+
+/* Monotonic time in nanoseconds, the same clock as the registered TEE
+ * time source, extrapolated from the perf counter when that is enabled
+ */
+
+uint64_t tee_time_system_ns(void);
+
+#endif /* TEE_TIME_SYSTEM_H */
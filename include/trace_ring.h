@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2020-2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TRACE_RING_H
+#define TRACE_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Event ids, TRACE_RING_EV_USER and up are free for callers */
+
+#define TRACE_RING_EV_TEXT 0 /* Trace line, text continues in ... */
+#define TRACE_RING_EV_TEXT_CONT 1 /* ... the records that follow */
+#define TRACE_RING_EV_USER 16
+
+#define TRACE_RING_ARGS 4
+
+#ifdef CONFIG_OPTEE_TRACE_RING
+
+/* Record an event with its args, takes no lock and allocates nothing */
+
+void trace_ring_event(uint16_t id, uintptr_t a0, uintptr_t a1, uintptr_t a2,
+    uintptr_t a3);
+
+/* Record a trace line, split over as many records as it needs */
+
+void trace_ring_text(const char* str, size_t len);
+
+/* Render the records still in the ring as text lines, oldest first,
+ * returns the length of the whole text like snprintf()
+ */
+
+size_t trace_ring_format(char* buf, size_t size);
+
+/* Print the records still in the ring to syslog, oldest first */
+
+void trace_ring_dump(void);
+
+#else
+
+static inline void trace_ring_event(uint16_t id, uintptr_t a0, uintptr_t a1,
+    uintptr_t a2, uintptr_t a3)
+{
+}
+
+#endif
+
+#endif /* TRACE_RING_H */
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef USER_TA_WASM_CACHE_H
+#define USER_TA_WASM_CACHE_H
+
+#include <stdbool.h>
+#include <sys/queue.h>
+#include <tee_api_types.h>
+#include <user_ta_wasm_header.h>
+#include <wasm_export.h>
+
+/*
+ * struct wasm_module_cache_entry - loaded WASM module shared by all
+ * contexts of the same TA
+ * @link:		Link in the LRU list, most recently used first
+ * @uuid:		UUID of the TA
+ * @module:		Module loaded by the WASM runtime
+ * @file_buffer:	TA file, mmapped in place or copied to the runtime heap
+ * @file_size:		Size of the TA file
+ * @is_xip_file:	True when file_buffer is an mmap of the TA file
+ * @has_manifest:	True when the TA file carries a valid manifest
+ * @manifest:		Sizing and flags read from the TA file
+ * @ref_count:		Number of contexts instantiated from the module
+ */
+struct wasm_module_cache_entry {
+    TAILQ_ENTRY(wasm_module_cache_entry) link;
+    TEE_UUID uuid;
+    wasm_module_t module;
+    uint8_t* file_buffer;
+    uint32_t file_size;
+    bool is_xip_file;
+    bool has_manifest;
+    struct user_ta_wasm_manifest manifest;
+    uint32_t ref_count;
+};
+
+/* Get the module of the TA, loading it from path on a cache miss */
+
+TEE_Result wasm_module_cache_get(const TEE_UUID* uuid, const char* path,
+    struct wasm_module_cache_entry** entry);
+
+/* Drop a reference, unreferenced modules stay cached within the budget */
+
+void wasm_module_cache_put(struct wasm_module_cache_entry* entry);
+
+#endif /* USER_TA_WASM_CACHE_H */
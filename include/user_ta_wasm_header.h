@@ -36,4 +36,100 @@ struct user_ta_head {
         TEE_Param pParams[TEE_NUM_PARAMS]);
 };
 
+/*
+ * Optional TA manifest, stored in the "ta_manifest" custom section of the
+ * .wasm file. A zero size keeps the loader default.
+ */
+#define USER_TA_WASM_MANIFEST_SECTION "ta_manifest"
+#define USER_TA_WASM_MANIFEST_MAGIC 0x464d4154 /* "TAMF" */
+#define USER_TA_WASM_MANIFEST_VERSION 1
+
+struct user_ta_wasm_manifest {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags; /* TA_FLAG_* */
+    uint32_t stack_size;
+    uint32_t heap_size;
+};
+
+/* Emit the manifest from the TA sources, e.g.
+ * USER_TA_WASM_MANIFEST(TA_FLAG_SINGLE_INSTANCE, 16 * 1024, 8 * 1024);
+ */
+#define USER_TA_WASM_MANIFEST(_flags, _stack_size, _heap_size)   \
+    __attribute__((used, section(".custom_section."            \
+                                 USER_TA_WASM_MANIFEST_SECTION))) \
+    static const struct user_ta_wasm_manifest user_ta_wasm_manifest = { \
+        .magic = USER_TA_WASM_MANIFEST_MAGIC,                   \
+        .version = USER_TA_WASM_MANIFEST_VERSION,               \
+        .flags = (_flags),                                      \
+        .stack_size = (_stack_size),                            \
+        .heap_size = (_heap_size),                              \
+    }
+
+/*
+ * Compressed TA image, the header followed by the .wasm or .aot file cut
+ * in LZF blocks as written by NuttX's lzf tool ("ZV" block headers). The
+ * loader inflates it block by block into the module buffer.
+ */
+#define USER_TA_WASM_LZF_MAGIC 0x5a4c4154 /* "TALZ" */
+
+struct user_ta_wasm_lzf_header {
+    uint32_t magic;
+    uint32_t size; /* size of the uncompressed file */
+};
+
+/*
+ * One buffer of a vectored update, pointers are 32 bits in a WASM TA.
+ * The *UpdateV natives below take an array of them, feeding every chunk
+ * to the operation in order with a single call out of the TA.
+ */
+struct user_ta_wasm_chunk {
+    uint32_t buffer;
+    uint32_t size;
+};
+
+/* Vendor flag of TEE_OpenPersistentObject, the object is read front to back */
+#ifndef TEE_DATA_FLAG_SEQUENTIAL
+#define TEE_DATA_FLAG_SEQUENTIAL 0x00010000
+#endif
+
+#ifdef __wasm__
+void TEE_DigestUpdateV(TEE_OperationHandle operation,
+    const struct user_ta_wasm_chunk* chunks, uint32_t count);
+void TEE_MACUpdateV(TEE_OperationHandle operation,
+    const struct user_ta_wasm_chunk* chunks, uint32_t count);
+
+/* The output of all chunks is written back to back to destData, which
+ * must hold the total chunk size plus one cipher block, else nothing is
+ * processed and TEE_ERROR_SHORT_BUFFER returns that size in *destLen.
+ */
+TEE_Result TEE_CipherUpdateV(TEE_OperationHandle operation,
+    const struct user_ta_wasm_chunk* chunks, uint32_t count,
+    void* destData, size_t* destLen);
+#endif
+
+#if !defined(__wasm__) && defined(CONFIG_OPTEE_WASM_TA_FAST_CALL)
+#include <wasm_export.h>
+
+/* TEE_OpenTASession and TEE_InvokeTACommand of a WASM TA, straight into
+ * the TA manager. params is the TEE_Param array in the linear memory of
+ * module_inst, with app offsets as memref buffers.
+ */
+
+TEE_Result wasm_ta_open_session(wasm_module_inst_t module_inst,
+    const TEE_UUID* uuid, uint32_t cancel_req_to, uint32_t param_types,
+    TEE_Param params[TEE_NUM_PARAMS], uint32_t* session, uint32_t* ret_orig);
+TEE_Result wasm_ta_invoke_command(wasm_module_inst_t module_inst,
+    uint32_t session, uint32_t cancel_req_to, uint32_t cmd,
+    uint32_t param_types, TEE_Param params[TEE_NUM_PARAMS], uint32_t* ret_orig);
+#endif
+
+#if !defined(__wasm__) && defined(USER_TA_WASM)
+/* Initialize the WASM runtime and prewarm the hot TAs ahead of their first
+ * session, the server runs it in the background once it takes requests.
+ */
+
+void user_ta_wasm_warmup(void);
+#endif
+
 #endif /* USER_TA_WASM_HEADER_H */
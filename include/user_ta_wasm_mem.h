@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef USER_TA_WASM_MEM_H
+#define USER_TA_WASM_MEM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <tee_api_types.h>
+
+/*
+ * struct wasm_mem_stats - WASM runtime memory charged to a TA
+ * @uuid:		UUID of the TA, nil for memory not tied to a TA
+ * @current:		Bytes currently allocated
+ * @peak:		Highest value current reached
+ * @failed:		Number of allocations that could not be served
+ */
+struct wasm_mem_stats {
+    TEE_UUID uuid;
+    size_t current;
+    size_t peak;
+    uint32_t failed;
+};
+
+/* Set up the arena the runtime allocates from */
+
+TEE_Result wasm_mem_init(void);
+
+/* Get the stats of the TA, shared by all of its instances */
+
+struct wasm_mem_stats* wasm_mem_stats_get(const TEE_UUID* uuid);
+
+/* Copy the stats of a TA tracked separately, returns false for the
+ * others
+ */
+
+bool wasm_mem_stats_read(const TEE_UUID* uuid, struct wasm_mem_stats* stats);
+
+/* Charge the runtime allocations of the calling thread to owner, returns
+ * the previous owner to restore
+ */
+
+struct wasm_mem_stats* wasm_mem_set_owner(struct wasm_mem_stats* owner);
+
+/* Allocator handed to the WASM runtime */
+
+void* wasm_mem_malloc(unsigned int size);
+void* wasm_mem_realloc(void* ptr, unsigned int size);
+void wasm_mem_free(void* ptr);
+
+#endif /* USER_TA_WASM_MEM_H */
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef USER_TA_WASM_SLAB_H
+#define USER_TA_WASM_SLAB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wasm_export.h>
+
+/*
+ * struct wasm_slab_stats - small TEE_Malloc allocations of an instance
+ * @slab_allocs:	Allocations served from a slab
+ * @heap_allocs:	Allocations too large for a slab, served by the app heap
+ * @zero_skipped:	Zero filled allocations that were already zero
+ * @chunks:		Slab chunks currently taken from the app heap
+ * @chunks_peak:	Highest value chunks reached
+ * @failed:		Allocations that could not be served
+ */
+struct wasm_slab_stats {
+    uint32_t slab_allocs;
+    uint32_t heap_allocs;
+    uint32_t zero_skipped;
+    uint32_t chunks;
+    uint32_t chunks_peak;
+    uint32_t failed;
+};
+
+#ifdef CONFIG_OPTEE_WASM_SLAB
+
+/* Attach a slab layer to the instance, TEE_Malloc falls back to the app
+ * heap if this fails
+ */
+
+void wasm_slab_create(wasm_module_inst_t module_inst);
+
+/* Drop the slab state and trace its stats, the chunks go away with the
+ * app heap
+ */
+
+void wasm_slab_destroy(wasm_module_inst_t module_inst);
+
+/* TEE_Malloc, TEE_Realloc and TEE_Free on the app heap of the instance,
+ * returning and taking app offsets
+ */
+
+uint32_t wasm_slab_malloc(wasm_module_inst_t module_inst, uint32_t size,
+    bool zero, void** p_native_addr);
+uint32_t wasm_slab_realloc(wasm_module_inst_t module_inst, uint32_t ptr,
+    uint32_t size);
+void wasm_slab_free(wasm_module_inst_t module_inst, uint32_t ptr);
+
+#else
+
+static inline void wasm_slab_create(wasm_module_inst_t module_inst)
+{
+}
+
+static inline void wasm_slab_destroy(wasm_module_inst_t module_inst)
+{
+}
+
+#endif
+
+#endif /* USER_TA_WASM_SLAB_H */
@@ -0,0 +1,606 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <crypto/crypto.h>
+#include <initcall.h>
+#include <inttypes.h>
+#include <kernel/tee_ta_manager.h>
+#include <optee_msg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tee/entry_std.h>
+#include <tee/tee_fs.h>
+#include <tee/uuid.h>
+#include <tee_api_defines.h>
+#include <time.h>
+#include <trace.h>
+#include <unistd.h>
+#ifdef USER_TA_WASM
+#include <user_ta_wasm_header.h>
+#endif
+
+#ifdef CONFIG_OPTEE_RPMB_FS
+#include <mm/mobj.h>
+#include <netinet/in.h>
+#include <rpmb_fs.h>
+#endif
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define OPTEE_BENCH_ITERATIONS 100
+
+/* Param sizes from 16 B to 256 KiB, each four times the previous one */
+
+#define OPTEE_BENCH_PARAM_MIN 16
+#define OPTEE_BENCH_PARAM_MAX (256 * 1024)
+
+#define OPTEE_BENCH_FS_BLOCK 4096
+#define OPTEE_BENCH_FS_BLOCKS 16
+#define OPTEE_BENCH_FS_FILE FS_STORAGE_DIR_PRIVATE "optee_bench"
+
+#define OPTEE_BENCH_GCM_BLOCK 16
+#define OPTEE_BENCH_GCM_CHUNK 4096
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+struct optee_bench {
+    unsigned int iterations;
+    TEE_UUID uuid;
+    bool has_uuid;
+    uint32_t cmd;
+    uint16_t rpmb_dev;
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static uint64_t optee_bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* One CSV line per result, bytes is the payload moved by one operation
+ * and 0 for operations without a throughput
+ */
+
+static void optee_bench_report(const char* test, size_t bytes,
+    unsigned int iterations, uint64_t ns)
+{
+    uint64_t ns_per_op = ns / iterations;
+    uint64_t kib_per_s = 0;
+
+    if (bytes && ns) {
+        kib_per_s = (uint64_t)bytes * iterations * 1000000000 / 1024 / ns;
+    }
+
+    printf("%s,%zu,%u,%" PRIu64 ",%" PRIu64 "\n", test, bytes, iterations,
+        ns_per_op, kib_per_s);
+}
+
+static void optee_bench_fail(const char* test, size_t bytes, TEE_Result res)
+{
+    fprintf(stderr, "%s,%zu: failed 0x%08" PRIx32 "\n", test, bytes, res);
+}
+
+static bool optee_bench_parse_uuid(const char* s, TEE_UUID* uuid)
+{
+    unsigned int c[8];
+    unsigned int low, mid, hi;
+
+    if (sscanf(s, "%8x-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x", &low, &mid, &hi,
+            &c[0], &c[1], &c[2], &c[3], &c[4], &c[5], &c[6], &c[7])
+        != 11) {
+        return false;
+    }
+
+    uuid->timeLow = low;
+    uuid->timeMid = mid;
+    uuid->timeHiAndVersion = hi;
+    for (int i = 0; i < 8; i++) {
+        uuid->clockSeqAndNode[i] = c[i];
+    }
+
+    return true;
+}
+
+/* Run one request through the core the way opteed does, without the
+ * socket. Returns the core result or the TA result, whichever failed.
+ */
+
+static TEE_Result optee_bench_call(struct optee_msg_arg* msg)
+{
+    TEE_Result res = tee_entry_std(msg, msg->num_params);
+
+    return res != TEE_SUCCESS ? res : msg->ret;
+}
+
+static TEE_Result optee_bench_open(struct optee_bench* b, uint32_t* session)
+{
+    uint64_t buffer[OPTEE_MSG_GET_ARG_SIZE(2) / sizeof(uint64_t)] = { 0 };
+    struct optee_msg_arg* msg = (struct optee_msg_arg*)buffer;
+    struct optee_msg_param* param = (struct optee_msg_param*)(msg + 1);
+    TEE_Result res;
+
+    msg->cmd = OPTEE_MSG_CMD_OPEN_SESSION;
+    msg->num_params = 2;
+    param[0].attr = OPTEE_MSG_ATTR_TYPE_VALUE_INPUT | OPTEE_MSG_ATTR_META;
+    tee_uuid_to_octets((uint8_t*)&param[0].u.value, &b->uuid);
+    param[1].attr = OPTEE_MSG_ATTR_TYPE_VALUE_INPUT | OPTEE_MSG_ATTR_META;
+    param[1].u.value.c = TEE_LOGIN_PUBLIC;
+
+    res = optee_bench_call(msg);
+    if (res == TEE_SUCCESS) {
+        *session = msg->session;
+    }
+
+    return res;
+}
+
+static TEE_Result optee_bench_invoke(struct optee_bench* b, uint32_t session,
+    void* buf, size_t size)
+{
+    uint64_t buffer[OPTEE_MSG_GET_ARG_SIZE(1) / sizeof(uint64_t)] = { 0 };
+    struct optee_msg_arg* msg = (struct optee_msg_arg*)buffer;
+    struct optee_msg_param* param = (struct optee_msg_param*)(msg + 1);
+
+    msg->cmd = OPTEE_MSG_CMD_INVOKE_COMMAND;
+    msg->func = b->cmd;
+    msg->session = session;
+    if (buf) {
+        msg->num_params = 1;
+        param[0].attr = OPTEE_MSG_ATTR_TYPE_RMEM_INOUT;
+        param[0].u.rmem.shm_ref = (uintptr_t)buf;
+        param[0].u.rmem.size = size;
+    }
+
+    return optee_bench_call(msg);
+}
+
+static TEE_Result optee_bench_close(uint32_t session)
+{
+    uint64_t buffer[OPTEE_MSG_GET_ARG_SIZE(0) / sizeof(uint64_t)] = { 0 };
+    struct optee_msg_arg* msg = (struct optee_msg_arg*)buffer;
+
+    msg->cmd = OPTEE_MSG_CMD_CLOSE_SESSION;
+    msg->session = session;
+    return optee_bench_call(msg);
+}
+
+/* Open, invoke without params and close, then the invoke alone */
+
+static void optee_bench_session(struct optee_bench* b)
+{
+    uint64_t start, roundtrip = 0;
+    uint32_t session;
+    TEE_Result res;
+
+    for (unsigned int i = 0; i < b->iterations; i++) {
+        start = optee_bench_now();
+        res = optee_bench_open(b, &session);
+        if (res != TEE_SUCCESS) {
+            optee_bench_fail("session", 0, res);
+            return;
+        }
+        res = optee_bench_invoke(b, session, NULL, 0);
+        optee_bench_close(session);
+        roundtrip += optee_bench_now() - start;
+        if (res != TEE_SUCCESS) {
+            optee_bench_fail("session", 0, res);
+            return;
+        }
+    }
+    optee_bench_report("session", 0, b->iterations, roundtrip);
+
+    res = optee_bench_open(b, &session);
+    if (res != TEE_SUCCESS) {
+        optee_bench_fail("invoke", 0, res);
+        return;
+    }
+
+    start = optee_bench_now();
+    for (unsigned int i = 0; i < b->iterations; i++) {
+        optee_bench_invoke(b, session, NULL, 0);
+    }
+    optee_bench_report("invoke", 0, b->iterations, optee_bench_now() - start);
+    optee_bench_close(session);
+}
+
+/* Invoke with one inout memref, the TA params are copied into the WASM
+ * heap and back on every call. Compare against "invoke" for the copy cost.
+ */
+
+static void optee_bench_params(struct optee_bench* b)
+{
+    uint8_t* buf = malloc(OPTEE_BENCH_PARAM_MAX);
+    uint32_t session;
+    TEE_Result res;
+
+    if (!buf) {
+        optee_bench_fail("params", OPTEE_BENCH_PARAM_MAX, TEE_ERROR_OUT_OF_MEMORY);
+        return;
+    }
+
+    res = optee_bench_open(b, &session);
+    if (res != TEE_SUCCESS) {
+        optee_bench_fail("params", 0, res);
+        free(buf);
+        return;
+    }
+
+    memset(buf, 0x5a, OPTEE_BENCH_PARAM_MAX);
+    for (size_t size = OPTEE_BENCH_PARAM_MIN; size <= OPTEE_BENCH_PARAM_MAX;
+         size *= 4) {
+        uint64_t start = optee_bench_now();
+
+        for (unsigned int i = 0; i < b->iterations; i++) {
+            res = optee_bench_invoke(b, session, buf, size);
+            if (res != TEE_SUCCESS) {
+                break;
+            }
+        }
+        if (res != TEE_SUCCESS) {
+            optee_bench_fail("params", size, res);
+            continue;
+        }
+        optee_bench_report("params", size, b->iterations,
+            optee_bench_now() - start);
+    }
+
+    optee_bench_close(session);
+    free(buf);
+}
+
+#ifdef CONFIG_OPTEE_COMPAT_MITEE_FS
+static TEE_Result optee_bench_fs_pass(struct tee_file_handle* fh, uint8_t* buf,
+    bool write, bool random)
+{
+    TEE_Result res = TEE_SUCCESS;
+
+    for (unsigned int i = 0; i < OPTEE_BENCH_FS_BLOCKS && !res; i++) {
+        unsigned int blk = random ? (unsigned int)rand() % OPTEE_BENCH_FS_BLOCKS : i;
+        size_t len = OPTEE_BENCH_FS_BLOCK;
+
+        res = ree_fs_ops.seek(fh, blk * OPTEE_BENCH_FS_BLOCK, TEE_DATA_SEEK_SET,
+            NULL);
+        if (res == TEE_SUCCESS) {
+            res = write ? ree_fs_ops.write(fh, buf, len)
+                        : ree_fs_ops.read(fh, buf, &len);
+        }
+    }
+
+    return res;
+}
+
+static void optee_bench_fs_run(struct optee_bench* b, struct tee_file_handle* fh,
+    uint8_t* buf, const char* test, bool write, bool random)
+{
+    size_t bytes = OPTEE_BENCH_FS_BLOCK * OPTEE_BENCH_FS_BLOCKS;
+    uint64_t start = optee_bench_now();
+    TEE_Result res = TEE_SUCCESS;
+
+    for (unsigned int i = 0; i < b->iterations && !res; i++) {
+        res = optee_bench_fs_pass(fh, buf, write, random);
+    }
+    if (res != TEE_SUCCESS) {
+        optee_bench_fail(test, bytes, res);
+        return;
+    }
+
+    optee_bench_report(test, bytes, b->iterations, optee_bench_now() - start);
+}
+
+/* Encrypted ree_fs file of OPTEE_BENCH_FS_BLOCKS blocks on behalf of a
+ * session of the bench UUID, the file keys are derived from it.
+ */
+
+static void optee_bench_fs(struct optee_bench* b)
+{
+    struct ts_ctx ctx = { .uuid = b->uuid };
+    struct ts_session sess = { .ctx = &ctx };
+    struct tee_file_handle* fh = NULL;
+    uint8_t* buf = calloc(1, OPTEE_BENCH_FS_BLOCK);
+    uint64_t start;
+    TEE_Result res;
+
+    if (!buf) {
+        optee_bench_fail("fs", 0, TEE_ERROR_OUT_OF_MEMORY);
+        return;
+    }
+
+    ts_push_current_session(&sess);
+
+    res = ree_fs_ops.create(OPTEE_BENCH_FS_FILE, &fh);
+    if (res == TEE_SUCCESS) {
+        res = optee_bench_fs_pass(fh, buf, true, false);
+    }
+    if (res != TEE_SUCCESS) {
+        optee_bench_fail("fs", 0, res);
+        goto out;
+    }
+
+    optee_bench_fs_run(b, fh, buf, "fs_seq_write", true, false);
+    optee_bench_fs_run(b, fh, buf, "fs_seq_read", false, false);
+    optee_bench_fs_run(b, fh, buf, "fs_rand_write", true, true);
+    optee_bench_fs_run(b, fh, buf, "fs_rand_read", false, true);
+    ree_fs_ops.close(&fh);
+
+    start = optee_bench_now();
+    for (unsigned int i = 0; i < b->iterations; i++) {
+        res = ree_fs_ops.open(OPTEE_BENCH_FS_FILE, &fh);
+        if (res != TEE_SUCCESS) {
+            optee_bench_fail("fs_open", 0, res);
+            goto out;
+        }
+        ree_fs_ops.close(&fh);
+    }
+    optee_bench_report("fs_open", 0, b->iterations, optee_bench_now() - start);
+
+out:
+    if (fh) {
+        ree_fs_ops.close(&fh);
+    }
+    ree_fs_ops.remove(OPTEE_BENCH_FS_FILE);
+    ts_pop_current_session();
+    free(buf);
+}
+#endif
+
+#ifdef CONFIG_OPTEE_RPMB_FS
+static TEE_Result optee_bench_rpmb_req(struct optee_bench* b, uint16_t type,
+    uint8_t* req, struct rpmb_data_frame* rsp)
+{
+    struct rpmb_req* sreq = (struct rpmb_req*)req;
+    struct rpmb_data_frame* frm = (struct rpmb_data_frame*)(sreq + 1);
+    size_t req_size = sizeof(*sreq) + RPMB_DATA_FRAME_SIZE;
+    struct mobj req_mobj = { .size = req_size, .buffer = req };
+    struct mobj rsp_mobj = { .size = RPMB_DATA_FRAME_SIZE, .buffer = rsp };
+    struct thread_param params[2];
+
+    memset(req, 0, req_size);
+    sreq->cmd = RPMB_CMD_DATA_REQ;
+    sreq->dev_id = b->rpmb_dev;
+    frm->msg_type = htons(type);
+    if (type == RPMB_MSG_TYPE_REQ_AUTH_DATA_WRITE) {
+        frm->block_count = htons(1);
+        frm->write_counter = rsp->write_counter;
+    }
+
+    memset(params, 0, sizeof(params));
+    params[0].attr = THREAD_PARAM_ATTR_MEMREF_IN;
+    params[0].u.memref.mobj = &req_mobj;
+    params[0].u.memref.size = req_size;
+    params[1].attr = THREAD_PARAM_ATTR_MEMREF_OUT;
+    params[1].u.memref.mobj = &rsp_mobj;
+    params[1].u.memref.size = RPMB_DATA_FRAME_SIZE;
+
+    return rpmb_data_request(2, params);
+}
+
+/* The REE side of an RPMB write: the reliable write, result request and
+ * response commands. The bench has no RPMB key, so the frame carries a
+ * zero MAC and the card refuses it without programming or advancing the
+ * write counter, flash programming time is not included.
+ */
+
+static void optee_bench_rpmb(struct optee_bench* b)
+{
+    uint8_t req[sizeof(struct rpmb_req) + RPMB_DATA_FRAME_SIZE];
+    struct rpmb_data_frame rsp;
+    uint64_t start;
+    TEE_Result res;
+
+    memset(&rsp, 0, sizeof(rsp));
+    start = optee_bench_now();
+    for (unsigned int i = 0; i < b->iterations; i++) {
+        res = optee_bench_rpmb_req(b, RPMB_MSG_TYPE_REQ_WRITE_COUNTER_VAL_READ,
+            req, &rsp);
+        if (res != TEE_SUCCESS) {
+            optee_bench_fail("rpmb_counter", 0, res);
+            return;
+        }
+    }
+    optee_bench_report("rpmb_counter", 0, b->iterations,
+        optee_bench_now() - start);
+
+    start = optee_bench_now();
+    for (unsigned int i = 0; i < b->iterations; i++) {
+        res = optee_bench_rpmb_req(b, RPMB_MSG_TYPE_REQ_AUTH_DATA_WRITE,
+            req, &rsp);
+        if (res != TEE_SUCCESS) {
+            optee_bench_fail("rpmb_write", sizeof(rsp.data), res);
+            return;
+        }
+    }
+    optee_bench_report("rpmb_write", sizeof(rsp.data), b->iterations,
+        optee_bench_now() - start);
+}
+#endif
+
+static TEE_Result optee_bench_gcm_run(struct optee_bench* b, void* ctx,
+    uint8_t* buf, size_t size, uint64_t* ns)
+{
+    static const uint8_t key[16];
+    static const uint8_t nonce[12];
+    uint8_t tag[16];
+    size_t tag_len = sizeof(tag);
+    size_t out_len = size;
+    uint64_t start = optee_bench_now();
+    TEE_Result res = TEE_SUCCESS;
+
+    for (unsigned int i = 0; i < b->iterations && !res; i++) {
+        res = crypto_authenc_init(ctx, TEE_MODE_ENCRYPT, key, sizeof(key),
+            nonce, sizeof(nonce), sizeof(tag), 0, size);
+        if (res == TEE_SUCCESS) {
+            out_len = size;
+            res = crypto_authenc_enc_final(ctx, buf, size, buf, &out_len,
+                tag, &tag_len);
+        }
+        crypto_authenc_final(ctx);
+    }
+
+    *ns = optee_bench_now() - start;
+    return res;
+}
+
+/* AES-128-GCM encryption of a single block, which is dominated by the
+ * setup, and of a chunk, reported per 16 byte block
+ */
+
+static void optee_bench_gcm(struct optee_bench* b)
+{
+    uint8_t* buf = calloc(1, OPTEE_BENCH_GCM_CHUNK);
+    void* ctx = NULL;
+    uint64_t ns;
+    TEE_Result res;
+
+    if (!buf) {
+        optee_bench_fail("gcm", 0, TEE_ERROR_OUT_OF_MEMORY);
+        return;
+    }
+
+    res = crypto_authenc_alloc_ctx(&ctx, TEE_ALG_AES_GCM);
+    if (res != TEE_SUCCESS) {
+        optee_bench_fail("gcm", 0, res);
+        free(buf);
+        return;
+    }
+
+    res = optee_bench_gcm_run(b, ctx, buf, OPTEE_BENCH_GCM_BLOCK, &ns);
+    if (res == TEE_SUCCESS) {
+        optee_bench_report("gcm_block", OPTEE_BENCH_GCM_BLOCK, b->iterations, ns);
+        res = optee_bench_gcm_run(b, ctx, buf, OPTEE_BENCH_GCM_CHUNK, &ns);
+    }
+    if (res == TEE_SUCCESS) {
+        optee_bench_report("gcm_chunk_block", OPTEE_BENCH_GCM_BLOCK,
+            b->iterations * (OPTEE_BENCH_GCM_CHUNK / OPTEE_BENCH_GCM_BLOCK), ns);
+    } else {
+        optee_bench_fail("gcm", 0, res);
+    }
+
+    crypto_authenc_free_ctx(ctx);
+    free(buf);
+}
+
+static void optee_bench_usage(const char* progname)
+{
+    fprintf(stderr, "Usage: %s [-n iterations] [-u uuid] [-c cmd] [-d rpmb dev] [test...]\n"
+                    "Tests: session params fs rpmb gcm, all by default.\n"
+                    "session and params invoke cmd of TA uuid, fs files are\n"
+                    "keyed to uuid. Results go to stdout as CSV lines of\n"
+                    "test,bytes,iterations,ns_per_op,kib_per_s\n",
+        progname);
+}
+
+static bool optee_bench_selected(int argc, char* argv[], const char* test)
+{
+    if (optind >= argc) {
+        return true;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (!strcmp(argv[i], test)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, char* argv[])
+{
+    struct optee_bench b = {
+        .iterations = OPTEE_BENCH_ITERATIONS,
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:u:c:d:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            b.iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'u':
+            b.has_uuid = optee_bench_parse_uuid(optarg, &b.uuid);
+            if (!b.has_uuid) {
+                optee_bench_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            b.cmd = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            b.rpmb_dev = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            optee_bench_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (b.iterations == 0) {
+        optee_bench_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* Initialize optee-os modules, the bench runs instead of opteed */
+    call_initcalls();
+#if defined(CONFIG_OPTEE_SERVER_WARMUP) && defined(USER_TA_WASM)
+    user_ta_wasm_warmup();
+#endif
+
+    printf("test,bytes,iterations,ns_per_op,kib_per_s\n");
+
+    if (b.has_uuid && optee_bench_selected(argc, argv, "session")) {
+        optee_bench_session(&b);
+    }
+    if (b.has_uuid && optee_bench_selected(argc, argv, "params")) {
+        optee_bench_params(&b);
+    }
+#ifdef CONFIG_OPTEE_COMPAT_MITEE_FS
+    if (optee_bench_selected(argc, argv, "fs")) {
+        optee_bench_fs(&b);
+    }
+#endif
+#ifdef CONFIG_OPTEE_RPMB_FS
+    if (optee_bench_selected(argc, argv, "rpmb")) {
+        optee_bench_rpmb(&b);
+    }
+#endif
+    if (optee_bench_selected(argc, argv, "gcm")) {
+        optee_bench_gcm(&b);
+    }
+
+    return 0;
+}
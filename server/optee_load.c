@@ -0,0 +1,562 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <optee_msg.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef CONFIG_NET_RPMSG
+#include <netpacket/rpmsg.h>
+#endif
+#ifdef CONFIG_NET_LOCAL
+#include <sys/un.h>
+#endif
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#define OPTEE_LOAD_REMOTE_PATH "optee"
+#define OPTEE_LOAD_THREADS 4
+#define OPTEE_LOAD_REQUESTS 1000
+#define OPTEE_LOAD_MAX_MIX 8
+
+/* TEE_LOGIN_PUBLIC and TEE_ERROR_COMMUNICATION, the client does not pull
+ * in the TEE headers
+ */
+
+#define OPTEE_LOAD_LOGIN_PUBLIC 0
+#define OPTEE_LOAD_ERROR_COMMUNICATION 0xffff000e
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/* One entry of the InvokeCommand mix, picked with probability weight / sum */
+
+struct optee_load_op {
+    uint32_t cmd;
+    size_t size;
+    unsigned int weight;
+};
+
+struct optee_load {
+    const char* cpu; /* Remote CPU for rpmsg, NULL for the local socket */
+    uint8_t uuid[16];
+    unsigned int threads;
+    unsigned int requests;
+    struct optee_load_op mix[OPTEE_LOAD_MAX_MIX];
+    unsigned int nmix;
+    unsigned int weights;
+};
+
+struct optee_load_worker {
+    pthread_t thread;
+    struct optee_load* load;
+    unsigned int seed;
+    uint8_t* buf;
+
+    /* Latency of every completed request, ns */
+    uint64_t* lat;
+    unsigned int done;
+    unsigned int errors;
+};
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+static uint64_t optee_load_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int optee_load_connect(struct optee_load* load)
+{
+    int family;
+    int fd;
+    int ret;
+
+    if (load->cpu) {
+#ifdef CONFIG_NET_RPMSG
+        struct sockaddr_rpmsg addr = {
+            .rp_family = AF_RPMSG,
+            .rp_name = OPTEE_LOAD_REMOTE_PATH,
+        };
+
+        strlcpy(addr.rp_cpu, load->cpu, sizeof(addr.rp_cpu));
+        family = AF_RPMSG;
+        fd = socket(family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -errno;
+        }
+        ret = connect(fd, (const struct sockaddr*)&addr, sizeof(addr));
+#else
+        return -EAFNOSUPPORT;
+#endif
+    } else {
+#ifdef CONFIG_NET_LOCAL
+        const struct sockaddr_un addr = {
+            .sun_family = AF_UNIX,
+            .sun_path = OPTEE_LOAD_REMOTE_PATH,
+        };
+
+        family = AF_UNIX;
+        fd = socket(family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -errno;
+        }
+        ret = connect(fd, (const struct sockaddr*)&addr, sizeof(addr));
+#else
+        return -EAFNOSUPPORT;
+#endif
+    }
+
+    if (ret < 0) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+}
+
+static int optee_load_recv(int fd, void* buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = recv(fd, buf, size, 0);
+        if (n <= 0) {
+            return -1;
+        }
+
+        buf = (uint8_t*)buf + n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+static int optee_load_sendv(int fd, struct iovec* iov, int iovcnt)
+{
+    struct msghdr hdr = { 0 };
+
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = iovcnt;
+
+    while (hdr.msg_iovlen > 0) {
+        ssize_t n = sendmsg(fd, &hdr, 0);
+        if (n <= 0) {
+            return -1;
+        }
+
+        while (hdr.msg_iovlen > 0 && (size_t)n >= hdr.msg_iov->iov_len) {
+            n -= hdr.msg_iov->iov_len;
+            hdr.msg_iov++;
+            hdr.msg_iovlen--;
+        }
+
+        if (hdr.msg_iovlen > 0) {
+            hdr.msg_iov->iov_base = (uint8_t*)hdr.msg_iov->iov_base + n;
+            hdr.msg_iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/* One request in the opteed framing: optee_msg_arg and its params, then
+ * the payload of the input memrefs. The reply carries the same header
+ * followed by the payload of the output memrefs. At most one memref, in
+ * buf, is supported.
+ */
+
+static uint32_t optee_load_call(int fd, struct optee_msg_arg* msg,
+    uint8_t* buf, size_t size)
+{
+    struct optee_msg_param* param = (struct optee_msg_param*)(msg + 1);
+    uint32_t num_params = msg->num_params;
+    struct iovec iov[2];
+    int iovcnt = 0;
+
+    iov[iovcnt].iov_base = msg;
+    iov[iovcnt++].iov_len = OPTEE_MSG_GET_ARG_SIZE(num_params);
+    if (size > 0) {
+        iov[iovcnt].iov_base = buf;
+        iov[iovcnt++].iov_len = size;
+    }
+
+    if (optee_load_sendv(fd, iov, iovcnt) < 0) {
+        return OPTEE_LOAD_ERROR_COMMUNICATION;
+    }
+
+    if (optee_load_recv(fd, msg, sizeof(*msg)) < 0 || msg->num_params != num_params
+        || optee_load_recv(fd, param, sizeof(*param) * num_params) < 0) {
+        return OPTEE_LOAD_ERROR_COMMUNICATION;
+    }
+
+    if (size > 0) {
+        size_t out = param[num_params - 1].u.rmem.size;
+
+        if (optee_load_recv(fd, buf, out < size ? out : size) < 0) {
+            return OPTEE_LOAD_ERROR_COMMUNICATION;
+        }
+    }
+
+    return msg->ret;
+}
+
+static uint32_t optee_load_open(int fd, struct optee_load* load,
+    uint32_t* session)
+{
+    uint64_t buffer[OPTEE_MSG_GET_ARG_SIZE(2) / sizeof(uint64_t)] = { 0 };
+    struct optee_msg_arg* msg = (struct optee_msg_arg*)buffer;
+    struct optee_msg_param* param = (struct optee_msg_param*)(msg + 1);
+    uint32_t ret;
+
+    msg->cmd = OPTEE_MSG_CMD_OPEN_SESSION;
+    msg->num_params = 2;
+    param[0].attr = OPTEE_MSG_ATTR_TYPE_VALUE_INPUT | OPTEE_MSG_ATTR_META;
+    memcpy(&param[0].u.value, load->uuid, sizeof(load->uuid));
+    param[1].attr = OPTEE_MSG_ATTR_TYPE_VALUE_INPUT | OPTEE_MSG_ATTR_META;
+    param[1].u.value.c = OPTEE_LOAD_LOGIN_PUBLIC;
+
+    ret = optee_load_call(fd, msg, NULL, 0);
+    if (ret == 0) {
+        *session = msg->session;
+    }
+
+    return ret;
+}
+
+static uint32_t optee_load_invoke(int fd, uint32_t session,
+    const struct optee_load_op* op, uint8_t* buf)
+{
+    uint64_t buffer[OPTEE_MSG_GET_ARG_SIZE(1) / sizeof(uint64_t)] = { 0 };
+    struct optee_msg_arg* msg = (struct optee_msg_arg*)buffer;
+    struct optee_msg_param* param = (struct optee_msg_param*)(msg + 1);
+
+    msg->cmd = OPTEE_MSG_CMD_INVOKE_COMMAND;
+    msg->func = op->cmd;
+    msg->session = session;
+    if (op->size > 0) {
+        msg->num_params = 1;
+        param[0].attr = OPTEE_MSG_ATTR_TYPE_RMEM_INOUT;
+        param[0].u.rmem.size = op->size;
+    }
+
+    return optee_load_call(fd, msg, buf, op->size);
+}
+
+static void optee_load_close(int fd, uint32_t session)
+{
+    uint64_t buffer[OPTEE_MSG_GET_ARG_SIZE(0) / sizeof(uint64_t)] = { 0 };
+    struct optee_msg_arg* msg = (struct optee_msg_arg*)buffer;
+
+    msg->cmd = OPTEE_MSG_CMD_CLOSE_SESSION;
+    msg->session = session;
+    optee_load_call(fd, msg, NULL, 0);
+}
+
+static const struct optee_load_op* optee_load_pick(struct optee_load_worker* w)
+{
+    struct optee_load* load = w->load;
+    unsigned int r = rand_r(&w->seed) % load->weights;
+    unsigned int i;
+
+    for (i = 0; i < load->nmix - 1; i++) {
+        if (r < load->mix[i].weight) {
+            break;
+        }
+        r -= load->mix[i].weight;
+    }
+
+    return &load->mix[i];
+}
+
+/* One connection and session per worker, requests go back to back */
+
+static void* optee_load_worker(void* arg)
+{
+    struct optee_load_worker* w = arg;
+    struct optee_load* load = w->load;
+    uint32_t session;
+    uint32_t ret;
+    int fd;
+
+    fd = optee_load_connect(load);
+    if (fd < 0) {
+        fprintf(stderr, "connect failed(%d)\n", fd);
+        w->errors = load->requests;
+        return NULL;
+    }
+
+    ret = optee_load_open(fd, load, &session);
+    if (ret != 0) {
+        fprintf(stderr, "open session failed(0x%08" PRIx32 ")\n", ret);
+        w->errors = load->requests;
+        close(fd);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < load->requests; i++) {
+        const struct optee_load_op* op = optee_load_pick(w);
+        uint64_t start = optee_load_now();
+
+        ret = optee_load_invoke(fd, session, op, w->buf);
+        if (ret == OPTEE_LOAD_ERROR_COMMUNICATION) {
+            w->errors += load->requests - i;
+            close(fd);
+            return NULL;
+        } else if (ret != 0) {
+            w->errors++;
+        }
+
+        w->lat[w->done++] = optee_load_now() - start;
+    }
+
+    optee_load_close(fd, session);
+    close(fd);
+    return NULL;
+}
+
+static int optee_load_cmp(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Parse "cmd:size[:weight],..." into the InvokeCommand mix */
+
+static bool optee_load_parse_mix(struct optee_load* load, char* s)
+{
+    char* save = NULL;
+
+    load->nmix = 0;
+    load->weights = 0;
+    for (char* tok = strtok_r(s, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        struct optee_load_op* op = &load->mix[load->nmix];
+        char* end = NULL;
+
+        if (load->nmix == OPTEE_LOAD_MAX_MIX) {
+            return false;
+        }
+
+        op->cmd = strtoul(tok, &end, 0);
+        op->size = 0;
+        op->weight = 1;
+        if (*end == ':') {
+            op->size = strtoul(end + 1, &end, 0);
+        }
+        if (*end == ':') {
+            op->weight = strtoul(end + 1, &end, 0);
+        }
+        if (*end != '\0' || op->weight == 0) {
+            return false;
+        }
+
+        load->weights += op->weight;
+        load->nmix++;
+    }
+
+    return load->nmix > 0;
+}
+
+/* UUID string to the octets OPTEE_MSG_CMD_OPEN_SESSION carries */
+
+static bool optee_load_parse_uuid(struct optee_load* load, const char* s)
+{
+    unsigned int v[11];
+
+    if (sscanf(s, "%8x-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x", &v[0], &v[1],
+            &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9], &v[10])
+        != 11) {
+        return false;
+    }
+
+    load->uuid[0] = v[0] >> 24;
+    load->uuid[1] = v[0] >> 16;
+    load->uuid[2] = v[0] >> 8;
+    load->uuid[3] = v[0];
+    load->uuid[4] = v[1] >> 8;
+    load->uuid[5] = v[1];
+    load->uuid[6] = v[2] >> 8;
+    load->uuid[7] = v[2];
+    for (int i = 0; i < 8; i++) {
+        load->uuid[8 + i] = v[3 + i];
+    }
+
+    return true;
+}
+
+static void optee_load_usage(const char* progname)
+{
+    fprintf(stderr, "Usage: %s -u uuid [-r cpu] [-t threads] [-n requests]"
+                    " [-m cmd:size[:weight],...]\n"
+                    "Open one session per thread and invoke the command mix,\n"
+                    "size is the inout memref payload, 0 for none. -r connects\n"
+                    "over rpmsg to cpu, the local socket is used otherwise.\n"
+                    "Prints a CSV line of threads,requests,errors,req_per_s,\n"
+                    "p50_us,p99_us,max_us\n",
+        progname);
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, char* argv[])
+{
+    struct optee_load load = {
+        .threads = OPTEE_LOAD_THREADS,
+        .requests = OPTEE_LOAD_REQUESTS,
+        .mix = { { 0, 0, 1 } },
+        .nmix = 1,
+        .weights = 1,
+    };
+    struct optee_load_worker* workers = NULL;
+    uint64_t* lat = NULL;
+    bool has_uuid = false;
+    size_t buf_size = 0;
+    unsigned int errors = 0;
+    unsigned int done = 0;
+    unsigned int started = 0;
+    uint64_t start;
+    uint64_t elapsed;
+    int ret = EXIT_FAILURE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:r:t:n:m:h")) != -1) {
+        switch (opt) {
+        case 'u':
+            has_uuid = optee_load_parse_uuid(&load, optarg);
+            break;
+        case 'r':
+            load.cpu = optarg;
+            break;
+        case 't':
+            load.threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            load.requests = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            if (!optee_load_parse_mix(&load, optarg)) {
+                optee_load_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            optee_load_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!has_uuid || load.threads == 0 || load.requests == 0) {
+        optee_load_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (unsigned int i = 0; i < load.nmix; i++) {
+        if (load.mix[i].size > buf_size) {
+            buf_size = load.mix[i].size;
+        }
+    }
+
+    workers = calloc(load.threads, sizeof(*workers));
+    lat = calloc((size_t)load.threads * load.requests, sizeof(*lat));
+    if (!workers || !lat) {
+        fprintf(stderr, "malloc failed\n");
+        goto out;
+    }
+
+    for (unsigned int i = 0; i < load.threads; i++) {
+        workers[i].load = &load;
+        workers[i].seed = i + 1;
+        workers[i].lat = lat + (size_t)i * load.requests;
+        if (buf_size > 0) {
+            workers[i].buf = malloc(buf_size);
+            if (!workers[i].buf) {
+                fprintf(stderr, "malloc failed\n");
+                goto out_free;
+            }
+            memset(workers[i].buf, 0x5a, buf_size);
+        }
+    }
+
+    start = optee_load_now();
+    for (; started < load.threads; started++) {
+        if (pthread_create(&workers[started].thread, NULL, optee_load_worker,
+                &workers[started])
+            != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            break;
+        }
+    }
+
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    elapsed = optee_load_now() - start;
+
+    /* Compact the per-worker latencies and sort them for the percentiles */
+    for (unsigned int i = 0; i < started; i++) {
+        memmove(lat + done, workers[i].lat, workers[i].done * sizeof(*lat));
+        done += workers[i].done;
+        errors += workers[i].errors;
+    }
+
+    qsort(lat, done, sizeof(*lat), optee_load_cmp);
+
+    printf("threads,requests,errors,req_per_s,p50_us,p99_us,max_us\n");
+    printf("%u,%u,%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+        started, done, errors,
+        elapsed ? (uint64_t)done * 1000000000 / elapsed : 0,
+        done ? lat[(done - 1) / 2] / 1000 : 0,
+        done ? lat[(uint64_t)(done - 1) * 99 / 100] / 1000 : 0,
+        done ? lat[done - 1] / 1000 : 0);
+
+    ret = errors || started < load.threads ? EXIT_FAILURE : EXIT_SUCCESS;
+
+out_free:
+    for (unsigned int i = 0; i < load.threads; i++) {
+        free(workers[i].buf);
+    }
+
+out:
+    free(workers);
+    free(lat);
+    return ret;
+}
@@ -19,16 +19,41 @@
  ****************************************************************************/
 
 #include <errno.h>
+#include <fcntl.h>
 #include <initcall.h>
+#include <inttypes.h>
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+#include <kernel/tee_ta_manager.h>
+#include <user_ta_header.h>
+#endif
+#include <kernel/thread_private.h>
+#include <mem_budget.h>
 #include <netpacket/rpmsg.h>
 #include <optee_msg.h>
+#include <optee_stats.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <tee/entry_std.h>
+#include <tee_time_system.h>
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+#include <tee/uuid.h>
+#endif
 #include <trace.h>
+#include <unistd.h>
+#ifdef USER_TA_WASM
+#include <user_ta_wasm_header.h>
+#endif
 
 /****************************************************************************
  * Pre-processor Definitions
@@ -37,6 +62,277 @@
 #define OPTEE_MAX_PARAM_NUM 6
 #define OPTEE_SERVER_REMOTE_PATH "optee"
 
+/* Listeners at most, one per remote CPU of CONFIG_OPTEE_SERVER_RPMSG_CPUS */
+
+#ifdef CONFIG_OPTEE_SERVER_RPMSG
+#define OPTEE_SERVER_MAX_ENDPOINTS 4
+#else
+#define OPTEE_SERVER_MAX_ENDPOINTS 1
+#endif
+
+/* Small enough to stay cheap per connection, large enough to take the
+ * header, all params and a short payload in a single recv.
+ */
+
+#define OPTEE_SERVER_RXBUF_SIZE 512
+
+/* Shm buffers are handed out in page-rounded power of two classes,
+ * OPTEE_SHM_POOL_MIN << i for class i. Larger requests bypass the pool.
+ */
+
+#define OPTEE_SHM_POOL_MIN 4096
+#define OPTEE_SHM_POOL_CLASSES 8
+#define OPTEE_SHM_POOL_HIGH_WATER CONFIG_OPTEE_SERVER_SHM_POOL_HIGH_WATER
+#define OPTEE_SHM_POOL_TRIM CONFIG_OPTEE_SERVER_SHM_POOL_TRIM
+
+#if CONFIG_OPTEE_SERVER_NONCONTIG_MIN > 0
+/* Memrefs from this size on are received into a list of pool pages, the
+ * last entry of each list page links the next one as in OP-TEE.
+ */
+
+#define OPTEE_SERVER_NONCONTIG_MIN CONFIG_OPTEE_SERVER_NONCONTIG_MIN
+#define OPTEE_PAGE_SIZE OPTEE_MSG_NONCONTIG_PAGE_SIZE
+#define OPTEE_PAGE_LIST_ENTRIES (OPTEE_PAGE_SIZE / sizeof(uint64_t) - 1)
+
+/* Reply iovs sent at once, page-list outputs take one per page */
+
+#define OPTEE_REPLY_IOVS 16
+#else
+#define OPTEE_REPLY_IOVS (OPTEE_MAX_PARAM_NUM + 1)
+#endif
+
+/* Vendor extension: optee_msg_arg.pad bits 8..31 carry the milliseconds
+ * the client gives its request before it is cancelled, 0 for no more than
+ * CONFIG_OPTEE_SERVER_REQUEST_TIMEOUT.
+ */
+
+#define OPTEE_MSG_ARG_TIMEOUT_SHIFT 8
+
+#ifdef CONFIG_OPTEE_SERVER_REQUEST_TIMEOUT
+#define OPTEE_SERVER_REQUEST_TIMEOUT CONFIG_OPTEE_SERVER_REQUEST_TIMEOUT
+#else
+#define OPTEE_SERVER_REQUEST_TIMEOUT 0
+#endif
+
+#ifdef CONFIG_OPTEE_SERVER_SHM_WINDOW
+/* Vendor attribute bit: u.rmem.offs is an offset into the shared window
+ * and the payload is not carried over the socket.
+ */
+
+#define OPTEE_MSG_ATTR_SHM_WINDOW (1u << 31)
+#define OPTEE_SERVER_SHM_WINDOW_BASE CONFIG_OPTEE_SERVER_SHM_WINDOW_BASE
+#define OPTEE_SERVER_SHM_WINDOW_SIZE CONFIG_OPTEE_SERVER_SHM_WINDOW_SIZE
+#endif
+
+#ifdef CONFIG_OPTEE_SERVER_DISPATCH_POLL
+#define OPTEE_SERVER_WORKERS CONFIG_OPTEE_SERVER_WORKERS
+#define OPTEE_SERVER_MAX_CLIENTS CONFIG_OPTEE_SERVER_MAX_CLIENTS
+#define OPTEE_SERVER_RECV_TIMEOUT CONFIG_OPTEE_SERVER_RECV_TIMEOUT
+
+/* Every endpoint gets a worker even when there are fewer configured */
+
+#define OPTEE_SERVER_MAX_WORKERS \
+    MAX(OPTEE_SERVER_WORKERS, OPTEE_SERVER_MAX_ENDPOINTS)
+#endif
+
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+#define OPTEE_SERVER_MAX_TAS CONFIG_OPTEE_SERVER_MAX_TAS
+#define OPTEE_SERVER_MAX_SESSIONS CONFIG_OPTEE_SERVER_MAX_SESSIONS
+
+/* Requests at once on a TA that can take several, 0 for no limit */
+
+#if CONFIG_OPTEE_SERVER_TA_CONCURRENCY > 0
+#define OPTEE_SERVER_TA_CONCURRENCY CONFIG_OPTEE_SERVER_TA_CONCURRENCY
+#else
+#define OPTEE_SERVER_TA_CONCURRENCY OPTEE_SERVER_WORKERS
+#endif
+
+/* Vendor extension: optee_msg_arg.pad carries the NuttX priority the
+ * client wants its request served at, 0 for the worker's own priority.
+ */
+
+#define OPTEE_MSG_ARG_PRIO_MASK 0xff
+#endif
+
+#if defined(CONFIG_SMP) && CONFIG_OPTEE_SERVER_CPU_AFFINITY != 0
+#define OPTEE_SERVER_CPU_AFFINITY CONFIG_OPTEE_SERVER_CPU_AFFINITY
+#endif
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+struct optee_conn {
+    int fd;
+
+    /* Serializes replies of requests completing on different workers */
+    pthread_mutex_t send_lock;
+
+    /* Bytes received ahead of the current request */
+    char* rxbuf;
+    size_t rx_head;
+    size_t rx_tail;
+};
+
+/* One request in flight, clients pipelining several requests on a
+ * connection tell the replies apart by optee_msg_arg.cancel_id, which is
+ * echoed back untouched.
+ */
+
+struct optee_request {
+    char buffer[OPTEE_MSG_GET_ARG_SIZE(OPTEE_MAX_PARAM_NUM)];
+    size_t shm_size[OPTEE_MAX_PARAM_NUM];
+    uint64_t window_offs[OPTEE_MAX_PARAM_NUM];
+    uint32_t window;
+#ifdef OPTEE_SERVER_NONCONTIG_MIN
+    uint64_t* pages[OPTEE_MAX_PARAM_NUM];
+    uint64_t noncontig_offs[OPTEE_MAX_PARAM_NUM];
+    uint64_t noncontig_ref[OPTEE_MAX_PARAM_NUM];
+    uint32_t noncontig;
+#endif
+
+    struct optee_shm* shm;
+    struct thread_cancel cancel;
+};
+
+struct optee_shm {
+    struct optee_shm* next;
+    size_t size;
+    max_align_t data[0];
+};
+
+struct optee_shm_pool {
+    pthread_mutex_t lock;
+    struct optee_shm* free[OPTEE_SHM_POOL_CLASSES];
+    size_t cached;
+};
+
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+/* A request parked on the queue of its TA until the TA can take it */
+
+struct optee_sched_req {
+    TAILQ_ENTRY(optee_sched_req) link;
+    int idx; /* Connection the reply goes to */
+    int prio;
+    struct optee_request req;
+};
+
+TAILQ_HEAD(optee_sched_req_head, optee_sched_req);
+
+/* Requests of one TA, at most limit of them run at once. Single instance
+ * TAs are served one request at a time, the others wait here in priority
+ * order instead of each blocking a worker inside the TEE.
+ */
+
+struct optee_ta_queue {
+    bool used;
+    TEE_UUID uuid;
+    int running;
+    int limit;
+    int sessions;
+    struct optee_sched_req_head pending;
+};
+
+struct optee_sched_session {
+    uint32_t id;
+    int ta; /* Index into tas, -1 for a free entry */
+};
+#endif
+
+#ifdef CONFIG_OPTEE_SERVER_DISPATCH_POLL
+enum optee_conn_state {
+    OPTEE_CONN_FREE,
+    OPTEE_CONN_IDLE, /* Polled by the event loop */
+    OPTEE_CONN_BUSY, /* Queued or owned by a worker */
+    OPTEE_CONN_CLOSING, /* Released by a worker, closed by the event loop
+                         * once no request is in flight anymore */
+};
+
+/* A worker thread, with the TA request it runs so waiters can boost it
+ * and the event loop can cancel it
+ */
+
+struct optee_worker {
+    pthread_t thread;
+    int endpoint; /* Endpoint whose connections it picks up */
+    struct optee_request* running; /* Request inside the TEE, or NULL */
+    int idx; /* Connection of the running request */
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+    int ta; /* TA of the running request, -1 if none */
+    int base; /* Priority the worker was created with */
+    int prio; /* Priority it runs at right now */
+#endif
+};
+
+/* A listener with the ready connections accepted on it waiting for one
+ * of its workers, as indexes into conns
+ */
+
+struct optee_endpoint {
+    int fd;
+    pthread_cond_t cond;
+    int queue[OPTEE_SERVER_MAX_CLIENTS];
+    size_t queue_head;
+    size_t queue_count;
+};
+
+struct optee_dispatcher {
+    pthread_mutex_t lock;
+    int wakefd[2];
+
+    struct optee_endpoint endpoints[OPTEE_SERVER_MAX_ENDPOINTS];
+    int nendpoints;
+
+    struct optee_conn conns[OPTEE_SERVER_MAX_CLIENTS];
+    enum optee_conn_state state[OPTEE_SERVER_MAX_CLIENTS];
+    int inflight[OPTEE_SERVER_MAX_CLIENTS];
+    int endpoint[OPTEE_SERVER_MAX_CLIENTS];
+
+    struct pollfd pfds[OPTEE_SERVER_MAX_CLIENTS + OPTEE_SERVER_MAX_ENDPOINTS + 1];
+    int pfd_conn[OPTEE_SERVER_MAX_CLIENTS + OPTEE_SERVER_MAX_ENDPOINTS + 1];
+
+    struct optee_worker workers[OPTEE_SERVER_MAX_WORKERS];
+    int nworkers;
+    int nthreads; /* Workers created and not exited yet */
+    bool stopping; /* Set once the workers must exit */
+    pthread_cond_t exit_cond;
+
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+    struct optee_ta_queue tas[OPTEE_SERVER_MAX_TAS];
+    struct optee_sched_session sessions[OPTEE_SERVER_MAX_SESSIONS];
+#endif
+};
+#endif
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static struct optee_shm_pool g_shm_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static size_t optee_shm_pool_shrink(size_t bytes);
+static struct mem_budget_cache g_shm_budget = MEM_BUDGET_CACHE_INITIALIZER("shm pool", optee_shm_pool_shrink);
+
+/* Bounds the requests running inside the TEE to CFG_NUM_THREADS */
+
+static sem_t g_tee_threads;
+
+#ifdef CONFIG_OPTEE_SERVER_WARMUP
+/* Set once the optee-os modules, initialized in the background after the
+ * socket is bound, can take requests
+ */
+
+static bool g_tee_ready;
+static pthread_mutex_t g_tee_ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_tee_ready_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+#ifdef CONFIG_OPTEE_SERVER_DISPATCH_POLL
+static struct optee_dispatcher g_dispatcher;
+#endif
+
 /****************************************************************************
  * Public Functions Prototypes
  ****************************************************************************/
@@ -45,20 +341,22 @@
  * Private Functions
  ****************************************************************************/
 
-static int optee_bind(void)
+static int optee_bind(const char* cpu)
 {
 #if defined(CONFIG_OPTEE_SERVER_RPMSG)
     const int family = AF_RPMSG;
-    const struct sockaddr_rpmsg addr = {
+    struct sockaddr_rpmsg addr = {
         .rp_family = AF_RPMSG,
-        .rp_cpu = "",
         .rp_name = OPTEE_SERVER_REMOTE_PATH,
     };
     const socklen_t addrlen = sizeof(struct sockaddr_rpmsg);
 
-    DMSG("socket address: --family=rpmsg --name=%s\n",
-        OPTEE_SERVER_REMOTE_PATH);
+    strlcpy(addr.rp_cpu, cpu, sizeof(addr.rp_cpu));
+    DMSG("socket address: --family=rpmsg --cpu=%s --name=%s\n",
+        cpu, OPTEE_SERVER_REMOTE_PATH);
 #elif defined(CONFIG_OPTEE_SERVER_LOCAL)
+    (void)cpu;
+
     const int family = AF_UNIX;
     const struct sockaddr_un addr = {
         .sun_family = AF_UNIX,
@@ -93,193 +391,1578 @@ static int optee_bind(void)
     return fd;
 }
 
-static int optee_recv(int fd, void* msg, size_t size)
+/* Bind a listener per remote CPU of CONFIG_OPTEE_SERVER_RPMSG_CPUS, or a
+ * single one taking all CPUs, returns the number of listeners in fds
+ */
+
+static int optee_bind_endpoints(int* fds)
 {
-    while (size > 0) {
-        ssize_t n = recv(fd, msg, size, 0);
-        if (n <= 0) {
-            if (n < 0)
-                EMSG("recv failed(%d)\n", errno);
-            return -1;
+    int n = 0;
+
+#ifdef CONFIG_OPTEE_SERVER_RPMSG
+    char cpus[] = CONFIG_OPTEE_SERVER_RPMSG_CPUS;
+    char* save = NULL;
+    bool listed = false;
+
+    for (char* cpu = strtok_r(cpus, " ", &save); cpu != NULL;
+         cpu = strtok_r(NULL, " ", &save)) {
+        listed = true;
+        if (n == OPTEE_SERVER_MAX_ENDPOINTS) {
+            EMSG("too many endpoints, drop cpu: %s\n", cpu);
+            break;
         }
 
-        msg += n;
-        size -= n;
+        fds[n] = optee_bind(cpu);
+        if (fds[n] >= 0)
+            n++;
     }
 
-    return 0;
+    if (listed)
+        return n;
+#endif
+
+    fds[n] = optee_bind("");
+    return fds[n] >= 0 ? n + 1 : n;
 }
 
-static int optee_send(int fd, void* msg, size_t size)
+static int optee_shm_class(size_t size)
 {
-    while (size > 0) {
-        ssize_t n = send(fd, msg, size, 0);
-        if (n <= 0) {
-            EMSG("send failed(%d)\n", errno);
-            return -1;
+    size_t class_size = OPTEE_SHM_POOL_MIN;
+
+    for (int i = 0; i < OPTEE_SHM_POOL_CLASSES; i++) {
+        if (size <= class_size)
+            return i;
+        class_size <<= 1;
+    }
+
+    return -1;
+}
+
+/* Check a buffer of at least size bytes out of the shared pool */
+
+static struct optee_shm* optee_shm_get(size_t size)
+{
+    struct optee_shm_pool* pool = &g_shm_pool;
+    struct optee_shm* shm = NULL;
+    int i = optee_shm_class(size);
+
+    if (i >= 0) {
+        size_t cached;
+
+        size = (size_t)OPTEE_SHM_POOL_MIN << i;
+
+        pthread_mutex_lock(&pool->lock);
+        shm = pool->free[i];
+        if (shm != NULL) {
+            pool->free[i] = shm->next;
+            pool->cached -= shm->size;
         }
+        cached = pool->cached;
+        pthread_mutex_unlock(&pool->lock);
 
-        msg += n;
-        size -= n;
+        if (shm != NULL) {
+            mem_budget_update(&g_shm_budget, cached);
+            return shm;
+        }
     }
 
-    return 0;
+    shm = malloc(sizeof(*shm) + size);
+    if (shm == NULL && mem_budget_reclaim(sizeof(*shm) + size))
+        shm = malloc(sizeof(*shm) + size);
+    if (shm == NULL) {
+        EMSG("malloc failed\n");
+        return NULL;
+    }
+
+    shm->size = size;
+    return shm;
 }
 
-static void* optee_thread(void* arg)
+/* Return a buffer, it's freed instead of cached when it's larger than the
+ * trim threshold or the pool already holds the high-water amount.
+ */
+
+static void optee_shm_put(struct optee_shm* shm)
 {
-    char buffer[OPTEE_MSG_GET_ARG_SIZE(OPTEE_MAX_PARAM_NUM)];
-    struct optee_msg_arg* msg = (struct optee_msg_arg*)buffer;
-    struct optee_msg_param* param = (struct optee_msg_param*)(msg + 1);
+    struct optee_shm_pool* pool = &g_shm_pool;
+    int i = optee_shm_class(shm->size);
 
-    void* shm_buf = NULL;
-    size_t shm_buf_size = 0;
+    if (i >= 0 && shm->size <= OPTEE_SHM_POOL_TRIM) {
+        size_t cached;
 
-    int connfd = (intptr_t)arg;
+        pthread_mutex_lock(&pool->lock);
+        if (pool->cached + shm->size <= OPTEE_SHM_POOL_HIGH_WATER) {
+            shm->next = pool->free[i];
+            pool->free[i] = shm;
+            pool->cached += shm->size;
+            shm = NULL;
+        }
+        cached = pool->cached;
+        pthread_mutex_unlock(&pool->lock);
 
-    while (1) {
-        /* Receive struct optee_msg_arg */
-        int ret = optee_recv(connfd, msg, sizeof(*msg));
-        if (ret < 0)
-            break;
+        if (shm == NULL) {
+            mem_budget_update(&g_shm_budget, cached);
+            return;
+        }
+    }
 
-        if (msg->num_params > 0) {
-            /* Receive struct optee_msg_param */
-            ret = optee_recv(connfd, param,
-                sizeof(*param) * msg->num_params);
-            if (ret < 0)
-                break;
-        }
-
-        size_t shm_size[OPTEE_MAX_PARAM_NUM];
-        size_t shm_total = 0;
-        size_t shm_recv = 0;
-
-        for (uint32_t i = 0; i < msg->num_params; i++) {
-            uint32_t attr = param[i].attr & OPTEE_MSG_ATTR_TYPE_MASK;
-            if (attr == OPTEE_MSG_ATTR_TYPE_RMEM_INOUT || attr == OPTEE_MSG_ATTR_TYPE_RMEM_INPUT) {
-                shm_size[i] = param[i].u.rmem.size;
-                shm_total += param[i].u.rmem.size;
-                shm_recv += param[i].u.rmem.size;
-            } else if (attr == OPTEE_MSG_ATTR_TYPE_RMEM_OUTPUT) {
-                shm_size[i] = param[i].u.rmem.size;
-                shm_total += param[i].u.rmem.size;
-            }
+    free(shm);
+}
+
+/* Memory budget shrink: free idle buffers, the largest classes first */
+
+static size_t optee_shm_pool_shrink(size_t bytes)
+{
+    struct optee_shm_pool* pool = &g_shm_pool;
+    struct optee_shm* list = NULL;
+    struct optee_shm* shm = NULL;
+    size_t freed = 0;
+    size_t cached;
+
+    if (pthread_mutex_trylock(&pool->lock) != 0)
+        return 0;
+
+    for (int i = OPTEE_SHM_POOL_CLASSES - 1; i >= 0 && freed < bytes; i--) {
+        while ((shm = pool->free[i]) != NULL && freed < bytes) {
+            pool->free[i] = shm->next;
+            pool->cached -= shm->size;
+            freed += shm->size;
+            shm->next = list;
+            list = shm;
         }
+    }
 
-        void* shm_tmp = shm_buf;
-        if (shm_total > shm_buf_size) {
-            shm_tmp = realloc(shm_buf, shm_total);
-            if (shm_tmp == NULL) {
-                EMSG("realloc failed\n");
-                break;
-            }
+    cached = pool->cached;
+    pthread_mutex_unlock(&pool->lock);
 
-            shm_buf = shm_tmp;
-            shm_buf_size = shm_total;
+    while ((shm = list) != NULL) {
+        list = shm->next;
+        free(shm);
+    }
+
+    mem_budget_update(&g_shm_budget, cached);
+    return freed;
+}
+
+static int optee_recv_raw(int fd, void* msg, size_t size)
+{
+    ssize_t n = recv(fd, msg, size, 0);
+    if (n <= 0) {
+        if (n < 0)
+            EMSG("recv failed(%d)\n", errno);
+        return -1;
+    }
+
+    return n;
+}
+
+/* Read through a small per-connection buffer, so a request whose header,
+ * params and payload arrive together costs a single recv. Large payloads
+ * bypass the buffer and land directly in the destination.
+ */
+
+static int optee_recv(struct optee_conn* conn, void* msg, size_t size)
+{
+    while (size > 0) {
+        if (conn->rx_head < conn->rx_tail) {
+            size_t n = MIN(size, conn->rx_tail - conn->rx_head);
+            memcpy(msg, conn->rxbuf + conn->rx_head, n);
+            conn->rx_head += n;
+            msg += n;
+            size -= n;
+            continue;
         }
 
-        if (shm_recv > 0) {
-            ret = optee_recv(connfd, shm_tmp, shm_recv);
-            if (ret < 0)
-                break;
+        if (size >= OPTEE_SERVER_RXBUF_SIZE) {
+            int n = optee_recv_raw(conn->fd, msg, size);
+            if (n < 0)
+                return -1;
+
+            msg += n;
+            size -= n;
+            continue;
         }
 
-        void* shm_end = shm_tmp + shm_total;
-        for (uint32_t i = 0; i < msg->num_params; i++) {
-            uint32_t attr = param[i].attr & OPTEE_MSG_ATTR_TYPE_MASK;
-            if (attr == OPTEE_MSG_ATTR_TYPE_RMEM_INOUT || attr == OPTEE_MSG_ATTR_TYPE_RMEM_INPUT) {
-                param[i].u.rmem.shm_ref = (uintptr_t)shm_tmp;
-                shm_tmp += shm_size[i];
-            } else if (attr == OPTEE_MSG_ATTR_TYPE_RMEM_OUTPUT) {
-                shm_end -= shm_size[i];
-                param[i].u.rmem.shm_ref = (uintptr_t)shm_end;
+        if (conn->rxbuf == NULL) {
+            conn->rxbuf = malloc(OPTEE_SERVER_RXBUF_SIZE);
+            if (conn->rxbuf == NULL) {
+                EMSG("malloc failed\n");
+                return -1;
             }
         }
 
-        /* Call optee-os entry function */
-        ret = tee_entry_std(msg, msg->num_params);
-        if (ret < 0) {
-            EMSG("optee_ioctl failed(%d)\n", ret);
-            break;
+        int n = optee_recv_raw(conn->fd, conn->rxbuf,
+            OPTEE_SERVER_RXBUF_SIZE);
+        if (n < 0)
+            return -1;
+
+        conn->rx_head = 0;
+        conn->rx_tail = n;
+    }
+
+    return 0;
+}
+
+static bool optee_recv_pending(struct optee_conn* conn)
+{
+    return conn->rx_head < conn->rx_tail;
+}
+
+static int optee_sendv(int fd, struct iovec* iov, int iovcnt)
+{
+    struct msghdr hdr = { 0 };
+
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = iovcnt;
+
+    while (hdr.msg_iovlen > 0) {
+        ssize_t n = sendmsg(fd, &hdr, 0);
+        if (n <= 0) {
+            EMSG("send failed(%d)\n", errno);
+            return -1;
         }
 
-        /* Send optee_msg_arg and optee_msg_param */
-        ret = optee_send(connfd, msg,
-            OPTEE_MSG_GET_ARG_SIZE(msg->num_params));
-        if (ret < 0)
-            break;
+        /* Skip what was sent, sendmsg may stop in the middle of an iov */
+        while (hdr.msg_iovlen > 0 && (size_t)n >= hdr.msg_iov->iov_len) {
+            n -= hdr.msg_iov->iov_len;
+            hdr.msg_iov++;
+            hdr.msg_iovlen--;
+        }
 
-        for (uint32_t i = 0; i < msg->num_params; i++) {
-            uint32_t attr = param[i].attr & OPTEE_MSG_ATTR_TYPE_MASK;
-            if (attr == OPTEE_MSG_ATTR_TYPE_RMEM_OUTPUT || attr == OPTEE_MSG_ATTR_TYPE_RMEM_INOUT) {
-                shm_tmp = (void*)(uintptr_t)param[i].u.rmem.shm_ref;
-                /* Send inout and out data of shered memory */
-                ret = optee_send(connfd, shm_tmp,
-                    MIN(shm_size[i], param[i].u.rmem.size));
-                if (ret < 0)
-                    break;
-            }
+        if (hdr.msg_iovlen > 0) {
+            hdr.msg_iov->iov_base += n;
+            hdr.msg_iov->iov_len -= n;
         }
     }
 
-    free(shm_buf);
-    close(connfd);
     return 0;
 }
 
-static void optee_server(int fd)
+#ifdef CONFIG_OPTEE_SERVER_SHM_WINDOW
+/* Only RMEM params carry u.rmem, the bit means nothing on the others */
+
+static bool optee_param_in_window(struct optee_msg_param* param)
 {
-    pthread_attr_t attr;
+    uint32_t attr = param->attr & OPTEE_MSG_ATTR_TYPE_MASK;
 
-    int status = pthread_attr_init(&attr);
-    if (status != 0) {
-        EMSG("pthread_attr_init failed(%d)\n", status);
-        return;
+    return (param->attr & OPTEE_MSG_ATTR_SHM_WINDOW)
+        && (attr == OPTEE_MSG_ATTR_TYPE_RMEM_INPUT
+            || attr == OPTEE_MSG_ATTR_TYPE_RMEM_OUTPUT
+            || attr == OPTEE_MSG_ATTR_TYPE_RMEM_INOUT);
+}
+
+/* Point the param straight into the window, the TA works on the client
+ * buffer in place instead of a copy received into a shm buffer.
+ */
+
+static int optee_param_map_window(struct optee_msg_param* param)
+{
+    uint64_t offs = param->u.rmem.offs;
+    uint64_t size = param->u.rmem.size;
+
+    if (offs > OPTEE_SERVER_SHM_WINDOW_SIZE
+        || size > OPTEE_SERVER_SHM_WINDOW_SIZE - offs) {
+        EMSG("shm window overflow(0x%llx, 0x%llx)\n",
+            (unsigned long long)offs, (unsigned long long)size);
+        return -1;
     }
 
-    status = pthread_attr_setstacksize(&attr,
-        CONFIG_OPTEE_NATIVE_STACKSIZE);
-    if (status != 0) {
-        EMSG("pthread_attr_setstacksize failed(%d)\n", status);
-        return;
+    param->u.rmem.shm_ref = OPTEE_SERVER_SHM_WINDOW_BASE + offs;
+    param->u.rmem.offs = 0;
+    param->attr &= ~OPTEE_MSG_ATTR_SHM_WINDOW;
+    return 0;
+}
+
+/* Hand the window reference back as the client passed it */
+
+static void optee_param_unmap_window(struct optee_msg_param* param,
+    uint64_t offs)
+{
+    param->attr |= OPTEE_MSG_ATTR_SHM_WINDOW;
+    param->u.rmem.offs = offs;
+    param->u.rmem.shm_ref = 0;
+}
+#else
+#define optee_param_in_window(param) false
+#define optee_param_map_window(param) (-1)
+#define optee_param_unmap_window(param, offs) ((void)(offs))
+#endif
+
+#ifdef OPTEE_SERVER_NONCONTIG_MIN
+static bool optee_param_noncontig(struct optee_msg_param* param)
+{
+    uint32_t attr = param->attr & OPTEE_MSG_ATTR_TYPE_MASK;
+
+    return (attr == OPTEE_MSG_ATTR_TYPE_RMEM_INPUT
+               || attr == OPTEE_MSG_ATTR_TYPE_RMEM_OUTPUT
+               || attr == OPTEE_MSG_ATTR_TYPE_RMEM_INOUT)
+        && param->u.rmem.size >= OPTEE_SERVER_NONCONTIG_MIN;
+}
+
+/* Pages come out of the shm pool, a page is the data of its optee_shm */
+
+static void* optee_page_get(void)
+{
+    struct optee_shm* shm = optee_shm_get(OPTEE_PAGE_SIZE);
+
+    return shm != NULL ? shm->data : NULL;
+}
+
+static void optee_page_put(void* page)
+{
+    optee_shm_put((struct optee_shm*)((char*)page
+        - offsetof(struct optee_shm, data)));
+}
+
+/* Data page n of a page list */
+
+static void* optee_page(uint64_t* list, size_t n)
+{
+    while (n >= OPTEE_PAGE_LIST_ENTRIES) {
+        list = (uint64_t*)(uintptr_t)list[OPTEE_PAGE_LIST_ENTRIES];
+        n -= OPTEE_PAGE_LIST_ENTRIES;
     }
 
-    status = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    if (status != 0) {
-        EMSG("pthread_attr_setdetachstate failed(%d)\n", status);
-        return;
+    return (void*)(uintptr_t)list[n];
+}
+
+static void optee_pages_free(uint64_t* list)
+{
+    while (list != NULL) {
+        uint64_t* next = (uint64_t*)(uintptr_t)list[OPTEE_PAGE_LIST_ENTRIES];
+
+        for (size_t i = 0; i < OPTEE_PAGE_LIST_ENTRIES && list[i]; i++)
+            optee_page_put((void*)(uintptr_t)list[i]);
+
+        optee_page_put(list);
+        list = next;
     }
+}
 
-    while (1) {
-        DMSG("waiting tee client...\n");
-        int newfd = accept(fd, NULL, NULL);
-        if (newfd < 0)
-            continue;
-        DMSG("accepted, newfd: %d\n", newfd);
+/* Build the page list of a size bytes buffer, unused entries are zero */
 
-        status = pthread_create(NULL, &attr, optee_thread,
-            (void*)(intptr_t)newfd);
-        if (status != 0) {
-            EMSG("pthread_create failed(%d)\n", status);
-            close(newfd);
+static uint64_t* optee_pages_alloc(size_t size)
+{
+    size_t num_pages = (size + OPTEE_PAGE_SIZE - 1) / OPTEE_PAGE_SIZE;
+    uint64_t* head = NULL;
+    uint64_t* list = NULL;
+
+    for (size_t n = 0; n < num_pages; n++) {
+        size_t i = n % OPTEE_PAGE_LIST_ENTRIES;
+
+        if (i == 0) {
+            uint64_t* next = optee_page_get();
+            if (next == NULL)
+                goto err;
+
+            memset(next, 0, OPTEE_PAGE_SIZE);
+            if (list != NULL)
+                list[OPTEE_PAGE_LIST_ENTRIES] = (uintptr_t)next;
+            else
+                head = next;
+            list = next;
         }
+
+        void* page = optee_page_get();
+        if (page == NULL)
+            goto err;
+
+        list[i] = (uintptr_t)page;
     }
+
+    return head;
+
+err:
+    optee_pages_free(head);
+    return NULL;
 }
 
-/****************************************************************************
- * Public Functions
- ****************************************************************************/
+/* Back the param with a page list, the TEE sees it as non-contiguous
+ * tmem whose buf_ptr is the first list page.
+ */
 
-int main(int argc, char* argv[])
+static int optee_param_map_pages(struct optee_request* req,
+    struct optee_msg_param* param, uint32_t i)
 {
-    /* Initialize optee-os modules */
-    call_initcalls();
+    uint32_t attr = param->attr & OPTEE_MSG_ATTR_TYPE_MASK;
 
-    int fd = optee_bind();
-    if (fd >= 0) {
-        optee_server(fd);
-        close(fd);
+    req->pages[i] = optee_pages_alloc(param->u.rmem.size);
+    if (req->pages[i] == NULL)
+        return -1;
+
+    req->noncontig_offs[i] = param->u.rmem.offs;
+    req->noncontig_ref[i] = param->u.rmem.shm_ref;
+    req->noncontig |= 1u << i;
+
+    param->attr = (param->attr & ~OPTEE_MSG_ATTR_TYPE_MASK)
+        | (attr - OPTEE_MSG_ATTR_TYPE_RMEM_INPUT
+            + OPTEE_MSG_ATTR_TYPE_TMEM_INPUT)
+        | OPTEE_MSG_ATTR_NONCONTIG;
+    param->u.tmem.buf_ptr = (uintptr_t)req->pages[i];
+    param->u.tmem.shm_ref = 0;
+    return 0;
+}
+
+/* Hand the rmem reference back as the client passed it */
+
+static void optee_param_unmap_pages(struct optee_request* req,
+    struct optee_msg_param* param, uint32_t i)
+{
+    uint32_t attr = param->attr & OPTEE_MSG_ATTR_TYPE_MASK;
+    uint64_t size = param->u.tmem.size;
+
+    param->attr = (param->attr
+                      & ~(OPTEE_MSG_ATTR_TYPE_MASK | OPTEE_MSG_ATTR_NONCONTIG))
+        | (attr - OPTEE_MSG_ATTR_TYPE_TMEM_INPUT
+            + OPTEE_MSG_ATTR_TYPE_RMEM_INPUT);
+    param->u.rmem.offs = req->noncontig_offs[i];
+    param->u.rmem.size = size;
+    param->u.rmem.shm_ref = req->noncontig_ref[i];
+}
+
+static int optee_pages_recv(struct optee_conn* conn, uint64_t* list,
+    size_t size)
+{
+    for (size_t n = 0; size > 0; n++) {
+        size_t len = MIN(size, OPTEE_PAGE_SIZE);
+
+        if (optee_recv(conn, optee_page(list, n), len) < 0)
+            return -1;
+
+        size -= len;
+    }
+
+    return 0;
+}
+
+#define optee_request_noncontig(req, i) ((req)->noncontig & (1u << (i)))
+#else
+#define optee_param_noncontig(param) false
+#define optee_param_map_pages(req, param, i) (-1)
+#define optee_param_unmap_pages(req, param, i) ((void)0)
+#define optee_request_noncontig(req, i) false
+#endif
+
+static void optee_request_init(struct optee_request* req)
+{
+    req->shm = NULL;
+#ifdef OPTEE_SERVER_NONCONTIG_MIN
+    req->noncontig = 0;
+#endif
+}
+
+static void optee_request_release(struct optee_request* req)
+{
+    if (req->shm != NULL) {
+        optee_shm_put(req->shm);
+        req->shm = NULL;
+    }
+
+#ifdef OPTEE_SERVER_NONCONTIG_MIN
+    for (uint32_t i = 0; req->noncontig != 0; i++) {
+        if (req->noncontig & (1u << i)) {
+            optee_pages_free(req->pages[i]);
+            req->noncontig &= ~(1u << i);
+        }
+    }
+#endif
+}
+
+/* Deadline of a request, the client can only make it shorter than the
+ * configured one
+ */
+
+static uint32_t optee_request_timeout(struct optee_msg_arg* msg)
+{
+    uint32_t timeout = msg->pad >> OPTEE_MSG_ARG_TIMEOUT_SHIFT;
+
+    if (OPTEE_SERVER_REQUEST_TIMEOUT > 0
+        && (timeout == 0 || timeout > OPTEE_SERVER_REQUEST_TIMEOUT))
+        timeout = OPTEE_SERVER_REQUEST_TIMEOUT;
+
+    return timeout;
+}
+
+/* Receive one request from the connection, returns -1 once it must be
+ * closed
+ */
+
+static int optee_request_recv(struct optee_conn* conn,
+    struct optee_request* req)
+{
+    struct optee_msg_arg* msg = (struct optee_msg_arg*)req->buffer;
+    struct optee_msg_param* param = (struct optee_msg_param*)(msg + 1);
+    size_t* shm_size = req->shm_size;
+
+    /* Receive struct optee_msg_arg */
+    int ret = optee_recv(conn, msg, sizeof(*msg));
+    if (ret < 0)
+        return -1;
+
+    if (msg->num_params > OPTEE_MAX_PARAM_NUM) {
+        EMSG("too many params(%u)\n", msg->num_params);
+        return -1;
+    }
+
+    thread_cancel_init(&req->cancel, optee_request_timeout(msg));
+
+    if (msg->num_params > 0) {
+        /* Receive struct optee_msg_param */
+        ret = optee_recv(conn, param,
+            sizeof(*param) * msg->num_params);
+        if (ret < 0)
+            return -1;
+    }
+
+    size_t shm_total = 0;
+    size_t shm_recv = 0;
+
+    uint32_t noncontig = 0;
+
+    req->window = 0;
+
+    for (uint32_t i = 0; i < msg->num_params; i++) {
+        uint32_t attr = param[i].attr & OPTEE_MSG_ATTR_TYPE_MASK;
+        if (optee_param_in_window(&param[i])) {
+            req->window_offs[i] = param[i].u.rmem.offs;
+            if (optee_param_map_window(&param[i]) < 0)
+                return -1;
+
+            req->window |= 1u << i;
+        } else if (optee_param_noncontig(&param[i])) {
+            shm_size[i] = param[i].u.rmem.size;
+            noncontig |= 1u << i;
+        } else if (attr == OPTEE_MSG_ATTR_TYPE_RMEM_INOUT || attr == OPTEE_MSG_ATTR_TYPE_RMEM_INPUT) {
+            shm_size[i] = param[i].u.rmem.size;
+            shm_total += param[i].u.rmem.size;
+            shm_recv += param[i].u.rmem.size;
+        } else if (attr == OPTEE_MSG_ATTR_TYPE_RMEM_OUTPUT) {
+            shm_size[i] = param[i].u.rmem.size;
+            shm_total += param[i].u.rmem.size;
+        }
+    }
+
+    void* shm_tmp = NULL;
+    if (shm_total > 0) {
+        req->shm = optee_shm_get(shm_total);
+        if (req->shm == NULL)
+            return -1;
+
+        shm_tmp = req->shm->data;
+    }
+
+    void* shm_in = shm_tmp;
+    void* shm_end = shm_tmp + shm_total;
+    for (uint32_t i = 0; i < msg->num_params; i++) {
+        uint32_t attr = param[i].attr & OPTEE_MSG_ATTR_TYPE_MASK;
+        if (req->window & (1u << i)) {
+            continue;
+        } else if (noncontig & (1u << i)) {
+            if (optee_param_map_pages(req, &param[i], i) < 0) {
+                optee_request_release(req);
+                return -1;
+            }
+        } else if (attr == OPTEE_MSG_ATTR_TYPE_RMEM_INOUT || attr == OPTEE_MSG_ATTR_TYPE_RMEM_INPUT) {
+            param[i].u.rmem.shm_ref = (uintptr_t)shm_tmp;
+            shm_tmp += shm_size[i];
+        } else if (attr == OPTEE_MSG_ATTR_TYPE_RMEM_OUTPUT) {
+            shm_end -= shm_size[i];
+            param[i].u.rmem.shm_ref = (uintptr_t)shm_end;
+        }
+    }
+
+    if (noncontig == 0) {
+        if (shm_recv > 0 && optee_recv(conn, shm_in, shm_recv) < 0) {
+            optee_request_release(req);
+            return -1;
+        }
+
+        return 0;
+    }
+
+#ifdef OPTEE_SERVER_NONCONTIG_MIN
+    /* The client sends the input payloads in param order, receive each
+     * into its own block or page list
+     */
+
+    for (uint32_t i = 0; i < msg->num_params; i++) {
+        uint32_t attr = param[i].attr & OPTEE_MSG_ATTR_TYPE_MASK;
+        if (req->window & (1u << i)) {
+            continue;
+        } else if (noncontig & (1u << i)) {
+            if (attr == OPTEE_MSG_ATTR_TYPE_TMEM_INPUT || attr == OPTEE_MSG_ATTR_TYPE_TMEM_INOUT)
+                ret = optee_pages_recv(conn, req->pages[i], shm_size[i]);
+        } else if (attr == OPTEE_MSG_ATTR_TYPE_RMEM_INOUT || attr == OPTEE_MSG_ATTR_TYPE_RMEM_INPUT) {
+            ret = optee_recv(conn, (void*)(uintptr_t)param[i].u.rmem.shm_ref,
+                shm_size[i]);
+        }
+
+        if (ret < 0) {
+            optee_request_release(req);
+            return -1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+#ifdef CONFIG_OPTEE_SERVER_WARMUP
+static void optee_wait_ready(void)
+{
+    if (__atomic_load_n(&g_tee_ready, __ATOMIC_ACQUIRE))
+        return;
+
+    pthread_mutex_lock(&g_tee_ready_lock);
+    while (!g_tee_ready)
+        pthread_cond_wait(&g_tee_ready_cond, &g_tee_ready_lock);
+    pthread_mutex_unlock(&g_tee_ready_lock);
+}
+#else
+#define optee_wait_ready()
+#endif
+
+/* Run a received request and send its reply, returns -1 once the
+ * connection must be closed
+ */
+
+static int optee_request_exec(struct optee_conn* conn,
+    struct optee_request* req)
+{
+    struct optee_msg_arg* msg = (struct optee_msg_arg*)req->buffer;
+    struct optee_msg_param* param = (struct optee_msg_param*)(msg + 1);
+    uint32_t cmd = msg->cmd;
+
+    /* A cancel only flags the session it targets, it must not wait for
+     * a TEE thread held by the very request it cancels
+     */
+
+    bool throttled = cmd != OPTEE_MSG_CMD_CANCEL;
+
+    /* Call optee-os entry function */
+    optee_wait_ready();
+    while (throttled && sem_wait(&g_tee_threads) < 0 && errno == EINTR)
+        ;
+    uint64_t start = optee_stats_now();
+
+    /* Closing a session always runs to the end, so the TA can let go of
+     * what the session holds
+     */
+
+    bool cancellable = cmd == OPTEE_MSG_CMD_OPEN_SESSION || cmd == OPTEE_MSG_CMD_INVOKE_COMMAND;
+    if (cancellable)
+        thread_set_cancel(&req->cancel);
+    int ret = tee_entry_std(msg, msg->num_params);
+    if (cancellable)
+        thread_set_cancel(NULL);
+    optee_stats_record(OPTEE_STATS_STD, cmd, start, ret < 0 ? TEE_ERROR_GENERIC : msg->ret);
+    if (throttled)
+        sem_post(&g_tee_threads);
+    if (ret < 0) {
+        EMSG("optee_ioctl failed(%d)\n", ret);
+        optee_request_release(req);
+        return -1;
+    }
+
+    /* Restore the params as the client passed them before any of the
+     * header goes out
+     */
+
+    for (uint32_t i = 0; i < msg->num_params; i++) {
+        if (req->window & (1u << i))
+            optee_param_unmap_window(&param[i], req->window_offs[i]);
+        else if (optee_request_noncontig(req, i))
+            optee_param_unmap_pages(req, &param[i], i);
+    }
+
+    /* Send optee_msg_arg, optee_msg_param and the inout and out data of
+     * shared memory in one go, or in batches of iovs for page lists
+     */
+
+    struct iovec iov[OPTEE_REPLY_IOVS];
+    int iovcnt = 0;
+
+    iov[iovcnt].iov_base = msg;
+    iov[iovcnt++].iov_len = OPTEE_MSG_GET_ARG_SIZE(msg->num_params);
+
+    pthread_mutex_lock(&conn->send_lock);
+    ret = 0;
+    for (uint32_t i = 0; i < msg->num_params && ret >= 0; i++) {
+        uint32_t attr = param[i].attr & OPTEE_MSG_ATTR_TYPE_MASK;
+        size_t size = MIN(req->shm_size[i], param[i].u.rmem.size);
+        if (req->window & (1u << i)) {
+            continue;
+        } else if (attr != OPTEE_MSG_ATTR_TYPE_RMEM_OUTPUT && attr != OPTEE_MSG_ATTR_TYPE_RMEM_INOUT) {
+            continue;
+        }
+
+#ifdef OPTEE_SERVER_NONCONTIG_MIN
+        if (optee_request_noncontig(req, i)) {
+            for (size_t n = 0; size > 0 && ret >= 0; n++) {
+                size_t len = MIN(size, OPTEE_PAGE_SIZE);
+
+                if (iovcnt == OPTEE_REPLY_IOVS) {
+                    ret = optee_sendv(conn->fd, iov, iovcnt);
+                    iovcnt = 0;
+                }
+
+                iov[iovcnt].iov_base = optee_page(req->pages[i], n);
+                iov[iovcnt++].iov_len = len;
+                size -= len;
+            }
+
+            continue;
+        }
+
+        if (iovcnt == OPTEE_REPLY_IOVS) {
+            ret = optee_sendv(conn->fd, iov, iovcnt);
+            iovcnt = 0;
+        }
+#endif
+
+        iov[iovcnt].iov_base = (void*)(uintptr_t)param[i].u.rmem.shm_ref;
+        iov[iovcnt++].iov_len = size;
+    }
+
+    if (ret >= 0)
+        ret = optee_sendv(conn->fd, iov, iovcnt);
+    pthread_mutex_unlock(&conn->send_lock);
+
+    /* Return the shm buffer to the pool for the next request */
+    optee_request_release(req);
+    return ret;
+}
+
+static void optee_conn_init(struct optee_conn* conn, int fd)
+{
+    conn->fd = fd;
+    conn->rxbuf = NULL;
+    conn->rx_head = 0;
+    conn->rx_tail = 0;
+    pthread_mutex_init(&conn->send_lock, NULL);
+}
+
+static void optee_conn_release(struct optee_conn* conn)
+{
+    pthread_mutex_destroy(&conn->send_lock);
+    free(conn->rxbuf);
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+#ifdef OPTEE_SERVER_CPU_AFFINITY
+static void optee_cpuset(cpu_set_t* cpus)
+{
+    CPU_ZERO(cpus);
+    for (int cpu = 0; cpu < CONFIG_SMP_NCPUS; cpu++) {
+        if (OPTEE_SERVER_CPU_AFFINITY & (1u << cpu))
+            CPU_SET(cpu, cpus);
+    }
+}
+#endif
+
+static int optee_thread_attr_init(pthread_attr_t* attr)
+{
+    int status = pthread_attr_init(attr);
+    if (status != 0) {
+        EMSG("pthread_attr_init failed(%d)\n", status);
+        return status;
+    }
+
+    status = pthread_attr_setstacksize(attr,
+        CONFIG_OPTEE_NATIVE_STACKSIZE);
+    if (status != 0) {
+        EMSG("pthread_attr_setstacksize failed(%d)\n", status);
+        return status;
+    }
+
+    status = pthread_attr_setdetachstate(attr, PTHREAD_CREATE_DETACHED);
+    if (status != 0) {
+        EMSG("pthread_attr_setdetachstate failed(%d)\n", status);
+        return status;
+    }
+
+    /* Serve requests at the server priority, not the pthread default */
+    struct sched_param param = {
+        .sched_priority = CONFIG_OPTEE_SERVER_PRIORITY,
+    };
+
+    status = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+    if (status == 0)
+        status = pthread_attr_setschedparam(attr, &param);
+    if (status != 0) {
+        EMSG("pthread_attr_setschedparam failed(%d)\n", status);
+        return status;
+    }
+
+#ifdef OPTEE_SERVER_CPU_AFFINITY
+    cpu_set_t cpus;
+
+    optee_cpuset(&cpus);
+    status = pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+    if (status != 0) {
+        EMSG("pthread_attr_setaffinity_np failed(%d)\n", status);
+        return status;
+    }
+#endif
+
+    return 0;
+}
+
+#ifdef CONFIG_OPTEE_SERVER_DISPATCH_POLL
+static void optee_dispatcher_wakeup(struct optee_dispatcher* d)
+{
+    char c = 0;
+
+    if (write(d->wakefd[1], &c, sizeof(c)) < 0 && errno != EAGAIN)
+        EMSG("wakeup failed(%d)\n", errno);
+}
+
+static void optee_dispatcher_enqueue(struct optee_dispatcher* d, int idx)
+{
+    struct optee_endpoint* ep = &d->endpoints[d->endpoint[idx]];
+
+    d->state[idx] = OPTEE_CONN_BUSY;
+    ep->queue[(ep->queue_head + ep->queue_count) % OPTEE_SERVER_MAX_CLIENTS] = idx;
+    ep->queue_count++;
+    pthread_cond_signal(&ep->cond);
+}
+
+/* Called with the lock held once connection idx is gone, nobody is left
+ * to take the replies of its requests
+ */
+
+static void optee_dispatcher_cancel(struct optee_dispatcher* d, int idx)
+{
+    for (int i = 0; i < d->nworkers; i++) {
+        struct optee_worker* w = &d->workers[i];
+        if (w->running && w->idx == idx)
+            thread_cancel_fire(&w->running->cancel);
+    }
+
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+    struct optee_sched_req* sreq = NULL;
+
+    for (int i = 0; i < OPTEE_SERVER_MAX_TAS; i++) {
+        TAILQ_FOREACH(sreq, &d->tas[i].pending, link)
+        {
+            if (sreq->idx == idx)
+                thread_cancel_fire(&sreq->req.cancel);
+        }
+    }
+#endif
+}
+
+/* Called with the lock held, cancels the running requests past their
+ * deadline and returns the poll timeout until the next one, -1 for none
+ */
+
+static int optee_dispatcher_expire(struct optee_dispatcher* d)
+{
+    uint64_t now = tee_time_system_ns();
+    int timeout = -1;
+
+    for (int i = 0; i < d->nworkers; i++) {
+        struct optee_worker* w = &d->workers[i];
+        struct thread_cancel* c = w->running ? &w->running->cancel : NULL;
+        if (c == NULL || c->deadline == 0 || thread_cancel_fired(c))
+            continue;
+
+        if (c->deadline <= now) {
+            DMSG("request of fd %d past its deadline\n", d->conns[w->idx].fd);
+            thread_cancel_fire(c);
+            continue;
+        }
+
+        int ms = (c->deadline - now + 999999) / 1000000;
+        if (timeout < 0 || ms < timeout)
+            timeout = ms;
+    }
+
+    return timeout;
+}
+
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+static int optee_sched_ta_get(struct optee_dispatcher* d, const TEE_UUID* uuid)
+{
+    int free = -1;
+
+    for (int i = 0; i < OPTEE_SERVER_MAX_TAS; i++) {
+        if (!d->tas[i].used) {
+            if (free < 0)
+                free = i;
+        } else if (!memcmp(&d->tas[i].uuid, uuid, sizeof(*uuid))) {
+            return i;
+        }
+    }
+
+    if (free >= 0) {
+        struct optee_ta_queue* q = &d->tas[free];
+
+        /* Until the TA is loaded assume it is single instance */
+        q->used = true;
+        q->uuid = *uuid;
+        q->running = 0;
+        q->limit = 1;
+        q->sessions = 0;
+        TAILQ_INIT(&q->pending);
+    }
+
+    return free;
+}
+
+static void optee_sched_ta_put(struct optee_dispatcher* d, int ta)
+{
+    struct optee_ta_queue* q = &d->tas[ta];
+
+    if (q->sessions == 0 && q->running == 0 && TAILQ_EMPTY(&q->pending))
+        q->used = false;
+}
+
+static struct optee_sched_session* optee_sched_session(
+    struct optee_dispatcher* d, uint32_t id, int ta)
+{
+    for (int i = 0; i < OPTEE_SERVER_MAX_SESSIONS; i++) {
+        if (d->sessions[i].ta == ta && (ta < 0 || d->sessions[i].id == id))
+            return &d->sessions[i];
+    }
+
+    return NULL;
+}
+
+/* Called with the lock held: run the worker at prio, 0 for its base */
+
+static void optee_sched_set_prio(struct optee_worker* w, int prio)
+{
+    int min = sched_get_priority_min(SCHED_FIFO);
+    int max = sched_get_priority_max(SCHED_FIFO);
+
+    prio = MIN(MAX(prio ? prio : w->base, min), max);
+    if (prio != w->prio && pthread_setschedprio(w->thread, prio) == 0)
+        w->prio = prio;
+}
+
+/* Priority inheritance: the workers running requests of a TA run at
+ * least at the priority of the requests parked on it
+ */
+
+static void optee_sched_boost(struct optee_dispatcher* d, int ta, int prio)
+{
+    for (int i = 0; i < d->nworkers; i++) {
+        struct optee_worker* w = &d->workers[i];
+
+        if (w->ta == ta && prio > w->prio)
+            optee_sched_set_prio(w, prio);
+    }
+}
+
+/* TA queue a request belongs to, -1 for requests served right away */
+
+static int optee_sched_classify(struct optee_dispatcher* d,
+    struct optee_msg_arg* msg)
+{
+    struct optee_msg_param* param = (struct optee_msg_param*)(msg + 1);
+    struct optee_sched_session* sess = NULL;
+    TEE_UUID uuid;
+
+    switch (msg->cmd) {
+    case OPTEE_MSG_CMD_OPEN_SESSION:
+        if (msg->num_params < 1 || !(param[0].attr & OPTEE_MSG_ATTR_META))
+            return -1;
+
+        tee_uuid_from_octets(&uuid, (const uint8_t*)&param[0].u.value);
+        return optee_sched_ta_get(d, &uuid);
+
+    case OPTEE_MSG_CMD_INVOKE_COMMAND:
+    case OPTEE_MSG_CMD_CLOSE_SESSION:
+        for (int i = 0; i < OPTEE_SERVER_MAX_SESSIONS; i++) {
+            sess = &d->sessions[i];
+            if (sess->ta >= 0 && sess->id == msg->session)
+                return sess->ta;
+        }
+        return -1;
+
+    default:
+        return -1;
+    }
+}
+
+/* Called with the lock held once a request is received. Returns true if
+ * the caller runs the request now, false once it is parked on its TA.
+ */
+
+static bool optee_sched_submit(struct optee_dispatcher* d,
+    struct optee_worker* w, int idx, struct optee_request* req, int* ta)
+{
+    struct optee_msg_arg* msg = (struct optee_msg_arg*)req->buffer;
+    int prio = msg->pad & OPTEE_MSG_ARG_PRIO_MASK;
+    struct optee_sched_req* sreq = NULL;
+    struct optee_sched_req* pos = NULL;
+    struct optee_ta_queue* q = NULL;
+
+    *ta = optee_sched_classify(d, msg);
+    if (*ta >= 0) {
+        q = &d->tas[*ta];
+        if (q->running >= q->limit)
+            sreq = malloc(sizeof(*sreq));
+    }
+
+    if (sreq == NULL) {
+        if (q)
+            q->running++;
+        w->ta = *ta;
+        optee_sched_set_prio(w, prio);
+        return true;
+    }
+
+    sreq->idx = idx;
+    sreq->prio = prio;
+    sreq->req = *req;
+    optee_request_init(req);
+
+    /* Highest priority first, in arrival order within a priority */
+    TAILQ_FOREACH(pos, &q->pending, link)
+    {
+        if (pos->prio < sreq->prio)
+            break;
+    }
+
+    if (pos)
+        TAILQ_INSERT_BEFORE(pos, sreq, link);
+    else
+        TAILQ_INSERT_TAIL(&q->pending, sreq, link);
+
+    optee_sched_boost(d, *ta, prio);
+    return false;
+}
+
+/* How many requests a TA takes at once, from the flags of its context
+ * once an open loaded it
+ */
+
+static int optee_sched_limit(const TEE_UUID* uuid)
+{
+    struct tee_ta_ctx* ctx = NULL;
+    int limit = 1;
+
+    mutex_lock(&tee_ta_mutex);
+    TAILQ_FOREACH(ctx, &tee_ctxes, link)
+    {
+        if (!memcmp(&ctx->ts_ctx.uuid, uuid, sizeof(*uuid))) {
+            if (!(ctx->flags & TA_FLAG_SINGLE_INSTANCE)
+                || (ctx->flags & TA_FLAG_CONCURRENT))
+                limit = OPTEE_SERVER_TA_CONCURRENCY;
+            break;
+        }
+    }
+    mutex_unlock(&tee_ta_mutex);
+
+    return limit;
+}
+
+/* Called with the lock held once a request of TA ta is done. Returns the
+ * next parked request of the TA for the caller to run, if any.
+ */
+
+static struct optee_sched_req* optee_sched_done(struct optee_dispatcher* d,
+    int ta, uint32_t cmd, struct optee_msg_arg* msg, int limit)
+{
+    struct optee_ta_queue* q = &d->tas[ta];
+    struct optee_sched_session* sess = NULL;
+    struct optee_sched_req* next = NULL;
+
+    if (cmd == OPTEE_MSG_CMD_OPEN_SESSION && msg->ret == TEE_SUCCESS) {
+        q->limit = limit;
+        sess = optee_sched_session(d, 0, -1);
+        if (sess) {
+            sess->id = msg->session;
+            sess->ta = ta;
+            q->sessions++;
+        } else {
+            DMSG("session table full, session %" PRIu32 " unscheduled\n",
+                msg->session);
+        }
+    } else if (cmd == OPTEE_MSG_CMD_CLOSE_SESSION) {
+        sess = optee_sched_session(d, msg->session, ta);
+        if (sess) {
+            sess->ta = -1;
+            q->sessions--;
+        }
+    }
+
+    next = TAILQ_FIRST(&q->pending);
+    if (next)
+        TAILQ_REMOVE(&q->pending, next, link);
+    else
+        q->running--;
+
+    optee_sched_ta_put(d, ta);
+    return next;
+}
+
+#endif
+
+/* Run a request, then the requests parked on its TA meanwhile */
+
+static void optee_worker_exec(struct optee_dispatcher* d,
+    struct optee_worker* w, int idx, struct optee_request* req, int ta)
+{
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+    struct optee_sched_req* next = NULL;
+#endif
+
+    while (1) {
+        struct optee_msg_arg* msg = (struct optee_msg_arg*)req->buffer;
+        uint32_t cmd = msg->cmd;
+        int limit = 1;
+
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+        /* A failed open must not be taken for a new session */
+        msg->ret = TEE_ERROR_COMMUNICATION;
+#endif
+
+        pthread_mutex_lock(&d->lock);
+        w->running = req;
+        w->idx = idx;
+        pthread_mutex_unlock(&d->lock);
+
+        /* Let the event loop watch the deadline */
+        if (req->cancel.deadline)
+            optee_dispatcher_wakeup(d);
+
+        int ret = optee_request_exec(&d->conns[idx], req);
+
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+        if (ta >= 0 && cmd == OPTEE_MSG_CMD_OPEN_SESSION
+            && msg->ret == TEE_SUCCESS)
+            limit = optee_sched_limit(&d->tas[ta].uuid);
+#endif
+
+        pthread_mutex_lock(&d->lock);
+        w->running = NULL;
+        d->inflight[idx]--;
+        if (ret < 0 && d->state[idx] == OPTEE_CONN_IDLE)
+            d->state[idx] = OPTEE_CONN_CLOSING;
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+        next = ta >= 0 ? optee_sched_done(d, ta, cmd, msg, limit) : NULL;
+        w->ta = next ? ta : -1;
+        optee_sched_set_prio(w, next ? next->prio : 0);
+#endif
+        pthread_mutex_unlock(&d->lock);
+
+        optee_dispatcher_wakeup(d);
+
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+        if (next == NULL)
+            break;
+
+        idx = next->idx;
+        *req = next->req;
+        free(next);
+#else
+        (void)cmd;
+        (void)limit;
+        break;
+#endif
+    }
+}
+
+static void* optee_worker(void* arg)
+{
+    struct optee_dispatcher* d = arg;
+    struct optee_request req;
+    struct optee_worker* w = NULL;
+    struct optee_endpoint* ep = NULL;
+
+    optee_request_init(&req);
+
+    pthread_mutex_lock(&d->lock);
+    w = &d->workers[d->nworkers];
+    w->thread = pthread_self();
+    w->endpoint = d->nworkers++ % d->nendpoints;
+    w->running = NULL;
+    ep = &d->endpoints[w->endpoint];
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+    struct sched_param param;
+    int policy;
+
+    pthread_getschedparam(w->thread, &policy, &param);
+    w->ta = -1;
+    w->base = param.sched_priority;
+    w->prio = w->base;
+#endif
+    pthread_mutex_unlock(&d->lock);
+
+    while (1) {
+        pthread_mutex_lock(&d->lock);
+        while (ep->queue_count == 0 && !d->stopping)
+            pthread_cond_wait(&ep->cond, &d->lock);
+
+        if (d->stopping) {
+            pthread_mutex_unlock(&d->lock);
+            break;
+        }
+
+        int idx = ep->queue[ep->queue_head];
+        ep->queue_head = (ep->queue_head + 1) % OPTEE_SERVER_MAX_CLIENTS;
+        ep->queue_count--;
+        pthread_mutex_unlock(&d->lock);
+
+        /* The connection is BUSY, so nobody else reads from it meanwhile */
+        struct optee_conn* conn = &d->conns[idx];
+        int ret = optee_request_recv(conn, &req);
+
+        /* Give the connection back before running the request, so the
+         * next pipelined request can be picked up by another worker
+         */
+
+        bool run = true;
+        int ta = -1;
+
+        pthread_mutex_lock(&d->lock);
+        if (ret < 0) {
+            d->state[idx] = OPTEE_CONN_CLOSING;
+            optee_dispatcher_cancel(d, idx);
+        } else {
+            d->inflight[idx]++;
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+            run = optee_sched_submit(d, w, idx, &req, &ta);
+#endif
+            if (optee_recv_pending(conn)) {
+                /* The next request is already buffered, poll won't report it */
+                optee_dispatcher_enqueue(d, idx);
+            } else {
+                d->state[idx] = OPTEE_CONN_IDLE;
+            }
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        /* Let the event loop poll this connection again */
+        optee_dispatcher_wakeup(d);
+        if (ret < 0 || !run)
+            continue;
+
+        optee_worker_exec(d, w, idx, &req, ta);
+    }
+
+    optee_request_release(&req);
+
+    pthread_mutex_lock(&d->lock);
+    d->nthreads--;
+    pthread_cond_signal(&d->exit_cond);
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+static void optee_dispatcher_accept(struct optee_dispatcher* d, int endpoint)
+{
+    int newfd = accept(d->endpoints[endpoint].fd, NULL, NULL);
+    if (newfd < 0)
+        return;
+
+#if OPTEE_SERVER_RECV_TIMEOUT > 0
+    /* The worker blocks in recv for the rest of a request, don't let a
+     * client stalling in the middle of one hold it forever
+     */
+
+    struct timeval tv = {
+        .tv_sec = OPTEE_SERVER_RECV_TIMEOUT / 1000,
+        .tv_usec = OPTEE_SERVER_RECV_TIMEOUT % 1000 * 1000,
+    };
+
+    if (setsockopt(newfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+        EMSG("setsockopt failed(%d)\n", errno);
+#endif
+
+    pthread_mutex_lock(&d->lock);
+    for (int i = 0; i < OPTEE_SERVER_MAX_CLIENTS; i++) {
+        if (d->state[i] == OPTEE_CONN_FREE) {
+            optee_conn_init(&d->conns[i], newfd);
+            d->state[i] = OPTEE_CONN_IDLE;
+            d->endpoint[i] = endpoint;
+            pthread_mutex_unlock(&d->lock);
+            DMSG("accepted, newfd: %d\n", newfd);
+            return;
+        }
+    }
+
+    pthread_mutex_unlock(&d->lock);
+    EMSG("too many clients, drop newfd: %d\n", newfd);
+    close(newfd);
+}
+
+static void optee_server(const int* fds, int nfds)
+{
+    struct optee_dispatcher* d = &g_dispatcher;
+    pthread_attr_t attr;
+
+    int status = optee_thread_attr_init(&attr);
+    if (status != 0)
+        return;
+
+    if (pipe(d->wakefd) < 0) {
+        EMSG("pipe failed(%d)\n", errno);
+        pthread_attr_destroy(&attr);
+        return;
+    }
+
+    fcntl(d->wakefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(d->wakefd[1], F_SETFL, O_NONBLOCK);
+
+    /* Workers blocked on the lock boost the one holding it */
+    pthread_mutexattr_t mattr;
+
+    pthread_mutexattr_init(&mattr);
+#ifdef CONFIG_PRIORITY_INHERITANCE
+    pthread_mutexattr_setprotocol(&mattr, PTHREAD_PRIO_INHERIT);
+#endif
+    pthread_mutex_init(&d->lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+    pthread_cond_init(&d->exit_cond, NULL);
+    d->nthreads = 0;
+    d->stopping = false;
+
+    for (int i = 0; i < nfds; i++) {
+        d->endpoints[i].fd = fds[i];
+        pthread_cond_init(&d->endpoints[i].cond, NULL);
+        d->endpoints[i].queue_head = 0;
+        d->endpoints[i].queue_count = 0;
+    }
+
+    d->nendpoints = nfds;
+
+    for (int i = 0; i < OPTEE_SERVER_MAX_CLIENTS; i++) {
+        d->conns[i].fd = -1;
+        d->state[i] = OPTEE_CONN_FREE;
+        d->inflight[i] = 0;
+    }
+
+#ifdef CONFIG_OPTEE_SERVER_SCHED
+    for (int i = 0; i < OPTEE_SERVER_MAX_SESSIONS; i++)
+        d->sessions[i].ta = -1;
+#endif
+
+    /* Worker i serves endpoint i % nendpoints */
+    for (int i = 0; i < MAX(OPTEE_SERVER_WORKERS, d->nendpoints); i++) {
+        status = pthread_create(NULL, &attr, optee_worker, d);
+        if (status != 0) {
+            EMSG("pthread_create failed(%d)\n", status);
+            if (i < d->nendpoints)
+                goto out;
+            break;
+        }
+
+        pthread_mutex_lock(&d->lock);
+        d->nthreads++;
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    while (1) {
+        nfds_t npfds = 0;
+
+        /* The listeners first, then the wakeup pipe and the connections */
+        for (int i = 0; i < d->nendpoints; i++) {
+            d->pfds[npfds].fd = d->endpoints[i].fd;
+            d->pfds[npfds].events = POLLIN;
+            d->pfd_conn[npfds++] = -1;
+        }
+
+        d->pfds[npfds].fd = d->wakefd[0];
+        d->pfds[npfds].events = POLLIN;
+        d->pfd_conn[npfds++] = -1;
+
+        pthread_mutex_lock(&d->lock);
+        for (int i = 0; i < OPTEE_SERVER_MAX_CLIENTS; i++) {
+            if (d->state[i] == OPTEE_CONN_CLOSING && d->inflight[i] == 0) {
+                DMSG("closed, fd: %d\n", d->conns[i].fd);
+                optee_conn_release(&d->conns[i]);
+                d->state[i] = OPTEE_CONN_FREE;
+            } else if (d->state[i] == OPTEE_CONN_IDLE) {
+                d->pfds[npfds].fd = d->conns[i].fd;
+                d->pfds[npfds].events = POLLIN;
+                d->pfd_conn[npfds++] = i;
+            }
+        }
+
+        int timeout = optee_dispatcher_expire(d);
+        pthread_mutex_unlock(&d->lock);
+
+        int ret = poll(d->pfds, npfds, timeout);
+        if (ret < 0) {
+            if (errno != EINTR)
+                EMSG("poll failed(%d)\n", errno);
+            continue;
+        }
+
+        if (d->pfds[d->nendpoints].revents & POLLIN) {
+            char c[8];
+            read(d->wakefd[0], c, sizeof(c));
+        }
+
+        /* Hand readable (or hung up) connections over to the workers */
+        pthread_mutex_lock(&d->lock);
+        for (nfds_t n = d->nendpoints + 1; n < npfds; n++) {
+            int idx = d->pfd_conn[n];
+            if (d->pfds[n].revents != 0)
+                optee_dispatcher_enqueue(d, idx);
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        for (int i = 0; i < d->nendpoints; i++) {
+            if (d->pfds[i].revents & POLLIN)
+                optee_dispatcher_accept(d, i);
+        }
+    }
+
+out:
+    /* An endpoint without a worker, stop the ones already created */
+    pthread_mutex_lock(&d->lock);
+    d->stopping = true;
+    for (int i = 0; i < d->nendpoints; i++)
+        pthread_cond_broadcast(&d->endpoints[i].cond);
+    while (d->nthreads > 0)
+        pthread_cond_wait(&d->exit_cond, &d->lock);
+    pthread_mutex_unlock(&d->lock);
+
+    for (int i = 0; i < d->nendpoints; i++)
+        pthread_cond_destroy(&d->endpoints[i].cond);
+    pthread_cond_destroy(&d->exit_cond);
+    pthread_mutex_destroy(&d->lock);
+    pthread_attr_destroy(&attr);
+    close(d->wakefd[0]);
+    close(d->wakefd[1]);
+}
+#else
+static void* optee_thread(void* arg)
+{
+    struct optee_request req;
+    struct optee_conn conn;
+
+    optee_conn_init(&conn, (intptr_t)arg);
+    optee_request_init(&req);
+
+    /* Pipelined requests are simply served in order */
+    while (optee_request_recv(&conn, &req) >= 0) {
+        if (optee_request_exec(&conn, &req) < 0)
+            break;
+    }
+
+    optee_request_release(&req);
+    optee_conn_release(&conn);
+    return 0;
+}
+
+static void optee_server(const int* fds, int nfds)
+{
+    struct pollfd pfds[OPTEE_SERVER_MAX_ENDPOINTS];
+    pthread_attr_t attr;
+
+    int status = optee_thread_attr_init(&attr);
+    if (status != 0)
+        return;
+
+    for (int i = 0; i < nfds; i++) {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+    }
+
+    while (1) {
+        DMSG("waiting tee client...\n");
+        if (poll(pfds, nfds, -1) < 0) {
+            if (errno != EINTR)
+                EMSG("poll failed(%d)\n", errno);
+            continue;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            if (!(pfds[i].revents & POLLIN))
+                continue;
+
+            int newfd = accept(fds[i], NULL, NULL);
+            if (newfd < 0)
+                continue;
+            DMSG("accepted, newfd: %d\n", newfd);
+
+            status = pthread_create(NULL, &attr, optee_thread,
+                (void*)(intptr_t)newfd);
+            if (status != 0) {
+                EMSG("pthread_create failed(%d)\n", status);
+                close(newfd);
+            }
+        }
+    }
+}
+#endif
+
+#ifdef CONFIG_OPTEE_SERVER_WARMUP
+static void* optee_warmup(void* arg)
+{
+    (void)arg;
+
+    /* Initialize optee-os modules, the storage roots among them */
+    call_initcalls();
+
+    pthread_mutex_lock(&g_tee_ready_lock);
+    __atomic_store_n(&g_tee_ready, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&g_tee_ready_cond);
+    pthread_mutex_unlock(&g_tee_ready_lock);
+    DMSG("tee ready\n");
+
+#ifdef USER_TA_WASM
+    /* Off the path of the first session, next to the first requests */
+    user_ta_wasm_warmup();
+#endif
+    return NULL;
+}
+
+static void optee_warmup_start(void)
+{
+    pthread_attr_t attr;
+    int status = optee_thread_attr_init(&attr);
+
+    if (status == 0) {
+        status = pthread_create(NULL, &attr, optee_warmup, NULL);
+        pthread_attr_destroy(&attr);
+    }
+    if (status != 0) {
+        EMSG("pthread_create failed(%d)\n", status);
+        optee_warmup(NULL);
+    }
+}
+#endif
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+int main(int argc, char* argv[])
+{
+#ifdef OPTEE_SERVER_CPU_AFFINITY
+    cpu_set_t cpus;
+
+    /* The event loop and the core initialization run there too */
+    optee_cpuset(&cpus);
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+#endif
+
+    sem_init(&g_tee_threads, 0, CFG_NUM_THREADS);
+
+    int fds[OPTEE_SERVER_MAX_ENDPOINTS];
+
+#ifdef CONFIG_OPTEE_SERVER_WARMUP
+    /* Clients can connect right away, their requests wait for the core */
+    int nfds = optee_bind_endpoints(fds);
+    optee_warmup_start();
+#else
+    /* Initialize optee-os modules */
+    call_initcalls();
+
+    int nfds = optee_bind_endpoints(fds);
+#endif
+    if (nfds > 0) {
+        optee_server(fds, nfds);
+        for (int i = 0; i < nfds; i++)
+            close(fds[i]);
     }
 
     return 0;
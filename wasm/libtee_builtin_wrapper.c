@@ -14,15 +14,23 @@
  * limitations under the License.
  */
 
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 
+#include <compiler.h>
 #include <tee_api.h>
 #include <tee_api_defines.h>
 #include <tee_api_types.h>
 #include <tee_internal_api.h>
 #include <trace.h>
+#include <user_ta_wasm_header.h>
+#include <user_ta_wasm_slab.h>
 
 #include "wasm_export.h"
 
@@ -66,6 +74,52 @@ wasm_runtime_module_realloc(wasm_module_inst_t module, uint64_t ptr, uint64_t si
 #define module_free(offset) \
     wasm_runtime_module_free(module_inst, offset)
 
+/* Native call tracing is a category of its own: at TRACE_LEVEL 3 only
+ * one in wasm_native_trace_sample calls is traced, 0 turns it off and
+ * leaves the wrappers without any formatting cost.
+ */
+#ifdef CONFIG_OPTEE_WASM_NATIVE_TRACE_SAMPLE
+#define WASM_NATIVE_TRACE_SAMPLE CONFIG_OPTEE_WASM_NATIVE_TRACE_SAMPLE
+#else
+#define WASM_NATIVE_TRACE_SAMPLE 0
+#endif
+
+#if TRACE_LEVEL >= TRACE_DEBUG
+static uint32_t wasm_native_trace_sample = WASM_NATIVE_TRACE_SAMPLE;
+static uint32_t wasm_native_trace_count;
+
+static inline bool wasm_native_trace_sampled(void)
+{
+    uint32_t sample = wasm_native_trace_sample;
+
+    return sample && ++wasm_native_trace_count % sample == 0;
+}
+
+#define NMSG(...)                           \
+    do {                                    \
+        if (wasm_native_trace_sampled()) {  \
+            DMSG(__VA_ARGS__);              \
+        }                                   \
+    } while (0)
+#else
+#define NMSG(...) \
+    do {          \
+    } while (0)
+#endif
+
+void wasm_native_trace_set_sample(uint32_t sample)
+{
+#if TRACE_LEVEL >= TRACE_DEBUG
+    wasm_native_trace_sample = sample;
+#else
+    (void)sample;
+#endif
+}
+
+#if defined(CONFIG_OPTEE_WASM_OP_POOL_SIZE) && CONFIG_OPTEE_WASM_OP_POOL_SIZE > 0
+#define WASM_OP_POOL CONFIG_OPTEE_WASM_OP_POOL_SIZE
+#endif
+
 typedef int (*out_func_t)(int c, void* ctx);
 
 enum pad_type {
@@ -92,7 +146,7 @@ static uint32_t
 TEE_Malloc_wrapper(wasm_exec_env_t exec_env,
     uint32_t size, uint32_t hint)
 {
-    DMSG("wasm.libtee.%s: size: %" PRIu32 ", hint: 0x%" PRIx32 "\n", __func__, size, hint);
+    NMSG("wasm.libtee.%s: size: %" PRIu32 ", hint: 0x%" PRIx32 "\n", __func__, size, hint);
     uint32_t ret_offset = 0;
     uint8_t* ret_ptr;
 
@@ -102,12 +156,17 @@ TEE_Malloc_wrapper(wasm_exec_env_t exec_env,
         return 0;
     }
 
+#ifdef CONFIG_OPTEE_WASM_SLAB
+    ret_offset = wasm_slab_malloc(module_inst, size, hint == TEE_MALLOC_FILL_ZERO,
+        (void**)&ret_ptr);
+#else
     ret_offset = module_malloc(size, (void**)&ret_ptr);
     if ((hint == TEE_MALLOC_FILL_ZERO) && (ret_offset)) {
         memset(ret_ptr, 0, size);
     }
+#endif
 
-    DMSG("wasm.libtee.%s: app_ptr: 0x%" PRIx32 ", native_ptr: 0x%" PRIx32 "\n", __func__, ret_offset, (uint32_t)ret_ptr);
+    NMSG("wasm.libtee.%s: app_ptr: 0x%" PRIx32 ", native_ptr: 0x%" PRIx32 "\n", __func__, ret_offset, (uint32_t)ret_ptr);
     return ret_offset;
 }
 
@@ -116,9 +175,13 @@ static uint32_t
 TEE_Realloc_wrapper(wasm_exec_env_t exec_env,
     uint32_t buffer, uint32_t newSize)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
+#ifdef CONFIG_OPTEE_WASM_SLAB
+    return wasm_slab_realloc(module_inst, buffer, newSize);
+#else
     return wasm_runtime_module_realloc(module_inst, buffer, newSize, NULL);
+#endif
 }
 
 /* 4.11.6 */
@@ -126,12 +189,16 @@ static void
 TEE_Free_wrapper(wasm_exec_env_t exec_env,
     void* buffer)
 {
-    DMSG("wasm.libtee.%s: buffer: 0x%" PRIx32 "\n", __func__, (uint32_t)buffer);
+    NMSG("wasm.libtee.%s: buffer: 0x%" PRIx32 "\n", __func__, (uint32_t)buffer);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
     if (!validate_native_addr(buffer, sizeof(uint32_t))) {
         return;
     }
+#ifdef CONFIG_OPTEE_WASM_SLAB
+    wasm_slab_free(module_inst, addr_native_to_app(buffer));
+#else
     module_free(addr_native_to_app(buffer));
+#endif
 }
 
 /* 4.11.7 */
@@ -139,7 +206,7 @@ static void
 TEE_MemMove_wrapper(wasm_exec_env_t exec_env,
     void* dst, const void* src, uint32_t size)
 {
-    DMSG("wasm.libtee.%s: size=%" PRIu32 "\n", __func__, size);
+    NMSG("wasm.libtee.%s: size=%" PRIu32 "\n", __func__, size);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     if (size == 0)
@@ -161,7 +228,7 @@ static int32_t
 TEE_MemCompare_wrapper(wasm_exec_env_t exec_env,
     const void* s1, const void* s2, uint32_t size)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* s1 has been checked by runtime */
@@ -180,7 +247,7 @@ static void
 TEE_MemFill_wrapper(wasm_exec_env_t exec_env,
     void* buffer, uint8_t x, size_t size)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     if (!validate_native_addr(buffer, size))
@@ -206,7 +273,7 @@ TEE_GetObjectInfo1_wrapper(wasm_exec_env_t exec_env,
     TEE_ObjectHandle object,
     TEE_ObjectInfo* objectInfo_app)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
     TEE_Result ret;
     TEE_ObjectInfo objectInfo_native;
@@ -225,7 +292,7 @@ static void
 TEE_CloseObject_wrapper(wasm_exec_env_t exec_env,
     TEE_ObjectHandle object)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     TEE_CloseObject(object);
@@ -239,7 +306,7 @@ TEE_OpenPersistentObject_wrapper(wasm_exec_env_t exec_env,
     uint32_t flags,
     TEE_ObjectHandle* object)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* objectID has been checked by runtime */
@@ -263,7 +330,7 @@ TEE_CreatePersistentObject_wrapper(wasm_exec_env_t exec_env,
     const void* initialData, uint32_t initialDataLen,
     TEE_ObjectHandle* object)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* objectID has been checked by runtime */
@@ -287,7 +354,7 @@ static TEE_Result
 TEE_CloseAndDeletePersistentObject1_wrapper(wasm_exec_env_t exec_env,
     TEE_ObjectHandle object)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     return TEE_CloseAndDeletePersistentObject1(object);
@@ -299,7 +366,7 @@ TEE_RenamePersistentObject_wrapper(wasm_exec_env_t exec_env,
     TEE_ObjectHandle object,
     void* newObjectID, size_t newObjectIDLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* newobjectID has been checked by runtime */
@@ -316,7 +383,7 @@ TEE_ReadObjectData_wrapper(wasm_exec_env_t exec_env,
     void* buffer, size_t size,
     size_t* count)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* buffer has been checked by runtime */
@@ -336,7 +403,7 @@ TEE_WriteObjectData_wrapper(wasm_exec_env_t exec_env,
     TEE_ObjectHandle object,
     const void* buffer, uint32_t size)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* buffer has been checked by runtime */
@@ -351,7 +418,7 @@ static TEE_Result
 TEE_TruncateObjectData_wrapper(wasm_exec_env_t exec_env,
     TEE_ObjectHandle object, uint32_t size)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     return TEE_TruncateObjectData(object, size);
@@ -364,7 +431,7 @@ TEE_SeekObjectData_wrapper(wasm_exec_env_t exec_env,
     int64_t offset,
     TEE_Whence whence)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     return TEE_SeekObjectData(object, offset, whence);
@@ -374,7 +441,7 @@ static TEE_Result TEE_AllocatePersistentObjectEnumerator_wrapper(
     wasm_exec_env_t exec_env,
     TEE_ObjectEnumHandle* objectEnumerator)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)objectEnumerator, sizeof(uint32_t)))
@@ -387,7 +454,7 @@ static void TEE_FreePersistentObjectEnumerator_wrapper(
     wasm_exec_env_t exec_env,
     TEE_ObjectEnumHandle objectEnumerator)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     TEE_FreePersistentObjectEnumerator(objectEnumerator);
@@ -397,7 +464,7 @@ static void TEE_ResetPersistentObjectEnumerator_wrapper(
     wasm_exec_env_t exec_env,
     TEE_ObjectEnumHandle objectEnumerator)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     TEE_ResetPersistentObjectEnumerator(objectEnumerator);
@@ -408,7 +475,7 @@ static TEE_Result TEE_StartPersistentObjectEnumerator_wrapper(
     TEE_ObjectEnumHandle objectEnumerator,
     uint32_t storageID)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     return TEE_StartPersistentObjectEnumerator(objectEnumerator, storageID);
@@ -421,7 +488,7 @@ static TEE_Result TEE_GetNextPersistentObject_wrapper(
     void* objectID,
     size_t* objectIDLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)objectInfo, sizeof(uint32_t)))
@@ -439,7 +506,7 @@ static void TEE_GetObjectInfo_wrapper(
     TEE_ObjectHandle object,
     TEE_ObjectInfo* objectInfo)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)objectInfo, sizeof(uint32_t)))
@@ -453,7 +520,7 @@ static TEE_Result TEE_RestrictObjectUsage1_wrapper(
     TEE_ObjectHandle object,
     uint32_t objectUsage)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     return TEE_RestrictObjectUsage1(object, objectUsage);
@@ -463,7 +530,7 @@ static void TEE_ResetTransientObject_wrapper(
     wasm_exec_env_t exec_env,
     TEE_ObjectHandle object)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     return TEE_ResetTransientObject(object);
@@ -473,7 +540,7 @@ static void TEE_Panic_wrapper(
     wasm_exec_env_t exec_env,
     TEE_Result panicCode)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     TEE_Panic(panicCode);
@@ -488,7 +555,7 @@ static int
 find_hash_wrapper(wasm_exec_env_t exec_env,
     const char* name)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* buffer has been checked by runtime */
@@ -513,7 +580,7 @@ hmac_memory_wrapper(wasm_exec_env_t exec_env,
     const unsigned char* in, unsigned long inlen,
     unsigned char* out, unsigned long* outlen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* buffer has been checked by runtime */
@@ -532,6 +599,62 @@ hmac_memory_wrapper(wasm_exec_env_t exec_env,
     return hmac_memory(hash, key, keylen, in, inlen, out, outlen);
 }
 
+/* compat/hmac_memory.c, streaming counterpart of hmac_memory, the
+ * handles are owned by the calling module instance
+ */
+extern int hmac_stream_init(const void* owner, int hash,
+    const unsigned char* key, unsigned long keylen);
+
+extern int hmac_stream_update(const void* owner, int handle,
+    const unsigned char* in, unsigned long inlen);
+
+extern int hmac_stream_final(const void* owner, int handle,
+    unsigned char* out, unsigned long* outlen);
+
+static int
+hmac_stream_init_wrapper(wasm_exec_env_t exec_env,
+    int hash, const unsigned char* key, unsigned long keylen)
+{
+    NMSG("wasm.libtee.%s\n", __func__);
+    wasm_module_inst_t module_inst = get_module_inst(exec_env);
+
+    /* buffer has been checked by runtime */
+    if (!validate_native_addr((void*)key, keylen))
+        return -1;
+
+    return hmac_stream_init(module_inst, hash, key, keylen);
+}
+
+static int
+hmac_stream_update_wrapper(wasm_exec_env_t exec_env,
+    int handle, const unsigned char* in, unsigned long inlen)
+{
+    NMSG("wasm.libtee.%s\n", __func__);
+    wasm_module_inst_t module_inst = get_module_inst(exec_env);
+
+    /* buffer has been checked by runtime */
+    if (!validate_native_addr((void*)in, inlen))
+        return -1;
+
+    return hmac_stream_update(module_inst, handle, in, inlen);
+}
+
+static int
+hmac_stream_final_wrapper(wasm_exec_env_t exec_env,
+    int handle, unsigned char* out, unsigned long* outlen)
+{
+    NMSG("wasm.libtee.%s\n", __func__);
+    wasm_module_inst_t module_inst = get_module_inst(exec_env);
+
+    if (!validate_native_addr((void*)outlen, sizeof(unsigned long)))
+        return -1;
+
+    if (!validate_native_addr((void*)out, *outlen))
+        return -1;
+
+    return hmac_stream_final(module_inst, handle, out, outlen);
+}
+
 /**
  * @brief Output an unsigned int in hex format
  *
@@ -834,29 +957,193 @@ fail:
     return false;
 }
 
+/* TA prints are queued a line at a time to a ring emptied to syslog by
+ * a drainer thread, so a TA does not wait on syslog and lines of TAs
+ * running on different threads never interleave. Producers claim slots
+ * lock-free, lines that find the ring full are dropped and counted.
+ * Each thread assembles its line across trace_printf calls, it is only
+ * queued on a newline, when it fills up or when the thread exits.
+ */
+#define WASM_PRINT_LINE_SIZE 128
+#define WASM_PRINT_RING_LINES 32
+
+struct wasm_print_slot {
+    uint32_t seq;
+    char line[WASM_PRINT_LINE_SIZE];
+};
+
+struct wasm_print_line {
+    uint32_t size;
+    char buf[WASM_PRINT_LINE_SIZE];
+};
+
+static struct wasm_print_slot print_ring[WASM_PRINT_RING_LINES];
+static uint32_t print_ring_head;
+static uint32_t print_ring_tail;
+static uint32_t print_ring_overrun;
+static sem_t print_ring_sem;
+static pthread_once_t print_ring_once = PTHREAD_ONCE_INIT;
+static bool print_ring_ready;
+static pthread_key_t print_line_key;
+static pthread_once_t print_line_once = PTHREAD_ONCE_INIT;
+static bool print_line_ready;
+
+static void*
+print_ring_drainer(void* arg)
+{
+    struct wasm_print_slot* slot;
+    uint32_t overrun;
+
+    for (;;) {
+        sem_wait(&print_ring_sem);
+
+        slot = &print_ring[print_ring_tail % WASM_PRINT_RING_LINES];
+        while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == print_ring_tail + 1) {
+            syslog(LOG_INFO, "%s\n", slot->line);
+            __atomic_store_n(&slot->seq, print_ring_tail + WASM_PRINT_RING_LINES,
+                __ATOMIC_RELEASE);
+            print_ring_tail++;
+            slot = &print_ring[print_ring_tail % WASM_PRINT_RING_LINES];
+        }
+
+        overrun = __atomic_exchange_n(&print_ring_overrun, 0, __ATOMIC_RELAXED);
+        if (overrun) {
+            syslog(LOG_WARNING, "wasm print ring overrun, %" PRIu32 " lines dropped\n",
+                overrun);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+print_ring_init(void)
+{
+    pthread_t thread;
+
+    for (uint32_t i = 0; i < WASM_PRINT_RING_LINES; i++)
+        print_ring[i].seq = i;
+
+    sem_init(&print_ring_sem, 0, 0);
+    if (pthread_create(&thread, NULL, print_ring_drainer, NULL) != 0) {
+        EMSG("%08x\n", TEE_ERROR_GENERIC);
+        sem_destroy(&print_ring_sem);
+        return;
+    }
+
+    pthread_detach(thread);
+    print_ring_ready = true;
+}
+
+static void
+print_ring_put(const char* line)
+{
+    struct wasm_print_slot* slot;
+    uint32_t pos = __atomic_load_n(&print_ring_head, __ATOMIC_RELAXED);
+    int32_t diff;
+
+    pthread_once(&print_ring_once, print_ring_init);
+    if (!print_ring_ready) {
+        syslog(LOG_INFO, "%s\n", line);
+        return;
+    }
+
+    for (;;) {
+        slot = &print_ring[pos % WASM_PRINT_RING_LINES];
+        diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&print_ring_head, &pos, pos + 1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_fetch_add(&print_ring_overrun, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&print_ring_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    strlcpy(slot->line, line, sizeof(slot->line));
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    sem_post(&print_ring_sem);
+}
+
+static void
+print_line_flush(struct wasm_print_line* line)
+{
+    if (!line->size)
+        return;
+
+    line->buf[line->size] = '\0';
+    print_ring_put(line->buf);
+    line->size = 0;
+}
+
+static void
+print_line_destroy(void* arg)
+{
+    struct wasm_print_line* line = arg;
+
+    print_line_flush(line);
+    free(line);
+}
+
+static void
+print_line_key_create(void)
+{
+    if (pthread_key_create(&print_line_key, print_line_destroy) != 0) {
+        EMSG("%08x\n", TEE_ERROR_GENERIC);
+        return;
+    }
+
+    print_line_ready = true;
+}
+
+/* Returns the calling thread's pending line, NULL if it can't be kept */
+static struct wasm_print_line*
+print_line_get(void)
+{
+    struct wasm_print_line* line;
+
+    pthread_once(&print_line_once, print_line_key_create);
+    if (!print_line_ready)
+        return NULL;
+
+    line = pthread_getspecific(print_line_key);
+    if (!line) {
+        line = calloc(1, sizeof(*line));
+        if (!line)
+            return NULL;
+        if (pthread_setspecific(print_line_key, line) != 0) {
+            free(line);
+            return NULL;
+        }
+    }
+
+    return line;
+}
+
 struct str_context {
     char* str;
     uint32_t max;
     uint32_t count;
+    struct wasm_print_line* line;
 };
 
-static char print_buf[128] = { 0 };
-static int print_buf_size = 0;
-
 static int
 printf_out(int c, struct str_context* ctx)
 {
+    struct wasm_print_line* line = ctx->line;
+
     if (c == '\n') {
-        print_buf[print_buf_size] = '\0';
-        syslog(LOG_INFO, "%s\n", print_buf);
-        print_buf_size = 0;
-    } else if (print_buf_size >= sizeof(print_buf) - 2) {
-        print_buf[print_buf_size++] = (char)c;
-        print_buf[print_buf_size] = '\0';
-        syslog(LOG_INFO, "%s\n", print_buf);
-        print_buf_size = 0;
+        line->buf[line->size] = '\0';
+        print_ring_put(line->buf);
+        line->size = 0;
+    } else if (line->size >= sizeof(line->buf) - 2) {
+        line->buf[line->size++] = (char)c;
+        print_line_flush(line);
     } else {
-        print_buf[print_buf_size++] = (char)c;
+        line->buf[line->size++] = (char)c;
     }
     ctx->count++;
     return c;
@@ -890,7 +1177,8 @@ trace_printf_wrapper(wasm_exec_env_t exec_env,
     const char* fmt, _va_list va_args)
 {
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
-    struct str_context ctx = { NULL, 0, 0 };
+    struct wasm_print_line local = { 0 };
+    struct str_context ctx = { 0 };
     char buf[MAX_PRINT_SIZE];
     size_t boffs = 0;
     int res;
@@ -899,6 +1187,10 @@ trace_printf_wrapper(wasm_exec_env_t exec_env,
     if (!validate_native_addr(va_args, sizeof(int32_t)))
         return;
 
+    ctx.line = print_line_get();
+    if (!ctx.line)
+        ctx.line = &local;
+
     res = snprintf(buf, sizeof(buf), "[%s]", "");
     if (res < 0)
         return;
@@ -929,6 +1221,10 @@ out_put:
     if (!_vprintf_wa((out_func_t)printf_out, &ctx, fmt, va_args, module_inst)) {
         EMSG("%08x\n", TEE_ERROR_GENERIC);
     }
+
+    /* without a per thread line the rest can't wait for the next call */
+    if (ctx.line == &local)
+        print_line_flush(&local);
 }
 
 /* 5.6.1 */
@@ -936,7 +1232,7 @@ static TEE_Result
 TEE_AllocateTransientObject_wrapper(wasm_exec_env_t exec_env,
     TEE_ObjectType objectType, uint32_t maxKeySize, TEE_ObjectHandle* object)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* object has been checked by runtime */
@@ -951,7 +1247,7 @@ static void
 TEE_FreeTransientObject_wrapper(wasm_exec_env_t exec_env,
     TEE_ObjectHandle object)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     return TEE_FreeTransientObject(object);
@@ -985,7 +1281,7 @@ tee_attribute_wasm2native(wasm_module_inst_t module_inst,
             && (!wasm_validate_native_addr_test(module_inst,
                 attr_app->content.ref.buffer, attr_app->content.ref.length))) {
             attr_native->content.ref.buffer = addr_app_to_native((uint32_t)(attr_app->content.ref.buffer));
-            DMSG("convert app address 0x%" PRIx32 " to native address 0x%" PRIx32 "\n",
+            NMSG("convert app address 0x%" PRIx32 " to native address 0x%" PRIx32 "\n",
                 (uint32_t)attr_app->content.ref.buffer, (uint32_t)attr_native->content.ref.buffer);
         } else {
             attr_native->content.ref.buffer = attr_app->content.ref.buffer;
@@ -1012,7 +1308,7 @@ tee_attribute_native2wasm(wasm_module_inst_t module_inst,
     } else {
         if (attr_native->content.ref.buffer) {
             attr_app->content.ref.buffer = (void*)(uintptr_t)addr_native_to_app(attr_native->content.ref.buffer);
-            DMSG("convert native address 0x%" PRIx32 " to app address 0x%" PRIx32 "\n",
+            NMSG("convert native address 0x%" PRIx32 " to app address 0x%" PRIx32 "\n",
                 (uint32_t)attr_native->content.ref.buffer, (uint32_t)attr_app->content.ref.buffer);
         } else {
             attr_app->content.ref.buffer = attr_native->content.ref.buffer;
@@ -1027,7 +1323,7 @@ TEE_InitRefAttribute_wrapper(wasm_exec_env_t exec_env,
     TEE_Attribute* attr_app, uint32_t attributeID,
     const void* buffer, uint32_t length)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     TEE_Attribute attr_native;
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
@@ -1052,7 +1348,7 @@ static TEE_Result
 TEE_PopulateTransientObject_wrapper(wasm_exec_env_t exec_env,
     TEE_ObjectHandle object, TEE_Attribute* attrs_app, uint32_t attrCount)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     TEE_Result res;
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
     TEE_Attribute* attrs_native = NULL;
@@ -1079,6 +1375,123 @@ TEE_PopulateTransientObject_wrapper(wasm_exec_env_t exec_env,
     return res;
 }
 
+#ifdef WASM_OP_POOL
+/* Operations freed by a TA, reset and without a key, kept for its next
+ * TEE_AllocateOperation of the same algorithm, mode and key size. Their
+ * cryp states stay on the cryp_states list of the TA.
+ */
+struct wasm_op_pool_entry {
+    const void* owner;
+    TEE_OperationHandle operation;
+    uint32_t algorithm;
+    uint32_t mode;
+    uint32_t max_key_size;
+};
+
+static struct wasm_op_pool_entry wasm_op_pool[WASM_OP_POOL];
+static pthread_mutex_t wasm_op_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static TEE_OperationHandle wasm_op_pool_take(const void* owner,
+    uint32_t algorithm, uint32_t mode, uint32_t max_key_size)
+{
+    TEE_OperationHandle operation = TEE_HANDLE_NULL;
+
+    pthread_mutex_lock(&wasm_op_pool_lock);
+    for (int i = 0; i < WASM_OP_POOL; i++) {
+        struct wasm_op_pool_entry* entry = &wasm_op_pool[i];
+
+        if (entry->owner == owner && entry->algorithm == algorithm
+            && entry->mode == mode && entry->max_key_size == max_key_size) {
+            operation = entry->operation;
+            memset(entry, 0, sizeof(*entry));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wasm_op_pool_lock);
+
+    return operation;
+}
+
+/* Bring the operation back to the state TEE_AllocateOperation left it
+ * in, only symmetric and digest operations are kept
+ */
+static bool wasm_op_pool_reset(TEE_OperationHandle operation,
+    TEE_OperationInfo* info)
+{
+    TEE_GetOperationInfo(operation, info);
+    switch (info->operationClass) {
+    case TEE_OPERATION_DIGEST:
+        TEE_ResetOperation(operation);
+        return true;
+    case TEE_OPERATION_CIPHER:
+    case TEE_OPERATION_MAC:
+    case TEE_OPERATION_AE:
+        if (!(info->handleState & TEE_HANDLE_FLAG_KEY_SET)) {
+            return true;
+        }
+        TEE_ResetOperation(operation);
+        if (info->handleState & TEE_HANDLE_FLAG_EXPECT_TWO_KEYS) {
+            TEE_SetOperationKey2(operation, TEE_HANDLE_NULL, TEE_HANDLE_NULL);
+        } else {
+            TEE_SetOperationKey(operation, TEE_HANDLE_NULL);
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool wasm_op_pool_put(const void* owner, TEE_OperationHandle operation)
+{
+    TEE_OperationInfo info;
+    bool kept = false;
+
+    if (!wasm_op_pool_reset(operation, &info)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&wasm_op_pool_lock);
+    for (int i = 0; i < WASM_OP_POOL; i++) {
+        struct wasm_op_pool_entry* entry = &wasm_op_pool[i];
+
+        if (!entry->operation) {
+            entry->owner = owner;
+            entry->operation = operation;
+            entry->algorithm = info.algorithm;
+            entry->mode = info.mode;
+            entry->max_key_size = info.maxKeySize;
+            kept = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wasm_op_pool_lock);
+
+    return kept;
+}
+
+/* Free the operations kept for owner, with a session of its context
+ * current
+ */
+void wasm_op_pool_release(const void* owner)
+{
+    TEE_OperationHandle operation;
+
+    for (int i = 0; i < WASM_OP_POOL; i++) {
+        pthread_mutex_lock(&wasm_op_pool_lock);
+        operation = TEE_HANDLE_NULL;
+        if (wasm_op_pool[i].owner == owner) {
+            operation = wasm_op_pool[i].operation;
+            memset(&wasm_op_pool[i], 0, sizeof(wasm_op_pool[i]));
+        }
+        pthread_mutex_unlock(&wasm_op_pool_lock);
+
+        if (operation) {
+            TEE_FreeOperation(operation);
+        }
+    }
+}
+#endif
+
 /* 6.2.1 */
 static TEE_Result
 TEE_AllocateOperation_wrapper(wasm_exec_env_t exec_env,
@@ -1086,14 +1499,20 @@ TEE_AllocateOperation_wrapper(wasm_exec_env_t exec_env,
     uint32_t algorithm, uint32_t mode, uint32_t maxKeySize)
 {
     TEE_Result res;
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* operation has been checked by runtime */
     if (!validate_native_addr((void*)operation, sizeof(TEE_OperationHandle)))
         return TEE_ERROR_BAD_PARAMETERS;
 
-    DMSG("algorithm: 0x%" PRIx32 ", mode: 0x%" PRIx32 ", maxKeySize: %" PRIu32 "\n", algorithm, mode, maxKeySize);
+    NMSG("algorithm: 0x%" PRIx32 ", mode: 0x%" PRIx32 ", maxKeySize: %" PRIu32 "\n", algorithm, mode, maxKeySize);
+#ifdef WASM_OP_POOL
+    *operation = wasm_op_pool_take(module_inst, algorithm, mode, maxKeySize);
+    if (*operation) {
+        return TEE_SUCCESS;
+    }
+#endif
     res = TEE_AllocateOperation(operation, algorithm, mode, maxKeySize);
     return res;
 }
@@ -1102,9 +1521,14 @@ TEE_AllocateOperation_wrapper(wasm_exec_env_t exec_env,
 static void TEE_FreeOperation_wrapper(wasm_exec_env_t exec_env,
     TEE_OperationHandle operation)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
+#ifdef WASM_OP_POOL
+    if (operation && wasm_op_pool_put(module_inst, operation)) {
+        return;
+    }
+#endif
     TEE_FreeOperation(operation);
 }
 
@@ -1113,7 +1537,7 @@ static TEE_Result
 TEE_SetOperationKey_wrapper(wasm_exec_env_t exec_env,
     TEE_OperationHandle operation, TEE_ObjectHandle key)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     return TEE_SetOperationKey(operation, key);
@@ -1124,7 +1548,7 @@ static void
 TEE_CopyOperation_wrapper(wasm_exec_env_t exec_env,
     TEE_OperationHandle dstOperation, TEE_OperationHandle srcOperation)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     TEE_CopyOperation(dstOperation, srcOperation);
 }
 
@@ -1133,7 +1557,7 @@ static void
 TEE_MACInit_wrapper(wasm_exec_env_t exec_env,
     TEE_OperationHandle operation, const void* IV, uint32_t IVLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* IV has been checked by runtime */
@@ -1148,7 +1572,7 @@ static void
 TEE_MACUpdate_wrapper(wasm_exec_env_t exec_env,
     TEE_OperationHandle operation, const void* chunk, uint32_t chunkSize)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* chunk has been checked by runtime */
@@ -1158,13 +1582,54 @@ TEE_MACUpdate_wrapper(wasm_exec_env_t exec_env,
     TEE_MACUpdate(operation, chunk, chunkSize);
 }
 
+/* Validate a chunk vector of the TA, returning the total size of the
+ * chunks, so the per chunk work below only converts addresses.
+ */
+static bool
+wasm_validate_chunks(wasm_module_inst_t module_inst,
+    const struct user_ta_wasm_chunk* chunks, uint32_t count, size_t* total)
+{
+    size_t sum = 0;
+
+    if (count > UINT32_MAX / sizeof(*chunks)
+        || !validate_native_addr((void*)chunks, count * sizeof(*chunks)))
+        return false;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!validate_app_addr(chunks[i].buffer, chunks[i].size)
+            || ADD_OVERFLOW(sum, chunks[i].size, &sum))
+            return false;
+    }
+
+    if (total)
+        *total = sum;
+
+    return true;
+}
+
+static void
+TEE_MACUpdateV_wrapper(wasm_exec_env_t exec_env,
+    TEE_OperationHandle operation, const struct user_ta_wasm_chunk* chunks,
+    uint32_t count)
+{
+    NMSG("wasm.libtee.%s: count: %" PRIu32 "\n", __func__, count);
+    wasm_module_inst_t module_inst = get_module_inst(exec_env);
+
+    if (!wasm_validate_chunks(module_inst, chunks, count, NULL))
+        return;
+
+    for (uint32_t i = 0; i < count; i++)
+        TEE_MACUpdate(operation, addr_app_to_native(chunks[i].buffer),
+            chunks[i].size);
+}
+
 /* 6.6.3 */
 static TEE_Result
 TEE_MACComputeFinal_wrapper(wasm_exec_env_t exec_env,
     TEE_OperationHandle operation, const void* message, size_t messageLen,
     void* mac, size_t* macLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* messageLen has been checked by runtime */
@@ -1187,7 +1652,7 @@ TEE_MACCompareFinal_wrapper(wasm_exec_env_t exec_env,
     TEE_OperationHandle operation, const void* message, uint32_t messageLen,
     const void* mac, uint32_t macLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* messageLen has been checked by runtime */
@@ -1206,7 +1671,7 @@ static void
 TEE_DigestUpdate_wrapper(wasm_exec_env_t exec_env,
     TEE_OperationHandle operation, void* chunk, uint32_t chunkSize)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* chunk has been checked by runtime */
@@ -1216,13 +1681,29 @@ TEE_DigestUpdate_wrapper(wasm_exec_env_t exec_env,
     TEE_DigestUpdate(operation, chunk, chunkSize);
 }
 
+static void
+TEE_DigestUpdateV_wrapper(wasm_exec_env_t exec_env,
+    TEE_OperationHandle operation, const struct user_ta_wasm_chunk* chunks,
+    uint32_t count)
+{
+    NMSG("wasm.libtee.%s: count: %" PRIu32 "\n", __func__, count);
+    wasm_module_inst_t module_inst = get_module_inst(exec_env);
+
+    if (!wasm_validate_chunks(module_inst, chunks, count, NULL))
+        return;
+
+    for (uint32_t i = 0; i < count; i++)
+        TEE_DigestUpdate(operation, addr_app_to_native(chunks[i].buffer),
+            chunks[i].size);
+}
+
 /* 6.3.2 */
 static TEE_Result
 TEE_DigestDoFinal_wrapper(wasm_exec_env_t exec_env,
     TEE_OperationHandle operation, void* chunk, size_t chunkLen,
     void* hash, size_t* hashLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* chunk has been checked by runtime */
@@ -1244,7 +1725,7 @@ static TEE_Result
 TEE_DigestExtract_wrapper(wasm_exec_env_t exec_env,
     TEE_OperationHandle operation, void* hash, size_t* hashLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst = get_module_inst(exec_env);
 
     /* chunk has been checked by runtime */
@@ -1263,7 +1744,7 @@ static void
 TEE_ResetOperation_wrapper(wasm_exec_env_t exec_env,
     TEE_OperationHandle operation)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     TEE_ResetOperation(operation);
@@ -1273,7 +1754,7 @@ static TEE_Result
 TEE_IsAlgorithmSupported_wrapper(wasm_exec_env_t exec_env,
     uint32_t algId, uint32_t element)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     return TEE_IsAlgorithmSupported(algId, element);
@@ -1283,7 +1764,7 @@ static void
 TEE_GetSystemTime_wrapper(wasm_exec_env_t exec_env,
     TEE_Time* time)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     /* time has been checked by runtime */
@@ -1300,7 +1781,7 @@ TEE_GenerateKey_wrapper(wasm_exec_env_t exec_env,
     TEE_ObjectHandle object, uint32_t keySize,
     const TEE_Attribute* params, uint32_t paramCount)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     /* params has been checked by runtime */
@@ -1316,7 +1797,7 @@ TEE_AEInit_wrapper(wasm_exec_env_t exec_env,
     uint32_t nonceLen, uint32_t tagLen, uint32_t AADLen,
     uint32_t payloadLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     /* nonce has been checked by runtime */
@@ -1333,7 +1814,7 @@ TEE_AEEncryptFinal_wrapper(wasm_exec_env_t exec_env,
     void* destData, size_t* destLen,
     void* tag, size_t* tagLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     /* srcData has been checked by runtime */
@@ -1365,7 +1846,7 @@ TEE_AEDecryptFinal_wrapper(wasm_exec_env_t exec_env,
     void* destData, size_t* destLen,
     void* tag, size_t tagLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     /* srcData has been checked by runtime */
@@ -1392,7 +1873,7 @@ TEE_GetObjectBufferAttribute_wrapper(wasm_exec_env_t exec_env,
     TEE_ObjectHandle object, uint32_t attributeID,
     void* buffer, size_t* size)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     /* size has been checked by runtime */
@@ -1411,7 +1892,7 @@ TEE_GetObjectValueAttribute_wrapper(wasm_exec_env_t exec_env,
     TEE_ObjectHandle object, uint32_t attributeID, uint32_t* a,
     uint32_t* b)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     /* a has been checked by runtime */
@@ -1429,7 +1910,7 @@ static void
 TEE_GenerateRandom_wrapper(wasm_exec_env_t exec_env,
     void* randomBuffer, uint32_t randomBufferLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     /* randomBuffer has been checked by runtime */
@@ -1446,7 +1927,7 @@ TEE_CipherInit_wrapper(wasm_exec_env_t exec_env,
     TEE_OperationHandle operation, const void* IV,
     uint32_t IVLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     /* IV has been checked by runtime */
@@ -1463,7 +1944,7 @@ TEE_CipherUpdate_wrapper(wasm_exec_env_t exec_env,
     TEE_OperationHandle operation, const void* srcData,
     size_t srcLen, void* destData, size_t* destLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     /* srcData has been checked by runtime */
@@ -1480,12 +1961,86 @@ TEE_CipherUpdate_wrapper(wasm_exec_env_t exec_env,
     return TEE_CipherUpdate(operation, srcData, srcLen, destData, destLen);
 }
 
+/* Output room TEE_CipherUpdate() may need for len more bytes. Stream
+ * modes and the modes holding back up to two blocks (CTS, XTS) never
+ * produce more than they are given. ECB and CBC emit whole blocks, the
+ * bytes they hold back aren't visible here, so an unaligned len takes
+ * the block it could complete.
+ */
+static size_t
+wasm_cipher_update_size(TEE_OperationHandle operation, size_t len)
+{
+    TEE_OperationInfo info;
+    size_t block = 0;
+
+    TEE_GetOperationInfo(operation, &info);
+    switch (info.algorithm) {
+    case TEE_ALG_AES_ECB_NOPAD:
+    case TEE_ALG_AES_CBC_NOPAD:
+        block = 16;
+        break;
+    case TEE_ALG_DES_ECB_NOPAD:
+    case TEE_ALG_DES_CBC_NOPAD:
+    case TEE_ALG_DES3_ECB_NOPAD:
+    case TEE_ALG_DES3_CBC_NOPAD:
+        block = 8;
+        break;
+    default:
+        return len;
+    }
+
+    return len % block ? len + block - len % block : len;
+}
+
+static TEE_Result
+TEE_CipherUpdateV_wrapper(wasm_exec_env_t exec_env,
+    TEE_OperationHandle operation, const struct user_ta_wasm_chunk* chunks,
+    uint32_t count, void* destData, size_t* destLen)
+{
+    NMSG("wasm.libtee.%s: count: %" PRIu32 "\n", __func__, count);
+    wasm_module_inst_t module_inst = get_module_inst(exec_env);
+    size_t total = 0;
+    size_t need = 0;
+    size_t left, len;
+    TEE_Result res = TEE_SUCCESS;
+
+    if (!wasm_validate_chunks(module_inst, chunks, count, &total))
+        return TEE_ERROR_BAD_PARAMETERS;
+
+    /* destLen has been checked by runtime */
+    if (!validate_native_addr((void*)destLen, sizeof(uint32_t)))
+        return TEE_ERROR_BAD_PARAMETERS;
+    /* destData has been checked by runtime */
+    if (!validate_native_addr((void*)destData, *destLen))
+        return TEE_ERROR_BAD_PARAMETERS;
+
+    /* check once up front, a short buffer midway would leave the
+     * operation with part of the chunks consumed
+     */
+    need = wasm_cipher_update_size(operation, total);
+    if (*destLen < need) {
+        *destLen = need;
+        return TEE_ERROR_SHORT_BUFFER;
+    }
+
+    left = *destLen;
+    for (uint32_t i = 0; i < count && res == TEE_SUCCESS; i++) {
+        len = left;
+        res = TEE_CipherUpdate(operation, addr_app_to_native(chunks[i].buffer),
+            chunks[i].size, (uint8_t*)destData + (*destLen - left), &len);
+        left -= len;
+    }
+
+    *destLen -= left;
+    return res;
+}
+
 static TEE_Result
 TEE_CipherDoFinal_wrapper(wasm_exec_env_t exec_env,
     TEE_OperationHandle operation, const void* srcData,
     size_t srcLen, void* destData, size_t* destLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     /* srcData has been checked by runtime */
@@ -1507,7 +2062,7 @@ TEE_InitValueAttribute_wrapper(wasm_exec_env_t exec_env,
     TEE_Attribute* attr, uint32_t attributeID,
     uint32_t a, uint32_t b)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     /* attr has been checked by runtime */
@@ -1523,7 +2078,7 @@ static void
 TEE_CloseAndDeletePersistentObject_wrapper(wasm_exec_env_t exec_env,
     TEE_ObjectHandle object)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     TEE_CloseAndDeletePersistentObject(object);
@@ -1545,7 +2100,7 @@ static TEE_Result TEE_SetOperationKey2_wrapper(
     TEE_ObjectHandle key1,
     TEE_ObjectHandle key2)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     return TEE_SetOperationKey2(operation, key1, key2);
@@ -1556,7 +2111,7 @@ static TEE_Result TEE_CopyObjectAttributes1_wrapper(
     TEE_ObjectHandle destObject,
     TEE_ObjectHandle srcObject)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     return TEE_CopyObjectAttributes1(destObject, srcObject);
@@ -1569,7 +2124,7 @@ static TEE_Result TEE_AsymmetricEncrypt_wrapper(
     const void* srcData, size_t srcLen,
     void* destData, size_t* destLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)params, paramCount))
@@ -1597,7 +2152,7 @@ static TEE_Result TEE_AsymmetricDecrypt_wrapper(
     const void* srcData, size_t srcLen,
     void* destData, size_t* destLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)params, paramCount))
@@ -1622,7 +2177,7 @@ static TEE_Result TEE_AsymmetricSignDigest_wrapper(
     const void* digest, size_t digestLen,
     void* signature, size_t* signatureLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)params, paramCount))
@@ -1650,7 +2205,7 @@ static TEE_Result TEE_AsymmetricVerifyDigest_wrapper(
     const void* digest, size_t digestLen,
     const void* signature, size_t signatureLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)params, paramCount))
@@ -1674,7 +2229,7 @@ static void TEE_DeriveKey_wrapper(
     const TEE_Attribute* params, uint32_t paramCount,
     TEE_ObjectHandle derivedKey)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)params, paramCount))
@@ -1688,7 +2243,7 @@ static void TEE_AEUpdateAAD_wrapper(
     TEE_OperationHandle operation,
     const void* AADdata, size_t AADdataLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     /* srcData has been checked by runtime */
@@ -1704,7 +2259,7 @@ static TEE_Result TEE_AEUpdate_wrapper(
     const void* srcData, size_t srcLen,
     void* destData, size_t* destLen)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)srcData, srcLen))
@@ -1724,7 +2279,7 @@ static void TEE_GetOperationInfo_wrapper(
     TEE_OperationHandle operation,
     TEE_OperationInfo* operationInfo)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)operationInfo, sizeof(uint32_t)))
@@ -1742,7 +2297,7 @@ static TEE_Result TEE_OpenTASession_wrapper(
     TEE_TASessionHandle* session,
     uint32_t* returnOrigin)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)destination, sizeof(uint32_t)))
@@ -1757,8 +2312,17 @@ static TEE_Result TEE_OpenTASession_wrapper(
     if (!validate_native_addr((void*)returnOrigin, sizeof(uint32_t)))
         return TEE_ERROR_BAD_PARAMETERS;
 
+#ifdef CONFIG_OPTEE_WASM_TA_FAST_CALL
+    if (!validate_native_addr((void*)params, sizeof(TEE_Param) * TEE_NUM_PARAMS))
+        return TEE_ERROR_BAD_PARAMETERS;
+
+    return wasm_ta_open_session(module_inst, destination,
+        cancellationRequestTimeout, paramTypes, params, (uint32_t*)session,
+        returnOrigin);
+#else
     return TEE_OpenTASession(destination, cancellationRequestTimeout,
         paramTypes, params, session, returnOrigin);
+#endif
 }
 
 static TEE_Result TEE_InvokeTACommand_wrapper(
@@ -1769,7 +2333,7 @@ static TEE_Result TEE_InvokeTACommand_wrapper(
     TEE_Param params[TEE_NUM_PARAMS],
     uint32_t* returnOrigin)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)params, sizeof(uint32_t)))
@@ -1778,15 +2342,23 @@ static TEE_Result TEE_InvokeTACommand_wrapper(
     if (!validate_native_addr((void*)returnOrigin, sizeof(uint32_t)))
         return TEE_ERROR_BAD_PARAMETERS;
 
+#ifdef CONFIG_OPTEE_WASM_TA_FAST_CALL
+    if (!validate_native_addr((void*)params, sizeof(TEE_Param) * TEE_NUM_PARAMS))
+        return TEE_ERROR_BAD_PARAMETERS;
+
+    return wasm_ta_invoke_command(module_inst, (uint32_t)(uintptr_t)session,
+        cancellationRequestTimeout, commandID, paramTypes, params, returnOrigin);
+#else
     return TEE_InvokeTACommand(session, cancellationRequestTimeout,
         commandID, paramTypes, params, returnOrigin);
+#endif
 }
 
 static void TEE_CloseTASession_wrapper(
     wasm_exec_env_t exec_env,
     TEE_TASessionHandle session)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     TEE_CloseTASession(session);
@@ -1796,7 +2368,7 @@ static void TEE_BigIntInit_wrapper(
     wasm_exec_env_t exec_env,
     TEE_BigInt* bigInt, size_t len)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)bigInt, sizeof(uint32_t)))
@@ -1809,7 +2381,7 @@ static size_t TEE_BigIntFMMContextSizeInU32_wrapper(
     wasm_exec_env_t exec_env,
     size_t modulusSizeInBits)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     return TEE_BigIntFMMContextSizeInU32(modulusSizeInBits);
@@ -1820,7 +2392,7 @@ static void TEE_BigIntInitFMMContext_wrapper(
     TEE_BigIntFMMContext* context, size_t len,
     const TEE_BigInt* modulus)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)context, sizeof(uint32_t)))
@@ -1835,7 +2407,7 @@ static void TEE_BigIntInitFMMContext_wrapper(
 static size_t TEE_BigIntFMMSizeInU32_wrapper(
     wasm_exec_env_t exec_env, size_t modulusSizeInBits)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     return TEE_BigIntFMMSizeInU32(modulusSizeInBits);
@@ -1844,7 +2416,7 @@ static size_t TEE_BigIntFMMSizeInU32_wrapper(
 static void TEE_BigIntInitFMM_wrapper(
     wasm_exec_env_t exec_env, TEE_BigIntFMM* bigIntFMM, size_t len)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)bigIntFMM, sizeof(uint32_t)))
@@ -1858,7 +2430,7 @@ static TEE_Result TEE_BigIntConvertFromOctetString_wrapper(
     TEE_BigInt* dest, const uint8_t* buffer, size_t bufferLen,
     int32_t sign)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -1873,7 +2445,7 @@ static TEE_Result TEE_BigIntConvertFromOctetString_wrapper(
 static void TEE_BigIntConvertFromS32_wrapper(
     wasm_exec_env_t exec_env, TEE_BigInt* dest, int32_t shortVal)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -1885,7 +2457,7 @@ static void TEE_BigIntConvertFromS32_wrapper(
 static int32_t TEE_BigIntCmpS32_wrapper(
     wasm_exec_env_t exec_env, const TEE_BigInt* op, int32_t shortVal)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)op, sizeof(uint32_t)))
@@ -1898,7 +2470,7 @@ static TEE_Result TEE_BigIntConvertToOctetString_wrapper(
     wasm_exec_env_t exec_env,
     uint8_t* buffer, size_t* bufferLen, const TEE_BigInt* bigInt)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)buffer, sizeof(uint32_t)))
@@ -1913,7 +2485,7 @@ static TEE_Result TEE_BigIntConvertToOctetString_wrapper(
 static TEE_Result TEE_BigIntConvertToS32_wrapper(
     wasm_exec_env_t exec_env, int32_t* dest, const TEE_BigInt* src)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -1928,7 +2500,7 @@ static TEE_Result TEE_BigIntConvertToS32_wrapper(
 static bool TEE_BigIntGetBit_wrapper(
     wasm_exec_env_t exec_env, const TEE_BigInt* src, uint32_t bitIndex)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)src, sizeof(uint32_t)))
@@ -1940,7 +2512,7 @@ static bool TEE_BigIntGetBit_wrapper(
 static uint32_t TEE_BigIntGetBitCount_wrapper(
     wasm_exec_env_t exec_env, const TEE_BigInt* src)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)src, sizeof(uint32_t)))
@@ -1953,7 +2525,7 @@ static TEE_Result TEE_BigIntSetBit_wrapper(
     wasm_exec_env_t exec_env, TEE_BigInt* op,
     uint32_t bitIndex, bool value)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)op, sizeof(uint32_t)))
@@ -1966,7 +2538,7 @@ static void TEE_BigIntShiftRight_wrapper(
     wasm_exec_env_t exec_env, TEE_BigInt* dest,
     const TEE_BigInt* op, size_t bits)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -1982,7 +2554,7 @@ static int32_t TEE_BigIntCmp_wrapper(
     wasm_exec_env_t exec_env,
     const TEE_BigInt* op1, const TEE_BigInt* op2)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)op1, sizeof(uint32_t)))
@@ -1998,7 +2570,7 @@ static void TEE_BigIntAdd_wrapper(
     wasm_exec_env_t exec_env,
     TEE_BigInt* dest, const TEE_BigInt* op1, const TEE_BigInt* op2)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2017,7 +2589,7 @@ static void TEE_BigIntSub_wrapper(
     wasm_exec_env_t exec_env, TEE_BigInt* dest,
     const TEE_BigInt* op1, const TEE_BigInt* op2)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2036,7 +2608,7 @@ static void TEE_BigIntMul_wrapper(
     wasm_exec_env_t exec_env, TEE_BigInt* dest,
     const TEE_BigInt* op1, const TEE_BigInt* op2)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2054,7 +2626,7 @@ static void TEE_BigIntMul_wrapper(
 static void TEE_BigIntNeg_wrapper(
     wasm_exec_env_t exec_env, TEE_BigInt* dest, const TEE_BigInt* op)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2070,7 +2642,7 @@ static TEE_Result TEE_BigIntAssign_wrapper(
     wasm_exec_env_t exec_env,
     TEE_BigInt* dest, const TEE_BigInt* src)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2085,7 +2657,7 @@ static TEE_Result TEE_BigIntAssign_wrapper(
 static TEE_Result TEE_BigIntAbs_wrapper(
     wasm_exec_env_t exec_env, TEE_BigInt* dest, const TEE_BigInt* src)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2100,7 +2672,7 @@ static TEE_Result TEE_BigIntAbs_wrapper(
 static void TEE_BigIntSquare_wrapper(
     wasm_exec_env_t exec_env, TEE_BigInt* dest, const TEE_BigInt* op)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2116,7 +2688,7 @@ static void TEE_BigIntDiv_wrapper(
     wasm_exec_env_t exec_env, TEE_BigInt* dest_q, TEE_BigInt* dest_r,
     const TEE_BigInt* op1, const TEE_BigInt* op2)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest_q, sizeof(uint32_t)))
@@ -2138,7 +2710,7 @@ static void TEE_BigIntMod_wrapper(
     wasm_exec_env_t exec_env, TEE_BigInt* dest,
     const TEE_BigInt* op, const TEE_BigInt* n)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2157,7 +2729,7 @@ static void TEE_BigIntAddMod_wrapper(
     wasm_exec_env_t exec_env, TEE_BigInt* dest,
     const TEE_BigInt* op1, const TEE_BigInt* op2, const TEE_BigInt* n)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2179,7 +2751,7 @@ static void TEE_BigIntSubMod_wrapper(
     wasm_exec_env_t exec_env, TEE_BigInt* dest,
     const TEE_BigInt* op1, const TEE_BigInt* op2, const TEE_BigInt* n)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2201,7 +2773,7 @@ static void TEE_BigIntMulMod_wrapper(
     wasm_exec_env_t exec_env, TEE_BigInt* dest,
     const TEE_BigInt* op1, const TEE_BigInt* op2, const TEE_BigInt* n)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2223,7 +2795,7 @@ static void TEE_BigIntSquareMod_wrapper(
     wasm_exec_env_t exec_env,
     TEE_BigInt* dest, const TEE_BigInt* op, const TEE_BigInt* n)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2242,7 +2814,7 @@ static void TEE_BigIntInvMod_wrapper(
     wasm_exec_env_t exec_env,
     TEE_BigInt* dest, const TEE_BigInt* op, const TEE_BigInt* n)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2262,7 +2834,7 @@ static TEE_Result TEE_BigIntExpMod_wrapper(
     const TEE_BigInt* op1, const TEE_BigInt* op2,
     const TEE_BigInt* n, const TEE_BigIntFMMContext* context)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2286,7 +2858,7 @@ static TEE_Result TEE_BigIntExpMod_wrapper(
 static bool TEE_BigIntRelativePrime_wrapper(
     wasm_exec_env_t exec_env, const TEE_BigInt* op1, const TEE_BigInt* op2)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)op1, sizeof(uint32_t)))
@@ -2303,7 +2875,7 @@ static void TEE_BigIntComputeExtendedGcd_wrapper(
     TEE_BigInt* gcd, TEE_BigInt* u, TEE_BigInt* v,
     const TEE_BigInt* op1, const TEE_BigInt* op2)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)gcd, sizeof(uint32_t)))
@@ -2327,7 +2899,7 @@ static void TEE_BigIntComputeExtendedGcd_wrapper(
 static int32_t TEE_BigIntIsProbablePrime_wrapper(
     wasm_exec_env_t exec_env, const TEE_BigInt* op, uint32_t confidenceLevel)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)op, sizeof(uint32_t)))
@@ -2341,7 +2913,7 @@ static void TEE_BigIntConvertToFMM_wrapper(
     TEE_BigIntFMM* dest, const TEE_BigInt* src,
     const TEE_BigInt* n, const TEE_BigIntFMMContext* context)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2364,7 +2936,7 @@ static void TEE_BigIntConvertFromFMM_wrapper(
     TEE_BigInt* dest, const TEE_BigIntFMM* src,
     const TEE_BigInt* n, const TEE_BigIntFMMContext* context)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2387,7 +2959,7 @@ static void TEE_BigIntComputeFMM_wrapper(
     const TEE_BigIntFMM* op1, const TEE_BigIntFMM* op2,
     const TEE_BigInt* n, const TEE_BigIntFMMContext* context)
 {
-    DMSG("wasm.libtee.%s\n", __func__);
+    NMSG("wasm.libtee.%s\n", __func__);
     wasm_module_inst_t module_inst __unused = get_module_inst(exec_env);
 
     if (!validate_native_addr((void*)dest, sizeof(uint32_t)))
@@ -2408,129 +2980,239 @@ static void TEE_BigIntComputeFMM_wrapper(
     TEE_BigIntComputeFMM(dest, op1, op2, n, context);
 }
 
+/* TEE_BigInt layout of libutee: a two word header, then alloc_size words */
+struct wasm_bigint_hdr {
+    int32_t sign;
+    uint16_t alloc_size;
+    uint16_t nblocks;
+};
+
+/* Validate a whole TEE_BigInt, not just its first word */
+static bool validate_bigint(wasm_module_inst_t module_inst,
+    const TEE_BigInt* bigInt)
+{
+    const struct wasm_bigint_hdr* hdr = (const struct wasm_bigint_hdr*)bigInt;
+
+    if (!validate_native_addr((void*)bigInt, sizeof(*hdr)))
+        return false;
+
+    return validate_native_addr((void*)bigInt,
+        sizeof(*hdr) + hdr->alloc_size * sizeof(uint32_t));
+}
+
+/* Vendor extension for RSA in WASM: the whole CRT private key operation
+ * dest = m2 + q * (qInv * (m1 - m2) mod p), with m1 = c^dP mod p and
+ * m2 = c^dQ mod q, in one native call. The operands are validated once
+ * and the intermediates never leave the host, instead of a call per
+ * step of a modexp built on the FMM functions.
+ */
+static TEE_Result bigint_exp_mod_crt_wrapper(
+    wasm_exec_env_t exec_env, TEE_BigInt* dest, const TEE_BigInt* c,
+    const TEE_BigInt* p, const TEE_BigInt* q,
+    const TEE_BigInt* dP, const TEE_BigInt* dQ, const TEE_BigInt* qInv)
+{
+    NMSG("wasm.libtee.%s\n", __func__);
+    wasm_module_inst_t module_inst = get_module_inst(exec_env);
+    const TEE_BigInt* in[] = { c, p, q, dP, dQ, qInv };
+    TEE_BigInt *cp, *cq, *m1, *m2, *t1, *t2, *h;
+    TEE_BigInt* buf = NULL;
+    size_t plen, qlen, nlen, size;
+    TEE_Result res;
+
+    if (!validate_bigint(module_inst, dest))
+        return TEE_ERROR_BAD_PARAMETERS;
+
+    for (size_t i = 0; i < sizeof(in) / sizeof(in[0]); i++) {
+        if (!validate_bigint(module_inst, in[i]))
+            return TEE_ERROR_BAD_PARAMETERS;
+    }
+
+    plen = TEE_BigIntSizeInU32(TEE_BigIntGetBitCount(p));
+    qlen = TEE_BigIntSizeInU32(TEE_BigIntGetBitCount(q));
+    nlen = TEE_BigIntSizeInU32(TEE_BigIntGetBitCount(p)
+        + TEE_BigIntGetBitCount(q));
+    if (TEE_BigIntSizeInU32(0) + ((struct wasm_bigint_hdr*)dest)->alloc_size < nlen)
+        return TEE_ERROR_SHORT_BUFFER;
+
+    size = (4 * plen + 2 * qlen + nlen) * sizeof(uint32_t);
+    buf = malloc(size);
+    if (!buf)
+        return TEE_ERROR_OUT_OF_MEMORY;
+
+    cp = buf;
+    m1 = cp + plen;
+    t1 = m1 + plen;
+    t2 = t1 + plen;
+    cq = t2 + plen;
+    m2 = cq + qlen;
+    h = m2 + qlen;
+    TEE_BigIntInit(cp, plen);
+    TEE_BigIntInit(m1, plen);
+    TEE_BigIntInit(t1, plen);
+    TEE_BigIntInit(t2, plen);
+    TEE_BigIntInit(cq, qlen);
+    TEE_BigIntInit(m2, qlen);
+    TEE_BigIntInit(h, nlen);
+
+    TEE_BigIntMod(cp, c, p);
+    TEE_BigIntMod(cq, c, q);
+    res = TEE_BigIntExpMod(m1, cp, dP, p, NULL);
+    if (res == TEE_SUCCESS)
+        res = TEE_BigIntExpMod(m2, cq, dQ, q, NULL);
+    if (res == TEE_SUCCESS) {
+        TEE_BigIntMod(t1, m2, p);
+        TEE_BigIntSubMod(t2, m1, t1, p);
+        TEE_BigIntMulMod(t1, qInv, t2, p);
+        TEE_BigIntMul(h, t1, q);
+        TEE_BigIntAdd(dest, h, m2);
+    }
+
+    /* The intermediates are as secret as the key */
+    TEE_MemFill(buf, 0, size);
+    free(buf);
+
+    return res;
+}
+
 #define REG_NATIVE_FUNC(func_name, signature)            \
     {                                                    \
 #func_name, func_name##_wrapper, signature, NULL \
     }
 
+/* Kept in strcmp() order of the symbol names: WAMR sorts the table in
+ * place when it is registered at runtime init and resolves every import
+ * of a module load by binary search, a sorted table leaves the sort
+ * nothing to do. Keep new entries in order.
+ */
 static NativeSymbol native_symbols_libtee_builtin[] = {
-    REG_NATIVE_FUNC(TEE_Malloc, "(ii)i"),
-    REG_NATIVE_FUNC(TEE_Realloc, "(ii)i"),
-    REG_NATIVE_FUNC(TEE_Free, "(*)"),
-    REG_NATIVE_FUNC(TEE_MemMove, "(**~)i"),
-    REG_NATIVE_FUNC(TEE_MemCompare, "(**~)i"),
-    REG_NATIVE_FUNC(TEE_MemFill, "(*ii)"),
-    REG_NATIVE_FUNC(TEE_GetObjectInfo1, "(i*)i"),
-    REG_NATIVE_FUNC(TEE_CloseObject, "(i)"),
-    REG_NATIVE_FUNC(TEE_OpenPersistentObject, "(i*~i*)i"),
-    REG_NATIVE_FUNC(TEE_CreatePersistentObject, "(i*~ii*~*)i"),
-    REG_NATIVE_FUNC(TEE_CloseAndDeletePersistentObject1, "(i)i"),
-    REG_NATIVE_FUNC(TEE_RenamePersistentObject, "(i*~)i"),
-    REG_NATIVE_FUNC(TEE_ReadObjectData, "(i*~*)i"),
-    REG_NATIVE_FUNC(TEE_WriteObjectData, "(i*~)i"),
-    REG_NATIVE_FUNC(TEE_TruncateObjectData, "(ii)i"),
-    REG_NATIVE_FUNC(TEE_SeekObjectData, "(iIi)i"),
-    REG_NATIVE_FUNC(find_hash, "(*)i"),
-    REG_NATIVE_FUNC(hmac_memory, "(i*~*~**)i"),
-    REG_NATIVE_FUNC(trace_printf, "($iii$*)"),
-
-    REG_NATIVE_FUNC(TEE_AllocateTransientObject, "(ii*)i"),
-    REG_NATIVE_FUNC(TEE_FreeTransientObject, "(i)"),
-    REG_NATIVE_FUNC(TEE_InitRefAttribute, "(*i*~)"),
-    REG_NATIVE_FUNC(TEE_PopulateTransientObject, "(i*i)i"),
-    REG_NATIVE_FUNC(TEE_AllocateOperation, "(*iii)i"),
-    REG_NATIVE_FUNC(TEE_FreeOperation, "(i)"),
-    REG_NATIVE_FUNC(TEE_SetOperationKey, "(ii)i"),
-    REG_NATIVE_FUNC(TEE_CopyOperation, "(ii)"),
-    REG_NATIVE_FUNC(TEE_MACInit, "(i*~)"),
-    REG_NATIVE_FUNC(TEE_MACUpdate, "(i*~)"),
-    REG_NATIVE_FUNC(TEE_MACComputeFinal, "(i*~**)i"),
-    REG_NATIVE_FUNC(TEE_MACCompareFinal, "(i*~*~)i"),
-
-    REG_NATIVE_FUNC(TEE_DigestUpdate, "(i*~)"),
-    REG_NATIVE_FUNC(TEE_DigestDoFinal, "(i*~**)i"),
-    REG_NATIVE_FUNC(TEE_DigestExtract, "(i**)i"),
-    REG_NATIVE_FUNC(TEE_ResetOperation, "(i)"),
-    REG_NATIVE_FUNC(TEE_IsAlgorithmSupported, "(ii)i"),
-
-    REG_NATIVE_FUNC(sleep, "(i)i"),
-    REG_NATIVE_FUNC(TEE_GetSystemTime, "(*)"),
-    REG_NATIVE_FUNC(TEE_GenerateKey, "(ii*i)i"),
-    REG_NATIVE_FUNC(TEE_AEInit, "(i*~iii)i"),
-    REG_NATIVE_FUNC(TEE_AEEncryptFinal, "(i*~****)i"),
     REG_NATIVE_FUNC(TEE_AEDecryptFinal, "(i*~***~)i"),
-    REG_NATIVE_FUNC(TEE_GetObjectBufferAttribute, "(ii**)i"),
-    REG_NATIVE_FUNC(TEE_GetObjectValueAttribute, "(ii**)i"),
-    REG_NATIVE_FUNC(TEE_GenerateRandom, "(*~)"),
-    REG_NATIVE_FUNC(TEE_CipherInit, "(i*~)"),
-    REG_NATIVE_FUNC(TEE_CipherUpdate, "(i*~**)i"),
-    REG_NATIVE_FUNC(TEE_CipherDoFinal, "(i*~**)i"),
-    REG_NATIVE_FUNC(TEE_InitValueAttribute, "(*iii)"),
-    REG_NATIVE_FUNC(TEE_CloseAndDeletePersistentObject, "(i)"),
-
+    REG_NATIVE_FUNC(TEE_AEEncryptFinal, "(i*~****)i"),
+    REG_NATIVE_FUNC(TEE_AEInit, "(i*~iii)i"),
+    REG_NATIVE_FUNC(TEE_AEUpdate, "(i*~**)i"),
+    REG_NATIVE_FUNC(TEE_AEUpdateAAD, "(i*~)"),
+    REG_NATIVE_FUNC(TEE_AllocateOperation, "(*iii)i"),
     REG_NATIVE_FUNC(TEE_AllocatePersistentObjectEnumerator, "(*)i"),
-    REG_NATIVE_FUNC(TEE_FreePersistentObjectEnumerator, "(i)"),
-    REG_NATIVE_FUNC(TEE_ResetPersistentObjectEnumerator, "(i)"),
-    REG_NATIVE_FUNC(TEE_StartPersistentObjectEnumerator, "(ii)i"),
-    REG_NATIVE_FUNC(TEE_GetNextPersistentObject, "(i***)i"),
-    REG_NATIVE_FUNC(TEE_GetObjectInfo, "(i*)"),
-    REG_NATIVE_FUNC(TEE_RestrictObjectUsage1, "(ii)i"),
-    REG_NATIVE_FUNC(TEE_ResetTransientObject, "(i)"),
-    REG_NATIVE_FUNC(TEE_Panic, "(i)"),
-    REG_NATIVE_FUNC(TEE_SetOperationKey2, "(iii)i"),
-    REG_NATIVE_FUNC(TEE_CopyObjectAttributes1, "(ii)i"),
-    REG_NATIVE_FUNC(TEE_AsymmetricEncrypt, "(i*~*~**)i"),
+    REG_NATIVE_FUNC(TEE_AllocateTransientObject, "(ii*)i"),
     REG_NATIVE_FUNC(TEE_AsymmetricDecrypt, "(i*~*~**)i"),
+    REG_NATIVE_FUNC(TEE_AsymmetricEncrypt, "(i*~*~**)i"),
     REG_NATIVE_FUNC(TEE_AsymmetricSignDigest, "(i*~*~**)i"),
     REG_NATIVE_FUNC(TEE_AsymmetricVerifyDigest, "(i*~*~*~)i"),
-    REG_NATIVE_FUNC(TEE_DeriveKey, "(i*~i)"),
-    REG_NATIVE_FUNC(TEE_AEUpdateAAD, "(i*~)"),
-    REG_NATIVE_FUNC(TEE_AEUpdate, "(i*~**)i"),
-    REG_NATIVE_FUNC(TEE_GetOperationInfo, "(i*)"),
-    REG_NATIVE_FUNC(TEE_OpenTASession, "(*ii***)i"),
-    REG_NATIVE_FUNC(TEE_InvokeTACommand, "(iiii**)i"),
-    REG_NATIVE_FUNC(TEE_CloseTASession, "(i)"),
-    REG_NATIVE_FUNC(TEE_BigIntInit, "(*i)"),
-    REG_NATIVE_FUNC(TEE_BigIntFMMContextSizeInU32, "(i)i"),
-    REG_NATIVE_FUNC(TEE_BigIntInitFMMContext, "(*i*)"),
-    REG_NATIVE_FUNC(TEE_BigIntFMMSizeInU32, "(i)i"),
-    REG_NATIVE_FUNC(TEE_BigIntInitFMM, "(*i)"),
+    REG_NATIVE_FUNC(TEE_BigIntAbs, "(**)i"),
+    REG_NATIVE_FUNC(TEE_BigIntAdd, "(***)"),
+    REG_NATIVE_FUNC(TEE_BigIntAddMod, "(****)"),
+    REG_NATIVE_FUNC(TEE_BigIntAssign, "(**)i"),
+    REG_NATIVE_FUNC(TEE_BigIntCmp, "(**)i"),
+    REG_NATIVE_FUNC(TEE_BigIntCmpS32, "(*i)i"),
+    REG_NATIVE_FUNC(TEE_BigIntComputeExtendedGcd, "(*****)"),
+    REG_NATIVE_FUNC(TEE_BigIntComputeFMM, "(*****)"),
+    REG_NATIVE_FUNC(TEE_BigIntConvertFromFMM, "(****)"),
     REG_NATIVE_FUNC(TEE_BigIntConvertFromOctetString, "(**~i)i"),
     REG_NATIVE_FUNC(TEE_BigIntConvertFromS32, "(*i)"),
-    REG_NATIVE_FUNC(TEE_BigIntCmpS32, "(*i)i"),
+    REG_NATIVE_FUNC(TEE_BigIntConvertToFMM, "(****)"),
     REG_NATIVE_FUNC(TEE_BigIntConvertToOctetString, "(***)i"),
     REG_NATIVE_FUNC(TEE_BigIntConvertToS32, "(**)i"),
+    REG_NATIVE_FUNC(TEE_BigIntDiv, "(****)"),
+    REG_NATIVE_FUNC(TEE_BigIntExpMod, "(*****)i"),
+    REG_NATIVE_FUNC(TEE_BigIntFMMContextSizeInU32, "(i)i"),
+    REG_NATIVE_FUNC(TEE_BigIntFMMSizeInU32, "(i)i"),
     REG_NATIVE_FUNC(TEE_BigIntGetBit, "(*i)i"),
-    REG_NATIVE_FUNC(TEE_BigIntSetBit, "(*ii)i"),
-    REG_NATIVE_FUNC(TEE_BigIntShiftRight, "(**i)"),
-    REG_NATIVE_FUNC(TEE_BigIntCmp, "(**)i"),
-    REG_NATIVE_FUNC(TEE_BigIntAdd, "(***)"),
-    REG_NATIVE_FUNC(TEE_BigIntSub, "(***)"),
+    REG_NATIVE_FUNC(TEE_BigIntGetBitCount, "(*)i"),
+    REG_NATIVE_FUNC(TEE_BigIntInit, "(*i)"),
+    REG_NATIVE_FUNC(TEE_BigIntInitFMM, "(*i)"),
+    REG_NATIVE_FUNC(TEE_BigIntInitFMMContext, "(*i*)"),
+    REG_NATIVE_FUNC(TEE_BigIntInvMod, "(***)"),
+    REG_NATIVE_FUNC(TEE_BigIntIsProbablePrime, "(*i)i"),
+    REG_NATIVE_FUNC(TEE_BigIntMod, "(***)"),
     REG_NATIVE_FUNC(TEE_BigIntMul, "(***)"),
+    REG_NATIVE_FUNC(TEE_BigIntMulMod, "(****)"),
     REG_NATIVE_FUNC(TEE_BigIntNeg, "(**)"),
-    REG_NATIVE_FUNC(TEE_BigIntAssign, "(**)i"),
-    REG_NATIVE_FUNC(TEE_BigIntAbs, "(**)i"),
+    REG_NATIVE_FUNC(TEE_BigIntRelativePrime, "(**)i"),
+    REG_NATIVE_FUNC(TEE_BigIntSetBit, "(*ii)i"),
+    REG_NATIVE_FUNC(TEE_BigIntShiftRight, "(**i)"),
     REG_NATIVE_FUNC(TEE_BigIntSquare, "(**)"),
-    REG_NATIVE_FUNC(TEE_BigIntDiv, "(****)"),
-    REG_NATIVE_FUNC(TEE_BigIntMod, "(***)"),
-    REG_NATIVE_FUNC(TEE_BigIntAddMod, "(****)"),
-    REG_NATIVE_FUNC(TEE_BigIntSubMod, "(****)"),
-    REG_NATIVE_FUNC(TEE_BigIntMulMod, "(****)"),
     REG_NATIVE_FUNC(TEE_BigIntSquareMod, "(***)"),
-    REG_NATIVE_FUNC(TEE_BigIntInvMod, "(***)"),
-    REG_NATIVE_FUNC(TEE_BigIntExpMod, "(*****)i"),
-    REG_NATIVE_FUNC(TEE_BigIntRelativePrime, "(**)i"),
-    REG_NATIVE_FUNC(TEE_BigIntComputeExtendedGcd, "(*****)"),
-    REG_NATIVE_FUNC(TEE_BigIntIsProbablePrime, "(*i)i"),
-    REG_NATIVE_FUNC(TEE_BigIntConvertToFMM, "(****)"),
-    REG_NATIVE_FUNC(TEE_BigIntConvertFromFMM, "(****)"),
-    REG_NATIVE_FUNC(TEE_BigIntComputeFMM, "(*****)"),
-    REG_NATIVE_FUNC(TEE_BigIntGetBitCount, "(*)i"),
+    REG_NATIVE_FUNC(TEE_BigIntSub, "(***)"),
+    REG_NATIVE_FUNC(TEE_BigIntSubMod, "(****)"),
+    REG_NATIVE_FUNC(TEE_CipherDoFinal, "(i*~**)i"),
+    REG_NATIVE_FUNC(TEE_CipherInit, "(i*~)"),
+    REG_NATIVE_FUNC(TEE_CipherUpdate, "(i*~**)i"),
+    REG_NATIVE_FUNC(TEE_CipherUpdateV, "(i*i**)i"),
+    REG_NATIVE_FUNC(TEE_CloseAndDeletePersistentObject, "(i)"),
+    REG_NATIVE_FUNC(TEE_CloseAndDeletePersistentObject1, "(i)i"),
+    REG_NATIVE_FUNC(TEE_CloseObject, "(i)"),
+    REG_NATIVE_FUNC(TEE_CloseTASession, "(i)"),
+    REG_NATIVE_FUNC(TEE_CopyObjectAttributes1, "(ii)i"),
+    REG_NATIVE_FUNC(TEE_CopyOperation, "(ii)"),
+    REG_NATIVE_FUNC(TEE_CreatePersistentObject, "(i*~ii*~*)i"),
+    REG_NATIVE_FUNC(TEE_DeriveKey, "(i*~i)"),
+    REG_NATIVE_FUNC(TEE_DigestDoFinal, "(i*~**)i"),
+    REG_NATIVE_FUNC(TEE_DigestExtract, "(i**)i"),
+    REG_NATIVE_FUNC(TEE_DigestUpdate, "(i*~)"),
+    REG_NATIVE_FUNC(TEE_DigestUpdateV, "(i*i)"),
+    REG_NATIVE_FUNC(TEE_Free, "(*)"),
+    REG_NATIVE_FUNC(TEE_FreeOperation, "(i)"),
+    REG_NATIVE_FUNC(TEE_FreePersistentObjectEnumerator, "(i)"),
+    REG_NATIVE_FUNC(TEE_FreeTransientObject, "(i)"),
+    REG_NATIVE_FUNC(TEE_GenerateKey, "(ii*i)i"),
+    REG_NATIVE_FUNC(TEE_GenerateRandom, "(*~)"),
+    REG_NATIVE_FUNC(TEE_GetNextPersistentObject, "(i***)i"),
+    REG_NATIVE_FUNC(TEE_GetObjectBufferAttribute, "(ii**)i"),
+    REG_NATIVE_FUNC(TEE_GetObjectInfo, "(i*)"),
+    REG_NATIVE_FUNC(TEE_GetObjectInfo1, "(i*)i"),
+    REG_NATIVE_FUNC(TEE_GetObjectValueAttribute, "(ii**)i"),
+    REG_NATIVE_FUNC(TEE_GetOperationInfo, "(i*)"),
+    REG_NATIVE_FUNC(TEE_GetSystemTime, "(*)"),
+    REG_NATIVE_FUNC(TEE_InitRefAttribute, "(*i*~)"),
+    REG_NATIVE_FUNC(TEE_InitValueAttribute, "(*iii)"),
+    REG_NATIVE_FUNC(TEE_InvokeTACommand, "(iiii**)i"),
+    REG_NATIVE_FUNC(TEE_IsAlgorithmSupported, "(ii)i"),
+    REG_NATIVE_FUNC(TEE_MACCompareFinal, "(i*~*~)i"),
+    REG_NATIVE_FUNC(TEE_MACComputeFinal, "(i*~**)i"),
+    REG_NATIVE_FUNC(TEE_MACInit, "(i*~)"),
+    REG_NATIVE_FUNC(TEE_MACUpdate, "(i*~)"),
+    REG_NATIVE_FUNC(TEE_MACUpdateV, "(i*i)"),
+    REG_NATIVE_FUNC(TEE_Malloc, "(ii)i"),
+    REG_NATIVE_FUNC(TEE_MemCompare, "(**~)i"),
+    REG_NATIVE_FUNC(TEE_MemFill, "(*ii)"),
+    REG_NATIVE_FUNC(TEE_MemMove, "(**~)i"),
+    REG_NATIVE_FUNC(TEE_OpenPersistentObject, "(i*~i*)i"),
+    REG_NATIVE_FUNC(TEE_OpenTASession, "(*ii***)i"),
+    REG_NATIVE_FUNC(TEE_Panic, "(i)"),
+    REG_NATIVE_FUNC(TEE_PopulateTransientObject, "(i*i)i"),
+    REG_NATIVE_FUNC(TEE_ReadObjectData, "(i*~*)i"),
+    REG_NATIVE_FUNC(TEE_Realloc, "(ii)i"),
+    REG_NATIVE_FUNC(TEE_RenamePersistentObject, "(i*~)i"),
+    REG_NATIVE_FUNC(TEE_ResetOperation, "(i)"),
+    REG_NATIVE_FUNC(TEE_ResetPersistentObjectEnumerator, "(i)"),
+    REG_NATIVE_FUNC(TEE_ResetTransientObject, "(i)"),
+    REG_NATIVE_FUNC(TEE_RestrictObjectUsage1, "(ii)i"),
+    REG_NATIVE_FUNC(TEE_SeekObjectData, "(iIi)i"),
+    REG_NATIVE_FUNC(TEE_SetOperationKey, "(ii)i"),
+    REG_NATIVE_FUNC(TEE_SetOperationKey2, "(iii)i"),
+    REG_NATIVE_FUNC(TEE_StartPersistentObjectEnumerator, "(ii)i"),
+    REG_NATIVE_FUNC(TEE_TruncateObjectData, "(ii)i"),
+    REG_NATIVE_FUNC(TEE_WriteObjectData, "(i*~)i"),
+    REG_NATIVE_FUNC(bigint_exp_mod_crt, "(*******)i"),
+    REG_NATIVE_FUNC(find_hash, "(*)i"),
+    REG_NATIVE_FUNC(hmac_memory, "(i*~*~**)i"),
+    REG_NATIVE_FUNC(hmac_stream_final, "(i**)i"),
+    REG_NATIVE_FUNC(hmac_stream_init, "(i*~)i"),
+    REG_NATIVE_FUNC(hmac_stream_update, "(i*~)i"),
+    REG_NATIVE_FUNC(sleep, "(i)i"),
+    REG_NATIVE_FUNC(trace_printf, "($iii$*)"),
 };
 
 uint32_t
 get_libtee_builtin_export_apis(NativeSymbol** p_libtee_builtin_apis)
 {
+#ifdef CFG_TEE_CORE_DEBUG
+    for (size_t i = 1; i < sizeof(native_symbols_libtee_builtin) / sizeof(NativeSymbol); i++) {
+        assert(strcmp(native_symbols_libtee_builtin[i - 1].symbol,
+                   native_symbols_libtee_builtin[i].symbol)
+            < 0);
+    }
+#endif
+
     *p_libtee_builtin_apis = native_symbols_libtee_builtin;
     return sizeof(native_symbols_libtee_builtin) / sizeof(NativeSymbol);
 }
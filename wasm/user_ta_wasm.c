@@ -23,6 +23,7 @@
 #include <tee/tee_obj.h>
 #include <tee/tee_svc.h>
 #include <tee/tee_svc_cryp.h>
+#include <tee/tee_svc_storage.h>
 #include <tee/uuid.h>
 #include <trace.h>
 #include <types_ext.h>
@@ -30,15 +31,106 @@
 #include <util.h>
 
 #include "wasm_export.h"
-#include <fcntl.h>
+#include <hmac_memory.h>
+#include <initcall.h>
+#include <kernel/mutex.h>
+#include <kernel/thread_private.h>
 #include <kernel/tee_misc.h>
+#include <kernel/user_access.h>
 #include <kernel/user_ta.h>
+#include <mem_budget.h>
 #include <mm/mobj.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
+#include <optee_stats.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <user_ta_wasm_cache.h>
+#include <user_ta_wasm_mem.h>
+#include <user_ta_wasm_slab.h>
 
 static uint8_t wasm_runtime_init_flag = 0;
 
+#if defined(CONFIG_OPTEE_WASM_INSTANCE_POOL_SIZE) && CONFIG_OPTEE_WASM_INSTANCE_POOL_SIZE > 0
+#define WASM_INSTANCE_POOL
+#define WASM_INSTANCE_POOL_SIZE CONFIG_OPTEE_WASM_INSTANCE_POOL_SIZE
+#define WASM_HOT_TAS_MAX 4
+#endif
+
+#if defined(CONFIG_OPTEE_WASM_OP_POOL_SIZE) && CONFIG_OPTEE_WASM_OP_POOL_SIZE > 0
+#define WASM_OP_POOL
+#endif
+
+#ifdef CONFIG_OPTEE_WASM_KEEP_ALIVE_BUDGET
+#define WASM_KEEP_ALIVE_BUDGET CONFIG_OPTEE_WASM_KEEP_ALIVE_BUDGET
+#else
+#define WASM_KEEP_ALIVE_BUDGET 0
+#endif
+
+static bool wasm_ctx_is_keep_alive(struct user_ta_ctx* utc)
+{
+    return (utc->ta_ctx.flags & TA_FLAG_INSTANCE_KEEP_ALIVE)
+        && (utc->ta_ctx.flags & TA_FLAG_SINGLE_INSTANCE);
+}
+
+/* The staging region holds all the params of an entry point call, after
+ * the session context slot TA_OpenSessionEntryPoint() writes. Each memref
+ * takes size(4 bytes) + buffer(size bytes), rounded up to keep every slot
+ * 8 bytes aligned, each value a(4 bytes) + b(4 bytes).
+ */
+#define WASM_PARAM_STAGE_SLOT(size) ROUNDUP((size) + sizeof(uint32_t), 8)
+#define WASM_PARAM_STAGE_VALUE (sizeof(uint32_t) * 2)
+#define WASM_PARAM_STAGE_CTX 8
+
+static TEE_Result wasm_param_stage_reserve(struct user_ta_ctx* utc,
+    uint32_t param_types, struct tee_ta_param* param)
+{
+    uint32_t size = WASM_PARAM_STAGE_CTX;
+    uint32_t type;
+    uint32_t buffer_for_wasm;
+
+    for (int n = 0; n < 4 && param; n++) {
+        type = TEE_PARAM_TYPE_GET(param_types, n);
+        if ((type == TEE_PARAM_TYPE_MEMREF_INPUT || type == TEE_PARAM_TYPE_MEMREF_OUTPUT
+                || type == TEE_PARAM_TYPE_MEMREF_INOUT)
+            && param->u[n].mem.mobj) {
+            size += WASM_PARAM_STAGE_SLOT(param->u[n].mem.mobj->size);
+        } else if (type == TEE_PARAM_TYPE_VALUE_INPUT || type == TEE_PARAM_TYPE_VALUE_OUTPUT
+            || type == TEE_PARAM_TYPE_VALUE_INOUT) {
+            size += WASM_PARAM_STAGE_VALUE;
+        }
+    }
+
+    if (size <= utc->param_stage_size) {
+        return TEE_SUCCESS;
+    }
+
+    /* grow the region, it is only released with the context */
+    if (utc->param_stage) {
+        wasm_runtime_module_free(utc->wasm_module_inst, utc->param_stage);
+        utc->param_stage = 0;
+        utc->param_stage_size = 0;
+    }
+
+    buffer_for_wasm = wasm_runtime_module_malloc(utc->wasm_module_inst, size,
+        NULL);
+    if (buffer_for_wasm == 0) {
+        EMSG("TEE out of memory: %" PRIu32 "\n", size);
+        return TEE_ERROR_OUT_OF_MEMORY;
+    }
+
+    utc->param_stage = buffer_for_wasm;
+    utc->param_stage_size = size;
+    return TEE_SUCCESS;
+}
+
+/* Native address of an app offset into the staging region. Linear memory
+ * moves when the TA grows it, so this is looked up again on every use
+ * instead of being kept across calls into the TA.
+ */
+static uint8_t* wasm_param_stage_va(struct user_ta_ctx* utc, uint32_t offs)
+{
+    return wasm_runtime_addr_app_to_native(utc->wasm_module_inst, offs);
+}
+
 static TEE_Result wasm_copy_in_app_params(struct user_ta_ctx* utc,
     uint32_t param_types,
     uint32_t* p, uint32_t* p_cookie,
@@ -50,11 +142,18 @@ static TEE_Result wasm_copy_in_app_params(struct user_ta_ctx* utc,
     TEE_Result res = TEE_ERROR_OUT_OF_MEMORY;
     uint32_t type;
     char* buffer = NULL;
-    uint32_t buffer_for_wasm;
+    char* stage = NULL;
+    uint32_t stage_offs = WASM_PARAM_STAGE_CTX;
 
     memset(p, 0, sizeof(uint32_t) * 4);
     memset(p_cookie, 0, sizeof(uint32_t) * 4);
 
+    res = wasm_param_stage_reserve(utc, param_types, param);
+    if (res != TEE_SUCCESS) {
+        return res;
+    }
+    stage = (char*)wasm_param_stage_va(utc, utc->param_stage);
+
     for (int n = 0; n < 4; n++) {
         type = TEE_PARAM_TYPE_GET(param_types, n);
         switch (type) {
@@ -68,21 +167,24 @@ static TEE_Result wasm_copy_in_app_params(struct user_ta_ctx* utc,
                 EMSG("param error!!!");
                 continue;
             }
-            buffer_for_wasm = wasm_runtime_module_malloc(
-                utc->wasm_module_inst,
-                param->u[n].mem.mobj->size + sizeof(uint32_t),
-                (void**)&buffer);
-            if (buffer_for_wasm != 0) {
-                p[n] = buffer_for_wasm;
-                p_cookie[n] = (uint32_t)buffer;
-                memcpy(buffer, &param->u[n].mem.mobj->size, sizeof(uint32_t));
-                memcpy(buffer + sizeof(uint32_t),
-                    param->u[n].mem.mobj->buffer,
-                    param->u[n].mem.mobj->size);
+            /* memrefs are carved out of the reusable staging region */
+            p[n] = utc->param_stage + stage_offs;
+            p_cookie[n] = p[n];
+            buffer = stage + stage_offs;
+            stage_offs += WASM_PARAM_STAGE_SLOT(param->u[n].mem.mobj->size);
+            memcpy(buffer, &param->u[n].mem.mobj->size, sizeof(uint32_t));
+            /* the TA only writes an OUTPUT buffer, clear what an earlier
+             * call left in the slot instead of copying it in
+             */
+            if (type == TEE_PARAM_TYPE_MEMREF_OUTPUT) {
+                memset(buffer + sizeof(uint32_t), 0, param->u[n].mem.mobj->size);
             } else {
-                EMSG("TEE out of memory: %zu\n", param->u[n].mem.mobj->size + sizeof(uint32_t));
-                res = TEE_ERROR_OUT_OF_MEMORY;
-                goto out;
+                res = mobj_read(param->u[n].mem.mobj, 0,
+                    buffer + sizeof(uint32_t), param->u[n].mem.mobj->size);
+                if (res != TEE_SUCCESS) {
+                    EMSG("%08x\n", res);
+                    return res;
+                }
             }
             break;
         case TEE_PARAM_TYPE_VALUE_INPUT:
@@ -92,41 +194,20 @@ static TEE_Result wasm_copy_in_app_params(struct user_ta_ctx* utc,
                 EMSG("param error!!!");
                 continue;
             }
-            buffer_for_wasm = wasm_runtime_module_malloc(
-                utc->wasm_module_inst,
-                sizeof(uint32_t) * 2,
-                (void**)&buffer);
-            if (buffer_for_wasm != 0) {
-                p[n] = buffer_for_wasm;
-                p_cookie[n] = (uint32_t)buffer;
-                memcpy(buffer, &param->u[n].val.a, sizeof(uint32_t));
-                memcpy(buffer + sizeof(uint32_t), &param->u[n].val.b, sizeof(uint32_t));
-            } else {
-                EMSG("%08x : %u\n", TEE_ERROR_OUT_OF_MEMORY, sizeof(uint32_t) * 2);
-                res = TEE_ERROR_OUT_OF_MEMORY;
-                goto out;
-            }
+            p[n] = utc->param_stage + stage_offs;
+            p_cookie[n] = p[n];
+            buffer = stage + stage_offs;
+            stage_offs += WASM_PARAM_STAGE_VALUE;
+            memcpy(buffer, &param->u[n].val.a, sizeof(uint32_t));
+            memcpy(buffer + sizeof(uint32_t), &param->u[n].val.b, sizeof(uint32_t));
             break;
         default:
             EMSG("%08x : 0x%" PRIx32 "\n", TEE_ERROR_ITEM_NOT_FOUND, type);
-            res = TEE_ERROR_ITEM_NOT_FOUND;
-            goto out;
+            return TEE_ERROR_ITEM_NOT_FOUND;
         }
     }
 
     return TEE_SUCCESS;
-out:
-    for (int n = 0; n < 4; n++) {
-        /* it is runtime embedder's responsibility to release the memory,
-         * unless the WASM app will free the passed pointer in its code
-         */
-        if (!p[n]) {
-            wasm_runtime_module_free(utc->wasm_module_inst, p[n]);
-            p[n] = 0;
-        }
-    }
-
-    return res;
 }
 
 static TEE_Result wasm_copy_out_app_params(struct user_ta_ctx* utc,
@@ -138,10 +219,15 @@ static TEE_Result wasm_copy_out_app_params(struct user_ta_ctx* utc,
      *            case 2: a(4 bytes) + b(4 bytes)
      */
     TEE_Result res = TEE_ERROR_GENERIC;
+    const uint8_t* va = NULL;
     uint32_t type;
 
     for (int n = 0; n < 4; n++) {
         type = TEE_PARAM_TYPE_GET(param_types, n);
+        /* the cookie is the app offset of the slot, the TA may have moved
+         * its linear memory since it was staged
+         */
+        va = p_cookie[n] ? wasm_param_stage_va(utc, p_cookie[n]) : NULL;
         switch (type) {
         case TEE_PARAM_TYPE_NONE:
             break;
@@ -152,19 +238,26 @@ static TEE_Result wasm_copy_out_app_params(struct user_ta_ctx* utc,
                 EMSG("param error!!!");
                 continue;
             }
-            if (p_cookie[n] != 0) {
-                memcpy(&param->u[n].mem.mobj->size, (const void*)p_cookie[n],
-                    sizeof(uint32_t));
-                param->u[n].mem.size = param->u[n].mem.mobj->size;
-                memcpy(param->u[n].mem.mobj->buffer,
-                    (const void*)(p_cookie[n] + sizeof(uint32_t)),
-                    param->u[n].mem.mobj->size);
-                wasm_runtime_module_free(utc->wasm_module_inst, p[n]);
-                p[n] = 0;
+            if (va) {
+                /* the TA doesn't change an INPUT buffer, nothing to copy back */
+                if (type != TEE_PARAM_TYPE_MEMREF_INPUT) {
+                    uint32_t capacity = param->u[n].mem.mobj->size;
+                    memcpy(&param->u[n].mem.mobj->size, va, sizeof(uint32_t));
+                    param->u[n].mem.size = param->u[n].mem.mobj->size;
+                    /* a size beyond the buffer only reports the size needed */
+                    if (param->u[n].mem.mobj->size <= capacity) {
+                        res = mobj_write(param->u[n].mem.mobj, 0,
+                            va + sizeof(uint32_t),
+                            param->u[n].mem.mobj->size);
+                        if (res != TEE_SUCCESS) {
+                            EMSG("%08x\n", res);
+                            return res;
+                        }
+                    }
+                }
             } else {
                 EMSG("%08x\n", TEE_ERROR_BAD_PARAMETERS);
-                res = TEE_ERROR_BAD_PARAMETERS;
-                goto out;
+                return TEE_ERROR_BAD_PARAMETERS;
             }
             break;
         case TEE_PARAM_TYPE_VALUE_INPUT:
@@ -175,52 +268,56 @@ static TEE_Result wasm_copy_out_app_params(struct user_ta_ctx* utc,
                 continue;
             }
 
-            if (p_cookie[n] != 0) {
-                memcpy(&param->u[n].val.a, (const void*)p_cookie[n], sizeof(uint32_t));
-                memcpy(&param->u[n].val.b,
-                    (const void*)(p_cookie[n] + sizeof(uint32_t)),
-                    sizeof(uint32_t));
-                wasm_runtime_module_free(utc->wasm_module_inst, p[n]);
-                p[n] = 0;
+            if (va) {
+                memcpy(&param->u[n].val.a, va, sizeof(uint32_t));
+                memcpy(&param->u[n].val.b, va + sizeof(uint32_t), sizeof(uint32_t));
             } else {
                 EMSG("%08x\n", TEE_ERROR_BAD_PARAMETERS);
-                res = TEE_ERROR_BAD_PARAMETERS;
-                goto out;
+                return TEE_ERROR_BAD_PARAMETERS;
             }
             break;
         default:
             EMSG("%08x : 0x%" PRIx32 "\n", TEE_ERROR_ITEM_NOT_FOUND, type);
-            res = TEE_ERROR_ITEM_NOT_FOUND;
-            goto out;
+            return TEE_ERROR_ITEM_NOT_FOUND;
         }
     }
 
     return TEE_SUCCESS;
-out:
-    for (int n = 0; n < 4; n++) {
-        /* it is runtime embedder's responsibility to release the memory,
-         * unless the WASM app will free the passed pointer in its code
-         */
-        if (!p[n]) {
-            wasm_runtime_module_free(utc->wasm_module_inst, p[n]);
-            p[n] = 0;
-        }
-    }
+}
 
-    return res;
+static void wasm_call_abort(void* arg)
+{
+    wasm_runtime_terminate(arg);
 }
 
-static void wasm_free_app_params(struct user_ta_ctx* utc, uint32_t* p)
+/* Call a TA entry point on behalf of the request the thread serves. The
+ * request can abort it once cancelled, the instance is left in a state only
+ * good for being destroyed, so the TA is taken for panicked.
+ */
+static TEE_Result wasm_call_entry(struct user_ta_ctx* utc,
+    wasm_function_inst_t func, uint32_t argc, uint32_t* argv)
 {
-    for (int n = 0; n < 4; n++) {
-        /* it is runtime embedder's responsibility to release the memory,
-         * unless the WASM app will free the passed pointer in its code
-         */
-        if (!p[n]) {
-            wasm_runtime_module_free(utc->wasm_module_inst, p[n]);
-            p[n] = 0;
-        }
+    bool done = false;
+
+    if (!thread_cancel_set_abort(wasm_call_abort, utc->wasm_module_inst)) {
+        return TEE_ERROR_CANCEL;
+    }
+
+    done = wasm_runtime_call_wasm(utc->exec_env, func, argc, argv);
+    if (!thread_cancel_set_abort(NULL, NULL) && !done) {
+        EMSG("%08x : request cancelled\n", TEE_ERROR_CANCEL);
+        utc->ta_ctx.panicked = true;
+        utc->ta_ctx.panic_code = TEE_ERROR_CANCEL;
+        utc->is_created = false;
+        return TEE_ERROR_CANCEL;
+    }
+
+    if (!done) {
+        EMSG("%08x : %s\n", TEE_ERROR_GENERIC, wasm_runtime_get_exception(utc->wasm_module_inst));
+        return TEE_ERROR_GENERIC;
     }
+
+    return TEE_SUCCESS;
 }
 
 static TEE_Result user_ta_wasm_enter_open_session(struct ts_session* s)
@@ -229,51 +326,31 @@ static TEE_Result user_ta_wasm_enter_open_session(struct ts_session* s)
     TEE_Result wasm_res = TEE_ERROR_GENERIC;
     uint32_t ta_argv[6] = { 0 };
     uint32_t p_cookie[4] = { 0 };
-    char* buffer = NULL;
+    uint32_t* session_ctx = NULL;
     struct tee_ta_session* ta_sess = to_ta_session(s);
     struct ts_session* ts_sess __maybe_unused = NULL;
-    uint32_t buffer_for_wasm = 0;
+    struct wasm_mem_stats* prev_owner = NULL;
 
     struct user_ta_ctx* utc = to_user_ta_ctx(s->ctx);
     ts_push_current_session(s);
+    prev_owner = wasm_mem_set_owner(utc->mem_stats);
     DMSG("context.ref_count: %" PRIu32 "\n", utc->ta_ctx.ref_count);
 
-    /* call create entry point if first open session, or when the session is re-opened
-     * but the utc->func is not inited, we need to perform the init action
-     */
-    if (utc->ta_ctx.ref_count == 1 || !utc->func) {
-        /* call create entry point if first open session */
-        /* lookup a WASM function by its name. */
-        utc->func = wasm_runtime_lookup_function(utc->wasm_module_inst,
-            "wasm_TA_CreateEntryPoint");
-        if (!utc->func) {
-            EMSG("%08x\n", TEE_ERROR_GENERIC);
-            res = TEE_ERROR_GENERIC;
-            goto out;
-        }
-    }
-
-    /* TEE_Result TA_EXPORT TA_CreateEntryPoint( void ) */
-    if (wasm_runtime_call_wasm(utc->exec_env, utc->func, 6, ta_argv)) {
-        wasm_res = *(TEE_Result*)ta_argv;
-        DMSG("call wasm_TA_CreateEntryPoint ret: 0x%" PRIx32 "\n", wasm_res);
-        if (wasm_res != TEE_SUCCESS) {
-            res = wasm_res;
+    /* call create entry point if first open session */
+    if (!utc->is_created) {
+        /* TEE_Result TA_EXPORT TA_CreateEntryPoint( void ) */
+        res = wasm_call_entry(utc, utc->create_entry, 6, ta_argv);
+        if (res == TEE_SUCCESS) {
+            wasm_res = *(TEE_Result*)ta_argv;
+            DMSG("call wasm_TA_CreateEntryPoint ret: 0x%" PRIx32 "\n", wasm_res);
+            if (wasm_res != TEE_SUCCESS) {
+                res = wasm_res;
+                goto out;
+            }
+        } else {
             goto out;
         }
-    } else {
-        EMSG("%08x : %s\n", TEE_ERROR_GENERIC, wasm_runtime_get_exception(utc->wasm_module_inst));
-        res = TEE_ERROR_GENERIC;
-        goto out;
-    }
-
-    /* lookup a WASM function by its name. */
-    utc->func = wasm_runtime_lookup_function(utc->wasm_module_inst,
-        "wasm_TA_OpenSessionEntryPoint");
-    if (!utc->func) {
-        EMSG("%08x\n", TEE_ERROR_GENERIC);
-        res = TEE_ERROR_GENERIC;
-        goto out;
+        utc->is_created = true;
     }
 
     /* TEE_Result TA_EXPORT TA_OpenSessionEntryPoint(
@@ -291,29 +368,21 @@ static TEE_Result user_ta_wasm_enter_open_session(struct ts_session* s)
         goto out;
     }
 
-    buffer_for_wasm = wasm_runtime_module_malloc(utc->wasm_module_inst,
-        sizeof(uint32_t), (void**)&buffer);
-    if (buffer_for_wasm != 0) {
-        ta_argv[5] = buffer_for_wasm;
-    } else {
-        EMSG("%08x : %u\n", TEE_ERROR_OUT_OF_MEMORY, sizeof(uint32_t));
-        wasm_free_app_params(utc, &ta_argv[1]);
-        res = TEE_ERROR_OUT_OF_MEMORY;
-        goto out;
-    }
+    /* sessionContext goes in the slot ahead of the params */
+    session_ctx = (uint32_t*)wasm_param_stage_va(utc, utc->param_stage);
+    *session_ctx = 0;
+    ta_argv[5] = utc->param_stage;
 
     /*TEE_Result TA_EXPORT TA_OpenSessionEntryPoint(
      * 				uint32_t paramTypes,
      *				[inout] TEE_Param params[4],
      *				[out][ctx] void** sessionContext );
      */
-    if (wasm_runtime_call_wasm(utc->exec_env, utc->func, 6, ta_argv)) {
+    res = wasm_call_entry(utc, utc->open_session_entry, 6, ta_argv);
+    if (res == TEE_SUCCESS) {
         wasm_res = *(uint32_t*)ta_argv;
         DMSG("call wasm_TA_OpenSessionEntryPoint ret: 0x%" PRIx32 "\n", wasm_res);
     } else {
-        EMSG("%08x : %s\n", TEE_ERROR_OUT_OF_MEMORY, wasm_runtime_get_exception(utc->wasm_module_inst));
-        wasm_free_app_params(utc, &ta_argv[1]);
-        res = TEE_ERROR_GENERIC;
         goto out;
     }
 
@@ -324,16 +393,15 @@ static TEE_Result user_ta_wasm_enter_open_session(struct ts_session* s)
         goto out;
     }
 
-    if (wasm_res) {
-        s->user_ctx = (void*)(*((uint32_t*)buffer)); // sessionContext
+    if (wasm_res == TEE_SUCCESS) {
+        /* the TA may have moved its linear memory meanwhile */
+        session_ctx = (uint32_t*)wasm_param_stage_va(utc, utc->param_stage);
+        s->user_ctx = (void*)(*session_ctx); // sessionContext
     }
     res = wasm_res;
 out:
-    if (buffer_for_wasm) {
-        wasm_runtime_module_free(utc->wasm_module_inst, buffer_for_wasm);
-    }
-
     // tee_ta_pop_current_session();
+    wasm_mem_set_owner(prev_owner);
     ts_sess = ts_pop_current_session();
     assert(ts_sess == s);
 
@@ -348,19 +416,13 @@ static TEE_Result user_ta_wasm_enter_invoke_cmd(struct ts_session* s, uint32_t c
     struct user_ta_ctx* utc = to_user_ta_ctx(s->ctx);
     struct tee_ta_session* ta_sess = to_ta_session(s);
     struct ts_session* ts_sess __maybe_unused = NULL;
+    struct wasm_mem_stats* prev_owner = NULL;
     uint32_t ta_argv[7] = { 0 };
     uint32_t p_cookie[4] = { 0 };
+    uint64_t start = optee_stats_now();
 
     ts_push_current_session(s);
-
-    /* lookup a WASM function by its name. */
-    utc->func = wasm_runtime_lookup_function(utc->wasm_module_inst,
-        "wasm_TA_InvokeCommandEntryPoint");
-    if (!utc->func) {
-        EMSG("%08x\n", TEE_ERROR_GENERIC);
-        res = TEE_ERROR_GENERIC;
-        goto out;
-    }
+    prev_owner = wasm_mem_set_owner(utc->mem_stats);
 
     /* TEE_Result TA_EXPORT TA_InvokeCommandEntryPoint(
      *				[ctx] void* sessionContext,
@@ -380,13 +442,11 @@ static TEE_Result user_ta_wasm_enter_invoke_cmd(struct ts_session* s, uint32_t c
         goto out;
     }
 
-    if (wasm_runtime_call_wasm(utc->exec_env, utc->func, 7, ta_argv)) {
+    res = wasm_call_entry(utc, utc->invoke_command_entry, 7, ta_argv);
+    if (res == TEE_SUCCESS) {
         wasm_res = *(TEE_Result*)ta_argv;
         DMSG("call wasm_TA_InvokeCommandEntryPoint ret: 0x%" PRIx32 "\n", wasm_res);
     } else {
-        EMSG("%08x : %s\n", TEE_ERROR_GENERIC, wasm_runtime_get_exception(utc->wasm_module_inst));
-        wasm_free_app_params(utc, &ta_argv[3]);
-        res = TEE_ERROR_GENERIC;
         goto out;
     }
 
@@ -397,30 +457,105 @@ static TEE_Result user_ta_wasm_enter_invoke_cmd(struct ts_session* s, uint32_t c
     }
     res = wasm_res;
 out:
+    wasm_mem_set_owner(prev_owner);
     ts_sess = ts_pop_current_session();
     assert(ts_sess == s);
+    optee_stats_record(OPTEE_STATS_TA, optee_stats_ta_id(&s->ctx->uuid), start, res);
     return res;
 }
 
+static void wasm_call_destroy_entry(struct user_ta_ctx* utc)
+{
+    struct wasm_mem_stats* prev_owner = wasm_mem_set_owner(utc->mem_stats);
+
+    /* void TA_EXPORT TA_DestroyEntryPoint( void ); */
+    if (wasm_runtime_call_wasm(utc->exec_env, utc->destroy_entry, 0, NULL)) {
+        /* to do */
+    } else {
+        EMSG("%08x : %s\n", TEE_ERROR_GENERIC, wasm_runtime_get_exception(utc->wasm_module_inst));
+    }
+    utc->is_created = false;
+    wasm_mem_set_owner(prev_owner);
+}
+
+extern const struct ts_ops user_ta_wasm_ops;
+
+static bool wasm_ctx_is_idle(struct tee_ta_ctx* ctx)
+{
+    return ctx->ts_ctx.ops == &user_ta_wasm_ops && !ctx->ref_count;
+}
+
+/* Bytes the memory budget wants the idle instances to give back. Running
+ * TA_DestroyEntryPoint from inside a failed allocation is not safe, so
+ * they are destroyed at the next reclaim point instead.
+ */
+static size_t wasm_keep_alive_squeeze;
+
+static size_t wasm_keep_alive_shrink(size_t bytes)
+{
+    __atomic_store_n(&wasm_keep_alive_squeeze, bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static struct mem_budget_cache keep_alive_budget = MEM_BUDGET_CACHE_INITIALIZER("wasm keep-alive", wasm_keep_alive_shrink);
+
+/* Destroy the least recently used idle keep-alive instances until the
+ * idle ones fit in the budget again.
+ */
+static void wasm_keep_alive_reclaim(void)
+{
+    struct tee_ta_ctx_head reclaimed = TAILQ_HEAD_INITIALIZER(reclaimed);
+    struct tee_ta_ctx* ctx = NULL;
+    struct tee_ta_ctx* next = NULL;
+    size_t squeeze = __atomic_exchange_n(&wasm_keep_alive_squeeze, 0, __ATOMIC_RELAXED);
+    size_t budget = WASM_KEEP_ALIVE_BUDGET;
+    size_t idle_size = 0;
+
+    mutex_lock(&tee_ta_mutex);
+    TAILQ_FOREACH(ctx, &tee_ctxes, link)
+    {
+        if (wasm_ctx_is_idle(ctx)) {
+            idle_size += to_user_ta_ctx(&ctx->ts_ctx)->instance_size;
+        }
+    }
+
+    if (squeeze) {
+        budget = MIN(budget, idle_size > squeeze ? idle_size - squeeze : 0);
+    }
+
+    for (ctx = TAILQ_FIRST(&tee_ctxes); ctx && idle_size > budget; ctx = next) {
+        next = TAILQ_NEXT(ctx, link);
+        if (wasm_ctx_is_idle(ctx)) {
+            idle_size -= to_user_ta_ctx(&ctx->ts_ctx)->instance_size;
+            TAILQ_REMOVE(&tee_ctxes, ctx, link);
+            TAILQ_INSERT_TAIL(&reclaimed, ctx, link);
+        }
+    }
+    mutex_unlock(&tee_ta_mutex);
+
+    /* out of tee_ctxes no session can reach them, destroy unlocked */
+    while ((ctx = TAILQ_FIRST(&reclaimed))) {
+        TAILQ_REMOVE(&reclaimed, ctx, link);
+        DMSG("reclaim keep-alive instance\n");
+        ctx->ts_ctx.ops->destroy(&ctx->ts_ctx);
+    }
+
+    mem_budget_update(&keep_alive_budget, idle_size);
+}
+
 static void user_ta_wasm_enter_close_session(struct ts_session* s)
 {
     struct user_ta_ctx* utc = to_user_ta_ctx(s->ctx);
     uint32_t ta_argv[1];
     struct ts_session* ts_sess __maybe_unused = NULL;
+    struct wasm_mem_stats* prev_owner = NULL;
     ts_push_current_session(s);
-
-    /* lookup a WASM function by its name. */
-    utc->func = wasm_runtime_lookup_function(utc->wasm_module_inst,
-        "wasm_TA_CloseSessionEntryPoint");
-    if (!utc->func) {
-        EMSG("%08x\n", TEE_ERROR_GENERIC);
-        goto out;
-    }
+    prev_owner = wasm_mem_set_owner(utc->mem_stats);
 
     /* void TA_EXPORT TA_CloseSessionEntryPoint( [ctx] void* sessionContext); */
     ta_argv[0] = (uint32_t)(s->user_ctx);
 
-    if (wasm_runtime_call_wasm(utc->exec_env, utc->func, 1, ta_argv)) {
+    if (wasm_runtime_call_wasm(utc->exec_env, utc->close_session_entry, 1, ta_argv)) {
         /* to do */
     } else {
         EMSG("%08x : %s\n", TEE_ERROR_GENERIC, wasm_runtime_get_exception(utc->wasm_module_inst));
@@ -428,28 +563,41 @@ static void user_ta_wasm_enter_close_session(struct ts_session* s)
     }
 
     DMSG("context.ref_count: %" PRIu32 "\n", utc->ta_ctx.ref_count);
-    /* call destory entry point if last opened session */
-    if (utc->ta_ctx.ref_count == 1) {
-        /* lookup a WASM function by its name. */
-        utc->func = wasm_runtime_lookup_function(utc->wasm_module_inst,
-            "wasm_TA_DestroyEntryPoint");
-        if (!utc->func) {
-            EMSG("%08x\n", TEE_ERROR_GENERIC);
-            goto out;
-        }
-
-        /* void TA_EXPORT TA_DestroyEntryPoint( void ); */
-        if (wasm_runtime_call_wasm(utc->exec_env, utc->func, 0, NULL)) {
-            /* to do */
-        } else {
-            EMSG("%08x : %s\n", TEE_ERROR_GENERIC, wasm_runtime_get_exception(utc->wasm_module_inst));
-        }
+    if (utc->ta_ctx.ref_count == 1 && wasm_ctx_is_keep_alive(utc)) {
+        /* the instance stays resident, tee_ctxes is kept least recently
+         * used first for the reclaim
+         */
+        mutex_lock(&tee_ta_mutex);
+        TAILQ_REMOVE(&tee_ctxes, &utc->ta_ctx, link);
+        TAILQ_INSERT_TAIL(&tee_ctxes, &utc->ta_ctx, link);
+        mutex_unlock(&tee_ta_mutex);
+    } else if (utc->ta_ctx.ref_count == 1) {
+        /* call destory entry point if last opened session */
+        wasm_call_destroy_entry(utc);
     }
 
 out:
+    wasm_mem_set_owner(prev_owner);
     ts_sess = ts_pop_current_session();
+
+    if (utc->ta_ctx.ref_count == 1 && wasm_ctx_is_keep_alive(utc)) {
+        wasm_keep_alive_reclaim();
+    }
 }
 
+static void wasm_instance_release(struct user_ta_ctx* utc);
+#ifdef WASM_INSTANCE_POOL
+static bool wasm_is_hot_uuid(const TEE_UUID* uuid);
+static void wasm_instance_pool_refill(const TEE_UUID* uuid);
+#else
+#define wasm_is_hot_uuid(uuid) false
+#define wasm_instance_pool_refill(uuid)
+#endif
+
+#ifdef WASM_OP_POOL
+extern void wasm_op_pool_release(const void* owner);
+#endif
+
 static void user_ta_wasm_ctx_destroy(struct ts_ctx* ctx)
 {
     struct user_ta_ctx* utc = to_user_ta_ctx(ctx);
@@ -466,49 +614,37 @@ static void user_ta_wasm_ctx_destroy(struct ts_ctx* ctx)
             &utc->open_sessions, KERN_IDENTITY);
     }
 
+#ifdef WASM_OP_POOL
+    /* operations kept by the TA go through libutee, on behalf of ctx */
+    if (utc->wasm_module_inst) {
+        struct tee_ta_session teardown = { .ts_sess.ctx = ctx };
+
+        ts_push_current_session(&teardown.ts_sess);
+        wasm_op_pool_release(utc->wasm_module_inst);
+        ts_pop_current_session();
+    }
+#endif
+
     /* Free cryp states created by this TA */
     tee_svc_cryp_free_states(utc);
     /* Close cryp objects opened by this TA */
     tee_obj_close_all(utc);
+    /* Free storage enumerators created by this TA */
+    tee_svc_storage_close_all_enum(utc);
 
-    /* destroy wasm members */
-    if (utc->exec_env) {
-        wasm_runtime_destroy_exec_env(utc->exec_env);
-    }
-    if (utc->wasm_module_inst) {
-        wasm_runtime_deinstantiate(utc->wasm_module_inst);
-    }
-    if (utc->wasm_module) {
-        wasm_runtime_unload(utc->wasm_module);
-    }
-    if (utc->is_xip_file) {
-        // os_munmap(utc->wasm_file_buffer, utc->wasm_file_size);
-        munmap(utc->wasm_file_buffer, utc->wasm_file_size);
-    } else {
-        if (utc->wasm_file_buffer) {
-            wasm_runtime_free(utc->wasm_file_buffer);
-        }
-    }
-    free(utc);
-}
-
-static int b_memcpy_s(void* dest, unsigned int s1max, const void* src, unsigned int n)
-{
-    if (n == 0) {
-        return 0;
+    /* a reclaimed keep-alive instance still owes TA_DestroyEntryPoint */
+    if (utc->is_created && wasm_ctx_is_keep_alive(utc)) {
+        wasm_call_destroy_entry(utc);
     }
 
-    if (dest == NULL) {
-        return -1;
-    }
+    /* destroy wasm members */
+    wasm_instance_release(utc);
 
-    if (src == NULL || n > s1max) {
-        memset(dest, 0, s1max);
-        return -1;
+    /* get a fresh instance ready for the next session of a hot TA */
+    if (wasm_is_hot_uuid(&ctx->uuid)) {
+        wasm_instance_pool_refill(&ctx->uuid);
     }
-
-    memcpy(dest, src, n);
-    return 0;
+    free(utc);
 }
 
 /*
@@ -527,152 +663,457 @@ static void set_ta_ctx_ops(struct tee_ta_ctx* ctx)
     ctx->ts_ctx.ops = &user_ta_wasm_ops;
 }
 
-#ifdef WASM_HEAP_POOL
-static char global_heap_buf[128 * 1024] = { 0 };
-#endif
-
 #define WASM_FILE_TEMPLATE "/etc/ta/00112233445566778899AABBCCDDEEFF"
 #define WASM_FILE_TEMPLATE_DIR_SIZE 8
+#define WASM_FILE_AOT_SUFFIX ".aot"
+
+/* sizing of TAs without a manifest */
+#define WASM_DEFAULT_STACK_SIZE (48 * 1024)
+#define WASM_DEFAULT_HEAP_SIZE (32 * 1024)
 
 extern uint32_t get_libtee_builtin_export_apis(NativeSymbol** p_libtee_builtin_apis);
+extern void wasm_native_trace_set_sample(uint32_t sample);
 
-static TEE_Result tee_ta_init_user_ta_wasm_session(const TEE_UUID* uuid __unused,
-    struct tee_ta_session* s)
+static wasm_function_inst_t wasm_lookup_entry_point(struct user_ta_ctx* utc,
+    const char* name)
 {
-    TEE_Result res = TEE_ERROR_GENERIC;
-    struct user_ta_ctx* utc = NULL;
-    char wasm_file[64] = { 0 };
-    uint32_t pos = WASM_FILE_TEMPLATE_DIR_SIZE;
-    uint32_t stack_size = 48 * 1024, heap_size = 32 * 1024;
-    char error_buf[128] = { 0 };
-    NativeSymbol* native_symbols;
-    uint32_t n_native_symbols;
-    RuntimeInitArgs init_args;
+    /* lookup a WASM function by its name. */
+    wasm_function_inst_t func = wasm_runtime_lookup_function(utc->wasm_module_inst, name);
+    if (!func) {
+        EMSG("%08x : %s\n", TEE_ERROR_BAD_FORMAT, name);
+    }
+    return func;
+}
 
-    /* convert uuid to wasm file name */
-    strcpy(wasm_file, WASM_FILE_TEMPLATE);
-    pos += tee_b2hs((uint8_t*)uuid, (uint8_t*)(wasm_file + pos),
-        sizeof(TEE_UUID), sizeof(wasm_file) - pos);
+static TEE_Result wasm_resolve_entry_points(struct user_ta_ctx* utc)
+{
+    utc->create_entry = wasm_lookup_entry_point(utc, "wasm_TA_CreateEntryPoint");
+    utc->destroy_entry = wasm_lookup_entry_point(utc, "wasm_TA_DestroyEntryPoint");
+    utc->open_session_entry = wasm_lookup_entry_point(utc, "wasm_TA_OpenSessionEntryPoint");
+    utc->close_session_entry = wasm_lookup_entry_point(utc, "wasm_TA_CloseSessionEntryPoint");
+    utc->invoke_command_entry = wasm_lookup_entry_point(utc, "wasm_TA_InvokeCommandEntryPoint");
+
+    if (!utc->create_entry || !utc->destroy_entry || !utc->open_session_entry
+        || !utc->close_session_entry || !utc->invoke_command_entry) {
+        return TEE_ERROR_BAD_FORMAT;
+    }
 
-    DMSG("Open ta: %s\n", wasm_file);
+    return TEE_SUCCESS;
+}
 
-    /* Register context */
-    utc = calloc(1, sizeof(struct user_ta_ctx));
-    if (!utc) {
-        EMSG("%08x : %u\n", TEE_ERROR_OUT_OF_MEMORY, sizeof(struct user_ta_ctx));
-        res = TEE_ERROR_OUT_OF_MEMORY;
-        goto out1;
-    }
+static pthread_mutex_t wasm_runtime_init_lock = PTHREAD_MUTEX_INITIALIZER;
 
+static TEE_Result wasm_runtime_init_once(void)
+{
+    TEE_Result res = TEE_SUCCESS;
+    NativeSymbol* native_symbols;
+    uint32_t n_native_symbols;
+    RuntimeInitArgs init_args;
+    const char* trace_sample = NULL;
+
+    pthread_mutex_lock(&wasm_runtime_init_lock);
     if (!wasm_runtime_init_flag) {
         /* initialize init arguments */
         DMSG("wasm runtime init ...\n");
         memset(&init_args, 0, sizeof(RuntimeInitArgs));
-#ifdef WASM_HEAP_POOL
-        init_args.mem_alloc_type = Alloc_With_Pool;
-        init_args.mem_alloc_option.pool.heap_buf = global_heap_buf;
-        init_args.mem_alloc_option.pool.heap_size = sizeof(global_heap_buf);
-#else
+        if (wasm_mem_init() != TEE_SUCCESS) {
+            res = TEE_ERROR_GENERIC;
+            goto out;
+        }
         init_args.mem_alloc_type = Alloc_With_Allocator;
-        init_args.mem_alloc_option.allocator.malloc_func = malloc;
-        init_args.mem_alloc_option.allocator.realloc_func = realloc;
-        init_args.mem_alloc_option.allocator.free_func = free;
-#endif
+        init_args.mem_alloc_option.allocator.malloc_func = wasm_mem_malloc;
+        init_args.mem_alloc_option.allocator.realloc_func = wasm_mem_realloc;
+        init_args.mem_alloc_option.allocator.free_func = wasm_mem_free;
         n_native_symbols = get_libtee_builtin_export_apis(&native_symbols);
         init_args.native_module_name = "env";
         init_args.n_native_symbols = n_native_symbols;
         init_args.native_symbols = native_symbols;
 
+        /* sample native call tracing without a rebuild */
+        trace_sample = getenv("OPTEE_WASM_NATIVE_TRACE");
+        if (trace_sample) {
+            wasm_native_trace_set_sample(strtoul(trace_sample, NULL, 0));
+        }
+
         /* initialize runtime environment */
-        if (!wasm_runtime_full_init(&init_args)) {
+        if (wasm_runtime_full_init(&init_args)) {
+            wasm_runtime_init_flag = 1;
+        } else {
             EMSG("%08x\n", TEE_ERROR_GENERIC);
-            goto out2;
+            res = TEE_ERROR_GENERIC;
         }
-
-        wasm_runtime_init_flag = 1;
     }
+out:
+    pthread_mutex_unlock(&wasm_runtime_init_lock);
 
-    /* load WASM byte buffer from WASM bin file */
-#ifdef FILE_TO_BUFFER
-    if (!(utc->wasm_file_buffer = (uint8_t*)bh_read_file_to_buffer(wasm_file, &utc->wasm_file_size))) {
-        EMSG("%08x : %s\n", TEE_ERROR_GENERIC, wasm_file);
-        goto out2;
-    }
-#else
-    int fd;
-    struct stat stat_buf;
+    return res;
+}
 
-    fd = open(wasm_file, O_RDONLY);
-    if (fd < 0) {
-        EMSG("%08x : %s, %d\n", TEE_ERROR_GENERIC, wasm_file, fd);
-        goto out2;
+static void wasm_instance_release(struct user_ta_ctx* utc)
+{
+    if (utc->param_stage) {
+        wasm_runtime_module_free(utc->wasm_module_inst, utc->param_stage);
     }
-    if (fstat(fd, &stat_buf) != 0) {
-        EMSG("%08x : %s\n", TEE_ERROR_GENERIC, wasm_file);
-        close(fd);
-        goto out2;
+    if (utc->exec_env) {
+        wasm_runtime_destroy_exec_env(utc->exec_env);
     }
-    utc->wasm_file_size = (uint32_t)stat_buf.st_size;
-    DMSG("ta size: %" PRIu32 "\n", utc->wasm_file_size);
-    utc->wasm_file_buffer = (uint8_t*)mmap(NULL, utc->wasm_file_size, PROT_READ, MAP_SHARED | MAP_FILE, fd, 0);
-    if (!utc->wasm_file_buffer || utc->wasm_file_buffer == (uint8_t*)MAP_FAILED) {
-        EMSG("%08x\n", TEE_ERROR_GENERIC);
-        /* fixed CID 209895, RESOURCE_LEAK */
-        close(fd);
-        goto out2;
+    if (utc->wasm_module_inst) {
+        hmac_stream_release(utc->wasm_module_inst);
+        wasm_slab_destroy(utc->wasm_module_inst);
+        wasm_runtime_deinstantiate(utc->wasm_module_inst);
     }
-    DMSG("file address: 0x%" PRIx32 "\n", (uint32_t)utc->wasm_file_buffer);
-    close(fd);
-    utc->is_xip_file = true;
-#endif
+    if (utc->module_entry) {
+        wasm_module_cache_put(utc->module_entry);
+    }
+}
 
-    /* map xip file */
-    if (wasm_runtime_is_xip_file(utc->wasm_file_buffer, utc->wasm_file_size)) {
-        DMSG("XIP ta\n");
-    }
-#ifndef FILE_TO_BUFFER
-    else {
-        DMSG("!XIP ta\n");
-        void* tmp_buf = wasm_runtime_malloc(utc->wasm_file_size);
-        if (tmp_buf == NULL) {
-            EMSG("%08x : %" PRIu32 "\n", TEE_ERROR_OUT_OF_MEMORY, utc->wasm_file_size);
-            goto out2;
-        }
-        b_memcpy_s(tmp_buf, utc->wasm_file_size, utc->wasm_file_buffer, utc->wasm_file_size);
-        munmap(utc->wasm_file_buffer, utc->wasm_file_size);
-        utc->wasm_file_buffer = tmp_buf;
-        utc->is_xip_file = false;
+/* Instantiate the TA module into utc, sized and flagged by its manifest */
+static TEE_Result wasm_instance_create(const TEE_UUID* uuid, struct user_ta_ctx* utc)
+{
+    char wasm_file[64] = { 0 };
+    uint32_t pos = WASM_FILE_TEMPLATE_DIR_SIZE;
+    uint32_t stack_size = WASM_DEFAULT_STACK_SIZE, heap_size = WASM_DEFAULT_HEAP_SIZE;
+    uint32_t flags = TA_FLAG_SINGLE_INSTANCE | TA_FLAG_MULTI_SESSION;
+    char error_buf[128] = { 0 };
+    struct wasm_mem_stats* prev_owner = NULL;
+
+    /* convert uuid to wasm file name */
+    strcpy(wasm_file, WASM_FILE_TEMPLATE);
+    pos += tee_b2hs((uint8_t*)uuid, (uint8_t*)(wasm_file + pos),
+        sizeof(TEE_UUID), sizeof(wasm_file) - pos);
+
+#ifdef CONFIG_OPTEE_WASM_PREFER_AOT
+    /* prefer the AOT compiled TA, executed in place when built for XIP,
+     * and fall back to interpreting the .wasm file
+     */
+    strcpy(wasm_file + pos, WASM_FILE_AOT_SUFFIX);
+    if (access(wasm_file, F_OK) != 0) {
+        wasm_file[pos] = '\0';
     }
 #endif
 
-    /* load WASM module */
-    if (!(utc->wasm_module = wasm_runtime_load(utc->wasm_file_buffer, utc->wasm_file_size,
-              error_buf, sizeof(error_buf)))) {
-        EMSG("%08x : %s\n", TEE_ERROR_GENERIC, error_buf);
-        goto out2;
+    DMSG("Open ta: %s\n", wasm_file);
+
+    /* idle keep-alive instances give way to new ones beyond the budget */
+    wasm_keep_alive_reclaim();
+
+    if (wasm_runtime_init_once() != TEE_SUCCESS) {
+        return TEE_ERROR_GENERIC;
+    }
+
+    /* the module, instance and exec env are charged to the TA */
+    utc->mem_stats = wasm_mem_stats_get(uuid);
+    prev_owner = wasm_mem_set_owner(utc->mem_stats);
+
+    /* get the loaded WASM module, the file is only read on a cache miss */
+    if (wasm_module_cache_get(uuid, wasm_file, &utc->module_entry) != TEE_SUCCESS) {
+        EMSG("%08x : %s\n", TEE_ERROR_GENERIC, wasm_file);
+        goto err;
+    }
+    utc->wasm_module = utc->module_entry->module;
+
+    /* the TA manifest overrides the default sizing and flags */
+    if (utc->module_entry->has_manifest) {
+        const struct user_ta_wasm_manifest* manifest = &utc->module_entry->manifest;
+
+        if (manifest->stack_size) {
+            stack_size = manifest->stack_size;
+        }
+        if (manifest->heap_size) {
+            heap_size = manifest->heap_size;
+        }
+        flags = manifest->flags;
     }
 
     /* instantiate the module */
     if (!(utc->wasm_module_inst = wasm_runtime_instantiate(utc->wasm_module, stack_size, heap_size,
               error_buf, sizeof(error_buf)))) {
         EMSG("%08x : %s\n", TEE_ERROR_GENERIC, error_buf);
-        goto out2;
+        goto err;
     }
+    wasm_slab_create(utc->wasm_module_inst);
 
     utc->stack_size = stack_size;
+    utc->instance_size = stack_size + heap_size;
     /* creat an execution environment to execute the WASM functions */
     if (!(utc->exec_env = wasm_runtime_create_exec_env(utc->wasm_module_inst,
               stack_size))) {
         EMSG("%08x\n", TEE_ERROR_GENERIC);
-        goto out2;
+        goto err;
+    }
+
+    /* resolve the entry points once, a TA missing one is rejected here */
+    if (wasm_resolve_entry_points(utc) != TEE_SUCCESS) {
+        goto err;
+    }
+
+    utc->ta_ctx.flags = flags;
+    utc->ta_ctx.ts_ctx.uuid = *uuid;
+    wasm_mem_set_owner(prev_owner);
+    return TEE_SUCCESS;
+
+err:
+    wasm_instance_release(utc);
+    wasm_mem_set_owner(prev_owner);
+    EMSG("current: %zu, peak: %zu, failed: %" PRIu32 "\n", utc->mem_stats->current,
+        utc->mem_stats->peak, utc->mem_stats->failed);
+    memset(utc, 0, sizeof(*utc));
+    return TEE_ERROR_GENERIC;
+}
+
+#ifdef WASM_INSTANCE_POOL
+/* Instances of hot TAs, instantiated and past TA_CreateEntryPoint ahead
+ * of their first session. They are linked through ta_ctx.link, which is
+ * free until the instance is handed out as a context.
+ */
+static TAILQ_HEAD(, tee_ta_ctx) wasm_instance_pool = TAILQ_HEAD_INITIALIZER(wasm_instance_pool);
+static pthread_mutex_t wasm_instance_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static TEE_UUID wasm_hot_uuids[WASM_HOT_TAS_MAX];
+static uint32_t wasm_hot_uuid_count;
+
+static bool wasm_is_hot_uuid(const TEE_UUID* uuid)
+{
+    for (uint32_t i = 0; i < wasm_hot_uuid_count; i++) {
+        if (!memcmp(&wasm_hot_uuids[i], uuid, sizeof(*uuid))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static struct user_ta_ctx* wasm_instance_pool_take(const TEE_UUID* uuid)
+{
+    struct tee_ta_ctx* ctx = NULL;
+
+    pthread_mutex_lock(&wasm_instance_pool_lock);
+    TAILQ_FOREACH(ctx, &wasm_instance_pool, link)
+    {
+        if (!memcmp(&ctx->ts_ctx.uuid, uuid, sizeof(*uuid))) {
+            TAILQ_REMOVE(&wasm_instance_pool, ctx, link);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wasm_instance_pool_lock);
+
+    return ctx ? container_of(ctx, struct user_ta_ctx, ta_ctx) : NULL;
+}
+
+static uint32_t wasm_instance_pool_count(const TEE_UUID* uuid)
+{
+    struct tee_ta_ctx* ctx = NULL;
+    uint32_t count = 0;
+
+    pthread_mutex_lock(&wasm_instance_pool_lock);
+    TAILQ_FOREACH(ctx, &wasm_instance_pool, link)
+    {
+        if (!memcmp(&ctx->ts_ctx.uuid, uuid, sizeof(*uuid))) {
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&wasm_instance_pool_lock);
+
+    return count;
+}
+
+/* Top the pool of a hot TA up. No session is current while
+ * TA_CreateEntryPoint runs here, so hot TAs must not depend on one there.
+ */
+static void wasm_instance_pool_fill(const TEE_UUID* uuid)
+{
+    uint32_t ta_argv[1] = { 0 };
+    struct user_ta_ctx* utc = NULL;
+    struct wasm_mem_stats* prev_owner = NULL;
+    TEE_Result res = TEE_ERROR_GENERIC;
+
+    while (wasm_instance_pool_count(uuid) < WASM_INSTANCE_POOL_SIZE) {
+        utc = calloc(1, sizeof(struct user_ta_ctx));
+        if (!utc) {
+            EMSG("%08x : %u\n", TEE_ERROR_OUT_OF_MEMORY, sizeof(struct user_ta_ctx));
+            return;
+        }
+
+        if (wasm_instance_create(uuid, utc) != TEE_SUCCESS) {
+            free(utc);
+            return;
+        }
+
+        prev_owner = wasm_mem_set_owner(utc->mem_stats);
+        res = wasm_runtime_call_wasm(utc->exec_env, utc->create_entry, 1, ta_argv)
+            ? *(TEE_Result*)ta_argv
+            : TEE_ERROR_GENERIC;
+        wasm_mem_set_owner(prev_owner);
+        if (res != TEE_SUCCESS) {
+            EMSG("%08x : prewarm failed\n", TEE_ERROR_GENERIC);
+            wasm_instance_release(utc);
+            free(utc);
+            return;
+        }
+        utc->is_created = true;
+
+        pthread_mutex_lock(&wasm_instance_pool_lock);
+        TAILQ_INSERT_TAIL(&wasm_instance_pool, &utc->ta_ctx, link);
+        pthread_mutex_unlock(&wasm_instance_pool_lock);
+    }
+}
+
+/* Hot TAs to top up, as bits of their index into wasm_hot_uuids. A
+ * closing context only flags its TA, the refill thread runs
+ * TA_CreateEntryPoint of the next instance off the client's close path.
+ */
+static pthread_cond_t wasm_instance_pool_work = PTHREAD_COND_INITIALIZER;
+static uint32_t wasm_instance_pool_pending;
+static bool wasm_instance_pool_started;
+static bool wasm_instance_pool_failed;
+
+static void* wasm_instance_pool_main(void* arg)
+{
+    uint32_t pending = 0;
+
+    (void)arg;
+    pthread_mutex_lock(&wasm_instance_pool_lock);
+    while (true) {
+        while (!wasm_instance_pool_pending) {
+            pthread_cond_wait(&wasm_instance_pool_work, &wasm_instance_pool_lock);
+        }
+
+        pending = wasm_instance_pool_pending;
+        wasm_instance_pool_pending = 0;
+        pthread_mutex_unlock(&wasm_instance_pool_lock);
+
+        for (uint32_t i = 0; i < wasm_hot_uuid_count; i++) {
+            if (pending & (1u << i)) {
+                wasm_instance_pool_fill(&wasm_hot_uuids[i]);
+            }
+        }
+
+        pthread_mutex_lock(&wasm_instance_pool_lock);
+    }
+
+    return NULL;
+}
+
+/* Must be called with the lock held */
+static bool wasm_instance_pool_start(void)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    int ret = 0;
+
+    if (wasm_instance_pool_started || wasm_instance_pool_failed) {
+        return wasm_instance_pool_started;
+    }
+
+    pthread_attr_init(&attr);
+#ifdef CONFIG_OPTEE_NATIVE_STACKSIZE
+    pthread_attr_setstacksize(&attr, CONFIG_OPTEE_NATIVE_STACKSIZE);
+#endif
+    ret = pthread_create(&thread, &attr, wasm_instance_pool_main, NULL);
+    pthread_attr_destroy(&attr);
+    if (ret) {
+        EMSG("%08x : instance pool, %d\n", TEE_ERROR_OUT_OF_MEMORY, ret);
+        wasm_instance_pool_failed = true;
+        return false;
+    }
+
+    pthread_detach(thread);
+    wasm_instance_pool_started = true;
+    return true;
+}
+
+static void wasm_instance_pool_refill(const TEE_UUID* uuid)
+{
+    for (uint32_t i = 0; i < wasm_hot_uuid_count; i++) {
+        if (memcmp(&wasm_hot_uuids[i], uuid, sizeof(*uuid))) {
+            continue;
+        }
+
+        pthread_mutex_lock(&wasm_instance_pool_lock);
+        if (wasm_instance_pool_start()) {
+            wasm_instance_pool_pending |= 1u << i;
+            pthread_cond_signal(&wasm_instance_pool_work);
+            pthread_mutex_unlock(&wasm_instance_pool_lock);
+            return;
+        }
+        pthread_mutex_unlock(&wasm_instance_pool_lock);
+
+        /* no refill thread, top the pool up right here as before */
+        wasm_instance_pool_fill(uuid);
+        return;
+    }
+}
+
+static TEE_Result wasm_instance_pool_init(void)
+{
+    const char* p = CONFIG_OPTEE_WASM_HOT_TAS;
+    size_t hs_len = sizeof(TEE_UUID) * 2;
+
+    /* hot TAs are listed like their /etc/ta file names, space separated */
+    while (*p && wasm_hot_uuid_count < WASM_HOT_TAS_MAX) {
+        if (*p == ' ') {
+            p++;
+            continue;
+        }
+
+        if (strnlen(p, hs_len) < hs_len
+            || tee_hs2b((uint8_t*)p, (uint8_t*)&wasm_hot_uuids[wasm_hot_uuid_count],
+                   hs_len, sizeof(TEE_UUID))
+                != sizeof(TEE_UUID)) {
+            EMSG("%08x : bad hot ta %s\n", TEE_ERROR_BAD_FORMAT, p);
+            break;
+        }
+
+        wasm_instance_pool_fill(&wasm_hot_uuids[wasm_hot_uuid_count++]);
+        p += hs_len;
+    }
+
+    return TEE_SUCCESS;
+}
+
+#ifndef CONFIG_OPTEE_SERVER_WARMUP
+service_init_late(wasm_instance_pool_init);
+#endif
+#else
+#define wasm_instance_pool_take(uuid) NULL
+#endif
+
+void user_ta_wasm_warmup(void)
+{
+    if (wasm_runtime_init_once() != TEE_SUCCESS) {
+        return;
+    }
+#if defined(WASM_INSTANCE_POOL) && defined(CONFIG_OPTEE_SERVER_WARMUP)
+    wasm_instance_pool_init();
+#endif
+}
+
+static TEE_Result tee_ta_init_user_ta_wasm_session(const TEE_UUID* uuid,
+    struct tee_ta_session* s)
+{
+    TEE_Result res = TEE_ERROR_GENERIC;
+    struct user_ta_ctx* utc = NULL;
+
+    /* take a prewarmed instance of a hot TA, else instantiate one */
+    utc = wasm_instance_pool_take(uuid);
+    if (!utc) {
+        /* Register context */
+        utc = calloc(1, sizeof(struct user_ta_ctx));
+        if (!utc) {
+            EMSG("%08x : %u\n", TEE_ERROR_OUT_OF_MEMORY, sizeof(struct user_ta_ctx));
+            res = TEE_ERROR_OUT_OF_MEMORY;
+            goto out;
+        }
+
+        res = wasm_instance_create(uuid, utc);
+        if (res != TEE_SUCCESS) {
+            free(utc);
+            goto out;
+        }
     }
 
     TAILQ_INIT(&utc->open_sessions);
     TAILQ_INIT(&utc->cryp_states);
     TAILQ_INIT(&utc->objects);
-
-    utc->ta_ctx.flags = TA_FLAG_SINGLE_INSTANCE | TA_FLAG_MULTI_SESSION;
-    utc->ta_ctx.ts_ctx.uuid = *uuid;
+    TAILQ_INIT(&utc->storage_enums);
 
     set_ta_ctx_ops(&utc->ta_ctx);
     utc->ta_ctx.ref_count++;
@@ -685,29 +1126,7 @@ static TEE_Result tee_ta_init_user_ta_wasm_session(const TEE_UUID* uuid __unused
 
     return TEE_SUCCESS;
 
-out2:
-    res = TEE_ERROR_GENERIC;
-    if (utc->exec_env) {
-        wasm_runtime_destroy_exec_env(utc->exec_env);
-    }
-    if (utc->wasm_module_inst) {
-        wasm_runtime_deinstantiate(utc->wasm_module_inst);
-    }
-    if (utc->wasm_module) {
-        wasm_runtime_unload(utc->wasm_module);
-    }
-    if (utc->is_xip_file) {
-        munmap(utc->wasm_file_buffer, utc->wasm_file_size);
-    } else {
-        if (utc->wasm_file_buffer) {
-            wasm_runtime_free(utc->wasm_file_buffer);
-        }
-    }
-    if (utc) {
-        free(utc);
-    }
-
-out1:
+out:
     DMSG("res: 0x%" PRIx32 "\n", res);
     return res;
 }
@@ -723,3 +1142,145 @@ TEE_Result tee_ta_init_user_ta_session(
 {
     return tee_ta_init_user_ta_wasm_session(uuid, s);
 }
+
+#ifdef CONFIG_OPTEE_WASM_TA_FAST_CALL
+/* The memrefs of a TA to TA call made by a WASM TA become mobjs over the
+ * linear memory of the caller. The core passes them to the callee as is,
+ * with no utee_params round trip and no bounce buffer, and a WASM callee
+ * stages them with its single copy in and out.
+ */
+static TEE_Result wasm_ta_param_in(wasm_module_inst_t module_inst,
+    uint32_t param_types, TEE_Param* params, struct tee_ta_param* param,
+    struct mobj* mobj)
+{
+    uint32_t offs, size;
+
+    param->types = param_types;
+    for (int n = 0; n < TEE_NUM_PARAMS; n++) {
+        switch (TEE_PARAM_TYPE_GET(param_types, n)) {
+        case TEE_PARAM_TYPE_NONE:
+            break;
+        case TEE_PARAM_TYPE_MEMREF_INPUT:
+        case TEE_PARAM_TYPE_MEMREF_OUTPUT:
+        case TEE_PARAM_TYPE_MEMREF_INOUT:
+            offs = (uint32_t)(uintptr_t)params[n].memref.buffer;
+            size = params[n].memref.size;
+            if (!offs && size) {
+                return TEE_ERROR_BAD_PARAMETERS;
+            }
+            if (offs && !wasm_runtime_validate_app_addr(module_inst, offs, size)) {
+                return TEE_ERROR_ACCESS_DENIED;
+            }
+            mobj[n].buffer = offs ? wasm_runtime_addr_app_to_native(module_inst, offs) : NULL;
+            mobj[n].size = size;
+            param->u[n].mem.mobj = &mobj[n];
+            param->u[n].mem.size = size;
+            param->u[n].mem.offs = 0;
+            break;
+        case TEE_PARAM_TYPE_VALUE_INPUT:
+        case TEE_PARAM_TYPE_VALUE_OUTPUT:
+        case TEE_PARAM_TYPE_VALUE_INOUT:
+            param->u[n].val.a = params[n].value.a;
+            param->u[n].val.b = params[n].value.b;
+            break;
+        default:
+            return TEE_ERROR_BAD_PARAMETERS;
+        }
+    }
+
+    return TEE_SUCCESS;
+}
+
+/* Output buffers were written in place, only sizes and values go back */
+static void wasm_ta_param_out(uint32_t param_types, TEE_Param* params,
+    struct tee_ta_param* param)
+{
+    for (int n = 0; n < TEE_NUM_PARAMS; n++) {
+        switch (TEE_PARAM_TYPE_GET(param_types, n)) {
+        case TEE_PARAM_TYPE_MEMREF_OUTPUT:
+        case TEE_PARAM_TYPE_MEMREF_INOUT:
+            params[n].memref.size = param->u[n].mem.size;
+            break;
+        case TEE_PARAM_TYPE_VALUE_OUTPUT:
+        case TEE_PARAM_TYPE_VALUE_INOUT:
+            params[n].value.a = param->u[n].val.a;
+            params[n].value.b = param->u[n].val.b;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+TEE_Result wasm_ta_open_session(wasm_module_inst_t module_inst,
+    const TEE_UUID* uuid, uint32_t cancel_req_to, uint32_t param_types,
+    TEE_Param params[TEE_NUM_PARAMS], uint32_t* session, uint32_t* ret_orig)
+{
+    struct ts_session* caller = ts_get_current_session();
+    struct user_ta_ctx* utc = to_user_ta_ctx(caller->ctx);
+    struct tee_ta_session* s = NULL;
+    struct tee_ta_param param = { 0 };
+    struct mobj mobj[TEE_NUM_PARAMS] = { 0 };
+    TEE_Identity clnt_id = { .login = TEE_LOGIN_TRUSTED_APP };
+    TEE_ErrorOrigin ret_o = TEE_ORIGIN_TEE;
+    TEE_Result res;
+
+    *session = 0;
+    *ret_orig = TEE_ORIGIN_TEE;
+    res = wasm_ta_param_in(module_inst, param_types, params, &param, mobj);
+    if (res != TEE_SUCCESS) {
+        EMSG("%08x : 0x%" PRIx32 "\n", res, param_types);
+        return res;
+    }
+
+    clnt_id.uuid = caller->ctx->uuid;
+    res = tee_ta_open_session(&ret_o, &s, &utc->open_sessions, uuid, &clnt_id,
+        cancel_req_to, &param);
+    wasm_ta_param_out(param_types, params, &param);
+
+    /* the handle is the session id syscall_open_ta_session() returns, so
+     * tee_ta_get_session() finds it on both paths, close included
+     */
+    if (res == TEE_SUCCESS) {
+        *session = s->id;
+    }
+    *ret_orig = ret_o;
+    return res;
+}
+
+TEE_Result wasm_ta_invoke_command(wasm_module_inst_t module_inst,
+    uint32_t session, uint32_t cancel_req_to, uint32_t cmd,
+    uint32_t param_types, TEE_Param params[TEE_NUM_PARAMS], uint32_t* ret_orig)
+{
+    struct ts_session* caller = ts_get_current_session();
+    struct user_ta_ctx* utc = to_user_ta_ctx(caller->ctx);
+    struct tee_ta_session* called = NULL;
+    struct tee_ta_param param = { 0 };
+    struct mobj mobj[TEE_NUM_PARAMS] = { 0 };
+    TEE_Identity clnt_id = { .login = TEE_LOGIN_TRUSTED_APP };
+    TEE_ErrorOrigin ret_o = TEE_ORIGIN_TEE;
+    TEE_Result res;
+
+    *ret_orig = TEE_ORIGIN_TEE;
+    res = wasm_ta_param_in(module_inst, param_types, params, &param, mobj);
+    if (res != TEE_SUCCESS) {
+        EMSG("%08x : 0x%" PRIx32 "\n", res, param_types);
+        return res;
+    }
+
+    called = tee_ta_get_session(session, true, &utc->open_sessions);
+    if (!called) {
+        EMSG("%08x : 0x%" PRIx32 "\n", TEE_ERROR_BAD_PARAMETERS, session);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+
+    clnt_id.uuid = caller->ctx->uuid;
+    res = tee_ta_invoke_command(&ret_o, called, &clnt_id, cancel_req_to, cmd,
+        &param);
+    wasm_ta_param_out(param_types, params, &param);
+    tee_ta_put_session(called);
+
+    *ret_orig = ret_o;
+    return res;
+}
+#endif
@@ -0,0 +1,456 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#ifdef CONFIG_OPTEE_WASM_COMPRESSED_TA
+#include <lzf.h>
+#endif
+#include <mem_budget.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <trace.h>
+#include <unistd.h>
+#include <user_ta_wasm_cache.h>
+
+#ifdef CONFIG_OPTEE_WASM_MODULE_CACHE_BUDGET
+#define WASM_MODULE_CACHE_BUDGET CONFIG_OPTEE_WASM_MODULE_CACHE_BUDGET
+#else
+#define WASM_MODULE_CACHE_BUDGET 0
+#endif
+
+static TAILQ_HEAD(wasm_module_cache_head, wasm_module_cache_entry) module_cache = TAILQ_HEAD_INITIALIZER(module_cache);
+static pthread_mutex_t module_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bytes of TA files held by unreferenced modules */
+static size_t module_cache_idle_size;
+
+static size_t wasm_module_cache_reclaim(size_t bytes);
+static struct mem_budget_cache module_cache_budget = MEM_BUDGET_CACHE_INITIALIZER("wasm module", wasm_module_cache_reclaim);
+
+static void wasm_module_cache_free(struct wasm_module_cache_entry* entry)
+{
+    if (entry->module) {
+        wasm_runtime_unload(entry->module);
+    }
+    if (entry->is_xip_file) {
+        munmap(entry->file_buffer, entry->file_size);
+    } else {
+        if (entry->file_buffer) {
+            wasm_runtime_free(entry->file_buffer);
+        }
+    }
+    free(entry);
+}
+
+static bool wasm_read_leb_u32(const uint8_t** p, const uint8_t* end,
+    uint32_t* value)
+{
+    uint32_t result = 0;
+
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*p >= end) {
+            return false;
+        }
+        uint8_t byte = *(*p)++;
+        result |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Walk the sections of a .wasm binary for the TA manifest custom section,
+ * AOT files carry no manifest and keep the defaults.
+ */
+static void wasm_module_cache_parse_manifest(struct wasm_module_cache_entry* entry)
+{
+    static const uint8_t wasm_magic[] = { 0x00, 'a', 's', 'm' };
+    const char* name = USER_TA_WASM_MANIFEST_SECTION;
+    const uint8_t* p = entry->file_buffer;
+    const uint8_t* end = p + entry->file_size;
+
+    if (entry->file_size < 8 || memcmp(p, wasm_magic, sizeof(wasm_magic))) {
+        return;
+    }
+
+    p += 8; /* magic + version */
+    while (p < end) {
+        uint8_t id = *p++;
+        uint32_t size, name_len;
+        const uint8_t* payload;
+
+        if (!wasm_read_leb_u32(&p, end, &size) || size > (uint32_t)(end - p)) {
+            return;
+        }
+        payload = p;
+        p += size;
+
+        if (id != 0) {
+            continue;
+        }
+        if (!wasm_read_leb_u32(&payload, p, &name_len)
+            || name_len > (uint32_t)(p - payload)
+            || name_len != strlen(name) || memcmp(payload, name, name_len)) {
+            continue;
+        }
+
+        payload += name_len;
+        if ((uint32_t)(p - payload) < sizeof(entry->manifest)) {
+            EMSG("%08x : short manifest\n", TEE_ERROR_BAD_FORMAT);
+            return;
+        }
+
+        memcpy(&entry->manifest, payload, sizeof(entry->manifest));
+        if (entry->manifest.magic != USER_TA_WASM_MANIFEST_MAGIC
+            || entry->manifest.version != USER_TA_WASM_MANIFEST_VERSION) {
+            EMSG("%08x : bad manifest\n", TEE_ERROR_BAD_FORMAT);
+            return;
+        }
+
+        DMSG("manifest flags: 0x%" PRIx32 ", stack: %" PRIu32 ", heap: %" PRIu32 "\n",
+            entry->manifest.flags, entry->manifest.stack_size,
+            entry->manifest.heap_size);
+        entry->has_manifest = true;
+        return;
+    }
+}
+
+static TEE_Result wasm_module_cache_read(struct wasm_module_cache_entry* entry,
+    const char* path)
+{
+    /* load WASM byte buffer from WASM bin file */
+#ifdef FILE_TO_BUFFER
+    if (!(entry->file_buffer = (uint8_t*)bh_read_file_to_buffer(path, &entry->file_size))) {
+        EMSG("%08x : %s\n", TEE_ERROR_GENERIC, path);
+        return TEE_ERROR_GENERIC;
+    }
+#else
+    int fd;
+    struct stat stat_buf;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        EMSG("%08x : %s, %d\n", TEE_ERROR_GENERIC, path, fd);
+        return TEE_ERROR_GENERIC;
+    }
+    if (fstat(fd, &stat_buf) != 0) {
+        EMSG("%08x : %s\n", TEE_ERROR_GENERIC, path);
+        close(fd);
+        return TEE_ERROR_GENERIC;
+    }
+    entry->file_size = (uint32_t)stat_buf.st_size;
+    DMSG("ta size: %" PRIu32 "\n", entry->file_size);
+    entry->file_buffer = (uint8_t*)mmap(NULL, entry->file_size, PROT_READ, MAP_SHARED | MAP_FILE, fd, 0);
+    if (!entry->file_buffer || entry->file_buffer == (uint8_t*)MAP_FAILED) {
+        EMSG("%08x\n", TEE_ERROR_GENERIC);
+        entry->file_buffer = NULL;
+        close(fd);
+        return TEE_ERROR_GENERIC;
+    }
+    DMSG("file address: 0x%" PRIx32 "\n", (uint32_t)entry->file_buffer);
+    close(fd);
+    entry->is_xip_file = true;
+#endif
+
+    /* map xip file */
+    if (wasm_runtime_is_xip_file(entry->file_buffer, entry->file_size)) {
+        DMSG("XIP ta\n");
+    }
+#ifndef FILE_TO_BUFFER
+    else {
+        DMSG("!XIP ta\n");
+        void* tmp_buf = wasm_runtime_malloc(entry->file_size);
+        if (tmp_buf == NULL) {
+            EMSG("%08x : %" PRIu32 "\n", TEE_ERROR_OUT_OF_MEMORY, entry->file_size);
+            return TEE_ERROR_OUT_OF_MEMORY;
+        }
+        memcpy(tmp_buf, entry->file_buffer, entry->file_size);
+        munmap(entry->file_buffer, entry->file_size);
+        entry->file_buffer = tmp_buf;
+        entry->is_xip_file = false;
+    }
+#endif
+
+    return TEE_SUCCESS;
+}
+
+#ifdef CONFIG_OPTEE_WASM_COMPRESSED_TA
+#define LZF_BLOCK_MAGIC0 'Z'
+#define LZF_BLOCK_MAGIC1 'V'
+#define LZF_BLOCK_STORED 0
+#define LZF_BLOCK_COMPRESSED 1
+
+static bool wasm_read_full(int fd, void* buf, size_t size)
+{
+    uint8_t* p = buf;
+    ssize_t ret;
+
+    while (size) {
+        ret = read(fd, p, size);
+        if (ret <= 0) {
+            return false;
+        }
+        p += ret;
+        size -= ret;
+    }
+
+    return true;
+}
+
+/* Decompress the LZF blocks following the image header straight into the
+ * runtime buffer, only a compressed block at a time is held besides it.
+ */
+static TEE_Result wasm_module_cache_inflate(struct wasm_module_cache_entry* entry,
+    int fd)
+{
+    TEE_Result res = TEE_ERROR_BAD_FORMAT;
+    uint8_t* in = NULL;
+    size_t in_size = 0;
+    uint32_t offs = 0;
+    uint8_t hdr[7];
+    size_t clen, ulen;
+
+    entry->file_buffer = wasm_runtime_malloc(entry->file_size);
+    if (!entry->file_buffer) {
+        EMSG("%08x : %" PRIu32 "\n", TEE_ERROR_OUT_OF_MEMORY, entry->file_size);
+        return TEE_ERROR_OUT_OF_MEMORY;
+    }
+
+    while (offs < entry->file_size) {
+        if (!wasm_read_full(fd, hdr, 5) || hdr[0] != LZF_BLOCK_MAGIC0
+            || hdr[1] != LZF_BLOCK_MAGIC1) {
+            goto out;
+        }
+
+        if (hdr[2] == LZF_BLOCK_STORED) {
+            ulen = hdr[3] << 8 | hdr[4];
+            if (ulen > entry->file_size - offs
+                || !wasm_read_full(fd, entry->file_buffer + offs, ulen)) {
+                goto out;
+            }
+        } else if (hdr[2] == LZF_BLOCK_COMPRESSED) {
+            if (!wasm_read_full(fd, hdr + 5, 2)) {
+                goto out;
+            }
+            clen = hdr[3] << 8 | hdr[4];
+            ulen = hdr[5] << 8 | hdr[6];
+            if (ulen > entry->file_size - offs) {
+                goto out;
+            }
+            if (clen > in_size) {
+                free(in);
+                in_size = 0;
+                in = malloc(clen);
+                if (!in) {
+                    EMSG("%08x : %zu\n", TEE_ERROR_OUT_OF_MEMORY, clen);
+                    res = TEE_ERROR_OUT_OF_MEMORY;
+                    goto out;
+                }
+                in_size = clen;
+            }
+            if (!wasm_read_full(fd, in, clen)
+                || lzf_decompress(in, clen, entry->file_buffer + offs, ulen) != ulen) {
+                goto out;
+            }
+        } else {
+            goto out;
+        }
+        offs += ulen;
+    }
+    res = TEE_SUCCESS;
+
+out:
+    if (res == TEE_ERROR_BAD_FORMAT) {
+        EMSG("%08x : bad compressed ta at %" PRIu32 "\n", res, offs);
+    }
+    free(in);
+    return res;
+}
+
+/* Read the TA file if it is a compressed image, TEE_ERROR_ITEM_NOT_FOUND
+ * if it is a plain one.
+ */
+static TEE_Result wasm_module_cache_read_lzf(struct wasm_module_cache_entry* entry,
+    const char* path)
+{
+    struct user_ta_wasm_lzf_header hdr;
+    TEE_Result res = TEE_ERROR_ITEM_NOT_FOUND;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        EMSG("%08x : %s, %d\n", TEE_ERROR_GENERIC, path, fd);
+        return TEE_ERROR_GENERIC;
+    }
+
+    if (wasm_read_full(fd, &hdr, sizeof(hdr))
+        && hdr.magic == USER_TA_WASM_LZF_MAGIC) {
+        DMSG("compressed ta size: %" PRIu32 "\n", hdr.size);
+        entry->file_size = hdr.size;
+        res = wasm_module_cache_inflate(entry, fd);
+    }
+
+    close(fd);
+    return res;
+}
+#endif
+
+static TEE_Result wasm_module_cache_load(struct wasm_module_cache_entry* entry,
+    const char* path)
+{
+    char error_buf[128] = { 0 };
+    TEE_Result res = TEE_ERROR_GENERIC;
+
+#ifdef CONFIG_OPTEE_WASM_COMPRESSED_TA
+    res = wasm_module_cache_read_lzf(entry, path);
+    if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+        res = wasm_module_cache_read(entry, path);
+    }
+#else
+    res = wasm_module_cache_read(entry, path);
+#endif
+    if (res != TEE_SUCCESS) {
+        return res;
+    }
+
+    wasm_module_cache_parse_manifest(entry);
+
+    /* load WASM module */
+    if (!(entry->module = wasm_runtime_load(entry->file_buffer, entry->file_size,
+              error_buf, sizeof(error_buf)))) {
+        EMSG("%08x : %s\n", TEE_ERROR_GENERIC, error_buf);
+        return TEE_ERROR_GENERIC;
+    }
+
+    return TEE_SUCCESS;
+}
+
+/* Unload least recently used modules nobody references until the idle
+ * ones fit in budget again, must be called with the lock held.
+ */
+static void wasm_module_cache_shrink(size_t budget)
+{
+    struct wasm_module_cache_entry* entry = NULL;
+    struct wasm_module_cache_entry* prev = NULL;
+
+    entry = TAILQ_LAST(&module_cache, wasm_module_cache_head);
+    while (entry && module_cache_idle_size > budget) {
+        prev = TAILQ_PREV(entry, wasm_module_cache_head, link);
+        if (entry->ref_count == 0) {
+            DMSG("evict module, size: %" PRIu32 "\n", entry->file_size);
+            TAILQ_REMOVE(&module_cache, entry, link);
+            module_cache_idle_size -= entry->file_size;
+            wasm_module_cache_free(entry);
+        }
+        entry = prev;
+    }
+}
+
+/* Memory budget shrink, skipped while the cache is busy, modules are
+ * loaded with the lock held
+ */
+static size_t wasm_module_cache_reclaim(size_t bytes)
+{
+    size_t idle_size = 0;
+    size_t freed = 0;
+
+    if (pthread_mutex_trylock(&module_cache_lock)) {
+        return 0;
+    }
+
+    freed = module_cache_idle_size;
+    wasm_module_cache_shrink(freed > bytes ? freed - bytes : 0);
+    idle_size = module_cache_idle_size;
+    freed -= idle_size;
+    pthread_mutex_unlock(&module_cache_lock);
+
+    mem_budget_update(&module_cache_budget, idle_size);
+    return freed;
+}
+
+TEE_Result wasm_module_cache_get(const TEE_UUID* uuid, const char* path,
+    struct wasm_module_cache_entry** entry)
+{
+    struct wasm_module_cache_entry* e = NULL;
+    TEE_Result res = TEE_ERROR_GENERIC;
+    size_t idle_size = 0;
+
+    pthread_mutex_lock(&module_cache_lock);
+    TAILQ_FOREACH(e, &module_cache, link)
+    {
+        if (!memcmp(&e->uuid, uuid, sizeof(*uuid))) {
+            if (e->ref_count++ == 0) {
+                module_cache_idle_size -= e->file_size;
+            }
+            TAILQ_REMOVE(&module_cache, e, link);
+            TAILQ_INSERT_HEAD(&module_cache, e, link);
+            idle_size = module_cache_idle_size;
+            pthread_mutex_unlock(&module_cache_lock);
+
+            mem_budget_update(&module_cache_budget, idle_size);
+
+            DMSG("module cache hit: %s\n", path);
+            *entry = e;
+            return TEE_SUCCESS;
+        }
+    }
+
+    /* Load under the lock, so concurrent opens of a TA share one module */
+    e = calloc(1, sizeof(*e));
+    if (!e) {
+        EMSG("%08x : %u\n", TEE_ERROR_OUT_OF_MEMORY, sizeof(*e));
+        res = TEE_ERROR_OUT_OF_MEMORY;
+        goto out;
+    }
+
+    e->uuid = *uuid;
+    res = wasm_module_cache_load(e, path);
+    if (res != TEE_SUCCESS) {
+        wasm_module_cache_free(e);
+        goto out;
+    }
+
+    e->ref_count = 1;
+    TAILQ_INSERT_HEAD(&module_cache, e, link);
+    *entry = e;
+
+out:
+    pthread_mutex_unlock(&module_cache_lock);
+    return res;
+}
+
+void wasm_module_cache_put(struct wasm_module_cache_entry* entry)
+{
+    size_t idle_size = 0;
+
+    pthread_mutex_lock(&module_cache_lock);
+    assert(entry->ref_count > 0);
+    if (--entry->ref_count == 0) {
+        module_cache_idle_size += entry->file_size;
+        wasm_module_cache_shrink(WASM_MODULE_CACHE_BUDGET);
+    }
+    idle_size = module_cache_idle_size;
+    pthread_mutex_unlock(&module_cache_lock);
+
+    mem_budget_update(&module_cache_budget, idle_size);
+}
@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <mem_budget.h>
+#include <nuttx/mm/mm.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <user_ta_wasm_mem.h>
+#include <util.h>
+
+#ifdef CONFIG_OPTEE_WASM_HEAP_POOL_SIZE
+#define WASM_HEAP_POOL_SIZE CONFIG_OPTEE_WASM_HEAP_POOL_SIZE
+#else
+#define WASM_HEAP_POOL_SIZE 0
+#endif
+
+/* TAs tracked separately, the others share the nil UUID entry */
+#define WASM_MEM_STATS_MAX 8
+
+/* Every block starts with its owner, so frees and reallocs from another
+ * thread are charged back to the TA that allocated it.
+ */
+struct wasm_mem_hdr {
+    struct wasm_mem_stats* owner;
+    size_t size;
+    max_align_t data[0];
+};
+
+#if WASM_HEAP_POOL_SIZE > 0
+static max_align_t wasm_heap_pool[WASM_HEAP_POOL_SIZE / sizeof(max_align_t)];
+static struct mm_heap_s* wasm_heap;
+
+#define wasm_heap_malloc(size) mm_malloc(wasm_heap, size)
+#define wasm_heap_realloc(ptr, size) mm_realloc(wasm_heap, ptr, size)
+#define wasm_heap_free(ptr) mm_free(wasm_heap, ptr)
+#else
+#define wasm_heap_malloc(size) malloc(size)
+#define wasm_heap_realloc(ptr, size) realloc(ptr, size)
+#define wasm_heap_free(ptr) free(ptr)
+#endif
+
+static struct wasm_mem_stats wasm_mem_stats[WASM_MEM_STATS_MAX];
+static uint32_t wasm_mem_stats_count = 1;
+static pthread_mutex_t wasm_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t wasm_mem_owner_key;
+
+static void wasm_mem_charge(struct wasm_mem_stats* owner, size_t add, size_t sub)
+{
+    pthread_mutex_lock(&wasm_mem_lock);
+    owner->current += add;
+    owner->current -= sub;
+    if (owner->current > owner->peak) {
+        owner->peak = owner->current;
+    }
+    pthread_mutex_unlock(&wasm_mem_lock);
+}
+
+static void wasm_mem_fail(struct wasm_mem_stats* owner, size_t size)
+{
+    pthread_mutex_lock(&wasm_mem_lock);
+    owner->failed++;
+    pthread_mutex_unlock(&wasm_mem_lock);
+
+    EMSG("%08x : %zu, current: %zu, peak: %zu\n", TEE_ERROR_OUT_OF_MEMORY,
+        size, owner->current, owner->peak);
+}
+
+static struct wasm_mem_stats* wasm_mem_get_owner(void)
+{
+    struct wasm_mem_stats* owner = pthread_getspecific(wasm_mem_owner_key);
+
+    return owner ? owner : &wasm_mem_stats[0];
+}
+
+TEE_Result wasm_mem_init(void)
+{
+    if (pthread_key_create(&wasm_mem_owner_key, NULL) != 0) {
+        EMSG("%08x\n", TEE_ERROR_GENERIC);
+        return TEE_ERROR_GENERIC;
+    }
+
+#if WASM_HEAP_POOL_SIZE > 0
+    /* WAMR allocations stay in their own arena, away from the shm
+     * buffers and everything else on the system heap
+     */
+    wasm_heap = mm_initialize("wasm", wasm_heap_pool, sizeof(wasm_heap_pool));
+    if (!wasm_heap) {
+        EMSG("%08x\n", TEE_ERROR_GENERIC);
+        pthread_key_delete(wasm_mem_owner_key);
+        return TEE_ERROR_GENERIC;
+    }
+#endif
+
+    return TEE_SUCCESS;
+}
+
+struct wasm_mem_stats* wasm_mem_stats_get(const TEE_UUID* uuid)
+{
+    struct wasm_mem_stats* stats = &wasm_mem_stats[0];
+
+    pthread_mutex_lock(&wasm_mem_lock);
+    for (uint32_t i = 1; i < wasm_mem_stats_count; i++) {
+        if (!memcmp(&wasm_mem_stats[i].uuid, uuid, sizeof(*uuid))) {
+            stats = &wasm_mem_stats[i];
+            goto out;
+        }
+    }
+
+    if (wasm_mem_stats_count < WASM_MEM_STATS_MAX) {
+        stats = &wasm_mem_stats[wasm_mem_stats_count++];
+        stats->uuid = *uuid;
+    }
+
+out:
+    pthread_mutex_unlock(&wasm_mem_lock);
+    return stats;
+}
+
+bool wasm_mem_stats_read(const TEE_UUID* uuid, struct wasm_mem_stats* stats)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&wasm_mem_lock);
+    for (uint32_t i = 1; i < wasm_mem_stats_count; i++) {
+        if (!memcmp(&wasm_mem_stats[i].uuid, uuid, sizeof(*uuid))) {
+            *stats = wasm_mem_stats[i];
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wasm_mem_lock);
+
+    return found;
+}
+
+struct wasm_mem_stats* wasm_mem_set_owner(struct wasm_mem_stats* owner)
+{
+    struct wasm_mem_stats* prev = pthread_getspecific(wasm_mem_owner_key);
+
+    pthread_setspecific(wasm_mem_owner_key, owner);
+    return prev;
+}
+
+void* wasm_mem_malloc(unsigned int size)
+{
+    struct wasm_mem_stats* owner = wasm_mem_get_owner();
+    struct wasm_mem_hdr* hdr = NULL;
+
+    hdr = wasm_heap_malloc(sizeof(*hdr) + size);
+    if (!hdr && mem_budget_reclaim(sizeof(*hdr) + size)) {
+        hdr = wasm_heap_malloc(sizeof(*hdr) + size);
+    }
+    if (!hdr) {
+        wasm_mem_fail(owner, size);
+        return NULL;
+    }
+
+    hdr->owner = owner;
+    hdr->size = size;
+    wasm_mem_charge(owner, size, 0);
+    return hdr->data;
+}
+
+void* wasm_mem_realloc(void* ptr, unsigned int size)
+{
+    struct wasm_mem_stats* owner = NULL;
+    struct wasm_mem_hdr* hdr = NULL;
+    struct wasm_mem_hdr* new_hdr = NULL;
+    size_t old_size;
+
+    if (!ptr) {
+        return wasm_mem_malloc(size);
+    }
+
+    hdr = container_of(ptr, struct wasm_mem_hdr, data);
+    owner = hdr->owner;
+    old_size = hdr->size;
+    new_hdr = wasm_heap_realloc(hdr, sizeof(*hdr) + size);
+    if (!new_hdr && mem_budget_reclaim(sizeof(*hdr) + size)) {
+        new_hdr = wasm_heap_realloc(hdr, sizeof(*hdr) + size);
+    }
+    if (!new_hdr) {
+        wasm_mem_fail(owner, size);
+        return NULL;
+    }
+
+    hdr = new_hdr;
+
+    hdr->size = size;
+    wasm_mem_charge(owner, size, old_size);
+    return hdr->data;
+}
+
+void wasm_mem_free(void* ptr)
+{
+    struct wasm_mem_hdr* hdr = NULL;
+
+    if (!ptr) {
+        return;
+    }
+
+    hdr = container_of(ptr, struct wasm_mem_hdr, data);
+    wasm_mem_charge(hdr->owner, 0, hdr->size);
+    wasm_heap_free(hdr);
+}
@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2023 Xiaomi Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <tee_api_types.h>
+#include <trace.h>
+#include <user_ta_wasm_slab.h>
+
+uint64_t
+wasm_runtime_module_realloc(wasm_module_inst_t module, uint64_t ptr, uint64_t size,
+    void** p_native_addr);
+
+/* Objects of 16 to 128 bytes, carved from chunks of the app heap */
+#define WASM_SLAB_CLASSES 4
+#define WASM_SLAB_MIN_SIZE 16
+#define WASM_SLAB_CHUNK_SIZE 512
+
+/* A chunk of one size class, its free and zero maps live on the host so
+ * the TA can't corrupt them through its linear memory
+ */
+struct wasm_slab_chunk {
+    LIST_ENTRY(wasm_slab_chunk) link;
+    uint32_t base;
+    int class;
+    uint8_t* native;
+    uint32_t free_map;
+    uint32_t zero_map;
+};
+
+LIST_HEAD(wasm_slab_chunk_head, wasm_slab_chunk);
+
+/* The instance runs one request at a time, so there is no lock. The
+ * chunks of all classes are also kept sorted by base, frees and reallocs
+ * look the chunk of an offset up by address.
+ */
+struct wasm_slab {
+    struct wasm_slab_chunk_head chunks[WASM_SLAB_CLASSES];
+    struct wasm_slab_chunk** sorted;
+    uint32_t nsorted;
+    uint32_t sorted_cap;
+    struct wasm_slab_stats stats;
+};
+
+static uint32_t wasm_slab_size(int class)
+{
+    return WASM_SLAB_MIN_SIZE << class;
+}
+
+static uint32_t wasm_slab_count(int class)
+{
+    return WASM_SLAB_CHUNK_SIZE / wasm_slab_size(class);
+}
+
+static uint32_t wasm_slab_full_map(int class)
+{
+    uint32_t count = wasm_slab_count(class);
+
+    return count >= 32 ? UINT32_MAX : (1u << count) - 1;
+}
+
+static int wasm_slab_class(uint32_t size)
+{
+    for (int class = 0; class < WASM_SLAB_CLASSES; class++) {
+        if (size <= wasm_slab_size(class)) {
+            return class;
+        }
+    }
+    return -1;
+}
+
+static struct wasm_slab* wasm_slab_get(wasm_module_inst_t module_inst)
+{
+    return wasm_runtime_get_custom_data(module_inst);
+}
+
+/* Index of the first sorted chunk with a base above ptr */
+static uint32_t wasm_slab_upper(struct wasm_slab* slab, uint32_t ptr)
+{
+    uint32_t lo = 0;
+    uint32_t hi = slab->nsorted;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (slab->sorted[mid]->base <= ptr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Chunk holding the app offset ptr, and its class */
+static struct wasm_slab_chunk* wasm_slab_find(struct wasm_slab* slab,
+    uint32_t ptr, int* class)
+{
+    uint32_t i = wasm_slab_upper(slab, ptr);
+    struct wasm_slab_chunk* chunk = i ? slab->sorted[i - 1] : NULL;
+
+    if (!chunk || ptr - chunk->base >= WASM_SLAB_CHUNK_SIZE) {
+        return NULL;
+    }
+
+    *class = chunk->class;
+    return chunk;
+}
+
+static bool wasm_slab_sorted_add(struct wasm_slab* slab,
+    struct wasm_slab_chunk* chunk)
+{
+    uint32_t i = wasm_slab_upper(slab, chunk->base);
+
+    if (slab->nsorted == slab->sorted_cap) {
+        uint32_t cap = slab->sorted_cap ? slab->sorted_cap * 2 : 8;
+        struct wasm_slab_chunk** sorted = realloc(slab->sorted,
+            cap * sizeof(*sorted));
+
+        if (!sorted) {
+            return false;
+        }
+        slab->sorted = sorted;
+        slab->sorted_cap = cap;
+    }
+
+    memmove(&slab->sorted[i + 1], &slab->sorted[i],
+        (slab->nsorted - i) * sizeof(*slab->sorted));
+    slab->sorted[i] = chunk;
+    slab->nsorted++;
+    return true;
+}
+
+static void wasm_slab_sorted_remove(struct wasm_slab* slab,
+    struct wasm_slab_chunk* chunk)
+{
+    uint32_t i = wasm_slab_upper(slab, chunk->base) - 1;
+
+    slab->nsorted--;
+    memmove(&slab->sorted[i], &slab->sorted[i + 1],
+        (slab->nsorted - i) * sizeof(*slab->sorted));
+}
+
+static struct wasm_slab_chunk* wasm_slab_chunk_new(wasm_module_inst_t module_inst,
+    struct wasm_slab* slab, int class)
+{
+    struct wasm_slab_chunk* chunk = malloc(sizeof(*chunk));
+    void* native = NULL;
+
+    if (!chunk) {
+        return NULL;
+    }
+
+    chunk->base = wasm_runtime_module_malloc(module_inst, WASM_SLAB_CHUNK_SIZE, &native);
+    if (!chunk->base) {
+        free(chunk);
+        return NULL;
+    }
+
+    if (!wasm_slab_sorted_add(slab, chunk)) {
+        wasm_runtime_module_free(module_inst, chunk->base);
+        free(chunk);
+        return NULL;
+    }
+
+    /* Zeroed once here, so zero filled allocations of fresh objects are
+     * free
+     */
+    memset(native, 0, WASM_SLAB_CHUNK_SIZE);
+    chunk->class = class;
+    chunk->native = native;
+    chunk->free_map = wasm_slab_full_map(class);
+    chunk->zero_map = chunk->free_map;
+    LIST_INSERT_HEAD(&slab->chunks[class], chunk, link);
+
+    if (++slab->stats.chunks > slab->stats.chunks_peak) {
+        slab->stats.chunks_peak = slab->stats.chunks;
+    }
+    return chunk;
+}
+
+static void wasm_slab_chunk_free(wasm_module_inst_t module_inst,
+    struct wasm_slab* slab, struct wasm_slab_chunk* chunk)
+{
+    LIST_REMOVE(chunk, link);
+    wasm_slab_sorted_remove(slab, chunk);
+    wasm_runtime_module_free(module_inst, chunk->base);
+    free(chunk);
+    slab->stats.chunks--;
+}
+
+void wasm_slab_create(wasm_module_inst_t module_inst)
+{
+    struct wasm_slab* slab = calloc(1, sizeof(*slab));
+
+    if (!slab) {
+        EMSG("%08x : %zu\n", TEE_ERROR_OUT_OF_MEMORY, sizeof(*slab));
+        return;
+    }
+
+    for (int class = 0; class < WASM_SLAB_CLASSES; class++) {
+        LIST_INIT(&slab->chunks[class]);
+    }
+    wasm_runtime_set_custom_data(module_inst, slab);
+}
+
+void wasm_slab_destroy(wasm_module_inst_t module_inst)
+{
+    struct wasm_slab* slab = wasm_slab_get(module_inst);
+    struct wasm_slab_chunk* chunk = NULL;
+
+    if (!slab) {
+        return;
+    }
+
+    DMSG("slab: %" PRIu32 ", heap: %" PRIu32 ", zero skipped: %" PRIu32
+         ", chunks peak: %" PRIu32 ", failed: %" PRIu32 "\n",
+        slab->stats.slab_allocs, slab->stats.heap_allocs,
+        slab->stats.zero_skipped, slab->stats.chunks_peak,
+        slab->stats.failed);
+
+    for (int class = 0; class < WASM_SLAB_CLASSES; class++) {
+        while ((chunk = LIST_FIRST(&slab->chunks[class]))) {
+            LIST_REMOVE(chunk, link);
+            free(chunk);
+        }
+    }
+
+    wasm_runtime_set_custom_data(module_inst, NULL);
+    free(slab->sorted);
+    free(slab);
+}
+
+uint32_t wasm_slab_malloc(wasm_module_inst_t module_inst, uint32_t size,
+    bool zero, void** p_native_addr)
+{
+    struct wasm_slab* slab = wasm_slab_get(module_inst);
+    struct wasm_slab_chunk* chunk = NULL;
+    int class = size ? wasm_slab_class(size) : -1;
+    uint32_t ptr = 0;
+    int index;
+
+    if (!slab || class < 0) {
+        ptr = wasm_runtime_module_malloc(module_inst, size, p_native_addr);
+        if (ptr && zero) {
+            memset(*p_native_addr, 0, size);
+        }
+        if (slab) {
+            slab->stats.heap_allocs++;
+            slab->stats.failed += !ptr;
+        }
+        return ptr;
+    }
+
+    LIST_FOREACH(chunk, &slab->chunks[class], link)
+    {
+        if (chunk->free_map) {
+            break;
+        }
+    }
+
+    if (!chunk && !(chunk = wasm_slab_chunk_new(module_inst, slab, class))) {
+        slab->stats.failed++;
+        return 0;
+    }
+
+    index = __builtin_ctz(chunk->free_map);
+    chunk->free_map &= ~(1u << index);
+    *p_native_addr = chunk->native + index * wasm_slab_size(class);
+    if (zero) {
+        if (chunk->zero_map & (1u << index)) {
+            slab->stats.zero_skipped++;
+        } else {
+            memset(*p_native_addr, 0, size);
+        }
+    }
+    chunk->zero_map &= ~(1u << index);
+    slab->stats.slab_allocs++;
+
+    return chunk->base + index * wasm_slab_size(class);
+}
+
+void wasm_slab_free(wasm_module_inst_t module_inst, uint32_t ptr)
+{
+    struct wasm_slab* slab = wasm_slab_get(module_inst);
+    struct wasm_slab_chunk* chunk = NULL;
+    struct wasm_slab_chunk* other = NULL;
+    uint32_t offset;
+    uint32_t bit;
+    int class;
+
+    if (!slab || !(chunk = wasm_slab_find(slab, ptr, &class))) {
+        wasm_runtime_module_free(module_inst, ptr);
+        return;
+    }
+
+    offset = ptr - chunk->base;
+    if (offset % wasm_slab_size(class)) {
+        EMSG("%08x : 0x%" PRIx32 "\n", TEE_ERROR_BAD_PARAMETERS, ptr);
+        return;
+    }
+
+    bit = 1u << (offset / wasm_slab_size(class));
+    if (chunk->free_map & bit) {
+        EMSG("%08x : double free 0x%" PRIx32 "\n", TEE_ERROR_BAD_STATE, ptr);
+        return;
+    }
+    chunk->free_map |= bit;
+
+    /* Keep one empty chunk per class around, give back the others */
+    if (chunk->free_map != wasm_slab_full_map(class)) {
+        return;
+    }
+    LIST_FOREACH(other, &slab->chunks[class], link)
+    {
+        if (other != chunk && other->free_map == wasm_slab_full_map(class)) {
+            wasm_slab_chunk_free(module_inst, slab, chunk);
+            return;
+        }
+    }
+}
+
+uint32_t wasm_slab_realloc(wasm_module_inst_t module_inst, uint32_t ptr,
+    uint32_t size)
+{
+    struct wasm_slab* slab = wasm_slab_get(module_inst);
+    struct wasm_slab_chunk* chunk = NULL;
+    void* native = NULL;
+    uint32_t new_ptr;
+    int class;
+
+    if (!slab || !ptr || !(chunk = wasm_slab_find(slab, ptr, &class))) {
+        return wasm_runtime_module_realloc(module_inst, ptr, size, NULL);
+    }
+
+    /* Like realloc(), a zero size frees the object */
+    if (!size) {
+        wasm_slab_free(module_inst, ptr);
+        return 0;
+    }
+
+    /* The object already has room for the new size */
+    if (size <= wasm_slab_size(class)) {
+        return ptr;
+    }
+
+    new_ptr = wasm_slab_malloc(module_inst, size, false, &native);
+    if (!new_ptr) {
+        return 0;
+    }
+
+    memcpy(native, chunk->native + (ptr - chunk->base), wasm_slab_size(class));
+    wasm_slab_free(module_inst, ptr);
+    return new_ptr;
+}